@@ -0,0 +1,624 @@
+#include "server.h"
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define ADMIN_LINE 256        // Maximum length of an admin command line
+#define ADMIN_SAMPLE_MS 1000  // Interval between rate samples
+#define ADMIN_RATE_ALPHA 0.5  // Weight of the newest sample in the moving average
+
+/**
+ * Rate sample structure - Per-slot state used to derive message rates
+ *
+ * Owned by the admin thread only, so it needs no locking.
+ */
+typedef struct
+{
+    uint64_t id;        // Session id the sample belongs to
+    uint64_t frames_in; // Counter values at the previous sample
+    uint64_t frames_out;
+    double in_rate;     // Smoothed incoming frames per second
+    double out_rate;    // Smoothed outgoing frames per second
+} RateSample;
+
+static RateSample *rates; // One entry per session slot
+static int admin_listener = -1;
+static int admin_conn = -1;
+static char admin_buffer[ADMIN_LINE];
+static size_t admin_buffered = 0;
+
+/**
+ * Updates the smoothed frame rates of every live session
+ *
+ * Counters are read with relaxed atomics and identities through the
+ * session seqlock, so the routing threads are never blocked.
+ *
+ * @param elapsed Seconds since the previous sample
+ */
+static void sample_rates(double elapsed)
+{
+    for (int i = 0; i < client_capacity; i++)
+    {
+        SessionSnapshot snap;
+        RateSample *r = &rates[i];
+        uint64_t in = atomic_load_explicit(&sessions[i].frames_in, memory_order_relaxed);
+        uint64_t out = atomic_load_explicit(&sessions[i].frames_out, memory_order_relaxed);
+
+        if (!session_snapshot(&sessions[i], &snap))
+        {
+            r->id = 0;
+            continue;
+        }
+
+        // A new session in the slot starts from a clean sample
+        if (r->id != snap.id)
+        {
+            r->id = snap.id;
+            r->frames_in = in;
+            r->frames_out = out;
+            r->in_rate = r->out_rate = 0;
+            continue;
+        }
+
+        double in_now = (in - r->frames_in) / elapsed;
+        double out_now = (out - r->frames_out) / elapsed;
+        r->in_rate = ADMIN_RATE_ALPHA * in_now + (1 - ADMIN_RATE_ALPHA) * r->in_rate;
+        r->out_rate = ADMIN_RATE_ALPHA * out_now + (1 - ADMIN_RATE_ALPHA) * r->out_rate;
+        r->frames_in = in;
+        r->frames_out = out;
+    }
+}
+
+/**
+ * Lists every live session with counters, rates and send queue depth
+ *
+ * @param fd Admin connection to write to
+ */
+static void cmd_sessions(int fd)
+{
+    time_t now = time(NULL);
+    int listed = 0;
+
+    dprintf(fd, "%-6s %-20s %5s %7s %9s %9s %11s %11s %8s %8s %7s\n",
+            "ID", "USER", "FD", "AGE", "IN", "OUT", "BYTES_IN", "BYTES_OUT",
+            "IN/s", "OUT/s", "OUTQ");
+
+    for (int i = 0; i < client_capacity; i++)
+    {
+        SessionSnapshot snap;
+        if (!session_snapshot(&sessions[i], &snap))
+            continue;
+
+        // Bytes still waiting in the kernel send buffer for this client
+        int outq = session_outq(&sessions[i], &snap);
+
+        const RateSample *r = &rates[i];
+        int fresh = r->id == snap.id;
+        dprintf(fd, "%-6llu %-20s %5d %6lds %9lu %9lu %11lu %11lu %8.1f %8.1f %7d\n",
+                (unsigned long long)snap.id, snap.username, snap.socket,
+                (long)(now - snap.connected_at),
+                atomic_load_explicit(&sessions[i].frames_in, memory_order_relaxed),
+                atomic_load_explicit(&sessions[i].frames_out, memory_order_relaxed),
+                atomic_load_explicit(&sessions[i].bytes_in, memory_order_relaxed),
+                atomic_load_explicit(&sessions[i].bytes_out, memory_order_relaxed),
+                fresh ? r->in_rate : 0.0, fresh ? r->out_rate : 0.0, outq);
+        listed++;
+    }
+
+    dprintf(fd, "%d session(s)\n", listed);
+}
+
+/**
+ * Account structure - Resource counters of one session, copied for reporting
+ */
+typedef struct
+{
+    SessionSnapshot snap;
+    uint64_t frames_in;
+    uint64_t frames_out;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t cpu_ns;
+    uint64_t drops;
+    uint64_t outq_peak;
+} Account;
+
+/**
+ * Copies a session slot's identity and counters
+ *
+ * @return 1 if the slot holds a live session, 0 otherwise
+ */
+static int read_account(int slot, Account *a)
+{
+    Session *s = &sessions[slot];
+    if (!session_snapshot(s, &a->snap))
+        return 0;
+    a->frames_in = atomic_load_explicit(&s->frames_in, memory_order_relaxed);
+    a->frames_out = atomic_load_explicit(&s->frames_out, memory_order_relaxed);
+    a->bytes_in = atomic_load_explicit(&s->bytes_in, memory_order_relaxed);
+    a->bytes_out = atomic_load_explicit(&s->bytes_out, memory_order_relaxed);
+    a->cpu_ns = atomic_load_explicit(&s->cpu_ns, memory_order_relaxed);
+    a->drops = atomic_load_explicit(&s->drops, memory_order_relaxed);
+    a->outq_peak = atomic_load_explicit(&s->outq_peak, memory_order_relaxed);
+    return 1;
+}
+
+/**
+ * Shows the resource counters of one user's session
+ *
+ * @param fd Admin connection to write to
+ * @param username User to show
+ */
+static void cmd_account(int fd, const char *username)
+{
+    for (int i = 0; i < client_capacity; i++)
+    {
+        Account a;
+        if (!read_account(i, &a) || strcmp(a.snap.username, username) != 0)
+            continue;
+
+        long age = time(NULL) - a.snap.connected_at;
+        dprintf(fd, "session %llu, %s, connected %lds\n", (unsigned long long)a.snap.id,
+                a.snap.link ? "via gateway" : "direct", age);
+        dprintf(fd, "frames in %llu, out %llu\n", (unsigned long long)a.frames_in, (unsigned long long)a.frames_out);
+        dprintf(fd, "bytes in %llu, out %llu\n", (unsigned long long)a.bytes_in, (unsigned long long)a.bytes_out);
+        dprintf(fd, "cpu %.3f ms (%.1f us per frame)\n", a.cpu_ns / 1e6,
+                a.frames_in ? a.cpu_ns / 1e3 / a.frames_in : 0.0);
+        dprintf(fd, "send drops %llu, send queue peak %llu bytes\n", (unsigned long long)a.drops,
+                (unsigned long long)a.outq_peak);
+        return;
+    }
+    dprintf(fd, "User '%s' not found\n", username);
+}
+
+/**
+ * Returns the counter a top list is ranked by
+ */
+static uint64_t account_key(const Account *a, char key)
+{
+    switch (key)
+    {
+    case 'b':
+        return a->bytes_in + a->bytes_out;
+    case 'f':
+        return a->frames_in + a->frames_out;
+    case 'd':
+        return a->drops;
+    case 'o':
+        return a->outq_peak;
+    default:
+        return a->cpu_ns;
+    }
+}
+
+/**
+ * Lists the sessions costing the most by one measure
+ *
+ * Keeps the best N in a small sorted array while scanning the slots, so
+ * the report needs no allocation.
+ *
+ * @param fd Admin connection to write to
+ * @param count_arg Number of sessions to list, NULL for 10
+ * @param key_arg cpu, bytes, frames, drops or outq; NULL for cpu
+ */
+static void cmd_top(int fd, const char *count_arg, const char *key_arg)
+{
+    enum { TOP_MAX = 50 };
+    int n = count_arg ? atoi(count_arg) : 10;
+    if (n < 1 || n > TOP_MAX)
+        n = n < 1 ? 10 : TOP_MAX;
+    const char *key = key_arg ? key_arg : "cpu";
+    if (strcmp(key, "cpu") && strcmp(key, "bytes") && strcmp(key, "frames") && strcmp(key, "drops") &&
+        strcmp(key, "outq"))
+    {
+        dprintf(fd, "usage: top [N] [cpu|bytes|frames|drops|outq]\n");
+        return;
+    }
+
+    Account top[TOP_MAX];
+    int count = 0;
+    for (int i = 0; i < client_capacity; i++)
+    {
+        Account a;
+        if (!read_account(i, &a))
+            continue;
+        uint64_t v = account_key(&a, key[0]);
+        if (count == n && v <= account_key(&top[n - 1], key[0]))
+            continue;
+
+        int pos = count < n ? count++ : n - 1;
+        while (pos > 0 && account_key(&top[pos - 1], key[0]) < v)
+        {
+            top[pos] = top[pos - 1];
+            pos--;
+        }
+        top[pos] = a;
+    }
+
+    dprintf(fd, "%-6s %-20s %10s %9s %9s %11s %11s %7s %10s\n",
+            "ID", "USER", "CPU_MS", "IN", "OUT", "BYTES_IN", "BYTES_OUT", "DROPS", "OUTQ_PEAK");
+    for (int i = 0; i < count; i++)
+    {
+        const Account *a = &top[i];
+        dprintf(fd, "%-6llu %-20s %10.3f %9llu %9llu %11llu %11llu %7llu %10llu\n",
+                (unsigned long long)a->snap.id, a->snap.username, a->cpu_ns / 1e6,
+                (unsigned long long)a->frames_in, (unsigned long long)a->frames_out,
+                (unsigned long long)a->bytes_in, (unsigned long long)a->bytes_out,
+                (unsigned long long)a->drops, (unsigned long long)a->outq_peak);
+    }
+}
+
+/**
+ * Disconnects a user by shutting down its socket
+ *
+ * The client's own thread sees the shutdown as a disconnect and runs
+ * the normal cleanup and logout broadcast. Users behind a gateway share
+ * its socket, so their gateway is asked to close just their stream.
+ *
+ * @param fd Admin connection to write to
+ * @param username User to disconnect
+ */
+static void cmd_kick(int fd, const char *username)
+{
+    int kicked = 0;
+    MuxLink *link = NULL;
+    uint32_t stream = 0;
+
+    // Held briefly so the socket cannot be closed and reused underneath us
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < client_count; i++)
+    {
+        if (strcmp(clients[i].username, username) == 0)
+        {
+            // Writing to a link can block, so pin it and send after unlocking
+            if (clients[i].link)
+            {
+                link = clients[i].link;
+                stream = clients[i].stream;
+                mux_hold(link);
+            }
+            else
+            {
+                shutdown(clients[i].socket, SHUT_RDWR);
+            }
+            kicked = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+
+    if (link)
+    {
+        mux_close(link, stream);
+        mux_put(link);
+    }
+
+    if (kicked)
+    {
+        format_whiteboard_msg(MSG_TYPE_ADMIN, "Kicked %s", username);
+        dprintf(fd, "kicked %s\n", username);
+    }
+    else
+    {
+        dprintf(fd, "error: no such user '%s'\n", username);
+    }
+}
+
+/**
+ * Shows the flight recorder or writes it to its dump file
+ *
+ * @param fd Admin connection to write to
+ * @param action "dump" to write the dump file, or NULL to only show it
+ */
+static void cmd_flight(int fd, const char *action)
+{
+    if (action && strcmp(action, "dump") == 0)
+    {
+        int count = flight_dump(NULL);
+        if (count < 0)
+            dprintf(fd, "dump failed: %s\n", strerror(errno));
+        else
+            dprintf(fd, "wrote %d events\n", count);
+    }
+    flight_report(fd);
+}
+
+/**
+ * Shows or changes the whiteboard log level
+ *
+ * @param fd Admin connection to write to
+ * @param name New level name, or NULL to show the current level
+ */
+static void cmd_loglevel(int fd, const char *name)
+{
+    if (name)
+    {
+        int level = parse_log_level(name);
+        if (level < 0)
+        {
+            dprintf(fd, "error: unknown level '%s' (debug, info, warn, error)\n", name);
+            return;
+        }
+        atomic_store(&log_level, level);
+        format_whiteboard_msg(MSG_TYPE_ADMIN, "Log level set to %s", name);
+    }
+
+    dprintf(fd, "loglevel %s\n", log_level_name(atomic_load(&log_level)));
+}
+
+/**
+ * Writes the whiteboard contents, oldest entry first
+ *
+ * @param fd Admin connection to write to
+ */
+static void cmd_whiteboard(int fd)
+{
+    pthread_mutex_lock(&whiteboard_mutex);
+    for (int i = 0; i < whiteboard.capacity; i++)
+    {
+        int idx = (whiteboard.current_index + i) % whiteboard.capacity;
+        if (whiteboard.messages[idx][0])
+            dprintf(fd, "%s\n", whiteboard.messages[idx]);
+    }
+    pthread_mutex_unlock(&whiteboard_mutex);
+}
+
+/**
+ * Prints one stored message, read back from its compressed segment
+ *
+ * @param fd Admin connection to write to
+ * @param segment Segment number
+ * @param record Record number within the segment
+ */
+static void cmd_read(int fd, const char *segment, const char *record)
+{
+    uint8_t *frame = buffer_get(PROTO_MAX_FRAME);
+    uint64_t timestamp;
+    int len = frame ? store_read(strtoul(segment, NULL, 10), strtoul(record, NULL, 10), frame, PROTO_MAX_FRAME,
+                                 &timestamp)
+                    : -1;
+
+    ProtoHeader hdr;
+    if (len < 0 || proto_decode_header(frame, &hdr) < 0)
+    {
+        dprintf(fd, "error: no record %s in segment %s\n", record, segment);
+        buffer_put(frame);
+        return;
+    }
+
+    time_t seconds = timestamp / 1000;
+    struct tm tm;
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &tm));
+
+    const uint8_t *body = frame + PROTO_HEADER_SIZE;
+    BroadcastMsg broadcast;
+    PrivateMsg private_msg;
+    if (hdr.type == MSG_BROADCAST && decode_broadcast(body, hdr.length, &broadcast) == 0)
+        dprintf(fd, "%s %s %.*s: %.*s\n", when, proto_type_name(hdr.type),
+                (int)broadcast.sender.len, broadcast.sender.ptr, (int)broadcast.content.len, broadcast.content.ptr);
+    else if (hdr.type == MSG_PRIVATE && decode_private(body, hdr.length, &private_msg) == 0)
+        dprintf(fd, "%s %s %.*s to %.*s: %.*s\n", when, proto_type_name(hdr.type),
+                (int)private_msg.sender.len, private_msg.sender.ptr,
+                (int)private_msg.recipient.len, private_msg.recipient.ptr,
+                (int)private_msg.content.len, private_msg.content.ptr);
+    else
+        dprintf(fd, "%s %s (%u bytes)\n", when, proto_type_name(hdr.type), hdr.length);
+    buffer_put(frame);
+}
+
+/**
+ * Parses and executes one admin command line
+ *
+ * @param fd Admin connection to write to
+ * @param line Null-terminated command line
+ * @return 0 to keep the connection open, -1 to close it
+ */
+static int run_command(int fd, char *line)
+{
+    char *saveptr;
+    char *cmd = strtok_r(line, " \t\r", &saveptr);
+    char *arg = strtok_r(NULL, " \t\r", &saveptr);
+    char *arg2 = strtok_r(NULL, " \t\r", &saveptr);
+
+    if (!cmd)
+        return 0;
+
+    if (strcmp(cmd, "sessions") == 0)
+        cmd_sessions(fd);
+    else if (strcmp(cmd, "kick") == 0 && arg)
+        cmd_kick(fd, arg);
+    else if (strcmp(cmd, "account") == 0 && arg)
+        cmd_account(fd, arg);
+    else if (strcmp(cmd, "top") == 0)
+        cmd_top(fd, arg, arg2);
+    else if (strcmp(cmd, "loglevel") == 0)
+        cmd_loglevel(fd, arg);
+    else if (strcmp(cmd, "whiteboard") == 0)
+        cmd_whiteboard(fd);
+    else if (strcmp(cmd, "journal") == 0)
+        journal_report(fd);
+    else if (strcmp(cmd, "store") == 0)
+        store_report(fd);
+    else if (strcmp(cmd, "gateways") == 0)
+        mux_report(fd);
+    else if (strcmp(cmd, "topics") == 0)
+        topic_report(fd);
+    else if (strcmp(cmd, "mentions") == 0)
+        mention_report(fd);
+    else if (strcmp(cmd, "spam") == 0)
+        spam_report(fd);
+    else if (strcmp(cmd, "overload") == 0)
+        overload_report(fd);
+    else if (strcmp(cmd, "eventlog") == 0)
+        eventlog_report(fd);
+    else if (strcmp(cmd, "flight") == 0)
+        cmd_flight(fd, arg);
+    else if (strcmp(cmd, "perf") == 0)
+        perf_report(fd);
+    else if (strcmp(cmd, "buffers") == 0)
+        buffer_report(fd);
+    else if (strcmp(cmd, "coroutines") == 0)
+        coro_report(fd);
+    else if (strcmp(cmd, "replication") == 0)
+        replica_report(fd);
+    else if (strcmp(cmd, "read") == 0 && arg2)
+        cmd_read(fd, arg, arg2);
+    else if (strcmp(cmd, "quit") == 0)
+        return -1;
+    else
+        dprintf(fd, "commands: sessions | kick <user> | account <user> | top [N] [cpu|bytes|frames|drops|outq] | loglevel [debug|info|warn|error] | whiteboard | journal | store | read <segment> <record> | replication | gateways | topics | mentions | spam | overload | eventlog | flight [dump] | perf | buffers | coroutines | quit\n");
+
+    return 0;
+}
+
+/**
+ * Reads pending input from the admin connection and runs complete lines
+ *
+ * @return 0 while the connection stays open, -1 once it should be closed
+ */
+static int serve_connection(void)
+{
+    ssize_t n = recv(admin_conn, admin_buffer + admin_buffered,
+                     sizeof(admin_buffer) - 1 - admin_buffered, 0);
+    if (n <= 0)
+        return -1;
+    admin_buffered += n;
+    admin_buffer[admin_buffered] = '\0';
+
+    char *newline;
+    while ((newline = strchr(admin_buffer, '\n')))
+    {
+        *newline = '\0';
+        int status = run_command(admin_conn, admin_buffer);
+
+        // Shift the remaining input to the front of the buffer
+        size_t consumed = newline + 1 - admin_buffer;
+        memmove(admin_buffer, newline + 1, admin_buffered - consumed + 1);
+        admin_buffered -= consumed;
+
+        if (status < 0)
+            return -1;
+    }
+
+    // Discard an overlong line rather than stalling on it
+    if (admin_buffered == sizeof(admin_buffer) - 1)
+        admin_buffered = 0;
+
+    return 0;
+}
+
+/**
+ * Admin thread - Serves one admin connection at a time
+ *
+ * Polls the listener and the current connection, sampling session
+ * rates once per interval between commands.
+ *
+ * @param arg Unused
+ * @return Never returns
+ */
+static void *admin_thread(void *arg)
+{
+    struct timespec last;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+
+    while (1)
+    {
+        struct pollfd fds[2] = {
+            {.fd = admin_listener, .events = POLLIN},
+            {.fd = admin_conn, .events = POLLIN}};
+
+        int ready = poll(fds, admin_conn >= 0 ? 2 : 1, ADMIN_SAMPLE_MS);
+        if (ready < 0 && errno != EINTR)
+            break;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+        if (elapsed * 1000 >= ADMIN_SAMPLE_MS)
+        {
+            sample_rates(elapsed);
+            last = now;
+        }
+
+        if (ready <= 0)
+            continue;
+
+        if (fds[0].revents & POLLIN)
+        {
+            int conn = accept(admin_listener, NULL, NULL);
+            if (conn >= 0 && admin_conn >= 0)
+            {
+                dprintf(conn, "error: another admin session is active\n");
+                close(conn);
+            }
+            else if (conn >= 0)
+            {
+                admin_conn = conn;
+                admin_buffered = 0;
+                format_whiteboard_msg(MSG_TYPE_DEBUG, "Admin connected");
+            }
+        }
+
+        if (admin_conn >= 0 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR)))
+        {
+            if (serve_connection() < 0)
+            {
+                close(admin_conn);
+                admin_conn = -1;
+                format_whiteboard_msg(MSG_TYPE_DEBUG, "Admin disconnected");
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Creates the admin Unix socket and starts its thread
+ *
+ * The socket file is recreated on every start and restricted to the
+ * owner, since it allows disconnecting users.
+ *
+ * @param path Filesystem path of the socket
+ * @return 0 on success, -1 on failure
+ */
+int admin_start(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    rates = calloc(client_capacity, sizeof(RateSample));
+    if (!rates)
+        return -1;
+
+    admin_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (admin_listener < 0)
+        return -1;
+
+    // Restrict the socket before listen(); until then connect() is refused,
+    // so nobody else can reach it. The process umask is left alone
+    unlink(path);
+    if (bind(admin_listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(path, 0600) < 0 ||
+        listen(admin_listener, 4) < 0)
+    {
+        close(admin_listener);
+        admin_listener = -1;
+        return -1;
+    }
+
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, admin_thread, NULL) != 0)
+    {
+        close(admin_listener);
+        admin_listener = -1;
+        return -1;
+    }
+    pthread_detach(thread_id);
+
+    return 0;
+}
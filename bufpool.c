@@ -0,0 +1,143 @@
+#include "server.h"
+
+/**
+ * Buffer header structure - Precedes every pooled buffer
+ *
+ * Padded to 16 bytes so buffers keep malloc's alignment.
+ */
+typedef struct BufferHeader
+{
+    struct BufferHeader *next; // Next idle buffer of the class
+    size_t size_class;         // Index into classes[]
+} __attribute__((aligned(16))) BufferHeader;
+
+/**
+ * Buffer class structure - Free list and counters of one buffer size
+ */
+typedef struct
+{
+    size_t size;             // Usable bytes of each buffer
+    pthread_mutex_t lock;    // Guards free and idle
+    BufferHeader *free;      // Idle buffers, most recently returned first
+    int idle;                // Buffers on the free list
+    atomic_long in_use;      // Buffers currently borrowed
+    atomic_ulong peak;       // Most buffers borrowed at once
+    atomic_ulong borrowed;   // Total buffer_get() calls served
+    atomic_ulong allocated;  // Calls that had to allocate
+    atomic_ulong released;   // Returned buffers freed because the pool was full
+} BufferClass;
+
+// Inbound client frames, and every other frame up to the protocol maximum
+static BufferClass classes[] = {
+    {.size = PROTO_HEADER_SIZE + MAX_INBOUND_BODY, .lock = PTHREAD_MUTEX_INITIALIZER},
+    {.size = PROTO_MAX_FRAME, .lock = PTHREAD_MUTEX_INITIALIZER},
+};
+
+#define CLASS_COUNT (sizeof(classes) / sizeof(classes[0]))
+
+static atomic_long idle_bytes; // Bytes held on all free lists
+
+/**
+ * Borrows a buffer for a frame in flight
+ *
+ * Sessions hold no buffers while idle; a thread borrows one when a frame
+ * arrives or is built and returns it once the frame is handled. Idle
+ * buffers are reused most recently returned first, so the pages touched
+ * stay few and warm.
+ *
+ * @param size Bytes needed, at most PROTO_MAX_FRAME
+ * @return Buffer of at least size bytes, or NULL if size is too large or
+ *         memory ran out
+ */
+uint8_t *buffer_get(size_t size)
+{
+    size_t c = 0;
+    while (c < CLASS_COUNT && classes[c].size < size)
+        c++;
+    if (c == CLASS_COUNT)
+        return NULL;
+    BufferClass *cls = &classes[c];
+
+    pthread_mutex_lock(&cls->lock);
+    BufferHeader *buffer = cls->free;
+    if (buffer)
+    {
+        cls->free = buffer->next;
+        cls->idle--;
+    }
+    pthread_mutex_unlock(&cls->lock);
+
+    if (buffer)
+    {
+        atomic_fetch_sub_explicit(&idle_bytes, cls->size, memory_order_relaxed);
+    }
+    else
+    {
+        buffer = malloc(sizeof(BufferHeader) + cls->size);
+        if (!buffer)
+            return NULL;
+        buffer->size_class = c;
+        atomic_fetch_add_explicit(&cls->allocated, 1, memory_order_relaxed);
+    }
+
+    long in_use = atomic_fetch_add_explicit(&cls->in_use, 1, memory_order_relaxed) + 1;
+    counter_max(&cls->peak, in_use);
+    atomic_fetch_add_explicit(&cls->borrowed, 1, memory_order_relaxed);
+    return (uint8_t *)(buffer + 1);
+}
+
+/**
+ * Returns a borrowed buffer to the pool
+ *
+ * Buffers beyond buffer_pool_kb of idle memory are freed instead.
+ *
+ * @param data Buffer from buffer_get(), or NULL
+ */
+void buffer_put(uint8_t *data)
+{
+    if (!data)
+        return;
+    BufferHeader *buffer = (BufferHeader *)data - 1;
+    BufferClass *cls = &classes[buffer->size_class];
+    atomic_fetch_sub_explicit(&cls->in_use, 1, memory_order_relaxed);
+
+    long limit = (long)config_get()->buffer_pool_kb * 1024;
+    if (atomic_fetch_add_explicit(&idle_bytes, cls->size, memory_order_relaxed) + (long)cls->size > limit)
+    {
+        atomic_fetch_sub_explicit(&idle_bytes, cls->size, memory_order_relaxed);
+        atomic_fetch_add_explicit(&cls->released, 1, memory_order_relaxed);
+        free(buffer);
+        return;
+    }
+
+    pthread_mutex_lock(&cls->lock);
+    buffer->next = cls->free;
+    cls->free = buffer;
+    cls->idle++;
+    pthread_mutex_unlock(&cls->lock);
+}
+
+/**
+ * Writes buffer pool usage per size class
+ *
+ * @param fd Admin connection to write to
+ */
+void buffer_report(int fd)
+{
+    dprintf(fd, "idle %ld KB (limit %d KB)\n", atomic_load_explicit(&idle_bytes, memory_order_relaxed) / 1024,
+            config_get()->buffer_pool_kb);
+    dprintf(fd, "%8s %8s %8s %8s %12s %10s %10s\n", "size", "in use", "peak", "idle", "borrowed", "allocated", "released");
+    for (size_t c = 0; c < CLASS_COUNT; c++)
+    {
+        BufferClass *cls = &classes[c];
+        pthread_mutex_lock(&cls->lock);
+        int idle = cls->idle;
+        pthread_mutex_unlock(&cls->lock);
+        dprintf(fd, "%8zu %8ld %8lu %8d %12lu %10lu %10lu\n", cls->size,
+                atomic_load_explicit(&cls->in_use, memory_order_relaxed),
+                atomic_load_explicit(&cls->peak, memory_order_relaxed), idle,
+                atomic_load_explicit(&cls->borrowed, memory_order_relaxed),
+                atomic_load_explicit(&cls->allocated, memory_order_relaxed),
+                atomic_load_explicit(&cls->released, memory_order_relaxed));
+    }
+}
@@ -1,4 +1,5 @@
 #include "common.h"
+#include "wire.h"
 #include <errno.h>
 #include <stdarg.h> // Add this header for va_start, va_end
 
@@ -6,6 +7,7 @@ int sock = -1;
 char username[MAX_USERNAME];
 pthread_t recv_thread;
 int connected = 0;
+uint32_t next_request_id = 1; // Id of the next query; responses echo it
 
 /**
  * Print formatted messages with optional timestamp
@@ -39,6 +41,149 @@ void print_message(int type, const char *format, ...)
     }
 }
 
+void display_frame(int type, const uint8_t *body, size_t len);
+
+/**
+ * Display the complete frames of a history or mentions batch
+ *
+ * @param frames Frames back to back
+ */
+void display_batch(ProtoBytes frames)
+{
+    const uint8_t *p = frames.ptr;
+    const uint8_t *end = p + frames.len;
+    ProtoHeader inner;
+    while (end - p >= PROTO_HEADER_SIZE && proto_decode_header(p, &inner) == 0 &&
+           inner.length <= (size_t)(end - p - PROTO_HEADER_SIZE))
+    {
+        // Batches never nest
+        if (inner.type != MSG_HISTORY && inner.type != MSG_MENTIONS)
+            display_frame(inner.type, p + PROTO_HEADER_SIZE, inner.length);
+        p += PROTO_HEADER_SIZE + inner.length;
+    }
+}
+
+/**
+ * Display one decoded frame according to its type
+ *
+ * @param type Message type from the frame header
+ * @param body Frame body
+ * @param len Body length
+ */
+void display_frame(int type, const uint8_t *body, size_t len)
+{
+    BroadcastMsg broadcast;
+    PrivateMsg private_msg;
+    JoinMsg join;
+    LogoutMsg logout;
+    ErrorMsg error;
+    RosterResponseMsg roster;
+    HistoryMsg history;
+    PublishMsg publish;
+    MentionMsg mention;
+    MentionsMsg mentions;
+
+    switch (type)
+    {
+    case MSG_BROADCAST:
+        if (decode_broadcast(body, len, &broadcast) == 0)
+            print_message(0, "%s%.*s%s: %.*s",
+                          ANSI_BOLD, (int)broadcast.sender.len, broadcast.sender.ptr, ANSI_RESET,
+                          (int)broadcast.content.len, broadcast.content.ptr);
+        break;
+    case MSG_PRIVATE:
+        if (decode_private(body, len, &private_msg) == 0)
+            print_message(0, "%s%s%.*s %s%s→%s %s%.*s: %.*s%s",
+                          ANSI_BOLD, ANSI_MAGENTA, (int)private_msg.sender.len, private_msg.sender.ptr,
+                          ANSI_BLUE, ANSI_BOLD, ANSI_RESET, ANSI_MAGENTA,
+                          (int)private_msg.recipient.len, private_msg.recipient.ptr,
+                          (int)private_msg.content.len, private_msg.content.ptr, ANSI_RESET);
+        break;
+    case MSG_PUBLISH:
+        if (decode_publish(body, len, &publish) == 0)
+            print_message(0, "%s[%.*s]%s %s%.*s%s: %.*s",
+                          ANSI_BLUE, (int)publish.topic.len, publish.topic.ptr, ANSI_RESET,
+                          ANSI_BOLD, (int)publish.sender.len, publish.sender.ptr, ANSI_RESET,
+                          (int)publish.content.len, publish.content.ptr);
+        break;
+    case MSG_JOIN:
+        if (decode_join(body, len, &join) == 0)
+            print_message(0, "%s*** %.*s %.*s ***%s", ANSI_GREEN,
+                          (int)join.sender.len, join.sender.ptr,
+                          (int)join.content.len, join.content.ptr, ANSI_RESET);
+        break;
+    case MSG_LOGOUT:
+        if (decode_logout(body, len, &logout) == 0)
+            print_message(0, "%s*** %.*s %.*s ***%s", ANSI_YELLOW,
+                          (int)logout.sender.len, logout.sender.ptr,
+                          (int)logout.content.len, logout.content.ptr, ANSI_RESET);
+        break;
+    case MSG_ERROR:
+        if (decode_error(body, len, &error) < 0)
+            break;
+        if (error.has_retry_after_ms)
+            print_message(0, "%sError: %.*s (retry in %u s)%s", ANSI_RED, (int)error.content.len,
+                          error.content.ptr, (error.retry_after_ms + 999) / 1000, ANSI_RESET);
+        else
+            print_message(0, "%sError: %.*s%s",
+                          ANSI_RED, (int)error.content.len, error.content.ptr, ANSI_RESET);
+        break;
+    case MSG_ROSTER_RESPONSE:
+        if (decode_roster_response(body, len, &roster) == 0)
+        {
+            print_message(0, "%s%u user(s) online:%s", ANSI_CYAN, roster.count, ANSI_RESET);
+
+            // Names are consecutive NUL-terminated strings
+            const char *name = (const char *)roster.names.ptr;
+            const char *end = name + roster.names.len;
+            while (name < end)
+            {
+                size_t name_len = strnlen(name, end - name);
+                print_message(0, "  %.*s", (int)name_len, name);
+                name += name_len + 1;
+            }
+        }
+        break;
+    case MSG_HISTORY:
+        if (decode_history(body, len, &history) == 0 && history.count > 0)
+        {
+            if (history.peer.len)
+                print_message(0, "%s--- last %u message(s) with %.*s ---%s", ANSI_CYAN, history.count,
+                              (int)history.peer.len, history.peer.ptr, ANSI_RESET);
+            else
+                print_message(0, "%s--- last %u message(s) in the room ---%s",
+                              ANSI_CYAN, history.count, ANSI_RESET);
+
+            display_batch(history.frames);
+            print_message(0, "%s---%s", ANSI_CYAN, ANSI_RESET);
+        }
+        else if (history.count == 0 && history.peer.len)
+        {
+            print_message(0, "%sNo recent messages with %.*s%s", ANSI_CYAN,
+                          (int)history.peer.len, history.peer.ptr, ANSI_RESET);
+        }
+        break;
+    case MSG_MENTION:
+        if (decode_mention(body, len, &mention) == 0)
+            print_message(0, "%s@ %.*s mentioned you (%u mention(s), /mentions to review)%s", ANSI_YELLOW,
+                          (int)mention.sender.len, mention.sender.ptr, mention.count, ANSI_RESET);
+        break;
+    case MSG_MENTIONS:
+        if (decode_mentions(body, len, &mentions) == 0)
+        {
+            if (mentions.count == 0)
+            {
+                print_message(0, "%sNo recent mentions%s", ANSI_CYAN, ANSI_RESET);
+                break;
+            }
+            print_message(0, "%s--- last %u mention(s) ---%s", ANSI_CYAN, mentions.count, ANSI_RESET);
+            display_batch(mentions.frames);
+            print_message(0, "%s---%s", ANSI_CYAN, ANSI_RESET);
+        }
+        break;
+    }
+}
+
 /**
  * Thread function to receive messages from the server
  *
@@ -50,12 +195,12 @@ void print_message(int type, const char *format, ...)
  */
 void *receive_messages(void *arg)
 {
-    Message msg;
+    uint8_t frame[PROTO_MAX_FRAME];
+    ProtoHeader hdr;
 
     while (connected)
     {
-        int bytes_received = recv(sock, &msg, sizeof(Message), 0);
-        if (bytes_received <= 0)
+        if (recv_frame(sock, frame, sizeof(frame), &hdr) < 0)
         {
             printf("\n%s[!] Server disconnected%s\n> ", ANSI_RED, ANSI_RESET);
             fflush(stdout);
@@ -64,30 +209,7 @@ void *receive_messages(void *arg)
         }
 
         printf("\n"); // Prevent overwriting the prompt
-
-        switch (msg.type)
-        {
-        case MSG_BROADCAST:
-            print_message(0, "%s%s%s: %s",
-                          ANSI_BOLD, msg.sender, ANSI_RESET, msg.content);
-            break;
-        case MSG_PRIVATE:
-            print_message(0, "%s%s%s %s%s→%s %s: %s%s",
-                          ANSI_BOLD, ANSI_MAGENTA, msg.sender, ANSI_BLUE, ANSI_BOLD,
-                          ANSI_RESET, ANSI_MAGENTA, msg.content, ANSI_RESET);
-            break;
-        case MSG_LOGIN:
-        case MSG_LOGOUT:
-            print_message(0, "%s*** %s %s ***%s",
-                          msg.type == MSG_LOGIN ? ANSI_GREEN : ANSI_YELLOW,
-                          msg.sender, msg.content, ANSI_RESET);
-            break;
-        case MSG_ERROR:
-            print_message(0, "%sError: %s%s",
-                          ANSI_RED, msg.content, ANSI_RESET);
-            break;
-        }
-
+        display_frame(hdr.type, frame + PROTO_HEADER_SIZE, hdr.length);
         printf("> ");
         fflush(stdout);
     }
@@ -97,7 +219,7 @@ void *receive_messages(void *arg)
 /**
  * Send a private message to a recipient
  *
- * Builds a Message structure with sender, recipient and content,
+ * Encodes a private frame with sender, recipient and content,
  * then sends it to the server.
  *
  * @param recipient Username of recipient
@@ -111,13 +233,70 @@ void send_message(const char *recipient, const char *content)
         return;
     }
 
-    Message msg;
-    msg.type = MSG_PRIVATE;
-    strncpy(msg.sender, username, MAX_USERNAME);
-    strncpy(msg.recipient, recipient, MAX_USERNAME);
-    strncpy(msg.content, content, MAX_MESSAGE);
+    uint8_t frame[PROTO_HEADER_SIZE + PRIVATE_MAX_BODY];
+    PrivateMsg msg = {
+        .sender = proto_str(username),
+        .recipient = proto_str(recipient),
+        .content = proto_str(content)};
+
+    size_t len = encode_private(frame, sizeof(frame), &msg);
+    if (len == 0)
+    {
+        printf("%s[!] Message too long%s\n", ANSI_RED, ANSI_RESET);
+        return;
+    }
+
+    send_all(sock, frame, len);
+}
+
+/**
+ * Send a message to everyone in the room
+ *
+ * @param content Message content
+ */
+void send_broadcast(const char *content)
+{
+    if (!connected)
+    {
+        printf("%s[!] Not connected to server%s\n", ANSI_RED, ANSI_RESET);
+        return;
+    }
+
+    uint8_t frame[PROTO_HEADER_SIZE + BROADCAST_MAX_BODY];
+    BroadcastMsg msg = {.sender = proto_str(username), .content = proto_str(content)};
+    size_t len = encode_broadcast(frame, sizeof(frame), &msg);
+    if (len == 0)
+    {
+        printf("%s[!] Message too long%s\n", ANSI_RED, ANSI_RESET);
+        return;
+    }
+    send_all(sock, frame, len);
+}
+
+/**
+ * Send an encoded request frame under a fresh request id
+ *
+ * The response is matched by request id and printed by the receive
+ * thread whenever it arrives, without blocking chat traffic.
+ *
+ * @param frame Encoded request frame
+ * @param len Frame length, 0 if encoding failed
+ */
+void send_request(uint8_t *frame, size_t len)
+{
+    if (!connected)
+    {
+        printf("%s[!] Not connected to server%s\n", ANSI_RED, ANSI_RESET);
+        return;
+    }
+    if (len == 0)
+    {
+        printf("%s[!] Invalid request%s\n", ANSI_RED, ANSI_RESET);
+        return;
+    }
 
-    send(sock, &msg, sizeof(Message), 0);
+    proto_set_request_id(frame, next_request_id++);
+    send_all(sock, frame, len);
 }
 
 /**
@@ -149,8 +328,11 @@ void connect_to_server(int server_port)
 
     connected = 1;
 
-    // Send username to server (server will handle the login announcement)
-    write(sock, username, MAX_USERNAME);
+    // Send login frame to server (server will handle the login announcement)
+    uint8_t frame[PROTO_HEADER_SIZE + LOGIN_MAX_BODY];
+    LoginMsg login = {.username = proto_str(username)};
+    size_t len = encode_login(frame, sizeof(frame), &login);
+    send_all(sock, frame, len);
 
     // Create message receiver thread
     pthread_create(&recv_thread, NULL, receive_messages, NULL);
@@ -193,6 +375,11 @@ int main(int argc, char *argv[])
     printf("%s╚══════════════════════════════════════╝%s\n\n", ANSI_BOLD, ANSI_RESET);
     printf("Welcome, %s%s%s!\n", ANSI_BOLD, username, ANSI_RESET);
     printf("To send a message, type: %s<username> <message>%s\n", ANSI_BOLD, ANSI_RESET);
+    printf("To message everyone, type: %s/all <message>%s\n", ANSI_BOLD, ANSI_RESET);
+    printf("To publish on a topic, type: %s/pub <topic> <message>%s\n", ANSI_BOLD, ANSI_RESET);
+    printf("Other commands: %s/who%s, %s/history [username]%s, %s/mentions%s, %s/sub <pattern>%s, %s/unsub <pattern>%s\n",
+           ANSI_BOLD, ANSI_RESET, ANSI_BOLD, ANSI_RESET, ANSI_BOLD, ANSI_RESET, ANSI_BOLD, ANSI_RESET,
+           ANSI_BOLD, ANSI_RESET);
 
     connect_to_server(server_port);
 
@@ -209,6 +396,63 @@ int main(int argc, char *argv[])
         if (strlen(input) == 0)
             continue;
 
+        // Handle commands
+        if (strcmp(input, "/who") == 0)
+        {
+            uint8_t frame[PROTO_HEADER_SIZE + ROSTER_REQUEST_MAX_BODY];
+            RosterRequestMsg request = {0};
+            send_request(frame, encode_roster_request(frame, sizeof(frame), &request));
+            continue;
+        }
+        if (strncmp(input, "/history", 8) == 0 && (input[8] == '\0' || input[8] == ' '))
+        {
+            uint8_t frame[PROTO_HEADER_SIZE + HISTORY_REQUEST_MAX_BODY];
+            HistoryRequestMsg request = {.peer = proto_str(input[8] ? input + 9 : "")};
+            send_request(frame, encode_history_request(frame, sizeof(frame), &request));
+            continue;
+        }
+        if (strcmp(input, "/mentions") == 0)
+        {
+            uint8_t frame[PROTO_HEADER_SIZE + MENTIONS_REQUEST_MAX_BODY];
+            MentionsRequestMsg request = {0};
+            send_request(frame, encode_mentions_request(frame, sizeof(frame), &request));
+            continue;
+        }
+        if (strncmp(input, "/sub ", 5) == 0)
+        {
+            uint8_t frame[PROTO_HEADER_SIZE + SUBSCRIBE_MAX_BODY];
+            SubscribeMsg request = {.pattern = proto_str(input + 5)};
+            send_request(frame, encode_subscribe(frame, sizeof(frame), &request));
+            continue;
+        }
+        if (strncmp(input, "/unsub ", 7) == 0)
+        {
+            uint8_t frame[PROTO_HEADER_SIZE + UNSUBSCRIBE_MAX_BODY];
+            UnsubscribeMsg request = {.pattern = proto_str(input + 7)};
+            send_request(frame, encode_unsubscribe(frame, sizeof(frame), &request));
+            continue;
+        }
+        if (strncmp(input, "/pub ", 5) == 0)
+        {
+            char *topic = input + 5;
+            char *space = strchr(topic, ' ');
+            if (!space)
+            {
+                printf("%s[!] Usage: /pub <topic> <message>%s\n", ANSI_YELLOW, ANSI_RESET);
+                continue;
+            }
+            *space = '\0';
+            uint8_t frame[PROTO_HEADER_SIZE + PUBLISH_MAX_BODY];
+            PublishMsg request = {.sender = proto_str(""), .topic = proto_str(topic), .content = proto_str(space + 1)};
+            send_request(frame, encode_publish(frame, sizeof(frame), &request));
+            continue;
+        }
+        if (strncmp(input, "/all ", 5) == 0)
+        {
+            send_broadcast(input + 5);
+            continue;
+        }
+
         // Handle message sending: <recipient> <message>
         char *space = strchr(input, ' ');
         if (!space)
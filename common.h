@@ -14,25 +14,11 @@
 #define MAX_USERNAME 20    // Maximum username length
 #define MAX_MESSAGE 256    // Maximum length of a message
 #define WHITEBOARD_SIZE 10 // Number of messages to store on the whiteboard
-
-// Message types: defines various message actions
-typedef enum
-{
-    MSG_LOGIN,
-    MSG_LOGOUT,
-    MSG_BROADCAST,
-    MSG_PRIVATE,
-    MSG_ERROR
-} MessageType;
-
-// Message structure for communication
-typedef struct
-{
-    MessageType type;
-    char sender[MAX_USERNAME];
-    char recipient[MAX_USERNAME]; // Recipient for private messaging
-    char content[MAX_MESSAGE];
-} Message;
+#define MAX_INBOUND_BODY 1024 // Largest frame body a client may send
+#define MAX_QUERY_BYTES 60000 // Largest payload of a query response
+#define MAX_STREAM_FRAME 65536 // Largest frame carried on a gateway stream
+#define MAX_TOPIC 128 // Maximum length of a topic or subscription pattern
+#define MAX_GATEWAY_SECRET 64 // Maximum length of the gateway link secret, plus one
 
 // ANSI color codes used for terminal output formatting
 #define ANSI_RESET "\x1b[0m"
@@ -0,0 +1,389 @@
+#include "config.h"
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/**
+ * Integer setting descriptor - Maps a config key to a Config field
+ */
+typedef struct
+{
+    const char *key; // Name used in the config file
+    size_t offset;   // Offset of the int field within Config
+    int min;         // Smallest accepted value
+    int max;         // Largest accepted value
+} IntSetting;
+
+static const IntSetting int_settings[] = {
+    {"port", offsetof(Config, port), 1, 65535},
+    {"max_clients", offsetof(Config, max_clients), 1, 65536},
+    {"whiteboard_size", offsetof(Config, whiteboard_size), 1, 1000},
+    {"listen_backlog", offsetof(Config, listen_backlog), 1, 65535},
+    {"max_message", offsetof(Config, max_message), 2, MAX_MESSAGE},
+    {"rate_limit_msgs", offsetof(Config, rate_limit_msgs), 0, 1000000},
+    {"rate_limit_burst", offsetof(Config, rate_limit_burst), 1, 1000000},
+    {"login_timeout_ms", offsetof(Config, login_timeout_ms), 0, 3600000},
+    {"send_timeout_ms", offsetof(Config, send_timeout_ms), 0, 3600000},
+    {"query_threads", offsetof(Config, query_threads), 1, 256},
+    {"query_queue_max", offsetof(Config, query_queue_max), 1, 1000000},
+    {"history_messages", offsetof(Config, history_messages), 0, 100000},
+    {"history_bytes", offsetof(Config, history_bytes), 1024, MAX_QUERY_BYTES},
+    {"history_dm_pairs", offsetof(Config, history_dm_pairs), 1, 10000000},
+    {"journal_buffer_kb", offsetof(Config, journal_buffer_kb), 16, 65536},
+    {"journal_flush_ms", offsetof(Config, journal_flush_ms), 1, 10000},
+    {"segment_kb", offsetof(Config, segment_kb), 64, 1048576},
+    {"dict_retrain_segments", offsetof(Config, dict_retrain_segments), 1, 100000},
+    {"retention_hours", offsetof(Config, retention_hours), 0, 876000},
+    {"retention_mb", offsetof(Config, retention_mb), 0, 16777216},
+    {"compaction_kbps", offsetof(Config, compaction_kbps), 0, 16777216},
+    {"replication_queue_kb", offsetof(Config, replication_queue_kb), 64, 1048576},
+    {"takeover_ms", offsetof(Config, takeover_ms), 100, 600000},
+    {"max_subscriptions", offsetof(Config, max_subscriptions), 1, 100000},
+    {"mention_index", offsetof(Config, mention_index), 0, 10000},
+    {"mention_users", offsetof(Config, mention_users), 1, 10000000},
+    {"spam_window_ms", offsetof(Config, spam_window_ms), 100, 3600000},
+    {"spam_sender_max", offsetof(Config, spam_sender_max), 0, 100000000},
+    {"spam_content_max", offsetof(Config, spam_content_max), 0, 100000000},
+    {"overload_lag_ms", offsetof(Config, overload_lag_ms), 0, 60000},
+    {"overload_queue_kb", offsetof(Config, overload_queue_kb), 0, 16777216},
+    {"overload_backlog", offsetof(Config, overload_backlog), 0, 65535},
+    {"overload_retry_ms", offsetof(Config, overload_retry_ms), 0, 3600000},
+    {"log_ring_records", offsetof(Config, log_ring_records), 16, 1048576},
+    {"flight_records", offsetof(Config, flight_records), 16, 65536},
+    {"log_flush_ms", offsetof(Config, log_flush_ms), 1, 60000},
+    {"log_rotate_kb", offsetof(Config, log_rotate_kb), 0, 16777216},
+    {"log_keep", offsetof(Config, log_keep), 0, 100},
+    {"log_sample_info", offsetof(Config, log_sample_info), 0, 1000000},
+    {"log_sample_debug", offsetof(Config, log_sample_debug), 0, 1000000},
+    {"perf_sample", offsetof(Config, perf_sample), 0, 100000000},
+    {"reactor_threads", offsetof(Config, reactor_threads), 0, 256},
+    {"coroutine_stack_kb", offsetof(Config, coroutine_stack_kb), 16, 8192},
+    {"buffer_pool_kb", offsetof(Config, buffer_pool_kb), 0, 1048576},
+    {"thread_stack_kb", offsetof(Config, thread_stack_kb), 64, 8192},
+};
+
+/**
+ * Path setting descriptor - Maps a config key to a Config path field
+ */
+typedef struct
+{
+    const char *key; // Name used in the config file
+    size_t offset;   // Offset of the CONFIG_PATH_MAX char array within Config
+} PathSetting;
+
+static const PathSetting path_settings[] = {
+    {"admin_socket", offsetof(Config, admin_socket)},
+    {"replication_socket", offsetof(Config, replication_socket)},
+    {"store_dir", offsetof(Config, store_dir)},
+    {"event_log", offsetof(Config, event_log)},
+    {"flight_file", offsetof(Config, flight_file)},
+};
+
+// Published snapshot; replaced ones are freed by the reloader
+static _Atomic(Config *) current_config;
+
+static char reload_path[CONFIG_PATH_MAX * 4];
+static void (*reload_callback)(const Config *old_cfg, const Config *new_cfg);
+
+/**
+ * Fills a config with the compile-time defaults
+ *
+ * @param cfg Config to initialize
+ */
+static void config_defaults(Config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->port = 8888;
+    cfg->max_clients = MAX_CLIENTS;
+    cfg->whiteboard_size = WHITEBOARD_SIZE;
+    cfg->listen_backlog = 5;
+    cfg->max_message = MAX_MESSAGE;
+    cfg->rate_limit_msgs = 0;
+    cfg->rate_limit_burst = 20;
+    cfg->login_timeout_ms = 10000;
+    cfg->send_timeout_ms = 2000;
+    cfg->query_threads = 2;
+    cfg->query_queue_max = 1024;
+    cfg->history_messages = 50;
+    cfg->history_bytes = 32768;
+    cfg->history_dm_pairs = 4096;
+    cfg->journal_buffer_kb = 256;
+    cfg->journal_flush_ms = 20;
+    cfg->segment_kb = 1024;
+    cfg->dict_retrain_segments = 16;
+    cfg->compaction_kbps = 1024;
+    cfg->replication_queue_kb = 1024;
+    cfg->takeover_ms = 1000;
+    cfg->max_subscriptions = 64;
+    cfg->mention_index = 50;
+    cfg->mention_users = 4096;
+    cfg->spam_window_ms = 10000;
+    cfg->spam_sender_max = 0;
+    cfg->spam_content_max = 0;
+    cfg->overload_lag_ms = 100;
+    cfg->overload_queue_kb = 65536;
+    cfg->overload_backlog = 0;
+    cfg->overload_retry_ms = 5000;
+    cfg->log_ring_records = 1024;
+    cfg->flight_records = 256;
+    cfg->reactor_threads = 0;
+    cfg->coroutine_stack_kb = 64;
+    cfg->log_flush_ms = 200;
+    cfg->log_rotate_kb = 16384;
+    cfg->log_keep = 4;
+    cfg->log_sample_info = 1;
+    cfg->log_sample_debug = 100;
+    cfg->perf_sample = 0;
+    cfg->buffer_pool_kb = 1024;
+    cfg->thread_stack_kb = 256;
+    strcpy(cfg->log_level, "info");
+}
+
+/**
+ * Removes leading and trailing whitespace in place
+ *
+ * @param s String to trim
+ * @return Pointer to the first non-space character
+ */
+static char *trim(char *s)
+{
+    while (isspace((unsigned char)*s))
+        s++;
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+    return s;
+}
+
+/**
+ * Applies one key/value pair to a config
+ *
+ * @param cfg Config being built
+ * @param key Setting name
+ * @param value Setting value
+ * @return 0 on success, -1 if the key or value is invalid
+ */
+static int config_set(Config *cfg, const char *key, const char *value)
+{
+    for (size_t i = 0; i < sizeof(int_settings) / sizeof(int_settings[0]); i++)
+    {
+        const IntSetting *s = &int_settings[i];
+        if (strcmp(key, s->key) != 0)
+            continue;
+
+        char *end;
+        errno = 0;
+        long v = strtol(value, &end, 10);
+        if (errno || *end || end == value || v < s->min || v > s->max)
+        {
+            fprintf(stderr, "config: %s must be between %d and %d\n", key, s->min, s->max);
+            return -1;
+        }
+        *(int *)((char *)cfg + s->offset) = (int)v;
+        return 0;
+    }
+
+    for (size_t i = 0; i < sizeof(path_settings) / sizeof(path_settings[0]); i++)
+    {
+        const PathSetting *s = &path_settings[i];
+        if (strcmp(key, s->key) != 0)
+            continue;
+
+        if (strlen(value) >= CONFIG_PATH_MAX)
+        {
+            fprintf(stderr, "config: %s path is too long\n", key);
+            return -1;
+        }
+        strcpy((char *)cfg + s->offset, value);
+        return 0;
+    }
+
+    if (strcmp(key, "log_level") == 0)
+    {
+        if (strcmp(value, "debug") && strcmp(value, "info") &&
+            strcmp(value, "warn") && strcmp(value, "error"))
+        {
+            fprintf(stderr, "config: log_level must be debug, info, warn or error\n");
+            return -1;
+        }
+        strcpy(cfg->log_level, value);
+        return 0;
+    }
+
+    if (strcmp(key, "gateway_secret") == 0)
+    {
+        if (strlen(value) >= MAX_GATEWAY_SECRET)
+        {
+            fprintf(stderr, "config: gateway_secret must be shorter than %d characters\n", MAX_GATEWAY_SECRET);
+            return -1;
+        }
+        strcpy(cfg->gateway_secret, value);
+        return 0;
+    }
+
+    fprintf(stderr, "config: unknown setting '%s'\n", key);
+    return -1;
+}
+
+/**
+ * Parses a config file into a freshly allocated snapshot
+ *
+ * Format is one "key = value" per line; '#' starts a comment.
+ * Keys that are not present keep their default values.
+ *
+ * @param path Config file path, or NULL for defaults only
+ * @return New snapshot, or NULL if the file is unreadable or invalid
+ */
+static Config *config_parse(const char *path)
+{
+    Config *cfg = malloc(sizeof(Config));
+    if (!cfg)
+        return NULL;
+    config_defaults(cfg);
+
+    if (!path)
+        return cfg;
+
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        fprintf(stderr, "config: cannot open %s\n", path);
+        free(cfg);
+        return NULL;
+    }
+
+    char line[512];
+    int lineno = 0;
+    int ok = 1;
+    while (ok && fgets(line, sizeof(line), file))
+    {
+        lineno++;
+        line[strcspn(line, "#")] = '\0';
+        char *entry = trim(line);
+        if (!*entry)
+            continue;
+
+        char *equals = strchr(entry, '=');
+        if (!equals)
+        {
+            fprintf(stderr, "config: %s:%d: expected key = value\n", path, lineno);
+            ok = 0;
+            break;
+        }
+        *equals = '\0';
+        if (config_set(cfg, trim(entry), trim(equals + 1)) < 0)
+        {
+            fprintf(stderr, "config: %s:%d: invalid line\n", path, lineno);
+            ok = 0;
+        }
+    }
+    fclose(file);
+
+    if (!ok)
+    {
+        free(cfg);
+        return NULL;
+    }
+    return cfg;
+}
+
+/**
+ * Loads the initial configuration
+ *
+ * @param path Config file path, or NULL to use the defaults
+ * @return 0 on success, -1 if the file is unreadable or invalid
+ */
+int config_load(const char *path)
+{
+    Config *cfg = config_parse(path);
+    if (!cfg)
+        return -1;
+    atomic_store_explicit(&current_config, cfg, memory_order_release);
+    return 0;
+}
+
+/**
+ * Returns the current configuration snapshot
+ *
+ * Lock-free; safe to call from any thread on the hot path.
+ *
+ * @return Pointer to the published snapshot
+ */
+const Config *config_get(void)
+{
+    return atomic_load_explicit(&current_config, memory_order_acquire);
+}
+
+/**
+ * Reloader thread - Waits for SIGHUP and swaps in a new snapshot
+ *
+ * A file that fails to parse leaves the current snapshot in place. The
+ * replaced snapshot is freed after CONFIG_RETIRE_MS, once readers that
+ * loaded it before the swap are done; SIGHUPs arriving meanwhile stay
+ * pending, so at most one retired snapshot is alive.
+ *
+ * @param arg Unused
+ * @return Never returns
+ */
+static void *reload_thread(void *arg)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+
+    while (1)
+    {
+        int sig;
+        if (sigwait(&set, &sig) != 0)
+            continue;
+
+        Config *cfg = config_parse(reload_path[0] ? reload_path : NULL);
+        if (!cfg)
+        {
+            if (reload_callback)
+                reload_callback(config_get(), NULL);
+            continue;
+        }
+
+        Config *old_cfg = atomic_exchange_explicit(&current_config, cfg, memory_order_acq_rel);
+        if (reload_callback)
+            reload_callback(old_cfg, cfg);
+
+        struct timespec grace = {CONFIG_RETIRE_MS / 1000, (CONFIG_RETIRE_MS % 1000) * 1000000L};
+        while (nanosleep(&grace, &grace) < 0 && errno == EINTR)
+            ;
+        free(old_cfg);
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts the thread that reloads the config file on SIGHUP
+ *
+ * SIGHUP must already be blocked in every thread (block it in main
+ * before creating any threads) so only the reloader receives it.
+ *
+ * @param path Config file to re-read, or NULL to reset to defaults
+ * @param on_reload Called after each reload attempt with the old and
+ *                  new snapshots; new_cfg is NULL if parsing failed
+ * @return 0 on success, -1 if the thread could not be created
+ */
+int config_start_reloader(const char *path,
+                          void (*on_reload)(const Config *old_cfg, const Config *new_cfg))
+{
+    if (path)
+    {
+        strncpy(reload_path, path, sizeof(reload_path) - 1);
+        reload_path[sizeof(reload_path) - 1] = '\0';
+    }
+    reload_callback = on_reload;
+
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, reload_thread, NULL) != 0)
+        return -1;
+    pthread_detach(thread_id);
+    return 0;
+}
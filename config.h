@@ -0,0 +1,81 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "common.h"
+
+#define CONFIG_PATH_MAX 108 // Longest path accepted for socket settings
+#define CONFIG_RETIRE_MS 5000 // How long a replaced snapshot stays readable
+
+/**
+ * Config structure - Immutable snapshot of the server tunables
+ *
+ * A snapshot is never modified after it is published. Reloads build a
+ * fresh snapshot and swap the global pointer, so readers just load the
+ * pointer and use it without locks. A replaced snapshot is freed
+ * CONFIG_RETIRE_MS after the swap, so a reader must not keep one across
+ * a blocking call; copy the values it needs or call config_get() again.
+ */
+typedef struct
+{
+    // Startup-only settings (changes need a restart)
+    int port;                            // TCP port to listen on
+    int max_clients;                     // Session capacity; reload may only lower the active limit
+    int whiteboard_size;                 // Whiteboard capacity; reload may only shrink the view
+    int listen_backlog;                  // Pending connection queue length
+    char admin_socket[CONFIG_PATH_MAX];  // Admin socket path, empty for the default
+    int query_threads;                   // Threads executing roster/history queries
+    char replication_socket[CONFIG_PATH_MAX]; // Standby change stream socket, empty for the default
+    int replication_queue_kb;            // Changes buffered for a slow standby before it must resync
+    char store_dir[CONFIG_PATH_MAX];     // Directory of the persistent message log, empty = off
+    int journal_buffer_kb;               // Size of each of the two journal write batches
+    char event_log[CONFIG_PATH_MAX];     // Structured event log file, empty = off
+    int log_ring_records;                // Events a thread may buffer before new ones are dropped
+    char flight_file[CONFIG_PATH_MAX];   // Flight recorder dump file, empty for the default
+    int flight_records;                  // Recent events the flight recorder keeps per thread
+    int reactor_threads;                 // Threads running sessions as coroutines, 0 = one thread per connection
+    int coroutine_stack_kb;              // Stack of each session coroutine, a guard page below it
+
+    // Hot-reloadable settings
+    int max_message;                     // Longest accepted message content
+    int rate_limit_msgs;                 // Sustained messages per second per session, 0 = unlimited
+    int rate_limit_burst;                // Messages a session may send in a burst
+    int login_timeout_ms;                // Time allowed to send the username
+    int send_timeout_ms;                 // Send timeout for new sessions before a message is dropped
+    int query_queue_max;                 // Queued queries before new ones are refused
+    int history_messages;                // Recent messages kept per conversation, 0 = off
+    int history_bytes;                   // Arena size of a conversation ring, applies to new rings
+    int history_dm_pairs;                // DM conversations kept before the least recent is dropped
+    int journal_flush_ms;                // Longest time a logged message waits for the disk
+    int segment_kb;                      // Journal size at which it is sealed into a segment
+    int dict_retrain_segments;           // Segments compressed before the dictionary is retrained
+    int retention_hours;                 // Age after which stored messages are removed, 0 = forever
+    int retention_mb;                    // Size above which the oldest segments are removed, 0 = unlimited
+    int compaction_kbps;                 // Disk bandwidth compaction may use, 0 = unthrottled
+    int takeover_ms;                     // Time a standby waits without a primary before taking over
+    int max_subscriptions;               // Topic subscriptions a session may hold
+    int mention_index;                   // Mentions kept per user, 0 = off; applies to new indexes
+    int mention_users;                   // Users with a mention index before the least recent is dropped
+    int spam_window_ms;                  // Window over which senders and repeated messages are counted
+    int spam_sender_max;                 // Messages a session may send per window, 0 = unlimited
+    int spam_content_max;                // Copies of one message allowed per window, 0 = unlimited
+    int overload_lag_ms;                 // Scheduling delay that counts as overload, 0 = ignore
+    int overload_queue_kb;               // KB queued to all clients that count as overload, 0 = ignore
+    int overload_backlog;                // Pending connections that count as overload, 0 = ignore
+    int overload_retry_ms;               // Retry delay suggested to logins turned away
+    int log_flush_ms;                    // Interval at which buffered events are written
+    int log_rotate_kb;                   // Event log size at which it is rotated, 0 = never
+    int log_keep;                        // Rotated event logs kept
+    int log_sample_info;                 // Keep one info event in N, 0 = none
+    int log_sample_debug;                // Keep one debug event in N, 0 = none
+    int perf_sample;                     // Measure one stage execution in N with hardware counters, 0 = off
+    int buffer_pool_kb;                  // Idle frame buffers kept for reuse
+    int thread_stack_kb;                 // Stack reserved for each new connection thread
+    char log_level[8];                   // Whiteboard log level name
+    char gateway_secret[MAX_GATEWAY_SECRET]; // Secret a gateway's hello must carry, empty = no gateways
+} Config;
+
+int config_load(const char *path);
+const Config *config_get(void);
+int config_start_reloader(const char *path, void (*on_reload)(const Config *old_cfg, const Config *new_cfg));
+
+#endif // CONFIG_H
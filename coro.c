@@ -0,0 +1,490 @@
+#include "server.h"
+#include "wire.h"
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+#define CORO_EVENTS 256        // Readiness events taken per epoll_wait
+#define CORO_STACK_CACHE 1024  // Finished coroutine stacks kept mapped for reuse
+
+typedef struct Reactor Reactor;
+
+/**
+ * Coroutine structure - One session's execution context
+ *
+ * Stored at the top of the coroutine's own stack mapping, under which
+ * the stack grows down to a PROT_NONE guard page. A parked session costs
+ * only the stack pages it has touched.
+ */
+typedef struct Coroutine
+{
+    ucontext_t context;            // Registers saved while parked
+    struct Coroutine *next;        // Ready queue or spawn queue link
+    struct Coroutine *timed_next;  // Reactor's list of waits with a deadline
+    Reactor *reactor;              // Reactor the coroutine is pinned to
+    void *(*entry)(void *);        // Session function
+    void *arg;                     // Its argument
+    uint64_t deadline_ns;          // Deadline of the current wait, 0 for none
+    int fd;                        // Socket registered with the reactor, -1 if none
+    int waiting;                   // Parked until fd is readable or the deadline passes
+    int in_timed;                  // On the reactor's timed list
+    int timed_out;                 // The last wait ended at its deadline
+    int done;                      // The session function returned
+} Coroutine;
+
+/**
+ * Reactor structure - One thread running coroutines over an epoll set
+ *
+ * Everything but the spawn queue is touched only by the reactor thread.
+ */
+struct Reactor
+{
+    pthread_t thread;
+    int epoll_fd;
+    int wake_fd;              // eventfd signalled when coroutines are spawned
+    pthread_mutex_t lock;     // Guards spawned
+    Coroutine *spawned;       // Coroutines handed over by other threads
+    Coroutine *ready;         // Coroutines to resume, in order
+    Coroutine *ready_tail;
+    Coroutine *timed;         // Waits with a deadline
+    ucontext_t scheduler;     // Context coroutines switch back to
+    atomic_long sessions;     // Live coroutines
+    atomic_ulong switches;    // Coroutine resumptions
+    atomic_ulong timeouts;    // Waits that reached their deadline
+};
+
+static Reactor *reactors;
+static int reactor_count;
+static size_t page_size;
+static size_t stack_bytes;    // Mapping per coroutine, guard page included
+static __thread Coroutine *current;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *stack_cache[CORO_STACK_CACHE];
+static int cached;
+static atomic_ulong spawned_total;
+static atomic_ulong stacks_mapped;
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Returns the coroutine record stored at the top of a stack mapping
+ */
+static Coroutine *stack_coroutine(char *base)
+{
+    return (Coroutine *)(base + stack_bytes - ((sizeof(Coroutine) + 63) & ~(size_t)63));
+}
+
+static char *coroutine_stack(Coroutine *co)
+{
+    return (char *)co + ((sizeof(Coroutine) + 63) & ~(size_t)63) - stack_bytes;
+}
+
+/**
+ * Takes a stack from the cache or maps a new one with a guard page
+ *
+ * @return Zeroed coroutine record at the top of the stack, or NULL
+ */
+static Coroutine *coroutine_alloc(void)
+{
+    char *base = NULL;
+    pthread_mutex_lock(&cache_lock);
+    if (cached)
+        base = stack_cache[--cached];
+    pthread_mutex_unlock(&cache_lock);
+
+    if (!base)
+    {
+        base = mmap(NULL, stack_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED)
+            return NULL;
+        if (mprotect(base, page_size, PROT_NONE) < 0)
+        {
+            munmap(base, stack_bytes);
+            return NULL;
+        }
+        atomic_fetch_add_explicit(&stacks_mapped, 1, memory_order_relaxed);
+    }
+
+    Coroutine *co = stack_coroutine(base);
+    memset(co, 0, sizeof(*co));
+    co->fd = -1;
+    return co;
+}
+
+/**
+ * Returns a finished coroutine's stack to the cache
+ *
+ * The pages are given back to the kernel first, so cached stacks cost
+ * address space only.
+ */
+static void coroutine_free(Coroutine *co)
+{
+    char *base = coroutine_stack(co);
+    madvise(base + page_size, stack_bytes - page_size, MADV_DONTNEED);
+
+    pthread_mutex_lock(&cache_lock);
+    int kept = cached < CORO_STACK_CACHE;
+    if (kept)
+        stack_cache[cached++] = base;
+    pthread_mutex_unlock(&cache_lock);
+
+    if (!kept)
+    {
+        munmap(base, stack_bytes);
+        atomic_fetch_sub_explicit(&stacks_mapped, 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * First function run on a coroutine's stack; returning switches back to
+ * the scheduler through uc_link
+ */
+static void coroutine_main(void)
+{
+    Coroutine *co = current;
+    co->entry(co->arg);
+    co->done = 1;
+}
+
+static void make_ready(Reactor *r, Coroutine *co)
+{
+    co->waiting = 0;
+    co->next = NULL;
+    if (r->ready_tail)
+        r->ready_tail->next = co;
+    else
+        r->ready = co;
+    r->ready_tail = co;
+}
+
+static void timed_unlink(Reactor *r, Coroutine *co)
+{
+    for (Coroutine **link = &r->timed; *link; link = &(*link)->timed_next)
+    {
+        if (*link == co)
+        {
+            *link = co->timed_next;
+            co->in_timed = 0;
+            return;
+        }
+    }
+}
+
+/**
+ * Runs a coroutine until it parks or finishes
+ */
+static void resume(Reactor *r, Coroutine *co)
+{
+    current = co;
+    atomic_fetch_add_explicit(&r->switches, 1, memory_order_relaxed);
+    swapcontext(&r->scheduler, &co->context);
+    current = NULL;
+
+    if (co->done)
+    {
+        if (co->in_timed)
+            timed_unlink(r, co);
+        atomic_fetch_sub_explicit(&r->sessions, 1, memory_order_relaxed);
+        coroutine_free(co);
+    }
+}
+
+/**
+ * Wakes waits whose deadline has passed and drops finished entries
+ *
+ * Entries stay on the list after an early wake-up and are removed here,
+ * so a wait costs no list operation unless it has a deadline.
+ *
+ * @return Milliseconds until the next deadline, or -1 if there is none
+ */
+static int expire_timed(Reactor *r)
+{
+    uint64_t now = now_ns();
+    uint64_t next = 0;
+    Coroutine **link = &r->timed;
+    while (*link)
+    {
+        Coroutine *co = *link;
+        if (!co->waiting || !co->deadline_ns || co->deadline_ns <= now)
+        {
+            *link = co->timed_next;
+            co->in_timed = 0;
+            if (co->waiting && co->deadline_ns)
+            {
+                co->timed_out = 1;
+                atomic_fetch_add_explicit(&r->timeouts, 1, memory_order_relaxed);
+                make_ready(r, co);
+            }
+            continue;
+        }
+        if (!next || co->deadline_ns < next)
+            next = co->deadline_ns;
+        link = &co->timed_next;
+    }
+    return next ? (int)((next - now + 999999) / 1000000) : -1;
+}
+
+/**
+ * Reactor thread: waits for readiness and resumes the coroutines it wakes
+ */
+static void *reactor_main(void *arg)
+{
+    Reactor *r = arg;
+    struct epoll_event events[CORO_EVENTS];
+    flight_attach();
+
+    while (1)
+    {
+        int timeout = expire_timed(r);
+        if (r->ready)
+            timeout = 0;
+        int n = epoll_wait(r->epoll_fd, events, CORO_EVENTS, timeout);
+        for (int i = 0; i < n; i++)
+        {
+            Coroutine *co = events[i].data.ptr;
+            if (co)
+            {
+                if (co->waiting)
+                    make_ready(r, co);
+                continue;
+            }
+
+            uint64_t count;
+            if (read(r->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                continue;
+            pthread_mutex_lock(&r->lock);
+            Coroutine *spawned = r->spawned;
+            r->spawned = NULL;
+            pthread_mutex_unlock(&r->lock);
+            while (spawned)
+            {
+                Coroutine *next = spawned->next;
+                make_ready(r, spawned);
+                spawned = next;
+            }
+        }
+        expire_timed(r);
+
+        // Coroutines made ready while these run wait for the next round
+        Coroutine *batch = r->ready;
+        r->ready = r->ready_tail = NULL;
+        while (batch)
+        {
+            Coroutine *co = batch;
+            batch = co->next;
+            resume(r, co);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Parks the calling coroutine until a socket is readable
+ *
+ * The socket stays registered with the reactor in one-shot mode and is
+ * re-armed on each wait, so the first wait costs an EPOLL_CTL_ADD and
+ * later ones an EPOLL_CTL_MOD.
+ *
+ * @param co Calling coroutine
+ * @param fd Socket to wait for
+ * @param timeout_ms Longest wait, 0 for none
+ * @return 0 when woken, -1 on timeout or error
+ */
+static int wait_readable(Coroutine *co, int fd, int timeout_ms)
+{
+    Reactor *r = co->reactor;
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = co};
+    int op = co->fd == fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(r->epoll_fd, op, fd, &ev) < 0)
+        return -1;
+    co->fd = fd;
+
+    co->timed_out = 0;
+    co->deadline_ns = timeout_ms > 0 ? now_ns() + (uint64_t)timeout_ms * 1000000 : 0;
+    if (co->deadline_ns && !co->in_timed)
+    {
+        co->timed_next = r->timed;
+        r->timed = co;
+        co->in_timed = 1;
+    }
+    co->waiting = 1;
+
+    perf_switch();
+    swapcontext(&co->context, &r->scheduler);
+    return co->timed_out ? -1 : 0;
+}
+
+/**
+ * Reads exactly len bytes from a socket
+ *
+ * In a coroutine, a read that would block parks the coroutine and lets
+ * its reactor run other sessions. On a plain thread this is a blocking
+ * recv_all() and the socket's SO_RCVTIMEO applies instead of timeout_ms.
+ *
+ * @param fd Socket to read
+ * @param buf Destination
+ * @param len Bytes to read
+ * @param timeout_ms Longest wait for each chunk in a coroutine, 0 for none
+ * @return 1 on success, 0 on close, error or timeout
+ */
+int coro_read(int fd, void *buf, size_t len, int timeout_ms)
+{
+    Coroutine *co = current;
+    if (!co)
+        return recv_all(fd, buf, len);
+
+    size_t got = 0;
+    while (got < len)
+    {
+        ssize_t n = recv(fd, (char *)buf + got, len - got, MSG_DONTWAIT);
+        if (n > 0)
+        {
+            got += n;
+            continue;
+        }
+        if (n == 0)
+            return 0;
+        if (errno == EINTR)
+            continue;
+        if ((errno != EAGAIN && errno != EWOULDBLOCK) || wait_readable(co, fd, timeout_ms) < 0)
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Tells whether the caller runs in a coroutine
+ *
+ * @return 1 in a coroutine, 0 on a plain thread
+ */
+int coro_running(void)
+{
+    return current != NULL;
+}
+
+/**
+ * Stops watching a socket the calling coroutine is handing to a thread
+ *
+ * Must be called before the coroutine finishes without closing the
+ * socket, or the reactor could wake a freed coroutine.
+ *
+ * @param fd Socket passed on
+ */
+void coro_release(int fd)
+{
+    Coroutine *co = current;
+    if (!co || co->fd != fd)
+        return;
+    epoll_ctl(co->reactor->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    co->fd = -1;
+}
+
+/**
+ * Starts a session function as a coroutine on the least loaded reactor
+ *
+ * @param entry Session function; it must close any socket the reactor
+ *              watches for it, or pass it on with coro_release()
+ * @param arg Its argument
+ * @return 0 on success, -1 if no stack could be mapped
+ */
+int coro_spawn(void *(*entry)(void *), void *arg)
+{
+    Coroutine *co = coroutine_alloc();
+    if (!co)
+        return -1;
+
+    Reactor *r = &reactors[0];
+    for (int i = 1; i < reactor_count; i++)
+    {
+        if (atomic_load_explicit(&reactors[i].sessions, memory_order_relaxed) <
+            atomic_load_explicit(&r->sessions, memory_order_relaxed))
+            r = &reactors[i];
+    }
+
+    char *base = coroutine_stack(co);
+    co->entry = entry;
+    co->arg = arg;
+    co->reactor = r;
+    getcontext(&co->context);
+    co->context.uc_stack.ss_sp = base + page_size;
+    co->context.uc_stack.ss_size = ((char *)co - (base + page_size)) & ~(size_t)15;
+    co->context.uc_link = &r->scheduler;
+    makecontext(&co->context, coroutine_main, 0);
+
+    atomic_fetch_add_explicit(&r->sessions, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&spawned_total, 1, memory_order_relaxed);
+    pthread_mutex_lock(&r->lock);
+    co->next = r->spawned;
+    r->spawned = co;
+    pthread_mutex_unlock(&r->lock);
+
+    uint64_t one = 1;
+    if (write(r->wake_fd, &one, sizeof(one)) < 0)
+        perror("coro_spawn");
+    return 0;
+}
+
+/**
+ * Starts the reactor threads
+ *
+ * @param threads Number of reactors
+ * @param stack_kb Usable stack per coroutine, rounded up to whole pages
+ * @return 0 on success, -1 on failure
+ */
+int coro_start(int threads, int stack_kb)
+{
+    page_size = sysconf(_SC_PAGESIZE);
+    stack_bytes = (((size_t)stack_kb * 1024 + page_size - 1) & ~(page_size - 1)) + page_size;
+    reactors = calloc(threads, sizeof(Reactor));
+    if (!reactors)
+        return -1;
+
+    for (int i = 0; i < threads; i++)
+    {
+        Reactor *r = &reactors[i];
+        pthread_mutex_init(&r->lock, NULL);
+        r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        r->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+        if (r->epoll_fd < 0 || r->wake_fd < 0 || epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &ev) < 0 ||
+            pthread_create(&r->thread, NULL, reactor_main, r) != 0)
+            return -1;
+        pthread_detach(r->thread);
+        reactor_count = i + 1;
+    }
+    return 0;
+}
+
+/**
+ * Writes reactor load and coroutine stack usage
+ *
+ * @param fd Admin connection to write to
+ */
+void coro_report(int fd)
+{
+    if (!reactor_count)
+    {
+        dprintf(fd, "off: one thread per connection (set reactor_threads)\n");
+        return;
+    }
+    pthread_mutex_lock(&cache_lock);
+    int idle_stacks = cached;
+    pthread_mutex_unlock(&cache_lock);
+
+    dprintf(fd, "stack %zu KB + guard page, %lu mapped, %d cached\n", (stack_bytes - page_size) / 1024,
+            atomic_load_explicit(&stacks_mapped, memory_order_relaxed), idle_stacks);
+    dprintf(fd, "spawned %lu\n", atomic_load_explicit(&spawned_total, memory_order_relaxed));
+    dprintf(fd, "%-8s %10s %12s %10s\n", "reactor", "sessions", "switches", "timeouts");
+    for (int i = 0; i < reactor_count; i++)
+        dprintf(fd, "%-8d %10ld %12lu %10lu\n", i, atomic_load_explicit(&reactors[i].sessions, memory_order_relaxed),
+                atomic_load_explicit(&reactors[i].switches, memory_order_relaxed),
+                atomic_load_explicit(&reactors[i].timeouts, memory_order_relaxed));
+}
@@ -0,0 +1,386 @@
+#include "server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define EVENTLOG_BATCH 65536     // Formatted bytes written per write()
+#define EVENTLOG_PATH (CONFIG_PATH_MAX + 8)
+
+/**
+ * Event ring structure - Single-producer, single-consumer queue of one thread
+ *
+ * The owning thread is the only writer of tail and the flush thread the
+ * only writer of head, so neither side takes a lock. When the ring is
+ * full new records are dropped and counted.
+ */
+typedef struct EventRing
+{
+    struct EventRing *next;   // Next ring in the flush thread's list
+    atomic_uint head;         // Next record to read
+    atomic_uint tail;         // Next record to write
+    atomic_int closed;        // Owner exited; free once drained
+    atomic_ulong dropped;     // Records lost to a full ring
+    unsigned capacity;        // Records, a power of two
+    unsigned long sample[LOG_ERROR + 1]; // Owner's per-level counters for sampling
+    EventRecord records[];
+} EventRing;
+
+const EventFormat event_formats[] = {
+    [EV_ACCEPT] = {"accept", "fd", NULL, NULL},
+    [EV_LOGIN] = {"login", "fd", "stream", "user"},
+    [EV_LOGIN_REJECTED] = {"login_rejected", "fd", NULL, "reason"},
+    [EV_LOGOUT] = {"logout", "frames_in", "frames_out", "user"},
+    [EV_FRAME] = {"frame", "type", "bytes", NULL},
+    [EV_PRIVATE] = {"private", "recipient", "bytes", NULL},
+    [EV_BROADCAST] = {"broadcast", "recipients", "bytes", NULL},
+    [EV_ERROR_SENT] = {"error_sent", "request", NULL, "text"},
+    [EV_OVERLOAD] = {"overload", "from", "to", NULL},
+    [EV_RELOAD] = {"config_reload", "ok", NULL, NULL},
+};
+
+static atomic_int enabled;
+static unsigned ring_capacity;
+static char log_path[EVENTLOG_PATH];
+static int log_fd = -1;
+static size_t log_size;
+
+static EventRing *rings = NULL;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread EventRing *my_ring;
+static __thread uint32_t my_thread; // Cached kernel thread id
+
+static atomic_ulong records_written;
+static atomic_ulong records_dropped; // From rings already freed
+static atomic_ulong rotations;
+static atomic_ulong write_errors;
+
+/**
+ * Marks the exiting thread's ring for the flush thread to free
+ */
+static void ring_release(void *arg)
+{
+    EventRing *ring = arg;
+    atomic_store_explicit(&ring->closed, 1, memory_order_release);
+}
+
+/**
+ * Returns the calling thread's ring, creating it on first use
+ *
+ * @return The ring, or NULL if memory ran out
+ */
+static EventRing *ring_get(void)
+{
+    if (my_ring)
+        return my_ring;
+
+    EventRing *ring = calloc(1, sizeof(EventRing) + ring_capacity * sizeof(EventRecord));
+    if (!ring)
+        return NULL;
+    ring->capacity = ring_capacity;
+
+    pthread_mutex_lock(&rings_mutex);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_mutex);
+
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+    return ring;
+}
+
+/**
+ * Records an event from the calling thread
+ *
+ * Every event goes to the flight recorder. For the log, warnings and
+ * errors are always kept; info and debug events are kept one in
+ * log_sample_info / log_sample_debug, counted per thread, and not at all
+ * when the rate is 0.
+ *
+ * @param level Severity
+ * @param event Event type
+ * @param session Session id, 0 if none
+ * @param a First event value
+ * @param b Second event value
+ * @param text Short text such as a username, or NULL
+ */
+void eventlog_emit(LogLevel level, EventType event, uint64_t session, uint64_t a, uint64_t b, const char *text)
+{
+    if (!my_thread)
+        my_thread = syscall(SYS_gettid);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    EventRecord record = {.ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec, .session = session,
+                          .a = a, .b = b, .thread = my_thread, .event = event, .level = level};
+    if (text)
+    {
+        record.text_len = strnlen(text, EVENT_TEXT);
+        memcpy(record.text, text, record.text_len);
+    }
+    flight_record(&record);
+
+    if (!atomic_load_explicit(&enabled, memory_order_acquire))
+        return;
+
+    EventRing *ring = ring_get();
+    if (!ring)
+        return;
+
+    if (level < LOG_WARN)
+    {
+        const Config *cfg = config_get();
+        int rate = level == LOG_DEBUG ? cfg->log_sample_debug : cfg->log_sample_info;
+        if (rate == 0 || ring->sample[level]++ % rate != 0)
+            return;
+    }
+
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == ring->capacity)
+    {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    ring->records[tail & (ring->capacity - 1)] = record;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/**
+ * Opens the log file for appending and records its size
+ */
+static int open_log(void)
+{
+    log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+    if (log_fd < 0)
+        return -1;
+    struct stat st;
+    log_size = fstat(log_fd, &st) == 0 ? st.st_size : 0;
+    return 0;
+}
+
+/**
+ * Renames path to path.1, path.1 to path.2 and so on, dropping the
+ * oldest, then starts a fresh file
+ *
+ * @param keep Rotated files to keep
+ */
+static void rotate(int keep)
+{
+    char from[EVENTLOG_PATH + 12];
+    char to[EVENTLOG_PATH + 12];
+
+    close(log_fd);
+    log_fd = -1;
+    for (int i = keep; i >= 1; i--)
+    {
+        if (i > 1)
+            snprintf(from, sizeof(from), "%s.%d", log_path, i - 1);
+        else
+            snprintf(from, sizeof(from), "%s", log_path);
+        snprintf(to, sizeof(to), "%s.%d", log_path, i);
+        rename(from, to);
+    }
+    if (keep == 0)
+        unlink(log_path);
+
+    if (open_log() < 0)
+        atomic_fetch_add_explicit(&write_errors, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&rotations, 1, memory_order_relaxed);
+}
+
+/**
+ * Writes formatted lines, rotating first if the file would grow too big
+ *
+ * The config is fetched per batch; the flush thread must not keep a
+ * snapshot across file writes.
+ */
+static void write_batch(const char *buf, size_t len)
+{
+    if (len == 0)
+        return;
+    const Config *cfg = config_get();
+    if (log_fd >= 0 && cfg->log_rotate_kb && log_size + len > (size_t)cfg->log_rotate_kb << 10 && log_size > 0)
+        rotate(cfg->log_keep);
+    if (log_fd < 0)
+        return;
+
+    ssize_t n = write(log_fd, buf, len);
+    if (n < 0 || (size_t)n != len)
+        atomic_fetch_add_explicit(&write_errors, 1, memory_order_relaxed);
+    if (n > 0)
+        log_size += n;
+}
+
+/**
+ * Formats one record as a line of key=value fields
+ *
+ * @return Characters written, excluding the NUL
+ */
+static int format_record(char *out, size_t cap, const EventRecord *r)
+{
+    time_t secs = r->ns / 1000000000ULL;
+    struct tm tm;
+    gmtime_r(&secs, &tm);
+
+    const EventFormat *f = &event_formats[r->event];
+    int n = snprintf(out, cap, "%04d-%02d-%02dT%02d:%02d:%02d.%06luZ %-5s %s",
+                     tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                     (unsigned long)(r->ns % 1000000000ULL / 1000), log_level_name(r->level), f->name);
+    if (r->session)
+        n += snprintf(out + n, cap - n, " session=%llu", (unsigned long long)r->session);
+    if (f->a)
+        n += snprintf(out + n, cap - n, " %s=%llu", f->a, (unsigned long long)r->a);
+    if (f->b)
+        n += snprintf(out + n, cap - n, " %s=%llu", f->b, (unsigned long long)r->b);
+    if (f->text)
+        n += snprintf(out + n, cap - n, " %s=\"%.*s\"", f->text, r->text_len, r->text);
+    n += snprintf(out + n, cap - n, "\n");
+    return n;
+}
+
+/**
+ * Orders records by timestamp
+ */
+static int compare_time(const void *x, const void *y)
+{
+    uint64_t a = ((const EventRecord *)x)->ns;
+    uint64_t b = ((const EventRecord *)y)->ns;
+    return a < b ? -1 : a > b;
+}
+
+/**
+ * Flush thread - Drains every ring, orders the records by time and
+ * writes them as text in large batches
+ *
+ * @param arg Unused
+ * @return Never returns
+ */
+static void *flush_thread(void *arg)
+{
+    (void)arg;
+    size_t cap = 4096;
+    EventRecord *batch = malloc(cap * sizeof(EventRecord));
+    char *text = malloc(EVENTLOG_BATCH + 256);
+    if (!batch || !text)
+        return NULL;
+
+    while (1)
+    {
+        const Config *cfg = config_get();
+        struct timespec pause = {.tv_sec = cfg->log_flush_ms / 1000, .tv_nsec = cfg->log_flush_ms % 1000 * 1000000L};
+        nanosleep(&pause, NULL);
+
+        size_t count = 0;
+        pthread_mutex_lock(&rings_mutex);
+        for (EventRing **link = &rings; *link;)
+        {
+            EventRing *ring = *link;
+            int closed = atomic_load_explicit(&ring->closed, memory_order_acquire);
+            unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+            if (count + (tail - head) > cap)
+            {
+                EventRecord *grown = realloc(batch, (count + (tail - head)) * 2 * sizeof(EventRecord));
+                if (grown)
+                {
+                    batch = grown;
+                    cap = (count + (tail - head)) * 2;
+                }
+            }
+            for (; head != tail && count < cap; head++)
+                batch[count++] = ring->records[head & (ring->capacity - 1)];
+            atomic_store_explicit(&ring->head, head, memory_order_release);
+
+            if (closed && head == tail)
+            {
+                *link = ring->next;
+                atomic_fetch_add_explicit(&records_dropped, atomic_load(&ring->dropped), memory_order_relaxed);
+                free(ring);
+                continue;
+            }
+            link = &ring->next;
+        }
+        pthread_mutex_unlock(&rings_mutex);
+
+        qsort(batch, count, sizeof(EventRecord), compare_time);
+
+        size_t used = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            used += format_record(text + used, EVENTLOG_BATCH + 256 - used, &batch[i]);
+            if (used >= EVENTLOG_BATCH)
+            {
+                write_batch(text, used);
+                used = 0;
+            }
+        }
+        write_batch(text, used);
+        atomic_fetch_add_explicit(&records_written, count, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+/**
+ * Opens the event log and starts its flush thread
+ *
+ * @param path Log file; rotated copies get .1, .2, ... suffixes
+ * @param ring_records Records per thread ring, rounded up to a power of two
+ * @return 0 on success, -1 on failure
+ */
+int eventlog_start(const char *path, int ring_records)
+{
+    snprintf(log_path, sizeof(log_path), "%s", path);
+    if (open_log() < 0)
+        return -1;
+
+    ring_capacity = 1;
+    while (ring_capacity < (unsigned)ring_records)
+        ring_capacity <<= 1;
+
+    if (pthread_key_create(&ring_key, ring_release) != 0)
+        return -1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, flush_thread, NULL) != 0)
+        return -1;
+    pthread_detach(thread);
+    atomic_store_explicit(&enabled, 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * Writes event log counters to an admin connection
+ *
+ * @param fd Admin connection to write to
+ */
+void eventlog_report(int fd)
+{
+    if (!atomic_load_explicit(&enabled, memory_order_acquire))
+    {
+        dprintf(fd, "event log disabled\n");
+        return;
+    }
+
+    int count = 0;
+    unsigned long dropped = atomic_load_explicit(&records_dropped, memory_order_relaxed);
+    pthread_mutex_lock(&rings_mutex);
+    for (EventRing *ring = rings; ring; ring = ring->next)
+    {
+        count++;
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&rings_mutex);
+
+    const Config *cfg = config_get();
+    int sample_info = cfg->log_sample_info, sample_debug = cfg->log_sample_debug;
+    dprintf(fd, "file %s\n", log_path);
+    dprintf(fd, "thread rings %d of %u records\n", count, ring_capacity);
+    dprintf(fd, "sampling info 1/%d, debug 1/%d (0 = off)\n", sample_info, sample_debug);
+    dprintf(fd, "written %lu, dropped %lu, rotations %lu, write errors %lu\n",
+            atomic_load_explicit(&records_written, memory_order_relaxed), dropped,
+            atomic_load_explicit(&rotations, memory_order_relaxed),
+            atomic_load_explicit(&write_errors, memory_order_relaxed));
+}
@@ -0,0 +1,585 @@
+#define _GNU_SOURCE // accept4
+#include "common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <time.h>
+
+#define PROXY_READ_CHUNK 16384 // Largest read from a socket at a time
+#define PROXY_MAX_EVENTS 256
+
+/**
+ * Faults structure - What the proxy does to a faulty connection
+ *
+ * Every setting applies to both directions on its own.
+ */
+typedef struct
+{
+    int latency_ms;     // Delay added to every chunk of data
+    int jitter_ms;      // Extra random delay, up to this much
+    int rate_bps;       // Bandwidth cap in bytes per second, 0 = none
+    int max_write;      // Writes are cut to 1..max_write bytes, 0 = whole chunks
+    int stall_every_ms; // Mean time between stalls, 0 = none
+    int stall_ms;       // Length of each stall
+    long reset_bytes;   // Mean bytes forwarded before a reset, 0 = never
+    int percent;        // Connections that get the faults; the rest pass clean
+    int queue_kb;       // Data held per direction before the proxy stops reading
+} Faults;
+
+/**
+ * Chunk structure - Data read from one side, waiting for its due time
+ */
+typedef struct Chunk
+{
+    struct Chunk *next;
+    uint64_t due_ns; // Earliest time it may be written
+    size_t len;
+    size_t off;      // Bytes already written
+    uint8_t data[];
+} Chunk;
+
+/**
+ * Pipe structure - One direction of a proxied connection
+ */
+typedef struct
+{
+    int from;             // Socket read from
+    int to;               // Socket written to
+    Chunk *head;
+    Chunk *tail;
+    size_t queued;        // Bytes read and not yet written
+    size_t queue_peak;
+    double tokens;        // Bandwidth budget, bytes
+    uint64_t refilled_ns; // When tokens was last topped up
+    uint64_t next_stall;  // Start of the next stall
+    uint64_t stall_until; // End of the current or last stall
+    int stalls;           // Stalls so far
+    int blocked;          // The last write found the socket full
+    int eof;              // from has closed
+    int shut;             // to has been shut down for writing
+    uint64_t bytes;       // Bytes written
+} Pipe;
+
+typedef enum
+{
+    END_OPEN,
+    END_CLOSED, // Both sides closed, or a peer reset
+    END_RESET,  // Reset by the proxy
+    END_ERROR   // A socket failed
+} EndReason;
+
+struct Link;
+
+/**
+ * Endpoint structure - Registered with epoll for one socket of a link
+ */
+typedef struct
+{
+    struct Link *link;
+    int side;      // 0 = client, 1 = server
+    uint32_t mask; // Events currently requested
+} Endpoint;
+
+/**
+ * Link structure - A client connection and its server connection
+ */
+typedef struct Link
+{
+    struct Link *prev;
+    struct Link *next;
+    unsigned long id;
+    int faulty;
+    uint64_t reset_after; // Bytes forwarded before the reset, 0 = never
+    EndReason end;
+    Endpoint ends[2];
+    Pipe up;              // Client to server
+    Pipe down;            // Server to client
+} Link;
+
+static Faults faults = {.percent = 100, .queue_kb = 64};
+static Link *links;
+static int epoll_fd = -1;
+static int server_port = 8888;
+static uint64_t rng_state = 1;
+static volatile sig_atomic_t stopping = 0;
+static unsigned long link_count = 0;
+static unsigned long faulty_count = 0;
+static unsigned long reset_count = 0;
+static unsigned long error_count = 0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Returns a uniformly distributed number in [lo, hi] (xorshift64*)
+ */
+static uint64_t rng_range(uint64_t lo, uint64_t hi)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    uint64_t r = rng_state * 0x2545f4914f6cdd1dULL;
+    return hi <= lo ? lo : lo + r % (hi - lo + 1);
+}
+
+static void handle_stop(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+/**
+ * Reports whether a pipe is in a stall, moving its stall schedule forward
+ */
+static int pipe_stalled(const Link *link, Pipe *p, uint64_t now)
+{
+    if (!link->faulty || !faults.stall_every_ms)
+        return 0;
+    uint64_t every = (uint64_t)faults.stall_every_ms * 1000000;
+    while (now >= p->next_stall)
+    {
+        p->stall_until = p->next_stall + (uint64_t)faults.stall_ms * 1000000;
+        p->next_stall = p->stall_until + rng_range(every / 2, every + every / 2);
+        p->stalls++;
+    }
+    return now < p->stall_until;
+}
+
+static int pipe_readable(const Link *link, Pipe *p, uint64_t now)
+{
+    return !p->eof && p->queued < (size_t)faults.queue_kb * 1024 && !pipe_stalled(link, p, now);
+}
+
+/**
+ * Reads what a side has sent, up to the queue limit, and queues it behind
+ * the added latency
+ */
+static void pipe_read(Link *link, Pipe *p, uint64_t now)
+{
+    Chunk *chunk = malloc(sizeof(Chunk) + PROXY_READ_CHUNK);
+    if (!chunk)
+    {
+        link->end = END_ERROR;
+        return;
+    }
+    size_t room = (size_t)faults.queue_kb * 1024 - p->queued;
+    ssize_t n = recv(p->from, chunk->data, room < PROXY_READ_CHUNK ? room : PROXY_READ_CHUNK, 0);
+    if (n <= 0)
+    {
+        free(chunk);
+        if (n == 0)
+            p->eof = 1;
+        else if (errno == ECONNRESET)
+            link->end = END_CLOSED;
+        else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            link->end = END_ERROR;
+        return;
+    }
+
+    chunk->next = NULL;
+    chunk->len = n;
+    chunk->off = 0;
+    chunk->due_ns = now;
+    if (link->faulty)
+        chunk->due_ns += (uint64_t)(faults.latency_ms + rng_range(0, faults.jitter_ms)) * 1000000;
+    // Jitter reorders delays, never bytes
+    if (p->tail && p->tail->due_ns > chunk->due_ns)
+        chunk->due_ns = p->tail->due_ns;
+    if (p->tail)
+        p->tail->next = chunk;
+    else
+        p->head = chunk;
+    p->tail = chunk;
+    p->queued += n;
+    if (p->queued > p->queue_peak)
+        p->queue_peak = p->queued;
+}
+
+/**
+ * Returns the bytes a shaped pipe writes at once: 50 ms worth of its rate
+ */
+static double pipe_burst(void)
+{
+    return faults.rate_bps / 20.0 > 1 ? faults.rate_bps / 20.0 : 1;
+}
+
+/**
+ * Returns the budget the head chunk waits for before a shaped write
+ */
+static double pipe_wanted(const Pipe *p)
+{
+    double left = p->head->len - p->head->off;
+    return left < pipe_burst() ? left : pipe_burst();
+}
+
+/**
+ * Writes the chunks that are due, within the bandwidth budget
+ */
+static void pipe_flush(Link *link, Pipe *p, uint64_t now)
+{
+    int shaped = link->faulty && faults.rate_bps;
+    if (shaped)
+    {
+        p->tokens += (now - p->refilled_ns) * (double)faults.rate_bps / 1e9;
+        if (p->tokens > pipe_burst())
+            p->tokens = pipe_burst();
+        p->refilled_ns = now;
+    }
+
+    while (p->head && !p->blocked && link->end == END_OPEN)
+    {
+        Chunk *chunk = p->head;
+        if (chunk->due_ns > now || pipe_stalled(link, p, now) || (shaped && p->tokens < pipe_wanted(p)))
+            break;
+        size_t len = chunk->len - chunk->off;
+        if (shaped && len > p->tokens)
+            len = p->tokens;
+        if (link->faulty && faults.max_write && len > (size_t)faults.max_write)
+            len = rng_range(1, faults.max_write);
+
+        ssize_t n = send(p->to, chunk->data + chunk->off, len, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                p->blocked = 1;
+            else if (errno == EPIPE || errno == ECONNRESET)
+                link->end = END_CLOSED;
+            else if (errno != EINTR)
+                link->end = END_ERROR;
+            continue;
+        }
+        chunk->off += n;
+        p->queued -= n;
+        p->bytes += n;
+        if (shaped)
+            p->tokens -= n;
+        if (link->reset_after && link->up.bytes + link->down.bytes >= link->reset_after)
+            link->end = END_RESET;
+        if (chunk->off == chunk->len)
+        {
+            p->head = chunk->next;
+            if (!p->head)
+                p->tail = NULL;
+            free(chunk);
+        }
+    }
+
+    if (!p->head && p->eof && !p->shut)
+    {
+        shutdown(p->to, SHUT_WR);
+        p->shut = 1;
+    }
+}
+
+/**
+ * Returns when a pipe next needs attention without a socket event
+ */
+static uint64_t pipe_deadline(const Link *link, Pipe *p, uint64_t now)
+{
+    if (pipe_stalled(link, p, now))
+        return p->stall_until;
+    if (!p->head || p->blocked)
+        return UINT64_MAX;
+    uint64_t due = p->head->due_ns;
+    if (link->faulty && faults.rate_bps && p->tokens < pipe_wanted(p))
+    {
+        uint64_t refill = p->refilled_ns + (uint64_t)((pipe_wanted(p) - p->tokens) * 1e9 / faults.rate_bps) + 1;
+        if (refill > due)
+            due = refill;
+    }
+    return due;
+}
+
+/**
+ * Requests the socket events each side of a link is waiting for
+ */
+static void link_arm(Link *link, uint64_t now)
+{
+    for (int side = 0; side < 2; side++)
+    {
+        Endpoint *end = &link->ends[side];
+        Pipe *reading = side == 0 ? &link->up : &link->down;
+        Pipe *writing = side == 0 ? &link->down : &link->up;
+        uint32_t mask = (pipe_readable(link, reading, now) ? EPOLLIN : 0) | (writing->blocked ? EPOLLOUT : 0);
+        if (mask == end->mask)
+            continue;
+        struct epoll_event ev = {.events = mask, .data.ptr = end};
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, reading->from, &ev);
+        end->mask = mask;
+    }
+}
+
+static void pipe_free(Pipe *p)
+{
+    while (p->head)
+    {
+        Chunk *next = p->head->next;
+        free(p->head);
+        p->head = next;
+    }
+}
+
+/**
+ * Closes both sockets of a finished link and prints its summary
+ *
+ * A reset closes with SO_LINGER set to zero, so both peers get an RST.
+ */
+static void link_close(Link *link)
+{
+    static const char *reasons[] = {"open", "closed", "reset", "error"};
+    if (link->end == END_RESET)
+    {
+        struct linger hard = {.l_onoff = 1, .l_linger = 0};
+        setsockopt(link->up.from, SOL_SOCKET, SO_LINGER, &hard, sizeof(hard));
+        setsockopt(link->up.to, SOL_SOCKET, SO_LINGER, &hard, sizeof(hard));
+        reset_count++;
+    }
+    else if (link->end == END_ERROR)
+    {
+        error_count++;
+    }
+    printf("conn %lu %s: up %llu B, down %llu B, queue peak %zu/%zu B, stalls %d/%d, %s\n", link->id,
+           link->faulty ? "faulty" : "clean", (unsigned long long)link->up.bytes,
+           (unsigned long long)link->down.bytes, link->up.queue_peak, link->down.queue_peak, link->up.stalls,
+           link->down.stalls, reasons[link->end]);
+
+    close(link->up.from);
+    close(link->up.to);
+    pipe_free(&link->up);
+    pipe_free(&link->down);
+    if (link->prev)
+        link->prev->next = link->next;
+    else
+        links = link->next;
+    if (link->next)
+        link->next->prev = link->prev;
+    free(link);
+}
+
+static void pipe_init(Pipe *p, int from, int to, uint64_t now)
+{
+    p->from = from;
+    p->to = to;
+    p->refilled_ns = now;
+    p->tokens = pipe_burst();
+    if (faults.stall_every_ms)
+        p->next_stall = now + rng_range(0, (uint64_t)faults.stall_every_ms * 2000000);
+}
+
+static void set_nodelay(int fd)
+{
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+/**
+ * Accepts a client and opens its connection to the server
+ */
+static void accept_link(int listener, uint64_t now)
+{
+    int client = accept4(listener, NULL, NULL, SOCK_NONBLOCK);
+    if (client < 0)
+        return;
+
+    // The server is local, so a blocking connect returns at once
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(server_port)};
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    Link *link = calloc(1, sizeof(Link));
+    if (server < 0 || !link || connect(server, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        fprintf(stderr, "faultproxy: cannot reach server on port %d: %s\n", server_port, strerror(errno));
+        if (server >= 0)
+            close(server);
+        close(client);
+        free(link);
+        return;
+    }
+    fcntl(server, F_SETFL, fcntl(server, F_GETFL) | O_NONBLOCK);
+    // Cut writes must reach the peer as separate segments
+    set_nodelay(client);
+    set_nodelay(server);
+
+    link->id = ++link_count;
+    link->faulty = (int)rng_range(1, 100) <= faults.percent;
+    if (link->faulty)
+    {
+        faulty_count++;
+        if (faults.reset_bytes)
+            link->reset_after = rng_range(1, 2 * faults.reset_bytes);
+    }
+    pipe_init(&link->up, client, server, now);
+    pipe_init(&link->down, server, client, now);
+    for (int side = 0; side < 2; side++)
+    {
+        link->ends[side] = (Endpoint){.link = link, .side = side, .mask = EPOLLIN};
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &link->ends[side]};
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, side == 0 ? client : server, &ev);
+    }
+    link->next = links;
+    if (links)
+        links->prev = link;
+    links = link;
+}
+
+/**
+ * Entry point for the fault-injecting proxy
+ *
+ * Forwards local connections to the server, adding latency, bandwidth
+ * caps, cut writes, stalls and resets to a share of them. Prints one line
+ * per connection as it ends and totals on SIGINT or SIGTERM.
+ *
+ * @param argc Argument count
+ * @param argv [-l listen_port] [-p server_port] [-L latency_ms]
+ *             [-J jitter_ms] [-b bytes_per_sec] [-w max_write]
+ *             [-s every_ms:stall_ms] [-x reset_bytes] [-f percent]
+ *             [-q queue_kb] [-S seed]
+ * @return 0 on success, 1 on failure
+ */
+int main(int argc, char *argv[])
+{
+    int listen_port = 9888;
+    int valid = 1;
+
+    for (int i = 1; i < argc && valid; i++)
+    {
+        if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+            listen_port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            server_port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc)
+            faults.latency_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-J") == 0 && i + 1 < argc)
+            faults.jitter_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            faults.rate_bps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+            faults.max_write = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            valid = sscanf(argv[++i], "%d:%d", &faults.stall_every_ms, &faults.stall_ms) == 2;
+        else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+            faults.reset_bytes = atol(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            faults.percent = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc)
+            faults.queue_kb = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+            rng_state = strtoull(argv[++i], NULL, 10) | 1;
+        else
+            valid = 0;
+    }
+    if (!valid)
+    {
+        printf("Usage: %s [-l listen_port] [-p server_port] [-L latency_ms] [-J jitter_ms] [-b bytes_per_sec] "
+               "[-w max_write] [-s every_ms:stall_ms] [-x reset_bytes] [-f percent] [-q queue_kb] [-S seed]\n",
+               argv[0]);
+        return 1;
+    }
+    if (listen_port <= 0 || listen_port > 65535 || server_port <= 0 || server_port > 65535 ||
+        faults.latency_ms < 0 || faults.jitter_ms < 0 || faults.rate_bps < 0 || faults.max_write < 0 ||
+        faults.stall_every_ms < 0 || faults.stall_ms < 0 || faults.reset_bytes < 0 || faults.percent < 0 ||
+        faults.percent > 100 || faults.queue_kb < 1)
+    {
+        fprintf(stderr, "faultproxy: invalid port or fault setting\n");
+        return 1;
+    }
+
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(listen_port)};
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 1024) < 0)
+    {
+        fprintf(stderr, "faultproxy: cannot listen on port %d: %s\n", listen_port, strerror(errno));
+        return 1;
+    }
+    epoll_fd = epoll_create1(0);
+    struct epoll_event listen_ev = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener, &listen_ev);
+
+    struct sigaction stop = {.sa_handler = handle_stop};
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    printf("faultproxy: 127.0.0.1:%d -> 127.0.0.1:%d, faults on %d%% of connections\n", listen_port, server_port,
+           faults.percent);
+
+    struct epoll_event events[PROXY_MAX_EVENTS];
+    while (!stopping)
+    {
+        uint64_t now = now_ns();
+        uint64_t next = UINT64_MAX;
+        for (Link *link = links; link; link = link->next)
+        {
+            uint64_t up = pipe_deadline(link, &link->up, now);
+            uint64_t down = pipe_deadline(link, &link->down, now);
+            if (up < next)
+                next = up;
+            if (down < next)
+                next = down;
+        }
+        int timeout = next == UINT64_MAX ? -1 : next <= now ? 0 : (int)((next - now + 999999) / 1000000);
+
+        int n = epoll_wait(epoll_fd, events, PROXY_MAX_EVENTS, timeout);
+        now = now_ns();
+        for (int i = 0; i < n; i++)
+        {
+            Endpoint *end = events[i].data.ptr;
+            if (!end)
+            {
+                accept_link(listener, now);
+                continue;
+            }
+            Link *link = end->link;
+            Pipe *reading = end->side == 0 ? &link->up : &link->down;
+            Pipe *writing = end->side == 0 ? &link->down : &link->up;
+            if (events[i].events & EPOLLERR)
+            {
+                // A peer that exits with unread data resets the connection
+                int error = 0;
+                socklen_t error_len = sizeof(error);
+                getsockopt(reading->from, SOL_SOCKET, SO_ERROR, &error, &error_len);
+                link->end = error == ECONNRESET || error == EPIPE ? END_CLOSED : END_ERROR;
+            }
+            if (events[i].events & EPOLLOUT)
+                writing->blocked = 0;
+            if ((events[i].events & (EPOLLIN | EPOLLHUP)) && link->end == END_OPEN)
+            {
+                if (pipe_readable(link, reading, now))
+                    pipe_read(link, reading, now);
+                else if (events[i].events & EPOLLHUP)
+                    link->end = END_CLOSED; // Hung up while its data waits; the rest is dropped
+            }
+        }
+
+        Link *link = links;
+        while (link)
+        {
+            Link *next_link = link->next;
+            pipe_flush(link, &link->up, now);
+            pipe_flush(link, &link->down, now);
+            if (link->end == END_OPEN && link->up.shut && link->down.shut)
+                link->end = END_CLOSED;
+            if (link->end != END_OPEN)
+                link_close(link);
+            else
+                link_arm(link, now);
+            link = next_link;
+        }
+    }
+
+    while (links)
+        link_close(links);
+    printf("faultproxy: %lu connections, %lu faulty, %lu reset by the proxy, %lu failed\n", link_count,
+           faulty_count, reset_count, error_count);
+    return 0;
+}
@@ -0,0 +1,390 @@
+#include "server.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#define FLIGHT_ALTSTACK 65536 // Signal stack per thread, so a stack overflow can still be dumped
+#define FLIGHT_LINE 256       // Longest formatted dump line
+
+/**
+ * Flight ring structure - The most recent events of one thread
+ *
+ * Unlike the event log rings nothing drains these: the owner overwrites
+ * the oldest record. Rings are never freed. A thread that exits hands
+ * its ring to the next new thread, keeping its records until they are
+ * overwritten, so the number of rings follows the peak thread count.
+ *
+ * A ring and its thread's signal stack share one anonymous mapping, so
+ * only the pages records have been written to are resident; an idle
+ * connection thread costs a page or two here, not the whole ring.
+ */
+typedef struct FlightRing
+{
+    struct FlightRing *next; // Next ring; the list only grows
+    atomic_int owned;        // A live thread is recording into the ring
+    atomic_uint head;        // Records written since the ring was created
+    unsigned cursor;         // Dump position, only used by the dumping thread
+    unsigned end;            // Dump end, only used by the dumping thread
+    void *altstack;          // Signal stack of the owning thread
+    EventRecord records[];
+} FlightRing;
+
+static _Atomic(FlightRing *) rings;
+static unsigned ring_capacity; // Records per ring, a power of two; 0 until started
+static char dump_path[CONFIG_PATH_MAX];
+static pthread_key_t ring_key;
+static __thread FlightRing *my_ring;
+static atomic_flag dumping = ATOMIC_FLAG_INIT;
+static atomic_ulong dumps;
+
+static const int fatal_signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+
+/**
+ * Gives an exiting thread's ring back for reuse
+ */
+static void ring_release(void *arg)
+{
+    FlightRing *ring = arg;
+    stack_t off = {.ss_flags = SS_DISABLE};
+    sigaltstack(&off, NULL);
+    atomic_store_explicit(&ring->owned, 0, memory_order_release);
+}
+
+/**
+ * Returns the calling thread's ring, claiming a free one or creating one
+ *
+ * Also installs the ring's signal stack for the thread.
+ *
+ * @return The ring, or NULL if memory ran out
+ */
+static FlightRing *ring_get(void)
+{
+    if (my_ring)
+        return my_ring;
+
+    FlightRing *ring;
+    for (ring = atomic_load_explicit(&rings, memory_order_acquire); ring; ring = ring->next)
+    {
+        int idle = 0;
+        if (atomic_compare_exchange_strong(&ring->owned, &idle, 1))
+            break;
+    }
+
+    if (!ring)
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t ring_bytes = (sizeof(FlightRing) + ring_capacity * sizeof(EventRecord) + page - 1) & ~(page - 1);
+        void *mapping = mmap(NULL, ring_bytes + FLIGHT_ALTSTACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+            return NULL;
+        ring = mapping;
+        ring->altstack = (char *)mapping + ring_bytes;
+        atomic_store_explicit(&ring->owned, 1, memory_order_relaxed);
+        ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&rings, &ring->next, ring, memory_order_release,
+                                                      memory_order_relaxed))
+            ;
+    }
+
+    stack_t stack = {.ss_sp = ring->altstack, .ss_size = FLIGHT_ALTSTACK};
+    sigaltstack(&stack, NULL);
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+    return ring;
+}
+
+/**
+ * Claims the calling thread's ring and signal stack ahead of its first
+ * event
+ *
+ * Threads running code on guarded stacks call this at start, so a stack
+ * overflow there is caught on the signal stack and dumped.
+ */
+void flight_attach(void)
+{
+    if (ring_capacity)
+        ring_get();
+}
+
+/**
+ * Keeps an event in the calling thread's flight ring
+ *
+ * Called for every event, before event log sampling. Only the owning
+ * thread writes a ring, so this is a 64-byte copy and a store.
+ *
+ * @param record Event to keep
+ */
+void flight_record(const EventRecord *record)
+{
+    if (!ring_capacity)
+        return;
+    FlightRing *ring = ring_get();
+    if (!ring)
+        return;
+
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring->records[head & (ring_capacity - 1)] = *record;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * Line buffer used while dumping; all helpers are async-signal-safe
+ */
+typedef struct
+{
+    char text[FLIGHT_LINE];
+    size_t len;
+} Line;
+
+static void put_str(Line *line, const char *s, size_t n)
+{
+    if (n > FLIGHT_LINE - line->len)
+        n = FLIGHT_LINE - line->len;
+    memcpy(line->text + line->len, s, n);
+    line->len += n;
+}
+
+static void put_cstr(Line *line, const char *s)
+{
+    put_str(line, s, strlen(s));
+}
+
+/**
+ * Appends a number in decimal, zero-padded to at least width digits
+ */
+static void put_u64(Line *line, uint64_t v, int width)
+{
+    char digits[20];
+    int n = 0;
+    do
+    {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (n < width)
+        digits[n++] = '0';
+
+    char out[20];
+    for (int i = 0; i < n; i++)
+        out[i] = digits[n - 1 - i];
+    put_str(line, out, n);
+}
+
+/**
+ * Appends " label=value" for a number
+ */
+static void put_field(Line *line, const char *label, uint64_t v)
+{
+    put_cstr(line, " ");
+    put_cstr(line, label);
+    put_cstr(line, "=");
+    put_u64(line, v, 1);
+}
+
+/**
+ * Formats one record as a dump line
+ *
+ * Time is printed as seconds.microseconds since the epoch, since
+ * calendar conversion is not safe in a signal handler.
+ */
+static void format_record(Line *line, const EventRecord *r)
+{
+    line->len = 0;
+    put_u64(line, r->ns / 1000000000ULL, 1);
+    put_cstr(line, ".");
+    put_u64(line, r->ns % 1000000000ULL / 1000, 6);
+    put_field(line, "thread", r->thread);
+    put_cstr(line, " ");
+    put_cstr(line, log_level_name(r->level));
+    put_cstr(line, " ");
+
+    const EventFormat *f = &event_formats[r->event];
+    put_cstr(line, f->name);
+    if (r->session)
+        put_field(line, "session", r->session);
+    if (f->a)
+        put_field(line, f->a, r->a);
+    if (f->b)
+        put_field(line, f->b, r->b);
+    if (f->text)
+    {
+        put_cstr(line, " ");
+        put_cstr(line, f->text);
+        put_cstr(line, "=\"");
+        put_str(line, r->text, r->text_len < EVENT_TEXT ? r->text_len : EVENT_TEXT);
+        put_cstr(line, "\"");
+    }
+    put_cstr(line, "\n");
+}
+
+/**
+ * Writes every ring to a file as one timeline, oldest event first
+ *
+ * Async-signal-safe: no allocation, locks or stdio. Rings are merged by
+ * repeatedly taking the oldest unprinted record. Threads keep recording
+ * during the dump, so a record being overwritten at that moment may come
+ * out mixed or be skipped.
+ *
+ * Callers must hold the dumping flag.
+ *
+ * @param path File to create or truncate
+ * @param reason Header text saying why the dump was taken
+ * @return Records written, or -1 if the file could not be created
+ */
+static long dump_rings(const char *path, const char *reason)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if (fd < 0)
+        return -1;
+
+    Line line = {.len = 0};
+    put_cstr(&line, "# flight recorder: ");
+    put_cstr(&line, reason);
+    put_cstr(&line, "\n");
+    if (write(fd, line.text, line.len) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    FlightRing *all = atomic_load_explicit(&rings, memory_order_acquire);
+    for (FlightRing *ring = all; ring; ring = ring->next)
+    {
+        ring->end = atomic_load_explicit(&ring->head, memory_order_acquire);
+        ring->cursor = ring->end > ring_capacity ? ring->end - ring_capacity : 0;
+    }
+
+    long count = 0;
+    while (1)
+    {
+        FlightRing *oldest = NULL;
+        const EventRecord *record = NULL;
+        for (FlightRing *ring = all; ring; ring = ring->next)
+        {
+            // Skip records never written or caught mid-write
+            while (ring->cursor != ring->end && ring->records[ring->cursor & (ring_capacity - 1)].ns == 0)
+                ring->cursor++;
+            if (ring->cursor == ring->end)
+                continue;
+            const EventRecord *r = &ring->records[ring->cursor & (ring_capacity - 1)];
+            if (!record || r->ns < record->ns)
+            {
+                oldest = ring;
+                record = r;
+            }
+        }
+        if (!oldest)
+            break;
+
+        EventRecord copy = *record;
+        oldest->cursor++;
+        if (copy.event >= EV_COUNT || copy.level > LOG_ERROR)
+            continue;
+        format_record(&line, &copy);
+        if (write(fd, line.text, line.len) < 0)
+            break;
+        count++;
+    }
+    close(fd);
+    atomic_fetch_add_explicit(&dumps, 1, memory_order_relaxed);
+    return count;
+}
+
+/**
+ * Dumps the rings when the server crashes, then lets the signal kill it
+ *
+ * Runs on the thread's signal stack. Other threads crashing meanwhile
+ * wait here until the process dies.
+ */
+static void crash_handler(int sig)
+{
+    while (atomic_flag_test_and_set(&dumping))
+        ;
+
+    const char *reason = "crashed";
+    switch (sig)
+    {
+    case SIGSEGV:
+        reason = "crashed with SIGSEGV";
+        break;
+    case SIGBUS:
+        reason = "crashed with SIGBUS";
+        break;
+    case SIGFPE:
+        reason = "crashed with SIGFPE";
+        break;
+    case SIGILL:
+        reason = "crashed with SIGILL";
+        break;
+    case SIGABRT:
+        reason = "aborted (SIGABRT)";
+        break;
+    }
+    dump_rings(dump_path, reason);
+
+    // SA_RESETHAND restored the default action; deliver the signal again
+    raise(sig);
+}
+
+/**
+ * Writes the flight recorder to a file on request
+ *
+ * @param path File to write, or NULL for the configured dump file
+ * @return Records written, or -1 on failure
+ */
+int flight_dump(const char *path)
+{
+    if (!ring_capacity)
+        return -1;
+    while (atomic_flag_test_and_set(&dumping))
+        sched_yield();
+    long count = dump_rings(path ? path : dump_path, "admin request");
+    atomic_flag_clear(&dumping);
+    return (int)count;
+}
+
+/**
+ * Starts recording and installs the crash handlers
+ *
+ * Must be called before other threads are created.
+ *
+ * @param path File written when the server crashes
+ * @param records Records kept per thread, rounded up to a power of two
+ * @return 0 on success, -1 on failure
+ */
+int flight_start(const char *path, int records)
+{
+    snprintf(dump_path, sizeof(dump_path), "%s", path);
+    if (pthread_key_create(&ring_key, ring_release) != 0)
+        return -1;
+
+    struct sigaction action = {.sa_handler = crash_handler, .sa_flags = SA_ONSTACK | SA_RESETHAND};
+    sigemptyset(&action.sa_mask);
+    for (size_t i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); i++)
+        sigaction(fatal_signals[i], &action, NULL);
+
+    unsigned capacity = 1;
+    while (capacity < (unsigned)records)
+        capacity <<= 1;
+    ring_capacity = capacity;
+    return 0;
+}
+
+/**
+ * Writes flight recorder settings and ring counts
+ *
+ * @param fd Admin connection to write to
+ */
+void flight_report(int fd)
+{
+    int total = 0;
+    int owned = 0;
+    for (FlightRing *ring = atomic_load_explicit(&rings, memory_order_acquire); ring; ring = ring->next)
+    {
+        total++;
+        owned += atomic_load_explicit(&ring->owned, memory_order_relaxed);
+    }
+    dprintf(fd, "dump file %s\n", dump_path);
+    dprintf(fd, "rings %d (%d in use) of %u records\n", total, owned, ring_capacity);
+    dprintf(fd, "dumps %lu\n", atomic_load_explicit(&dumps, memory_order_relaxed));
+}
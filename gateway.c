@@ -0,0 +1,1193 @@
+#define _GNU_SOURCE // accept4
+#include "common.h"
+#include "protocol.h"
+#include "websocket.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <time.h>
+
+#define GATEWAY_MAX_LINKS 64                   // Most upstream connections to the server
+#define GATEWAY_SLOT_BITS 20                   // Low bits of a stream id index the user table
+#define GATEWAY_MAX_USERS (1 << GATEWAY_SLOT_BITS)
+#define GATEWAY_LOGIN_TIMEOUT_MS 10000         // Time a new connection has to send its login
+#define GATEWAY_USER_QUEUE (256 * 1024)        // Output backlog that drops a slow user
+#define GATEWAY_LINK_QUEUE (16 * 1024 * 1024)  // Output backlog at which a link is taken for dead
+#define GATEWAY_LINK_HIGH (1024 * 1024)        // Link backlog that stops reading its users
+#define GATEWAY_LINK_LOW (256 * 1024)          // Link backlog at which they read again
+#define GATEWAY_KEEP_BUFFER (16 * 1024)        // Larger output buffers are freed once drained
+#define GATEWAY_RETRY_MS 1000                  // Delay between link reconnects
+#define GATEWAY_EVENTS 256                     // Events handled per epoll_wait
+#define GATEWAY_DEFLATE_MIN 64                 // Smaller WebSocket messages are sent uncompressed
+
+/**
+ * Connection kind enumeration - What an epoll event refers to
+ */
+typedef enum
+{
+    CONN_LISTENER,
+    CONN_USER,
+    CONN_LINK
+} ConnKind;
+
+/**
+ * Connection structure - A non-blocking socket with its buffers
+ *
+ * Output is queued and written once per loop iteration, so frames bound
+ * for the same socket in one iteration leave in a single write.
+ */
+typedef struct
+{
+    ConnKind kind;
+    int fd;           // Socket, -1 once closed
+    uint8_t *in;      // Bytes of a partially received frame
+    size_t in_len;
+    size_t in_cap;
+    uint8_t *out;     // Queued output, sent from out_off to out_len
+    size_t out_off;
+    size_t out_len;
+    size_t out_cap;
+    size_t out_max;   // Backlog at which the connection is dropped
+    int dirty;        // Position + 1 on the flush list, 0 if not queued
+    int polling_out;  // EPOLLOUT is registered
+    int paused;       // EPOLLIN is withheld until the user's link drains
+} Conn;
+
+typedef struct Link Link;
+
+/**
+ * User mode enumeration - How a user connection is framed
+ */
+typedef enum
+{
+    USER_NATIVE,    // Protocol frames directly on the socket
+    USER_UPGRADING, // Waiting for the rest of a WebSocket upgrade request
+    USER_WEBSOCKET  // One protocol frame per binary WebSocket message
+} UserMode;
+
+/**
+ * User structure - A user connection terminated by the gateway
+ */
+typedef struct User
+{
+    Conn conn;
+    uint32_t stream;          // Stream id, 0 until logged in
+    Link *link;               // Link carrying the stream, NULL until logged in
+    struct User *prev;        // Neighbours on the pending list or the link's list
+    struct User *next;
+    struct User *paused_next; // Next user waiting for the link to drain
+    long long deadline_ms;    // Login deadline while pending
+    UserMode mode;            // Framing used on the connection
+    int deflate;              // Window bits of permessage-deflate, 0 if not negotiated
+} User;
+
+/**
+ * Outgoing structure - A frame for users and, once a WebSocket user
+ * with compression needs it, its compressed form
+ *
+ * A fanout builds one and hands it to every recipient. The compressed
+ * form suits every user whose window is at least as large, so the frame
+ * is compressed again only for a user who asked for a smaller window.
+ */
+typedef struct
+{
+    const uint8_t *frame;
+    size_t len;
+    size_t deflated;  // Length in deflate_buffer, 0 if not compressed
+    int bits;         // Window compression was last attempted with, 0 if never
+} Outgoing;
+
+/**
+ * Link structure - One upstream connection to the server
+ */
+struct Link
+{
+    Conn conn;             // fd is -1 while disconnected
+    int users;             // Streams open on the link
+    User *head;            // Users carried by the link
+    User *paused;          // Users not read until the link drains
+    long long retry_ms;    // Next reconnect attempt while disconnected
+};
+
+static int epoll_fd;
+static Conn listener = {.kind = CONN_LISTENER};
+static Link links[GATEWAY_MAX_LINKS];
+static int link_count = 4;
+static struct sockaddr_in server_addr;
+static char gateway_name[MAX_USERNAME];
+static char gateway_secret[MAX_GATEWAY_SECRET]; // Sent in each hello, from GATEWAY_SECRET
+
+// Logged-in users by the slot in their stream id; the generation in the
+// high bits changes each time a slot is reused, so a late close for an
+// old stream never reaches its successor
+static User **slots;
+static uint16_t *generations;
+static uint32_t *free_slots;
+static int free_count;
+static int slots_used;
+static int user_count;
+
+// Users that have connected but not logged in, oldest first
+static User *pending_head;
+static User *pending_tail;
+
+static Conn **flush_list;
+static int flush_count;
+static int flush_cap;
+
+// Users closed during this iteration; freed once no event can refer to them
+static User *graveyard;
+
+// WebSocket payload scratch space; the loop handles one message at a time
+static uint8_t deflate_buffer[MAX_STREAM_FRAME + 1024];
+static uint8_t inflate_buffer[PROTO_HEADER_SIZE + MAX_INBOUND_BODY + 1];
+
+/**
+ * Returns a monotonic timestamp in milliseconds
+ *
+ * @return Milliseconds since an arbitrary point
+ */
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Sets a socket to non-blocking mode
+ *
+ * @param fd Socket descriptor
+ */
+static void set_nonblocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/**
+ * Registers the events a connection currently waits for
+ *
+ * @param c Connection
+ */
+static void conn_arm(Conn *c)
+{
+    struct epoll_event ev = {.events = (c->paused ? 0 : EPOLLIN) | (c->polling_out ? EPOLLOUT : 0), .data.ptr = c};
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/**
+ * Registers or clears interest in writability
+ *
+ * @param c Connection
+ * @param want Non-zero to wait for EPOLLOUT
+ */
+static void set_polling(Conn *c, int want)
+{
+    if (c->polling_out == want)
+        return;
+    c->polling_out = want;
+    conn_arm(c);
+}
+
+/**
+ * Puts a connection on the list flushed at the end of the iteration
+ *
+ * @param c Connection with new output
+ */
+static void mark_dirty(Conn *c)
+{
+    if (c->dirty)
+        return;
+    if (flush_count == flush_cap)
+    {
+        int cap = flush_cap ? flush_cap * 2 : 256;
+        Conn **grown = realloc(flush_list, cap * sizeof(Conn *));
+        if (!grown)
+            return;
+        flush_list = grown;
+        flush_cap = cap;
+    }
+    flush_list[flush_count++] = c;
+    c->dirty = flush_count;
+}
+
+/**
+ * Makes room for n more bytes of output
+ *
+ * @param c Connection
+ * @param n Bytes about to be queued
+ * @return Where to write them, or NULL if the backlog limit is reached
+ */
+static uint8_t *conn_reserve(Conn *c, size_t n)
+{
+    if (c->out_len - c->out_off + n > c->out_max)
+        return NULL;
+
+    if (c->out_off && c->out_len + n > c->out_cap)
+    {
+        memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+        c->out_len -= c->out_off;
+        c->out_off = 0;
+    }
+    if (c->out_len + n > c->out_cap)
+    {
+        size_t cap = c->out_cap ? c->out_cap : 4096;
+        while (cap < c->out_len + n)
+            cap *= 2;
+        uint8_t *grown = realloc(c->out, cap);
+        if (!grown)
+            return NULL;
+        c->out = grown;
+        c->out_cap = cap;
+    }
+    return c->out + c->out_len;
+}
+
+/**
+ * Queues bytes for a connection
+ *
+ * @param c Connection
+ * @param data Bytes to send
+ * @param n Number of bytes
+ * @return 0 on success, -1 if the backlog limit is reached
+ */
+static int conn_queue(Conn *c, const void *data, size_t n)
+{
+    uint8_t *p = conn_reserve(c, n);
+    if (!p)
+        return -1;
+    memcpy(p, data, n);
+    c->out_len += n;
+    mark_dirty(c);
+    return 0;
+}
+
+/**
+ * Writes as much queued output as the socket accepts
+ *
+ * @param c Connection
+ * @return 0 unless the socket failed
+ */
+static int conn_flush(Conn *c)
+{
+    while (c->out_off < c->out_len)
+    {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+            return -1;
+        c->out_off += n;
+    }
+
+    if (c->out_off == c->out_len)
+    {
+        c->out_off = c->out_len = 0;
+        if (c->out_cap > GATEWAY_KEEP_BUFFER)
+        {
+            free(c->out);
+            c->out = NULL;
+            c->out_cap = 0;
+        }
+    }
+    set_polling(c, c->out_off < c->out_len);
+    return 0;
+}
+
+/**
+ * Queues one WebSocket frame to a user
+ *
+ * @param u Recipient
+ * @param opcode WS_OP_*
+ * @param payload Payload
+ * @param len Payload length
+ * @param rsv1 Non-zero if the payload is compressed
+ * @return 0 on success, -1 if the backlog limit is reached
+ */
+static int ws_queue(User *u, int opcode, const uint8_t *payload, size_t len, int rsv1)
+{
+    uint8_t *p = conn_reserve(&u->conn, WS_MAX_HEADER + len);
+    if (!p)
+        return -1;
+    size_t header = ws_encode_header(p, opcode, rsv1, len);
+    memcpy(p + header, payload, len);
+    u->conn.out_len += header + len;
+    mark_dirty(&u->conn);
+    return 0;
+}
+
+/**
+ * Sends a close frame and writes it out straight away, since the
+ * connection is about to be closed
+ *
+ * @param u Recipient
+ * @param code Close status code
+ */
+static void ws_close(User *u, uint16_t code)
+{
+    uint8_t payload[2] = {code >> 8, code & 0xFF};
+    if (ws_queue(u, WS_OP_CLOSE, payload, sizeof(payload), 0) == 0)
+        conn_flush(&u->conn);
+}
+
+/**
+ * Queues a frame to a user in the user's framing
+ *
+ * @param u Recipient
+ * @param o Frame to send
+ * @return 0 on success, -1 if the backlog limit is reached
+ */
+static int user_send(User *u, Outgoing *o)
+{
+    if (u->mode != USER_WEBSOCKET)
+        return conn_queue(&u->conn, o->frame, o->len);
+
+    if (u->deflate && o->len >= GATEWAY_DEFLATE_MIN && (!o->bits || u->deflate < o->bits))
+    {
+        o->bits = u->deflate;
+        o->deflated = ws_deflate(o->frame, o->len, deflate_buffer, sizeof(deflate_buffer), u->deflate);
+        if (o->deflated >= o->len)
+            o->deflated = 0;
+    }
+    if (u->deflate && o->deflated)
+        return ws_queue(u, WS_OP_BINARY, deflate_buffer, o->deflated, 1);
+    return ws_queue(u, WS_OP_BINARY, o->frame, o->len, 0);
+}
+
+/**
+ * Queues a frame from the gateway itself to a user
+ *
+ * @param u Recipient
+ * @param text Error text
+ */
+static void user_error(User *u, const char *text)
+{
+    uint8_t frame[PROTO_HEADER_SIZE + ERROR_MAX_BODY];
+    ErrorMsg msg = {.sender = proto_str("Gateway"), .content = proto_str(text)};
+    Outgoing o = {.frame = frame, .len = encode_error(frame, sizeof(frame), &msg)};
+    if (o.len)
+        user_send(u, &o);
+}
+
+/**
+ * Unlinks a user from a doubly linked list
+ *
+ * @param head List head
+ * @param tail List tail, or NULL if the list does not track one
+ * @param u User to remove
+ */
+static void list_remove(User **head, User **tail, User *u)
+{
+    if (u->prev)
+        u->prev->next = u->next;
+    else
+        *head = u->next;
+    if (u->next)
+        u->next->prev = u->prev;
+    else if (tail)
+        *tail = u->prev;
+    u->prev = u->next = NULL;
+}
+
+static void link_down(Link *link);
+
+/**
+ * Closes a user connection
+ *
+ * @param u User to close
+ * @param notify Non-zero to tell the server the stream ended
+ */
+static void user_close(User *u, int notify)
+{
+    if (u->conn.fd < 0)
+        return;
+
+    if (u->link)
+    {
+        Link *link = u->link;
+        if (u->conn.paused)
+        {
+            User **p = &link->paused;
+            while (*p != u)
+                p = &(*p)->paused_next;
+            *p = u->paused_next;
+        }
+        list_remove(&link->head, NULL, u);
+        link->users--;
+        u->link = NULL;
+
+        uint32_t slot = u->stream & (GATEWAY_MAX_USERS - 1);
+        slots[slot] = NULL;
+        free_slots[free_count++] = slot;
+
+        if (notify && link->conn.fd >= 0)
+        {
+            uint8_t frame[PROTO_HEADER_SIZE + STREAM_CLOSE_MAX_BODY];
+            StreamCloseMsg msg = {.stream = u->stream};
+            size_t len = encode_stream_close(frame, sizeof(frame), &msg);
+            if (conn_queue(&link->conn, frame, len) < 0)
+                link_down(link);
+        }
+    }
+    else
+    {
+        list_remove(&pending_head, &pending_tail, u);
+    }
+
+    if (u->conn.dirty)
+        flush_list[u->conn.dirty - 1] = NULL;
+    close(u->conn.fd);
+    u->conn.fd = -1;
+    user_count--;
+
+    u->next = graveyard;
+    graveyard = u;
+}
+
+/**
+ * Drops a link and every user it carries
+ *
+ * Only for a link that failed or stopped draining altogether; a slow link
+ * pauses its users instead. The server logs those users out when it sees
+ * the link close.
+ *
+ * @param link Link that failed
+ */
+static void link_down(Link *link)
+{
+    if (link->conn.fd < 0)
+        return;
+
+    int dropped = link->users;
+    if (link->conn.dirty)
+        flush_list[link->conn.dirty - 1] = NULL;
+    link->conn.dirty = 0;
+    close(link->conn.fd);
+    link->conn.fd = -1;
+    link->conn.in_len = 0;
+    link->conn.out_off = link->conn.out_len = 0;
+    link->conn.polling_out = 0;
+    link->retry_ms = now_ms() + GATEWAY_RETRY_MS;
+
+    for (User *u = link->paused; u; u = u->paused_next)
+        u->conn.paused = 0;
+    link->paused = NULL;
+    while (link->head)
+        user_close(link->head, 0);
+
+    fprintf(stderr, "gateway: link %d lost, %d user(s) dropped\n", (int)(link - links), dropped);
+}
+
+/**
+ * Opens a link to the server and queues its hello
+ *
+ * @param link Disconnected link
+ */
+static void link_connect(Link *link)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return;
+    if (connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        close(fd);
+        link->retry_ms = now_ms() + GATEWAY_RETRY_MS;
+        return;
+    }
+
+    // Output is already batched per iteration; do not hold it back further
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    set_nonblocking(fd);
+
+    link->conn.fd = fd;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &link->conn};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+
+    uint8_t frame[PROTO_HEADER_SIZE + GATEWAY_HELLO_MAX_BODY];
+    GatewayHelloMsg hello = {.name = proto_str(gateway_name), .secret = proto_str(gateway_secret), .has_secret = 1};
+    conn_queue(&link->conn, frame, encode_gateway_hello(frame, sizeof(frame), &hello));
+
+    fprintf(stderr, "gateway: link %d connected\n", (int)(link - links));
+}
+
+/**
+ * Picks the connected link carrying the fewest users
+ *
+ * @return The link, or NULL if none is connected
+ */
+static Link *pick_link(void)
+{
+    Link *best = NULL;
+    for (int i = 0; i < link_count; i++)
+        if (links[i].conn.fd >= 0 && (!best || links[i].users < best->users))
+            best = &links[i];
+    return best;
+}
+
+/**
+ * Validates a new user's login and opens its stream
+ *
+ * @param u Pending user
+ * @param hdr Decoded header of the first frame
+ * @param frame The first frame
+ */
+static void user_login(User *u, const ProtoHeader *hdr, const uint8_t *frame)
+{
+    LoginMsg login;
+    if (hdr->type != MSG_LOGIN || decode_login(frame + PROTO_HEADER_SIZE, hdr->length, &login) < 0 ||
+        login.username.len == 0 || memchr(login.username.ptr, '\0', login.username.len))
+    {
+        user_close(u, 0);
+        return;
+    }
+
+    Link *link = pick_link();
+    if (!link || (free_count == 0 && slots_used == GATEWAY_MAX_USERS))
+    {
+        user_error(u, link ? "Gateway is full" : "Server unavailable");
+        conn_flush(&u->conn);
+        user_close(u, 0);
+        return;
+    }
+
+    uint32_t slot = free_count ? free_slots[--free_count] : (uint32_t)slots_used++;
+    generations[slot] = generations[slot] % 4095 + 1;
+    u->stream = (uint32_t)generations[slot] << GATEWAY_SLOT_BITS | slot;
+    slots[slot] = u;
+
+    list_remove(&pending_head, &pending_tail, u);
+    u->link = link;
+    u->next = link->head;
+    if (link->head)
+        link->head->prev = u;
+    link->head = u;
+    link->users++;
+
+    uint8_t open[PROTO_HEADER_SIZE + STREAM_OPEN_MAX_BODY];
+    StreamOpenMsg msg = {.stream = u->stream, .username = login.username};
+    if (conn_queue(&link->conn, open, encode_stream_open(open, sizeof(open), &msg)) < 0)
+        link_down(link);
+}
+
+/**
+ * Handles one complete frame from a user
+ *
+ * Logged-in users' frames are forwarded unchanged inside stream_data;
+ * the server applies the same checks as for a direct connection.
+ *
+ * @param u Sending user
+ * @param hdr Decoded header
+ * @param frame The frame
+ * @param len Frame length
+ */
+static void user_frame(User *u, const ProtoHeader *hdr, const uint8_t *frame, size_t len)
+{
+    if (!u->link)
+    {
+        user_login(u, hdr, frame);
+        return;
+    }
+
+    // Users are paused well below this limit, so reaching it means the
+    // server stopped reading the link
+    Link *link = u->link;
+    size_t wrapped = PROTO_HEADER_SIZE + 8 + len;
+    uint8_t *p = conn_reserve(&link->conn, wrapped);
+    if (!p)
+    {
+        link_down(link);
+        return;
+    }
+    StreamDataMsg msg = {.stream = u->stream, .frame = {.ptr = frame, .len = len}};
+    link->conn.out_len += encode_stream_data(p, wrapped, &msg);
+    mark_dirty(&link->conn);
+}
+
+/**
+ * Reports whether a user's frames must wait for its link to drain
+ *
+ * Above GATEWAY_LINK_HIGH of link backlog the user stops being read, so
+ * its input waits in its socket and TCP slows the sender down, instead of
+ * the link filling up and taking every user on it down.
+ *
+ * @param u Logged-in or pending user
+ * @return Non-zero if the user has been paused
+ */
+static int user_held(User *u)
+{
+    Link *link = u->link;
+    if (!link || link->conn.out_len - link->conn.out_off < GATEWAY_LINK_HIGH)
+        return 0;
+    if (!u->conn.paused)
+    {
+        u->conn.paused = 1;
+        u->paused_next = link->paused;
+        link->paused = u;
+        conn_arm(&u->conn);
+    }
+    return 1;
+}
+
+/**
+ * Queues a frame from the server to a user, dropping users that fall
+ * too far behind
+ *
+ * @param u Recipient
+ * @param o Frame to send
+ */
+static void deliver(User *u, Outgoing *o)
+{
+    if (u->conn.fd >= 0 && user_send(u, o) < 0)
+        user_close(u, 1);
+}
+
+/**
+ * Finds the user of a stream on a link
+ *
+ * @param link Link the stream belongs to
+ * @param stream Stream id
+ * @return The user, or NULL if the stream is no longer open
+ */
+static User *stream_user(Link *link, uint32_t stream)
+{
+    uint32_t slot = stream & (GATEWAY_MAX_USERS - 1);
+    if (slot >= (uint32_t)slots_used)
+        return NULL;
+    User *u = slots[slot];
+    return u && u->stream == stream && u->link == link ? u : NULL;
+}
+
+/**
+ * Handles one complete frame from the server
+ *
+ * @param link Link the frame arrived on
+ * @param hdr Decoded header
+ * @param body Frame body
+ */
+static void link_frame(Link *link, const ProtoHeader *hdr, const uint8_t *body)
+{
+    switch (hdr->type)
+    {
+    case MSG_STREAM_DATA:
+    {
+        StreamDataMsg msg;
+        User *u;
+        if (decode_stream_data(body, hdr->length, &msg) == 0 && (u = stream_user(link, msg.stream)))
+        {
+            Outgoing o = {.frame = msg.frame.ptr, .len = msg.frame.len};
+            deliver(u, &o);
+        }
+        break;
+    }
+    case MSG_STREAM_FANOUT:
+    {
+        StreamFanoutMsg msg;
+        if (decode_stream_fanout(body, hdr->length, &msg) < 0)
+            break;
+        Outgoing o = {.frame = msg.frame.ptr, .len = msg.frame.len};
+        for (User *u = link->head, *next; u && link->conn.fd >= 0; u = next)
+        {
+            next = u->next;
+            if (u->stream != msg.except)
+                deliver(u, &o);
+        }
+        break;
+    }
+    case MSG_STREAM_CLOSE:
+    {
+        // Closed by the server: send what is queued (usually the reason)
+        // and confirm, so the server logs the user out
+        StreamCloseMsg msg;
+        User *u;
+        if (decode_stream_close(body, hdr->length, &msg) == 0 && (u = stream_user(link, msg.stream)))
+        {
+            if (u->mode == USER_WEBSOCKET)
+                ws_close(u, 1000);
+            conn_flush(&u->conn);
+            user_close(u, 1);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/**
+ * Switches a new connection to WebSocket framing
+ *
+ * Native frames start with the high byte of a small length, always 0, so
+ * a leading 'G' can only be the "GET" of an upgrade request. The inline
+ * receive buffer is replaced by one large enough for the request.
+ *
+ * @param u Pending user
+ * @return 0 on success, -1 if out of memory
+ */
+static int user_upgrade(User *u)
+{
+    uint8_t *in = malloc(WS_MAX_REQUEST);
+    if (!in)
+        return -1;
+    memcpy(in, u->conn.in, u->conn.in_len);
+    u->conn.in = in;
+    u->conn.in_cap = WS_MAX_REQUEST;
+    u->mode = USER_UPGRADING;
+    return 0;
+}
+
+/**
+ * Handles one complete message from a WebSocket user
+ *
+ * Each binary message must hold exactly one protocol frame, which then
+ * takes the same path as a frame from a native connection.
+ *
+ * @param u Sending user
+ * @param f Decoded frame header
+ * @param payload Unmasked payload
+ * @return 0 if the connection stays open, -1 if it should close
+ */
+static int ws_message(User *u, const WsFrame *f, uint8_t *payload)
+{
+    switch (f->opcode)
+    {
+    case WS_OP_BINARY:
+    {
+        if (!f->fin)
+        {
+            ws_close(u, 1009); // Fragmented messages are not accepted
+            return -1;
+        }
+
+        const uint8_t *frame = payload;
+        size_t len = f->length;
+        if (f->rsv1)
+        {
+            ssize_t n = u->deflate ? ws_inflate(payload, len, inflate_buffer, sizeof(inflate_buffer)) : -1;
+            if (n < 0)
+            {
+                ws_close(u, 1007);
+                return -1;
+            }
+            frame = inflate_buffer;
+            len = n;
+        }
+
+        ProtoHeader hdr;
+        if (len < PROTO_HEADER_SIZE || proto_decode_header(frame, &hdr) < 0 ||
+            hdr.length > MAX_INBOUND_BODY || PROTO_HEADER_SIZE + hdr.length != len)
+        {
+            ws_close(u, 1007);
+            return -1;
+        }
+        user_frame(u, &hdr, frame, len);
+        return 0;
+    }
+    case WS_OP_PING:
+        return ws_queue(u, WS_OP_PONG, payload, f->length, 0);
+    case WS_OP_PONG:
+        return 0;
+    case WS_OP_CLOSE:
+        ws_close(u, 1000);
+        return -1;
+    default:
+        ws_close(u, 1003); // Text and stray continuation frames
+        return -1;
+    }
+}
+
+/**
+ * Handles the upgrade request and every complete WebSocket frame
+ * received from a user
+ *
+ * @param u WebSocket user
+ * @return 0 if the connection is still usable, -1 if it should close
+ */
+static int ws_input(User *u)
+{
+    Conn *c = &u->conn;
+    size_t off = 0;
+
+    while (c->fd >= 0)
+    {
+        uint8_t *p = c->in + off;
+        size_t avail = c->in_len - off;
+
+        if (u->mode == USER_UPGRADING)
+        {
+            uint8_t *end = memmem(p, avail, "\r\n\r\n", 4);
+            if (!end)
+            {
+                if (c->in_len == c->in_cap)
+                    return -1;
+                break;
+            }
+
+            size_t request_len = end + 4 - p;
+            char response[WS_MAX_RESPONSE];
+            int n = ws_handshake((const char *)p, request_len, response, sizeof(response), &u->deflate);
+            if (n < 0)
+            {
+                static const char bad[] = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n";
+                conn_queue(c, bad, sizeof(bad) - 1);
+                conn_flush(c);
+                return -1;
+            }
+            conn_queue(c, response, n);
+            u->mode = USER_WEBSOCKET;
+            off += request_len;
+            continue;
+        }
+
+        if (user_held(u))
+            break;
+        WsFrame f;
+        int parsed = ws_parse_header(p, avail, &f);
+        if (parsed == 0)
+            break;
+        if (parsed < 0 || !f.masked)
+        {
+            ws_close(u, 1002);
+            return -1;
+        }
+        if (f.length > c->in_cap - f.header_len)
+        {
+            ws_close(u, 1009);
+            return -1;
+        }
+        if (avail < f.header_len + f.length)
+            break;
+
+        uint8_t *payload = p + f.header_len;
+        ws_unmask(payload, f.length, f.mask);
+        off += f.header_len + f.length;
+        if (ws_message(u, &f, payload) < 0)
+            return -1;
+    }
+
+    if (c->fd < 0)
+        return 0;
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    return 0;
+}
+
+/**
+ * Handles every complete native frame received on a connection
+ *
+ * @param c User or link connection
+ * @return 0 if the connection is still usable, -1 if it should close
+ */
+static int conn_input(Conn *c)
+{
+    size_t off = 0;
+    while (c->fd >= 0 && c->in_len - off >= PROTO_HEADER_SIZE)
+    {
+        if (c->kind == CONN_USER && user_held((User *)c))
+            break;
+        ProtoHeader hdr;
+        if (proto_decode_header(c->in + off, &hdr) < 0 || hdr.length > c->in_cap - PROTO_HEADER_SIZE)
+            return -1;
+        size_t len = PROTO_HEADER_SIZE + hdr.length;
+        if (c->in_len - off < len)
+            break;
+
+        if (c->kind == CONN_USER)
+            user_frame((User *)c, &hdr, c->in + off, len);
+        else
+            link_frame((Link *)c, &hdr, c->in + off + PROTO_HEADER_SIZE);
+        off += len;
+    }
+
+    // A closed connection already had its buffer reset or freed
+    if (c->fd < 0)
+        return 0;
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    return 0;
+}
+
+/**
+ * Reads from a connection and handles every complete frame
+ *
+ * @param c User or link connection
+ * @return 0 if the connection is still usable, -1 if it should close
+ */
+static int conn_read(Conn *c)
+{
+    ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+    if (n == 0)
+        return -1;
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    c->in_len += n;
+
+    if (c->kind == CONN_USER)
+    {
+        User *u = (User *)c;
+        if (u->mode == USER_NATIVE && !u->link && c->in[0] == 'G' && user_upgrade(u) < 0)
+            return -1;
+        if (u->mode != USER_NATIVE)
+            return ws_input(u);
+    }
+    return conn_input(c);
+}
+
+/**
+ * Reads again from the users a link paused, once it has drained
+ *
+ * Input they already hold is handled first. Users are resumed until the
+ * link fills up again; the rest stay paused.
+ *
+ * @param link Connected link
+ */
+static void link_resume(Link *link)
+{
+    while (link->paused && link->conn.fd >= 0 &&
+           link->conn.out_len - link->conn.out_off <= GATEWAY_LINK_LOW)
+    {
+        User *u = link->paused;
+        link->paused = u->paused_next;
+        u->conn.paused = 0;
+        conn_arm(&u->conn);
+        int failed = u->mode == USER_NATIVE ? conn_input(&u->conn) : ws_input(u);
+        if (failed < 0)
+            user_close(u, 1);
+    }
+}
+
+/**
+ * Accepts every waiting user connection
+ */
+static void accept_users(void)
+{
+    while (1)
+    {
+        int fd = accept4(listener.fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0)
+            return;
+        if (user_count >= GATEWAY_MAX_USERS)
+        {
+            close(fd);
+            continue;
+        }
+
+        // The receive buffer only has to hold one inbound frame
+        size_t in_cap = PROTO_HEADER_SIZE + MAX_INBOUND_BODY;
+        User *u = calloc(1, sizeof(User) + in_cap);
+        if (!u)
+        {
+            close(fd);
+            continue;
+        }
+        u->conn.kind = CONN_USER;
+        u->conn.fd = fd;
+        u->conn.in = (uint8_t *)(u + 1);
+        u->conn.in_cap = in_cap;
+        u->conn.out_max = GATEWAY_USER_QUEUE;
+        u->deadline_ms = now_ms() + GATEWAY_LOGIN_TIMEOUT_MS;
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &u->conn};
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+
+        u->prev = pending_tail;
+        if (pending_tail)
+            pending_tail->next = u;
+        else
+            pending_head = u;
+        pending_tail = u;
+        user_count++;
+    }
+}
+
+/**
+ * Handles one epoll event
+ *
+ * @param c Connection the event refers to
+ * @param events Ready events
+ */
+static void handle_event(Conn *c, uint32_t events)
+{
+    if (c->kind == CONN_LISTENER)
+    {
+        accept_users();
+        return;
+    }
+    if (c->fd < 0)
+        return;
+
+    int failed = 0;
+    if (c->paused)
+        failed = (events & (EPOLLHUP | EPOLLERR)) != 0; // Gone while waiting for its link
+    else if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        failed = conn_read(c) < 0;
+    if (!failed && c->fd >= 0 && (events & EPOLLOUT))
+        failed = conn_flush(c) < 0;
+
+    if (failed && c->kind == CONN_USER)
+        user_close((User *)c, 1);
+    else if (failed)
+        link_down((Link *)c);
+}
+
+/**
+ * Writes the output queued during this iteration
+ */
+static void flush_dirty(void)
+{
+    // Closing a user can queue a close on its link, so the list may grow
+    for (int i = 0; i < flush_count; i++)
+    {
+        Conn *c = flush_list[i];
+        if (!c)
+            continue;
+        c->dirty = 0;
+        flush_list[i] = NULL;
+        if (conn_flush(c) == 0)
+            continue;
+        if (c->kind == CONN_USER)
+            user_close((User *)c, 1);
+        else
+            link_down((Link *)c);
+    }
+    flush_count = 0;
+}
+
+/**
+ * Entry point of the gateway
+ *
+ * Accepts user connections, native or WebSocket on the same port, checks
+ * each login, and carries all users over a few links to the server as
+ * numbered streams. Everything runs on one epoll loop.
+ *
+ * @param argc Number of command-line arguments
+ * @param argv Array of command-line argument strings
+ * @return 0 on success, 1 if setup fails
+ */
+int main(int argc, char *argv[])
+{
+    int port = 9888;
+    int server_port = 8888;
+
+    if (argc > 4)
+    {
+        printf("Usage: %s [port] [server_port] [links]\n", argv[0]);
+        return 1;
+    }
+    if (argc >= 2)
+        port = atoi(argv[1]);
+    if (argc >= 3)
+        server_port = atoi(argv[2]);
+    if (argc >= 4)
+        link_count = atoi(argv[3]);
+    if (port <= 0 || port > 65535 || server_port <= 0 || server_port > 65535 ||
+        link_count < 1 || link_count > GATEWAY_MAX_LINKS)
+    {
+        fprintf(stderr, "gateway: invalid port or link count (1-%d)\n", GATEWAY_MAX_LINKS);
+        return 1;
+    }
+
+    // Taken from the environment so it does not show in the process list
+    const char *secret = getenv("GATEWAY_SECRET");
+    if (!secret || !secret[0] || strlen(secret) >= sizeof(gateway_secret))
+    {
+        fprintf(stderr, "gateway: set GATEWAY_SECRET to the server's gateway_secret (1-%d characters)\n",
+                MAX_GATEWAY_SECRET - 1);
+        return 1;
+    }
+    strcpy(gateway_secret, secret);
+
+    signal(SIGPIPE, SIG_IGN);
+    snprintf(gateway_name, sizeof(gateway_name), "gateway:%d", port);
+
+    // Tables are sized for the largest stream id; untouched pages cost nothing
+    slots = calloc(GATEWAY_MAX_USERS, sizeof(User *));
+    generations = calloc(GATEWAY_MAX_USERS, sizeof(uint16_t));
+    free_slots = malloc(GATEWAY_MAX_USERS * sizeof(uint32_t));
+    epoll_fd = epoll_create1(0);
+    if (!slots || !generations || !free_slots || epoll_fd < 0)
+    {
+        fprintf(stderr, "gateway: setup failed\n");
+        return 1;
+    }
+
+    listener.fd = socket(AF_INET, SOCK_STREAM, 0);
+    int opt = 1;
+    setsockopt(listener.fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY, .sin_port = htons(port)};
+    if (bind(listener.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener.fd, SOMAXCONN) < 0)
+    {
+        perror("gateway: bind");
+        return 1;
+    }
+    set_nonblocking(listener.fd);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &listener};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener.fd, &ev);
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(server_port);
+    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+
+    size_t link_in = PROTO_HEADER_SIZE + PROTO_MAX_BODY;
+    for (int i = 0; i < link_count; i++)
+    {
+        links[i].conn.kind = CONN_LINK;
+        links[i].conn.fd = -1;
+        links[i].conn.in = malloc(link_in);
+        links[i].conn.in_cap = link_in;
+        links[i].conn.out_max = GATEWAY_LINK_QUEUE;
+        if (!links[i].conn.in)
+            return 1;
+        link_connect(&links[i]);
+    }
+
+    printf("Gateway %s listening on port %d, %d link(s) to port %d\n",
+           gateway_name, port, link_count, server_port);
+
+    struct epoll_event events[GATEWAY_EVENTS];
+    while (1)
+    {
+        int n = epoll_wait(epoll_fd, events, GATEWAY_EVENTS, 250);
+        for (int i = 0; i < n; i++)
+            handle_event(events[i].data.ptr, events[i].events);
+
+        flush_dirty();
+
+        // Resuming users forwards their held input, so flush again
+        int resumed = 0;
+        for (int i = 0; i < link_count; i++)
+        {
+            if (links[i].paused && links[i].conn.out_len - links[i].conn.out_off <= GATEWAY_LINK_LOW)
+            {
+                link_resume(&links[i]);
+                resumed = 1;
+            }
+        }
+        if (resumed)
+            flush_dirty();
+
+        long long now = now_ms();
+        while (pending_head && pending_head->deadline_ms <= now)
+            user_close(pending_head, 0);
+        for (int i = 0; i < link_count; i++)
+            if (links[i].conn.fd < 0 && links[i].retry_ms <= now)
+                link_connect(&links[i]);
+        flush_dirty();
+
+        while (graveyard)
+        {
+            User *u = graveyard;
+            graveyard = u->next;
+            if (u->conn.in != (uint8_t *)(u + 1))
+                free(u->conn.in);
+            free(u->conn.out);
+            free(u);
+        }
+    }
+
+    return 0;
+}
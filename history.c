@@ -0,0 +1,406 @@
+#include "server.h"
+
+#define HISTORY_BUCKETS 1024 // Hash buckets for DM conversation rings
+#define HISTORY_MAX_FRAME MAX_INBOUND_BODY // Largest frame kept; replication carries no more
+
+/**
+ * History ring structure - Recent frames of one conversation
+ *
+ * Frames are stored back to back in a byte arena as a u16 length
+ * followed by the encoded frame, wrapping around the end of the arena.
+ * The oldest frames are evicted when the byte or message limit is hit.
+ */
+typedef struct
+{
+    uint8_t *arena;  // Record storage, allocated on first use
+    size_t capacity; // Arena size in bytes
+    size_t head;     // Offset of the oldest record
+    size_t used;     // Bytes occupied by records
+    int count;       // Number of records
+} HistoryRing;
+
+/**
+ * DM history structure - Ring of one user pair, chained in a hash bucket
+ */
+typedef struct DmHistory
+{
+    struct DmHistory *next;
+    char first[MAX_USERNAME];  // Lexicographically smaller username
+    char second[MAX_USERNAME]; // Larger username
+    LruLink lru;               // Position in dm_lru, by last append
+    HistoryRing ring;
+} DmHistory;
+
+static HistoryRing room_ring;
+static pthread_mutex_t room_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static DmHistory *dm_buckets[HISTORY_BUCKETS];
+static int dm_count = 0;
+static LruList dm_lru; // Rings by last append, oldest at the tail
+static pthread_mutex_t dm_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Copies bytes into the arena at a logical offset, wrapping at the end
+ */
+static void ring_write(HistoryRing *ring, size_t offset, const void *src, size_t n)
+{
+    size_t pos = offset % ring->capacity;
+    size_t first = n < ring->capacity - pos ? n : ring->capacity - pos;
+    memcpy(ring->arena + pos, src, first);
+    memcpy(ring->arena, (const uint8_t *)src + first, n - first);
+}
+
+/**
+ * Copies bytes out of the arena at a logical offset, wrapping at the end
+ */
+static void ring_read(const HistoryRing *ring, size_t offset, void *dst, size_t n)
+{
+    size_t pos = offset % ring->capacity;
+    size_t first = n < ring->capacity - pos ? n : ring->capacity - pos;
+    memcpy(dst, ring->arena + pos, first);
+    memcpy((uint8_t *)dst + first, ring->arena, n - first);
+}
+
+/**
+ * Drops the oldest record of a ring
+ */
+static void ring_evict(HistoryRing *ring)
+{
+    uint8_t len_bytes[2];
+    ring_read(ring, ring->head, len_bytes, 2);
+    size_t size = 2 + proto_get_u16(len_bytes);
+    ring->head = (ring->head + size) % ring->capacity;
+    ring->used -= size;
+    ring->count--;
+}
+
+/**
+ * Appends a frame to a ring, evicting old records as needed
+ *
+ * @param ring Destination ring
+ * @param frame Encoded frame
+ * @param len Frame length
+ * @param cfg Current configuration snapshot
+ */
+static void ring_append(HistoryRing *ring, const uint8_t *frame, size_t len, const Config *cfg)
+{
+    if (!ring->arena)
+    {
+        ring->arena = malloc(cfg->history_bytes);
+        if (!ring->arena)
+            return;
+        ring->capacity = cfg->history_bytes;
+    }
+
+    size_t size = 2 + len;
+    if (len > HISTORY_MAX_FRAME || size > ring->capacity)
+        return;
+
+    while (ring->count > 0 && (ring->count >= cfg->history_messages || ring->capacity - ring->used < size))
+        ring_evict(ring);
+
+    uint8_t len_bytes[2];
+    proto_put_u16(len_bytes, (uint16_t)len);
+    ring_write(ring, ring->head + ring->used, len_bytes, 2);
+    ring_write(ring, ring->head + ring->used + 2, frame, len);
+    ring->used += size;
+    ring->count++;
+}
+
+/**
+ * Copies a ring's frames back to back into a buffer, oldest first
+ *
+ * When the buffer is too small the oldest frames are left out.
+ *
+ * @param ring Source ring
+ * @param out Destination buffer
+ * @param cap Size of out
+ * @param count Output for the number of frames copied
+ * @return Number of bytes written
+ */
+static size_t ring_collect(const HistoryRing *ring, uint8_t *out, size_t cap, uint32_t *count)
+{
+    size_t offset = ring->head;
+    size_t remaining = ring->used;
+    int skip = 0;
+
+    // Skip old records until the rest fits (records cost 2 bytes less in out)
+    size_t needed = ring->used - 2 * ring->count;
+    while (needed > cap && skip < ring->count)
+    {
+        uint8_t len_bytes[2];
+        ring_read(ring, offset, len_bytes, 2);
+        size_t len = proto_get_u16(len_bytes);
+        offset += 2 + len;
+        remaining -= 2 + len;
+        needed -= len;
+        skip++;
+    }
+
+    size_t written = 0;
+    *count = 0;
+    while (remaining > 0)
+    {
+        uint8_t len_bytes[2];
+        ring_read(ring, offset, len_bytes, 2);
+        size_t len = proto_get_u16(len_bytes);
+        ring_read(ring, offset + 2, out + written, len);
+        written += len;
+        offset += 2 + len;
+        remaining -= 2 + len;
+        (*count)++;
+    }
+    return written;
+}
+
+/**
+ * Hashes an ordered username pair (FNV-1a)
+ */
+static unsigned pair_hash(const char *first, const char *second)
+{
+    unsigned h = 2166136261u;
+    for (const char *p = first; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    h = (h ^ 0xFF) * 16777619u;
+    for (const char *p = second; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    return h % HISTORY_BUCKETS;
+}
+
+/**
+ * Orders a username pair so both directions map to one conversation
+ */
+static void order_pair(const char **a, const char **b)
+{
+    if (strcmp(*a, *b) > 0)
+    {
+        const char *t = *a;
+        *a = *b;
+        *b = t;
+    }
+}
+
+/**
+ * Frees the least recently used DM ring
+ *
+ * Must be called with dm_mutex held.
+ */
+static void dm_evict_oldest(void)
+{
+    if (!dm_lru.tail)
+        return;
+
+    DmHistory *entry = LRU_ENTRY(dm_lru.tail, DmHistory, lru);
+    DmHistory **link = &dm_buckets[pair_hash(entry->first, entry->second)];
+    while (*link != entry)
+        link = &(*link)->next;
+    *link = entry->next;
+    lru_remove(&dm_lru, &entry->lru);
+    free(entry->ring.arena);
+    free(entry);
+    dm_count--;
+}
+
+/**
+ * Finds the ring of a user pair, optionally creating it
+ *
+ * Must be called with dm_mutex held.
+ *
+ * @param a One username
+ * @param b The other username
+ * @param create Non-zero to create a missing ring
+ * @return The ring entry, or NULL
+ */
+static DmHistory *dm_lookup(const char *a, const char *b, int create)
+{
+    order_pair(&a, &b);
+    unsigned bucket = pair_hash(a, b);
+
+    for (DmHistory *entry = dm_buckets[bucket]; entry; entry = entry->next)
+    {
+        if (strcmp(entry->first, a) == 0 && strcmp(entry->second, b) == 0)
+            return entry;
+    }
+    if (!create)
+        return NULL;
+
+    if (dm_count >= config_get()->history_dm_pairs)
+        dm_evict_oldest();
+
+    DmHistory *entry = calloc(1, sizeof(DmHistory));
+    if (!entry)
+        return NULL;
+    strncpy(entry->first, a, MAX_USERNAME - 1);
+    strncpy(entry->second, b, MAX_USERNAME - 1);
+    entry->next = dm_buckets[bucket];
+    dm_buckets[bucket] = entry;
+    lru_push(&dm_lru, &entry->lru);
+    dm_count++;
+    return entry;
+}
+
+/**
+ * Records a routed frame in its conversation's history
+ *
+ * @param a Sender username, or NULL for the global room
+ * @param b Recipient username, or NULL for the global room
+ * @param frame Encoded frame as delivered to recipients
+ * @param len Frame length
+ */
+void history_record(const char *a, const char *b, const uint8_t *frame, size_t len)
+{
+    const Config *cfg = config_get();
+    if (cfg->history_messages == 0)
+        return;
+
+    if (!a || !b)
+    {
+        pthread_mutex_lock(&room_mutex);
+        ring_append(&room_ring, frame, len, cfg);
+        pthread_mutex_unlock(&room_mutex);
+        return;
+    }
+
+    pthread_mutex_lock(&dm_mutex);
+    DmHistory *entry = dm_lookup(a, b, 1);
+    if (entry)
+    {
+        lru_touch(&dm_lru, &entry->lru);
+        ring_append(&entry->ring, frame, len, cfg);
+    }
+    pthread_mutex_unlock(&dm_mutex);
+}
+
+/**
+ * Copies a conversation's recent frames into a buffer, oldest first
+ *
+ * @param a One participant, or NULL for the global room
+ * @param b The other participant, or NULL for the global room
+ * @param out Destination buffer
+ * @param cap Size of out
+ * @param count Output for the number of frames copied
+ * @return Number of bytes written
+ */
+size_t history_collect(const char *a, const char *b, uint8_t *out, size_t cap, uint32_t *count)
+{
+    size_t written = 0;
+    *count = 0;
+
+    if (!a || !b)
+    {
+        pthread_mutex_lock(&room_mutex);
+        if (room_ring.arena)
+            written = ring_collect(&room_ring, out, cap, count);
+        pthread_mutex_unlock(&room_mutex);
+        return written;
+    }
+
+    pthread_mutex_lock(&dm_mutex);
+    DmHistory *entry = dm_lookup(a, b, 0);
+    if (entry && entry->ring.arena)
+        written = ring_collect(&entry->ring, out, cap, count);
+    pthread_mutex_unlock(&dm_mutex);
+    return written;
+}
+
+/**
+ * Encodes a conversation's history as one batched frame
+ *
+ * @param requester User the frame is for, or NULL for the global room
+ * @param peer Other DM participant, or NULL for the global room
+ * @param len Output for the frame length
+ * @return Malloc'd frame the caller must free, or NULL if memory ran out
+ */
+uint8_t *history_encode(const char *requester, const char *peer, size_t *len)
+{
+    uint8_t *frames = malloc(MAX_QUERY_BYTES);
+    uint8_t *frame = malloc(PROTO_HEADER_SIZE + HISTORY_MAX_BODY);
+    if (!frames || !frame)
+    {
+        free(frames);
+        free(frame);
+        return NULL;
+    }
+
+    HistoryMsg msg = {.peer = proto_str(peer ? peer : "")};
+    msg.frames.len = history_collect(requester, peer, frames, MAX_QUERY_BYTES, &msg.count);
+    msg.frames.ptr = frames;
+
+    *len = encode_history(frame, PROTO_HEADER_SIZE + HISTORY_MAX_BODY, &msg);
+    free(frames);
+    return frame;
+}
+
+/**
+ * Calls a function for every stored frame of one ring, oldest first
+ */
+static void ring_foreach(const HistoryRing *ring, const char *a, const char *b, HistoryVisitor visit, void *arg)
+{
+    uint8_t frame[HISTORY_MAX_FRAME];
+    size_t offset = ring->head;
+    for (int i = 0; i < ring->count; i++)
+    {
+        uint8_t len_bytes[2];
+        ring_read(ring, offset, len_bytes, 2);
+        size_t len = proto_get_u16(len_bytes);
+        ring_read(ring, offset + 2, frame, len);
+        visit(a, b, frame, len, arg);
+        offset += 2 + len;
+    }
+}
+
+/**
+ * Calls a function for every stored frame of every conversation
+ *
+ * Each conversation is visited oldest first under its lock, so the
+ * visitor must not call back into the history module.
+ *
+ * @param visit Called with the participants (NULL for the global room) and a frame
+ * @param arg Passed through to visit
+ */
+void history_foreach(HistoryVisitor visit, void *arg)
+{
+    pthread_mutex_lock(&room_mutex);
+    if (room_ring.arena)
+        ring_foreach(&room_ring, NULL, NULL, visit, arg);
+    pthread_mutex_unlock(&room_mutex);
+
+    pthread_mutex_lock(&dm_mutex);
+    for (int i = 0; i < HISTORY_BUCKETS; i++)
+    {
+        for (DmHistory *entry = dm_buckets[i]; entry; entry = entry->next)
+        {
+            if (entry->ring.arena)
+                ring_foreach(&entry->ring, entry->first, entry->second, visit, arg);
+        }
+    }
+    pthread_mutex_unlock(&dm_mutex);
+}
+
+/**
+ * Forgets all stored history
+ *
+ * Used by a standby before it applies a fresh snapshot from the primary.
+ */
+void history_clear(void)
+{
+    pthread_mutex_lock(&room_mutex);
+    free(room_ring.arena);
+    memset(&room_ring, 0, sizeof(room_ring));
+    pthread_mutex_unlock(&room_mutex);
+
+    pthread_mutex_lock(&dm_mutex);
+    for (int i = 0; i < HISTORY_BUCKETS; i++)
+    {
+        while (dm_buckets[i])
+        {
+            DmHistory *entry = dm_buckets[i];
+            dm_buckets[i] = entry->next;
+            free(entry->ring.arena);
+            free(entry);
+        }
+    }
+    dm_count = 0;
+    dm_lru = (LruList){0};
+    pthread_mutex_unlock(&dm_mutex);
+}
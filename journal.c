@@ -0,0 +1,479 @@
+#define _GNU_SOURCE // O_DIRECT
+#include "server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define JOURNAL_ALIGN 4096 // O_DIRECT buffer, offset and length alignment
+#define JOURNAL_FILE "journal.log"
+
+/**
+ * Journal buffer structure - One of the two aligned write batches
+ *
+ * Routing threads fill the active buffer while the writer thread owns the
+ * other one. A batch may begin with the unfinished tail block of the
+ * previous batch, which is rewritten at the same file offset.
+ */
+typedef struct
+{
+    uint8_t *data;   // JOURNAL_ALIGN-aligned storage
+    size_t fill;     // Bytes used, including the carried tail
+    size_t carried;  // Leading bytes already written by the previous batch
+    uint64_t offset; // File offset of data[0], always aligned
+} JournalBuffer;
+
+/**
+ * Submission ring structure - Minimal io_uring mapping without liburing
+ */
+typedef struct
+{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    int fixed_buffers; // Both journal buffers are registered with the ring
+} Uring;
+
+static JournalBuffer buffers[2];
+static JournalBuffer *active = NULL; // Buffer accepting appends, NULL when disabled
+static size_t buffer_size;
+static int journal_fd = -1;
+static int direct_io = 0;
+static int failed = 0;
+static Uring ring = {.fd = -1};
+static char journal_path[CONFIG_PATH_MAX + sizeof(JOURNAL_FILE) + 1];
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+
+// Counters for the admin socket; bytes_written / bytes_appended is the write amplification
+static atomic_ulong records_appended;
+static atomic_ulong bytes_appended;
+static atomic_ulong bytes_written;
+static atomic_ulong batches_written;
+static atomic_ulong records_dropped;
+
+/**
+ * Rounds a size up to the journal alignment
+ */
+static size_t align_up(size_t n)
+{
+    return (n + JOURNAL_ALIGN - 1) & ~(size_t)(JOURNAL_ALIGN - 1);
+}
+
+/**
+ * Sets up an io_uring instance and maps its rings
+ *
+ * @param entries Submission queue size
+ * @return 0 on success, -1 if io_uring is unavailable
+ */
+static int uring_init(unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return -1;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t sqe_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    uint8_t *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    uint8_t *cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, sqe_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+
+    ring.fd = fd;
+    ring.sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring.sqes = sqes;
+
+    // Registered buffers skip the per-write page pinning of O_DIRECT
+    struct iovec iov[2] = {
+        {buffers[0].data, buffer_size},
+        {buffers[1].data, buffer_size}};
+    ring.fixed_buffers = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, 2) == 0;
+    return 0;
+}
+
+/**
+ * Queues one submission entry; the ring is only used by the writer thread
+ */
+static struct io_uring_sqe *uring_next_sqe(void)
+{
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/**
+ * Writes a batch and syncs it through io_uring as one linked submission
+ *
+ * @param buf Batch to write
+ * @param len Aligned number of bytes to write
+ * @return 0 on success, -1 on failure
+ */
+static int uring_write_sync(const JournalBuffer *buf, size_t len)
+{
+    struct io_uring_sqe *write = uring_next_sqe();
+    write->opcode = ring.fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    write->fd = journal_fd;
+    write->addr = (uint64_t)(uintptr_t)buf->data;
+    write->len = len;
+    write->off = buf->offset;
+    if (ring.fixed_buffers)
+        write->buf_index = buf == &buffers[0] ? 0 : 1;
+    write->flags = IOSQE_IO_LINK; // The sync only runs once the write succeeded
+    write->user_data = 1;
+
+    struct io_uring_sqe *sync = uring_next_sqe();
+    sync->opcode = IORING_OP_FSYNC;
+    sync->fd = journal_fd;
+    sync->fsync_flags = IORING_FSYNC_DATASYNC;
+    sync->user_data = 2;
+
+    int submitted = 0;
+    while (submitted < 2)
+    {
+        int n = (int)syscall(__NR_io_uring_enter, ring.fd, 2 - submitted, 2 - submitted,
+                             IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0 && errno != EINTR)
+            return -1;
+        if (n > 0)
+            submitted += n;
+    }
+
+    int ok = 1;
+    int reaped = 0;
+    while (reaped < 2)
+    {
+        unsigned head = *ring.cq_head;
+        if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+        {
+            if (syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                errno != EINTR)
+                return -1;
+            continue;
+        }
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        if (cqe->user_data == 1 ? cqe->res != (int)len : cqe->res < 0)
+            ok = 0;
+        __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+        reaped++;
+    }
+    return ok ? 0 : -1;
+}
+
+/**
+ * Writes a batch and syncs it with plain system calls
+ *
+ * Used when the kernel has no io_uring or refuses it (e.g. seccomp).
+ *
+ * @param buf Batch to write
+ * @param len Aligned number of bytes to write
+ * @return 0 on success, -1 on failure
+ */
+static int pwrite_sync(const JournalBuffer *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = pwrite(journal_fd, buf->data + done, len - done, buf->offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return fdatasync(journal_fd);
+}
+
+/**
+ * Opens the active log file, preferring O_DIRECT
+ *
+ * @return File descriptor, or -1 on failure
+ */
+static int journal_open(void)
+{
+    int fd = open(journal_path, O_RDWR | O_CREAT | O_DIRECT, 0600);
+    direct_io = fd >= 0;
+    if (fd < 0 && errno == EINVAL)
+        fd = open(journal_path, O_RDWR | O_CREAT, 0600);
+    return fd;
+}
+
+/**
+ * Hands the full log file to the segment store and starts a new one
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int journal_rotate(void)
+{
+    if (store_seal(journal_path) < 0)
+        return -1;
+
+    int fd = journal_open();
+    if (fd < 0)
+        return -1;
+    close(journal_fd);
+    journal_fd = fd;
+    return 0;
+}
+
+/**
+ * Writer thread - Flushes the active buffer every journal_flush_ms
+ *
+ * Swaps the buffers under the lock, then writes and syncs the full batch
+ * with the lock released, so appends never wait for the disk.
+ *
+ * @param arg Unused
+ * @return Never returns
+ */
+static void *journal_thread(void *arg)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&journal_mutex);
+        while (active->fill == active->carried)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            long ms = config_get()->journal_flush_ms;
+            deadline.tv_sec += ms / 1000;
+            deadline.tv_nsec += (ms % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&journal_cond, &journal_mutex, &deadline);
+        }
+
+        // Start the next batch with the unfinished last block of this one,
+        // or at the start of a fresh file once this one is large enough
+        JournalBuffer *batch = active;
+        JournalBuffer *next = batch == &buffers[0] ? &buffers[1] : &buffers[0];
+        int seal = batch->offset + batch->fill >= (uint64_t)config_get()->segment_kb * 1024;
+        size_t whole = seal ? batch->fill : batch->fill & ~(size_t)(JOURNAL_ALIGN - 1);
+        next->carried = next->fill = batch->fill - whole;
+        next->offset = seal ? 0 : batch->offset + whole;
+        memcpy(next->data, batch->data + whole, next->fill);
+        active = next;
+        pthread_mutex_unlock(&journal_mutex);
+
+        // Zero padding marks the end of the log for recovery
+        size_t len = align_up(batch->fill);
+        memset(batch->data + batch->fill, 0, len - batch->fill);
+
+        int rc = ring.fd >= 0 ? uring_write_sync(batch, len) : pwrite_sync(batch, len);
+        if (rc == 0 && seal)
+            rc = journal_rotate();
+        if (rc < 0)
+        {
+            // Later batches would leave a hole, so stop persisting altogether
+            pthread_mutex_lock(&journal_mutex);
+            failed = 1;
+            pthread_mutex_unlock(&journal_mutex);
+            format_whiteboard_msg(MSG_TYPE_ERROR, "Journal write failed, persistence disabled");
+            return NULL;
+        }
+        atomic_fetch_add(&bytes_written, len);
+        atomic_fetch_add(&batches_written, 1);
+    }
+
+    return NULL;
+}
+
+/**
+ * Appends a routed frame to the message log
+ *
+ * Only copies into the active buffer; the writer thread persists it
+ * within journal_flush_ms. If the buffer is full because the disk falls
+ * behind, the record is dropped rather than blocking the caller.
+ *
+ * @param frame Encoded frame as delivered to recipients
+ * @param len Frame length
+ */
+void journal_append(const uint8_t *frame, size_t len)
+{
+    if (!active)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t ms = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+    uint8_t header[JOURNAL_RECORD_HEADER];
+    proto_put_u32(header, (uint32_t)len);
+    proto_put_u64(header + 4, ms);
+
+    pthread_mutex_lock(&journal_mutex);
+    if (failed || active->fill + JOURNAL_RECORD_HEADER + len > buffer_size)
+    {
+        pthread_mutex_unlock(&journal_mutex);
+        atomic_fetch_add(&records_dropped, 1);
+        return;
+    }
+    memcpy(active->data + active->fill, header, JOURNAL_RECORD_HEADER);
+    memcpy(active->data + active->fill + JOURNAL_RECORD_HEADER, frame, len);
+    active->fill += JOURNAL_RECORD_HEADER + len;
+    if (active->fill > buffer_size / 2)
+        pthread_cond_signal(&journal_cond); // Flush early before the buffer fills up
+    pthread_mutex_unlock(&journal_mutex);
+
+    atomic_fetch_add(&records_appended, 1);
+    atomic_fetch_add(&bytes_appended, JOURNAL_RECORD_HEADER + len);
+}
+
+/**
+ * Checks the record at the start of a buffer
+ *
+ * @param p Start of the record
+ * @param avail Bytes available from p
+ * @return Size of the record, or 0 if it is torn, padding or malformed
+ */
+size_t journal_record_size(const uint8_t *p, size_t avail)
+{
+    if (avail < JOURNAL_RECORD_HEADER)
+        return 0;
+
+    uint32_t len = proto_get_u32(p);
+    ProtoHeader hdr;
+    if (len < PROTO_HEADER_SIZE || len > PROTO_MAX_FRAME || len > avail - JOURNAL_RECORD_HEADER ||
+        proto_decode_header(p + JOURNAL_RECORD_HEADER, &hdr) < 0 || hdr.length + PROTO_HEADER_SIZE != len)
+        return 0;
+    return JOURNAL_RECORD_HEADER + len;
+}
+
+/**
+ * Finds the end of the valid records in an existing log
+ *
+ * Stops at zero padding or at the first record that is torn or does not
+ * hold a well-formed frame.
+ *
+ * @param path Log file path
+ * @return Offset just past the last valid record
+ */
+static uint64_t journal_scan(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return 0;
+
+    // Static rather than on the stack; the scan runs once, at startup
+    static uint8_t record[JOURNAL_RECORD_HEADER + PROTO_MAX_FRAME];
+    uint64_t end = 0;
+    while (fread(record, 1, JOURNAL_RECORD_HEADER, file) == JOURNAL_RECORD_HEADER)
+    {
+        uint32_t len = proto_get_u32(record);
+        if (len > PROTO_MAX_FRAME || fread(record + JOURNAL_RECORD_HEADER, 1, len, file) != len ||
+            journal_record_size(record, JOURNAL_RECORD_HEADER + len) == 0)
+            break;
+        end += JOURNAL_RECORD_HEADER + len;
+    }
+    fclose(file);
+    return end;
+}
+
+/**
+ * Opens the message log in a store directory and starts its writer thread
+ *
+ * New records are appended after the last valid record already on disk.
+ * O_DIRECT is used when the file system supports it, and io_uring when
+ * the kernel allows it; otherwise the journal falls back to buffered I/O
+ * and pwrite/fdatasync on the same thread.
+ *
+ * @param dir Store directory, created if missing
+ * @param buffer_kb Size of each write batch in KiB
+ * @return 0 on success, -1 on failure
+ */
+int journal_start(const char *dir, int buffer_kb)
+{
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        return -1;
+    snprintf(journal_path, sizeof(journal_path), "%s/%s", dir, JOURNAL_FILE);
+
+    buffer_size = align_up((size_t)buffer_kb * 1024);
+    for (int i = 0; i < 2; i++)
+    {
+        if (posix_memalign((void **)&buffers[i].data, JOURNAL_ALIGN, buffer_size) != 0)
+            return -1;
+    }
+
+    uint64_t end = journal_scan(journal_path);
+
+    journal_fd = journal_open();
+    if (journal_fd < 0)
+        return -1;
+
+    // Reload the unfinished last block so the first batch rewrites it whole
+    JournalBuffer *first = &buffers[0];
+    first->offset = end & ~(uint64_t)(JOURNAL_ALIGN - 1);
+    first->carried = first->fill = end - first->offset;
+    if (first->fill && pread(journal_fd, first->data, JOURNAL_ALIGN, first->offset) < (ssize_t)first->fill)
+        return -1;
+    if (ftruncate(journal_fd, align_up(end)) < 0)
+        return -1;
+
+    if (uring_init(8) < 0)
+        ring.fd = -1;
+
+    active = first;
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, journal_thread, NULL) != 0)
+    {
+        active = NULL;
+        return -1;
+    }
+    pthread_detach(thread_id);
+    return 0;
+}
+
+/**
+ * Writes the journal state and counters to an admin connection
+ *
+ * @param fd Connection to write to
+ */
+void journal_report(int fd)
+{
+    if (!active)
+    {
+        dprintf(fd, "journal disabled (set store_dir to enable)\n");
+        return;
+    }
+
+    pthread_mutex_lock(&journal_mutex);
+    int is_failed = failed;
+    pthread_mutex_unlock(&journal_mutex);
+
+    unsigned long appended = atomic_load(&bytes_appended);
+    unsigned long written = atomic_load(&bytes_written);
+    dprintf(fd, "path %s\n", journal_path);
+    dprintf(fd, "state %s\n", is_failed ? "failed" : "ok");
+    dprintf(fd, "io %s%s, %s\n", ring.fd >= 0 ? "io_uring" : "pwrite",
+            ring.fd >= 0 && ring.fixed_buffers ? " (fixed buffers)" : "",
+            direct_io ? "O_DIRECT" : "buffered");
+    dprintf(fd, "records %lu dropped %lu\n", atomic_load(&records_appended), atomic_load(&records_dropped));
+    dprintf(fd, "bytes_appended %lu bytes_written %lu batches %lu\n",
+            appended, written, atomic_load(&batches_written));
+    dprintf(fd, "write_amplification %.2f\n", appended ? (double)written / appended : 0.0);
+}
@@ -0,0 +1,335 @@
+#include "server.h"
+
+#define MENTION_BUCKETS 1024     // Hash buckets for per-user indexes
+#define MENTION_MAX_PER_MESSAGE 8 // Distinct users notified per message
+
+/**
+ * Mention index structure - Recent room messages that named one user
+ *
+ * Frames are kept in a ring of separately allocated copies. The ring
+ * size is taken from the configuration when the index is created.
+ */
+typedef struct MentionIndex
+{
+    struct MentionIndex *next;  // Next index in the same bucket
+    char username[MAX_USERNAME];
+    LruLink lru;                // Position in index_lru, by last mention
+    uint32_t total;             // Mentions recorded since the index was created
+    int capacity;               // Slots in frames
+    int head;                   // Slot of the oldest frame
+    int count;                  // Frames stored
+    uint8_t **frames;           // Each a u16 length followed by the frame
+} MentionIndex;
+
+static MentionIndex *buckets[MENTION_BUCKETS];
+static int index_count = 0;
+static LruList index_lru; // Indexes by last mention, oldest at the tail
+static pthread_mutex_t mention_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_ulong messages_scanned;
+static atomic_ulong mentions_delivered;
+
+/**
+ * Characters that may appear in a mentionable username
+ */
+static const uint8_t name_char[256] = {
+    ['a' ... 'z'] = 1, ['A' ... 'Z'] = 1, ['0' ... '9'] = 1,
+    ['_'] = 1, ['-'] = 1, ['.'] = 1,
+};
+
+/**
+ * Hashes a username (FNV-1a)
+ */
+static unsigned name_hash(const char *name)
+{
+    unsigned h = 2166136261u;
+    for (const char *p = name; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    return h % MENTION_BUCKETS;
+}
+
+/**
+ * Frees an index and its frames
+ */
+static void index_free(MentionIndex *index)
+{
+    for (int i = 0; i < index->count; i++)
+        free(index->frames[(index->head + i) % index->capacity]);
+    free(index->frames);
+    free(index);
+}
+
+/**
+ * Frees the least recently mentioned user's index
+ *
+ * Must be called with mention_mutex held.
+ */
+static void evict_oldest(void)
+{
+    if (!index_lru.tail)
+        return;
+
+    MentionIndex *index = LRU_ENTRY(index_lru.tail, MentionIndex, lru);
+    MentionIndex **link = &buckets[name_hash(index->username)];
+    while (*link != index)
+        link = &(*link)->next;
+    *link = index->next;
+    lru_remove(&index_lru, &index->lru);
+    index_free(index);
+    index_count--;
+}
+
+/**
+ * Finds a user's index, optionally creating it
+ *
+ * Must be called with mention_mutex held.
+ *
+ * @param username User to look up
+ * @param cfg Current configuration snapshot, used when creating
+ * @return The index, or NULL
+ */
+static MentionIndex *index_lookup(const char *username, const Config *cfg)
+{
+    unsigned bucket = name_hash(username);
+    for (MentionIndex *index = buckets[bucket]; index; index = index->next)
+    {
+        if (strcmp(index->username, username) == 0)
+            return index;
+    }
+    if (!cfg)
+        return NULL;
+
+    if (index_count >= cfg->mention_users)
+        evict_oldest();
+
+    MentionIndex *index = calloc(1, sizeof(MentionIndex));
+    uint8_t **frames = calloc(cfg->mention_index, sizeof(uint8_t *));
+    if (!index || !frames)
+    {
+        free(index);
+        free(frames);
+        return NULL;
+    }
+    strncpy(index->username, username, MAX_USERNAME - 1);
+    index->capacity = cfg->mention_index;
+    index->frames = frames;
+    index->next = buckets[bucket];
+    buckets[bucket] = index;
+    lru_push(&index_lru, &index->lru);
+    index_count++;
+    return index;
+}
+
+/**
+ * Adds a frame to a user's index, dropping the oldest if it is full
+ *
+ * @param username Mentioned user
+ * @param frame Broadcast frame that mentioned them
+ * @param len Frame length
+ * @param cfg Current configuration snapshot
+ * @return Mentions recorded for the user, 0 if nothing was stored
+ */
+static uint32_t index_add(const char *username, const uint8_t *frame, size_t len, const Config *cfg)
+{
+    if (len > 0xFFFF)
+        return 0;
+    uint8_t *copy = malloc(2 + len);
+    if (!copy)
+        return 0;
+    proto_put_u16(copy, (uint16_t)len);
+    memcpy(copy + 2, frame, len);
+
+    uint32_t total = 0;
+    pthread_mutex_lock(&mention_mutex);
+    MentionIndex *index = index_lookup(username, cfg);
+    if (index)
+    {
+        if (index->count == index->capacity)
+        {
+            free(index->frames[index->head]);
+            index->head = (index->head + 1) % index->capacity;
+            index->count--;
+        }
+        index->frames[(index->head + index->count) % index->capacity] = copy;
+        index->count++;
+        lru_touch(&index_lru, &index->lru);
+        total = ++index->total;
+        copy = NULL;
+    }
+    pthread_mutex_unlock(&mention_mutex);
+
+    free(copy);
+    return total;
+}
+
+/**
+ * Finds the @username tokens in a message
+ *
+ * A token is '@' at the start or after a character that cannot be part
+ * of a name (so addresses like bob@example.com are skipped), followed by
+ * name characters. Trailing '.' and '-' are taken as punctuation.
+ * Repeated names are reported once.
+ *
+ * @param content Message content
+ * @param names Output, MENTION_MAX_PER_MESSAGE entries
+ * @return Number of distinct names found
+ */
+static int extract_mentions(ProtoStr content, char names[][MAX_USERNAME])
+{
+    const char *p = content.ptr;
+    const char *end = content.ptr + content.len;
+    int count = 0;
+
+    while (count < MENTION_MAX_PER_MESSAGE && (p = memchr(p, '@', end - p)))
+    {
+        const char *at = p++;
+        if (at > content.ptr && name_char[(uint8_t)at[-1]])
+            continue;
+
+        const char *name = p;
+        while (p < end && name_char[(uint8_t)*p])
+            p++;
+        size_t len = p - name;
+        while (len > 0 && (name[len - 1] == '.' || name[len - 1] == '-'))
+            len--;
+        if (len == 0 || len >= MAX_USERNAME)
+            continue;
+
+        int seen = 0;
+        for (int i = 0; i < count && !seen; i++)
+            seen = strncmp(names[i], name, len) == 0 && names[i][len] == '\0';
+        if (seen)
+            continue;
+
+        memcpy(names[count], name, len);
+        names[count][len] = '\0';
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Returns the wall-clock time in milliseconds
+ */
+static uint64_t now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Indexes a room message under every online user it mentions and
+ * notifies them
+ *
+ * Messages without '@' return after a single memchr().
+ *
+ * @param sender Username of the sender, never notified about itself
+ * @param content Message content
+ * @param frame Broadcast frame as delivered to the room
+ * @param len Frame length
+ */
+void mention_scan(const char *sender, ProtoStr content, const uint8_t *frame, size_t len)
+{
+    if (!memchr(content.ptr, '@', content.len))
+        return;
+
+    if (config_get()->mention_index == 0)
+        return;
+
+    char names[MENTION_MAX_PER_MESSAGE][MAX_USERNAME];
+    int count = extract_mentions(content, names);
+    atomic_fetch_add_explicit(&messages_scanned, 1, memory_order_relaxed);
+
+    uint64_t sent_ms = now_ms();
+    for (int i = 0; i < count; i++)
+    {
+        Client target;
+        if (strcmp(names[i], sender) == 0 || !find_client(names[i], &target))
+            continue;
+
+        // Fetched per target: the snapshot must not be kept across sends
+        uint32_t total = index_add(target.username, frame, len, config_get());
+        if (!total || overload_shed(SHED_EPHEMERAL))
+            continue;
+
+        uint8_t note[PROTO_HEADER_SIZE + MENTION_MAX_BODY];
+        MentionMsg msg = {.sender = proto_str(sender), .sent_ms = sent_ms, .count = total};
+        size_t note_len = encode_mention(note, sizeof(note), &msg);
+        if (note_len)
+        {
+            send_to_client(&target, note, note_len);
+            atomic_fetch_add_explicit(&mentions_delivered, 1, memory_order_relaxed);
+        }
+        format_whiteboard_msg(MSG_TYPE_DEBUG, "%s mentioned %s", sender, target.username);
+    }
+}
+
+/**
+ * Encodes a user's recent mentions as one batched frame
+ *
+ * When the batch limit is reached the oldest mentions are left out.
+ *
+ * @param username User the frame is for
+ * @param len Output for the frame length
+ * @return Malloc'd frame the caller must free, or NULL if memory ran out
+ */
+uint8_t *mention_encode(const char *username, size_t *len)
+{
+    uint8_t *frames = malloc(MAX_QUERY_BYTES);
+    uint8_t *frame = malloc(PROTO_HEADER_SIZE + MENTIONS_MAX_BODY);
+    if (!frames || !frame)
+    {
+        free(frames);
+        free(frame);
+        return NULL;
+    }
+
+    MentionsMsg msg = {.frames = {.ptr = frames}};
+    pthread_mutex_lock(&mention_mutex);
+    MentionIndex *index = index_lookup(username, NULL);
+    if (index)
+    {
+        // Newest first until the batch is full, then keep that suffix
+        int first = index->count;
+        size_t needed = 0;
+        while (first > 0)
+        {
+            const uint8_t *entry = index->frames[(index->head + first - 1) % index->capacity];
+            size_t size = proto_get_u16(entry);
+            if (needed + size > MAX_QUERY_BYTES)
+                break;
+            needed += size;
+            first--;
+        }
+        for (int i = first; i < index->count; i++)
+        {
+            const uint8_t *entry = index->frames[(index->head + i) % index->capacity];
+            size_t size = proto_get_u16(entry);
+            memcpy(frames + msg.frames.len, entry + 2, size);
+            msg.frames.len += size;
+            msg.count++;
+        }
+    }
+    pthread_mutex_unlock(&mention_mutex);
+
+    *len = encode_mentions(frame, PROTO_HEADER_SIZE + MENTIONS_MAX_BODY, &msg);
+    free(frames);
+    return frame;
+}
+
+/**
+ * Writes mention counters to an admin connection
+ *
+ * @param fd Admin connection to write to
+ */
+void mention_report(int fd)
+{
+    pthread_mutex_lock(&mention_mutex);
+    int users = index_count;
+    pthread_mutex_unlock(&mention_mutex);
+
+    dprintf(fd, "indexed users %d\n", users);
+    dprintf(fd, "messages with mentions %lu\n", atomic_load_explicit(&messages_scanned, memory_order_relaxed));
+    dprintf(fd, "notifications %lu\n", atomic_load_explicit(&mentions_delivered, memory_order_relaxed));
+}
@@ -0,0 +1,545 @@
+#include "server.h"
+#include "wire.h"
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/sockios.h>
+
+#define MUX_BUCKETS_MIN 64 // Initial size of a link's stream table
+#define MUX_LINKS_MAX 64   // Gateway links served at once
+
+/**
+ * Mux stream structure - One user carried on a gateway link
+ */
+typedef struct MuxStream
+{
+    struct MuxStream *next; // Next stream in the same hash bucket
+    Client client;          // Registry entry of the user
+    RateBucket bucket;      // The user's rate limit
+} MuxStream;
+
+/**
+ * Mux link structure - A gateway connection and the users it carries
+ *
+ * The stream table is only touched by the link's own thread; everything
+ * else reaches a user through its Client entry and session. Threads
+ * writing to a link outside its sessions' send locks hold a reference,
+ * and the socket is closed and the link freed with the last one.
+ */
+struct MuxLink
+{
+    struct MuxLink *next;      // Next link in the list of gateways
+    atomic_int refs;           // The link thread's reference plus pinned writers
+    int socket;                // Connection to the gateway
+    char name[MAX_USERNAME];   // Name from the gateway's hello
+    time_t connected_at;       // Wall-clock time of the hello
+    pthread_mutex_t send_lock; // Serializes frames written to the link
+    MuxStream **buckets;       // Stream table, chained by stream id
+    size_t bucket_count;       // Size of buckets, a power of two
+    atomic_uint streams;       // Open streams on the link
+    atomic_ulong frames_in;    // Frames received from the gateway
+    atomic_ulong frames_out;   // Frames sent to the gateway
+    atomic_ulong fanouts;      // Room frames delivered by fanout
+};
+
+static MuxLink *links = NULL;
+static int link_count = 0;
+static pthread_mutex_t links_mutex = PTHREAD_MUTEX_INITIALIZER; // Guards the list only; never held across I/O
+
+/**
+ * Takes a reference on a link
+ *
+ * The caller must already know the link is alive: it holds links_mutex
+ * with the link listed, holds another reference, or holds clients_mutex
+ * with one of the link's users registered.
+ *
+ * @param link Link to pin
+ */
+void mux_hold(MuxLink *link)
+{
+    atomic_fetch_add_explicit(&link->refs, 1, memory_order_relaxed);
+}
+
+/**
+ * Drops a reference on a link, freeing it with the last one
+ *
+ * @param link Link to release
+ */
+void mux_put(MuxLink *link)
+{
+    if (atomic_fetch_sub_explicit(&link->refs, 1, memory_order_acq_rel) != 1)
+        return;
+    close(link->socket);
+    pthread_mutex_destroy(&link->send_lock);
+    free(link);
+}
+
+/**
+ * Pins every listed link so it can be used without links_mutex
+ *
+ * @param out Output, MUX_LINKS_MAX entries; release each with mux_put()
+ * @return Number of links pinned
+ */
+static int links_pin(MuxLink **out)
+{
+    int n = 0;
+    pthread_mutex_lock(&links_mutex);
+    for (MuxLink *link = links; link && n < MUX_LINKS_MAX; link = link->next)
+    {
+        mux_hold(link);
+        out[n++] = link;
+    }
+    pthread_mutex_unlock(&links_mutex);
+    return n;
+}
+
+/**
+ * Writes a frame prefix and payload to a link as one unit
+ *
+ * Uses one vectored write so wrapped frames are never copied. As with
+ * sessions, a frame cut off by the send timeout would leave the stream
+ * unparsable, so the link is shut down; its thread then closes every
+ * stream on it.
+ *
+ * @param link Destination link
+ * @param prefix Header bytes written first
+ * @param prefix_len Length of prefix
+ * @param frame Payload written after the prefix, may be NULL
+ * @param len Length of frame
+ * @return 0 if everything was sent, -1 otherwise
+ */
+static int link_write(MuxLink *link, const uint8_t *prefix, size_t prefix_len,
+                      const uint8_t *frame, size_t len)
+{
+    struct iovec iov[2] = {{(void *)prefix, prefix_len}, {(void *)frame, len}};
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = len ? 2 : 1};
+    size_t total = prefix_len + len;
+    size_t sent = 0;
+
+    pthread_mutex_lock(&link->send_lock);
+    while (sent < total)
+    {
+        ssize_t n = sendmsg(link->socket, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        sent += n;
+
+        // Skip the iovecs that were written completely
+        while (msg.msg_iovlen && (size_t)n >= msg.msg_iov->iov_len)
+        {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen)
+        {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    if (sent > 0 && sent < total)
+        shutdown(link->socket, SHUT_RDWR);
+    pthread_mutex_unlock(&link->send_lock);
+
+    if (sent < total)
+        return -1;
+    atomic_fetch_add_explicit(&link->frames_out, 1, memory_order_relaxed);
+    return 0;
+}
+
+/**
+ * Sends a frame to one user of a gateway
+ *
+ * The stream_data header is laid out here, as encode_stream_data()
+ * would, so the frame is written straight from the caller's buffer.
+ *
+ * @param link Link carrying the user
+ * @param stream The user's stream id
+ * @param frame Encoded frame
+ * @param len Frame length
+ * @return 0 if the whole frame was sent, -1 otherwise
+ */
+int mux_send(MuxLink *link, uint32_t stream, const uint8_t *frame, size_t len)
+{
+    uint8_t prefix[PROTO_HEADER_SIZE + 8];
+
+    if (len > MAX_STREAM_FRAME)
+        return -1;
+    proto_encode_header(prefix, MSG_STREAM_DATA, 8 + len);
+    proto_put_u32(prefix + PROTO_HEADER_SIZE, stream);
+    proto_put_u32(prefix + PROTO_HEADER_SIZE + 4, len);
+    return link_write(link, prefix, sizeof(prefix), frame, len);
+}
+
+/**
+ * Sends a room frame once to every gateway
+ *
+ * Each gateway copies it to all of its users except the sender. The
+ * links are pinned and written after links_mutex is released, so a
+ * backed-up gateway delays only this fanout, not other broadcasts or
+ * links coming and going.
+ *
+ * @param frame Encoded frame
+ * @param len Frame length
+ * @param except Sender to exclude, or NULL
+ */
+void mux_fanout(const uint8_t *frame, size_t len, const Client *except)
+{
+    uint8_t prefix[PROTO_HEADER_SIZE + 8];
+    MuxLink *pinned[MUX_LINKS_MAX];
+
+    if (len > MAX_STREAM_FRAME)
+        return;
+
+    int count = links_pin(pinned);
+    for (int i = 0; i < count; i++)
+    {
+        MuxLink *link = pinned[i];
+        if (atomic_load_explicit(&link->streams, memory_order_relaxed) != 0)
+        {
+            uint32_t skip = except && except->link == link ? except->stream : 0;
+            proto_encode_header(prefix, MSG_STREAM_FANOUT, 8 + len);
+            proto_put_u32(prefix + PROTO_HEADER_SIZE, skip);
+            proto_put_u32(prefix + PROTO_HEADER_SIZE + 4, len);
+            if (link_write(link, prefix, sizeof(prefix), frame, len) == 0)
+                atomic_fetch_add_explicit(&link->fanouts, 1, memory_order_relaxed);
+        }
+        mux_put(link);
+    }
+}
+
+/**
+ * Asks a gateway to disconnect one user
+ *
+ * The gateway answers with its own close, and the link thread then runs
+ * the normal logout.
+ *
+ * @param link Link carrying the user
+ * @param stream The user's stream id
+ */
+void mux_close(MuxLink *link, uint32_t stream)
+{
+    uint8_t frame[PROTO_HEADER_SIZE + STREAM_CLOSE_MAX_BODY];
+    StreamCloseMsg msg = {.stream = stream};
+    size_t len = encode_stream_close(frame, sizeof(frame), &msg);
+    if (len)
+        link_write(link, frame, len, NULL, 0);
+}
+
+/**
+ * Returns the table bucket of a stream id
+ *
+ * @param link Link owning the table
+ * @param stream Stream id
+ * @return Pointer to the head of the bucket's chain
+ */
+static MuxStream **stream_bucket(MuxLink *link, uint32_t stream)
+{
+    return &link->buckets[(stream ^ (stream >> 16)) & (link->bucket_count - 1)];
+}
+
+/**
+ * Looks up an open stream
+ *
+ * @param link Link owning the table
+ * @param stream Stream id
+ * @return The stream, or NULL if it is not open
+ */
+static MuxStream *stream_find(MuxLink *link, uint32_t stream)
+{
+    for (MuxStream *s = *stream_bucket(link, stream); s; s = s->next)
+        if (s->client.stream == stream)
+            return s;
+    return NULL;
+}
+
+/**
+ * Adds a stream to the table, doubling the table once it is full
+ *
+ * @param link Link owning the table
+ * @param s Stream to add
+ */
+static void stream_insert(MuxLink *link, MuxStream *s)
+{
+    unsigned count = atomic_load_explicit(&link->streams, memory_order_relaxed);
+    if (count >= link->bucket_count)
+    {
+        size_t old_count = link->bucket_count;
+        MuxStream **old = link->buckets;
+        MuxStream **grown = calloc(old_count * 2, sizeof(MuxStream *));
+        if (grown)
+        {
+            link->buckets = grown;
+            link->bucket_count = old_count * 2;
+            for (size_t i = 0; i < old_count; i++)
+            {
+                while (old[i])
+                {
+                    MuxStream *moved = old[i];
+                    old[i] = moved->next;
+                    MuxStream **b = stream_bucket(link, moved->client.stream);
+                    moved->next = *b;
+                    *b = moved;
+                }
+            }
+            free(old);
+        }
+    }
+
+    MuxStream **b = stream_bucket(link, s->client.stream);
+    s->next = *b;
+    *b = s;
+    atomic_fetch_add_explicit(&link->streams, 1, memory_order_relaxed);
+}
+
+/**
+ * Logs a stream's user out and frees the stream
+ *
+ * @param link Link owning the table
+ * @param stream Stream id
+ */
+static void stream_remove(MuxLink *link, uint32_t stream)
+{
+    for (MuxStream **p = stream_bucket(link, stream); *p; p = &(*p)->next)
+    {
+        MuxStream *s = *p;
+        if (s->client.stream != stream)
+            continue;
+
+        *p = s->next;
+        atomic_fetch_sub_explicit(&link->streams, 1, memory_order_relaxed);
+        client_leave(&s->client);
+        free(s);
+        return;
+    }
+}
+
+/**
+ * Admits the user of a newly opened stream
+ *
+ * @param link Link the open arrived on
+ * @param body Body of the stream_open frame
+ * @param len Body length
+ */
+static void stream_open(MuxLink *link, const uint8_t *body, size_t len)
+{
+    StreamOpenMsg msg;
+    if (decode_stream_open(body, len, &msg) < 0 || msg.stream == 0 ||
+        msg.username.len == 0 || memchr(msg.username.ptr, '\0', msg.username.len) ||
+        stream_find(link, msg.stream))
+        return;
+
+    MuxStream *s = calloc(1, sizeof(MuxStream));
+    if (!s)
+    {
+        mux_close(link, msg.stream);
+        return;
+    }
+    s->client.socket = link->socket;
+    s->client.stream = msg.stream;
+    s->client.link = link;
+    proto_str_copy(s->client.username, MAX_USERNAME, msg.username);
+
+    // A rejected user has already been sent the reason
+    if (!client_join(&s->client))
+    {
+        mux_close(link, msg.stream);
+        free(s);
+        return;
+    }
+
+    rate_limit_init(&s->bucket);
+    stream_insert(link, s);
+}
+
+/**
+ * Handles a frame from one stream's user
+ *
+ * The wrapped frame must be a single well-formed frame within the limits
+ * of a direct connection; anything else ends the stream, just as it
+ * would end a direct connection.
+ *
+ * @param link Link the frame arrived on
+ * @param body Body of the stream_data frame
+ * @param len Body length
+ */
+static void stream_data(MuxLink *link, const uint8_t *body, size_t len)
+{
+    StreamDataMsg msg;
+    ProtoHeader hdr;
+    if (decode_stream_data(body, len, &msg) < 0)
+        return;
+
+    MuxStream *s = stream_find(link, msg.stream);
+    if (!s)
+        return;
+
+    if (msg.frame.len < PROTO_HEADER_SIZE || proto_decode_header(msg.frame.ptr, &hdr) < 0 ||
+        hdr.length > MAX_INBOUND_BODY || PROTO_HEADER_SIZE + hdr.length != msg.frame.len)
+    {
+        mux_close(link, msg.stream);
+        stream_remove(link, msg.stream);
+        return;
+    }
+
+    client_dispatch(&s->client, &s->bucket, &hdr, msg.frame.ptr, msg.frame.len);
+}
+
+/**
+ * Serves a gateway connection until it closes
+ *
+ * Runs on the connection's own thread. Every user of the gateway is a
+ * stream with a normal registry entry and session, so routing, queries
+ * and the admin socket treat them like direct users. When the link
+ * drops, all of its users are logged out.
+ *
+ * @param socket Connection to the gateway, already past its hello;
+ *               closed when the link's last reference is dropped
+ * @param name Name the gateway gave in its hello
+ */
+void mux_serve(int socket, const char *name)
+{
+    uint8_t frame[PROTO_HEADER_SIZE + 8 + PROTO_HEADER_SIZE + MAX_INBOUND_BODY];
+    ProtoHeader hdr;
+
+    MuxLink *link = calloc(1, sizeof(MuxLink));
+    if (!link || !(link->buckets = calloc(MUX_BUCKETS_MIN, sizeof(MuxStream *))))
+    {
+        free(link);
+        close(socket);
+        return;
+    }
+    atomic_init(&link->refs, 1);
+    link->bucket_count = MUX_BUCKETS_MIN;
+    link->socket = socket;
+    strcpy(link->name, name);
+    link->connected_at = time(NULL);
+    pthread_mutex_init(&link->send_lock, NULL);
+
+    pthread_mutex_lock(&links_mutex);
+    int listed = link_count < MUX_LINKS_MAX;
+    if (listed)
+    {
+        link->next = links;
+        links = link;
+        link_count++;
+    }
+    pthread_mutex_unlock(&links_mutex);
+    if (!listed)
+    {
+        format_whiteboard_msg(MSG_TYPE_ERROR, "Gateway %s refused, %d links already served", name, MUX_LINKS_MAX);
+        free(link->buckets);
+        mux_put(link);
+        return;
+    }
+
+    format_whiteboard_msg(MSG_TYPE_LOGIN, "Gateway %s connected", name);
+
+    while (recv_frame(socket, frame, sizeof(frame), &hdr) >= 0)
+    {
+        atomic_fetch_add_explicit(&link->frames_in, 1, memory_order_relaxed);
+        const uint8_t *body = frame + PROTO_HEADER_SIZE;
+
+        switch (hdr.type)
+        {
+        case MSG_STREAM_OPEN:
+            stream_open(link, body, hdr.length);
+            break;
+        case MSG_STREAM_DATA:
+            stream_data(link, body, hdr.length);
+            break;
+        case MSG_STREAM_CLOSE:
+        {
+            StreamCloseMsg msg;
+            if (decode_stream_close(body, hdr.length, &msg) == 0)
+                stream_remove(link, msg.stream);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    // Unlist the link first so no fanout reaches it while users leave
+    pthread_mutex_lock(&links_mutex);
+    for (MuxLink **p = &links; *p; p = &(*p)->next)
+    {
+        if (*p == link)
+        {
+            *p = link->next;
+            link_count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&links_mutex);
+
+    unsigned dropped = atomic_load_explicit(&link->streams, memory_order_relaxed);
+    for (size_t i = 0; i < link->bucket_count; i++)
+        while (link->buckets[i])
+            stream_remove(link, link->buckets[i]->client.stream);
+
+    format_whiteboard_msg(MSG_TYPE_LOGOUT, "Gateway %s disconnected, %u user(s) dropped", name, dropped);
+
+    // Writers that pinned the link before it was unlisted fail fast
+    // on the shut down socket, and the last of them frees the link
+    shutdown(socket, SHUT_RDWR);
+    free(link->buckets);
+    mux_put(link);
+}
+
+/**
+ * Sums the bytes waiting in the kernel send buffers of all gateway links
+ *
+ * Called by the overload monitor. links_mutex is only held to pin the
+ * list, never across I/O, and the ioctls run on pinned links, whose
+ * sockets stay open until the last reference is dropped.
+ *
+ * @return Queued bytes
+ */
+long mux_queued(void)
+{
+    MuxLink *pinned[MUX_LINKS_MAX];
+    long total = 0;
+
+    int count = links_pin(pinned);
+    for (int i = 0; i < count; i++)
+    {
+        int outq;
+        if (ioctl(pinned[i]->socket, SIOCOUTQ, &outq) == 0)
+            total += outq;
+        mux_put(pinned[i]);
+    }
+    return total;
+}
+
+/**
+ * Writes one line per connected gateway to an admin connection
+ *
+ * @param fd Admin connection to write to
+ */
+void mux_report(int fd)
+{
+    time_t now = time(NULL);
+    MuxLink *pinned[MUX_LINKS_MAX];
+
+    dprintf(fd, "%-20s %5s %7s %8s %11s %11s %11s\n",
+            "GATEWAY", "FD", "AGE", "STREAMS", "FRAMES_IN", "FRAMES_OUT", "FANOUTS");
+
+    // Pinned rather than locked, since a slow admin client blocks dprintf()
+    int count = links_pin(pinned);
+    for (int i = 0; i < count; i++)
+    {
+        MuxLink *link = pinned[i];
+        dprintf(fd, "%-20s %5d %6lds %8u %11lu %11lu %11lu\n",
+                link->name, link->socket, (long)(now - link->connected_at),
+                atomic_load_explicit(&link->streams, memory_order_relaxed),
+                atomic_load_explicit(&link->frames_in, memory_order_relaxed),
+                atomic_load_explicit(&link->frames_out, memory_order_relaxed),
+                atomic_load_explicit(&link->fanouts, memory_order_relaxed));
+        mux_put(link);
+    }
+
+    dprintf(fd, "%d gateway(s)\n", count);
+}
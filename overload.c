@@ -0,0 +1,304 @@
+#include "server.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define OVERLOAD_TICK_MS 100      // Sampling period of the monitor thread
+#define OVERLOAD_QUEUE_TICKS 5    // Ticks between scans of the send queues
+#define OVERLOAD_PRESENCE_MAX 4096 // Presence notices held while deferred
+
+/**
+ * Deferred presence structure - A join or leave notice not yet broadcast
+ */
+typedef struct
+{
+    Client client; // The user who joined or left
+    int online;    // 1 for a join, 0 for a leave
+} DeferredPresence;
+
+static int listen_socket = -1;
+static atomic_int level;
+
+// Latest samples, for the admin report
+static atomic_long lag_ms;
+static atomic_long queued_bytes;
+static atomic_long backlog;
+
+static DeferredPresence *deferred;
+static int deferred_count;
+static int flushing; // Deferred notices are being sent; later ones must queue behind them
+static pthread_mutex_t deferred_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t deferred_ready = PTHREAD_COND_INITIALIZER; // Load dropped below SHED_PRESENCE
+
+static atomic_ulong shed[SHED_LOGINS + 1]; // Events shed at each level
+static atomic_ulong coalesced;             // Join/leave pairs that cancelled out
+static atomic_ulong presence_dropped;      // Notices lost to a full deferral queue
+
+/**
+ * Returns the current shedding level
+ *
+ * @return SHED_NONE up to SHED_LOGINS
+ */
+int overload_level(void)
+{
+    return atomic_load_explicit(&level, memory_order_relaxed);
+}
+
+/**
+ * Tells whether an action at a given level must be shed, counting it if so
+ *
+ * @param at Level from which the action is shed
+ * @return 1 to shed, 0 to go ahead
+ */
+int overload_shed(ShedLevel at)
+{
+    if (overload_level() < (int)at)
+        return 0;
+    atomic_fetch_add_explicit(&shed[at], 1, memory_order_relaxed);
+    return 1;
+}
+
+/**
+ * Holds back a join or leave notice while presence is deferred
+ *
+ * Notices also queue while earlier ones are still waiting, so joins
+ * and leaves are never seen out of order. A leave cancels a join of the
+ * same session still waiting, since nobody has seen that user arrive.
+ *
+ * @param client The user who joined or left
+ * @param online 1 for a join, 0 for a leave
+ * @return 1 if the notice was taken (or dropped), 0 to broadcast it now
+ */
+int overload_defer_presence(const Client *client, int online)
+{
+    int shedding = overload_shed(SHED_PRESENCE);
+
+    pthread_mutex_lock(&deferred_mutex);
+    if (!shedding && deferred_count == 0 && !flushing)
+    {
+        pthread_mutex_unlock(&deferred_mutex);
+        return 0;
+    }
+    if (!online)
+    {
+        for (int i = 0; i < deferred_count; i++)
+        {
+            if (deferred[i].online && deferred[i].client.session_id == client->session_id)
+            {
+                memmove(&deferred[i], &deferred[i + 1], (deferred_count - i - 1) * sizeof(DeferredPresence));
+                deferred_count--;
+                pthread_mutex_unlock(&deferred_mutex);
+                atomic_fetch_add_explicit(&coalesced, 1, memory_order_relaxed);
+                return 1;
+            }
+        }
+    }
+
+    if (deferred_count < OVERLOAD_PRESENCE_MAX)
+        deferred[deferred_count++] = (DeferredPresence){.client = *client, .online = online};
+    else
+        atomic_fetch_add_explicit(&presence_dropped, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&deferred_mutex);
+    return 1;
+}
+
+/**
+ * Presence thread - Broadcasts the notices held back while overloaded
+ *
+ * Broadcasting can block on slow clients, so it runs here rather than
+ * on the monitor thread, which only wakes this one up. Sending stops
+ * between batches if presence is deferred again.
+ *
+ * @param arg Unused
+ * @return Never returns
+ */
+static void *presence_thread(void *arg)
+{
+    (void)arg;
+    static DeferredPresence batch[OVERLOAD_PRESENCE_MAX];
+
+    pthread_mutex_lock(&deferred_mutex);
+    while (1)
+    {
+        flushing = 0;
+        while (deferred_count == 0 || overload_level() >= SHED_PRESENCE)
+            pthread_cond_wait(&deferred_ready, &deferred_mutex);
+
+        int count = deferred_count;
+        memcpy(batch, deferred, count * sizeof(DeferredPresence));
+        deferred_count = 0;
+        flushing = 1;
+        pthread_mutex_unlock(&deferred_mutex);
+
+        for (int i = 0; i < count; i++)
+        {
+            const Client *c = &batch[i].client;
+            if (batch[i].online)
+                broadcast_message(MSG_JOIN, c->username, proto_str("has joined the chat"), c);
+            else
+                broadcast_message(MSG_LOGOUT, c->username, proto_str("has left the chat"), c);
+        }
+        pthread_mutex_lock(&deferred_mutex);
+    }
+    return NULL;
+}
+
+/**
+ * Sums the bytes waiting in kernel send buffers for every session
+ *
+ * Users behind a gateway share its link, which is counted once. Each
+ * direct session's high-water mark is updated on the way.
+ */
+static long sample_queued(void)
+{
+    long total = mux_queued();
+    for (int i = 0; i < client_capacity; i++)
+    {
+        SessionSnapshot snap;
+        int outq;
+        if (session_snapshot(&sessions[i], &snap) && (outq = session_outq(&sessions[i], &snap)) > 0)
+            total += outq;
+    }
+    return total;
+}
+
+/**
+ * Reads the number of connections waiting in the accept queue
+ *
+ * For a listening socket, Linux reports the queue length in tcpi_unacked.
+ */
+static long sample_backlog(void)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (listen_socket < 0 || getsockopt(listen_socket, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+        return 0;
+    return info.tcpi_unacked;
+}
+
+/**
+ * Returns how far a signal is past its limit, 1.0 meaning at the limit
+ */
+static double pressure(long value, long limit)
+{
+    return limit > 0 ? (double)value / limit : 0.0;
+}
+
+/**
+ * Monitor thread - Samples the overload signals and sets the level
+ *
+ * Lag is how late the thread wakes up, which grows when runnable
+ * threads outnumber the CPUs. The level follows the worst signal:
+ * at its limit, twice it and four times it. It rises at once but falls
+ * one step per tick. Below SHED_PRESENCE the presence thread is woken
+ * to send deferred notices; the monitor itself never broadcasts.
+ *
+ * @param arg Unused
+ * @return Never returns
+ */
+static void *overload_thread(void *arg)
+{
+    (void)arg;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    for (unsigned long tick = 0;; tick++)
+    {
+        next.tv_nsec += OVERLOAD_TICK_MS * 1000000L;
+        if (next.tv_nsec >= 1000000000L)
+        {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long lag = (now.tv_sec - next.tv_sec) * 1000 + (now.tv_nsec - next.tv_nsec) / 1000000;
+        if (lag > OVERLOAD_TICK_MS)
+            next = now; // Do not try to catch up on missed ticks
+        atomic_store_explicit(&lag_ms, lag, memory_order_relaxed);
+
+        if (tick % OVERLOAD_QUEUE_TICKS == 0)
+            atomic_store_explicit(&queued_bytes, sample_queued(), memory_order_relaxed);
+        atomic_store_explicit(&backlog, sample_backlog(), memory_order_relaxed);
+
+        const Config *cfg = config_get();
+        double worst = pressure(lag, cfg->overload_lag_ms);
+        double p = pressure(atomic_load_explicit(&queued_bytes, memory_order_relaxed),
+                            (long)cfg->overload_queue_kb << 10);
+        if (p > worst)
+            worst = p;
+        p = pressure(atomic_load_explicit(&backlog, memory_order_relaxed), cfg->overload_backlog);
+        if (p > worst)
+            worst = p;
+
+        int target = worst >= 4 ? SHED_LOGINS : worst >= 2 ? SHED_PRESENCE : worst >= 1 ? SHED_EPHEMERAL : SHED_NONE;
+        int current = overload_level();
+        int updated = target >= current ? target : current - 1;
+        if (updated != current)
+        {
+            atomic_store_explicit(&level, updated, memory_order_relaxed);
+            format_whiteboard_msg(updated > current ? MSG_TYPE_ERROR : MSG_TYPE_ADMIN,
+                                  "Overload level %d -> %d", current, updated);
+            eventlog_emit(LOG_WARN, EV_OVERLOAD, 0, current, updated, NULL);
+        }
+        // Signalled every tick without the lock, so a missed wakeup waits one tick
+        if (updated < SHED_PRESENCE)
+            pthread_cond_signal(&deferred_ready);
+    }
+    return NULL;
+}
+
+/**
+ * Starts the overload monitor for a listening socket
+ *
+ * @param socket Listening socket whose accept queue is watched
+ * @return 0 on success, -1 on failure
+ */
+int overload_start(int socket)
+{
+    deferred = malloc(OVERLOAD_PRESENCE_MAX * sizeof(DeferredPresence));
+    if (!deferred)
+        return -1;
+    listen_socket = socket;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, presence_thread, NULL) != 0)
+        return -1;
+    pthread_detach(thread);
+    if (pthread_create(&thread, NULL, overload_thread, NULL) != 0)
+        return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+/**
+ * Writes the overload level, its signals and shedding counters
+ *
+ * @param fd Admin connection to write to
+ */
+void overload_report(int fd)
+{
+    // Copied up front: the admin client may be slow to read, and a snapshot
+    // must not be kept across blocking writes
+    const Config *cfg = config_get();
+    int lag_limit = cfg->overload_lag_ms, queue_limit = cfg->overload_queue_kb, backlog_limit = cfg->overload_backlog;
+    static const char *names[] = {"normal", "shedding ephemeral events", "deferring presence", "rejecting logins"};
+
+    dprintf(fd, "level %d (%s)\n", overload_level(), names[overload_level()]);
+    dprintf(fd, "scheduler lag %ld ms (limit %d)\n", atomic_load_explicit(&lag_ms, memory_order_relaxed), lag_limit);
+    dprintf(fd, "send queues %ld bytes (limit %d KB)\n", atomic_load_explicit(&queued_bytes, memory_order_relaxed), queue_limit);
+    dprintf(fd, "accept backlog %ld (limit %d)\n", atomic_load_explicit(&backlog, memory_order_relaxed), backlog_limit);
+    dprintf(fd, "shed ephemeral %lu, deferred presence %lu, rejected logins %lu\n",
+            atomic_load_explicit(&shed[SHED_EPHEMERAL], memory_order_relaxed),
+            atomic_load_explicit(&shed[SHED_PRESENCE], memory_order_relaxed),
+            atomic_load_explicit(&shed[SHED_LOGINS], memory_order_relaxed));
+    pthread_mutex_lock(&deferred_mutex);
+    int pending = deferred_count;
+    pthread_mutex_unlock(&deferred_mutex);
+    dprintf(fd, "presence pending %d, coalesced %lu, dropped %lu\n", pending,
+            atomic_load_explicit(&coalesced, memory_order_relaxed),
+            atomic_load_explicit(&presence_dropped, memory_order_relaxed));
+}
@@ -0,0 +1,320 @@
+#include "server.h"
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#define PERF_MAX_GROUPS 16 // Counter groups open at once across all threads
+
+/**
+ * Counter enumeration - Members of each thread's counter group, in read order
+ */
+enum
+{
+    CTR_CYCLES,       // Leader; kernel cycles included when permitted
+    CTR_INSTRUCTIONS,
+    CTR_LLC_MISSES,   // Last-level cache misses
+    CTR_USER_CYCLES,  // Only opened when CTR_CYCLES includes the kernel
+    CTR_COUNT
+};
+
+_Static_assert(CTR_COUNT == sizeof(((PerfSample *)0)->start) / sizeof(uint64_t), "PerfSample holds every counter");
+
+/**
+ * Thread counters structure - One thread's counter group
+ *
+ * A group is open only while a sample of the thread is in flight, so
+ * idle threads hold no counter fds and no PMU slots. Samples of nested
+ * stages share the group.
+ */
+typedef struct
+{
+    int fds[CTR_COUNT];  // Counter fds, leader first; -1 if not open
+    int counters;        // Members in the group, 0 while closed
+    int state;           // 0 usable, -1 unavailable on this thread
+    int users;           // Samples in flight on the open group
+    unsigned countdown;  // Stage executions to skip before the next sample
+} ThreadCounters;
+
+/**
+ * Stage totals structure - Counter deltas summed over a stage's samples
+ */
+typedef struct
+{
+    atomic_ulong samples;
+    atomic_ulong values[CTR_COUNT];
+} StageTotals;
+
+static const char *stage_names[STAGE_COUNT] = {
+    [STAGE_RECEIVE] = "receive",
+    [STAGE_DECODE] = "decode",
+    [STAGE_LOOKUP] = "lookup",
+    [STAGE_FANOUT] = "fanout",
+    [STAGE_SEND] = "send",
+};
+
+static StageTotals totals[STAGE_COUNT];
+static __thread ThreadCounters mine;
+static __thread unsigned switches;     // Coroutine switches on this thread
+static pthread_key_t counters_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static atomic_int kernel_counted = -1; // 1 if cycles include the kernel, 0 if user only, -1 unknown
+static atomic_int open_error;          // errno of the last failed open
+static atomic_ulong unscheduled;       // Samples lost because the group was not on the PMU
+static atomic_int groups_open;         // Threads with a group open, at most PERF_MAX_GROUPS
+static atomic_ulong no_group;          // Samples skipped because PERF_MAX_GROUPS were open
+
+/**
+ * Closes a thread's counter group and gives up its slot
+ *
+ * Also runs when a thread exits with a sample still in flight.
+ */
+static void counters_close(void *arg)
+{
+    ThreadCounters *c = arg;
+    for (int i = 0; i < c->counters; i++)
+        close(c->fds[i]);
+    if (c->counters)
+        atomic_fetch_sub_explicit(&groups_open, 1, memory_order_relaxed);
+    c->counters = 0;
+    c->users = 0;
+}
+
+static void key_create(void)
+{
+    pthread_key_create(&counters_key, counters_close);
+}
+
+/**
+ * Opens one hardware counter of the calling thread
+ *
+ * @param config PERF_COUNT_HW_* event
+ * @param user_only Leave out cycles spent in the kernel
+ * @param group Leader fd, or -1 to open a leader
+ * @return Counter fd, or -1 with errno set
+ */
+static int open_counter(uint64_t config, int user_only, int group)
+{
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = config,
+        .exclude_kernel = user_only,
+        .exclude_hv = 1,
+        .read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_RUNNING,
+    };
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+/**
+ * Opens the calling thread's counter group
+ *
+ * Kernel cycles need perf_event_paranoid <= 1 or CAP_PERFMON; without
+ * them the group counts user space only and the kernel share is not
+ * reported. A failure other than running out of slots marks the thread
+ * unavailable so it does not retry on every sample.
+ *
+ * @param c Thread counters, closed
+ * @return 0 on success, -1 if no group was opened
+ */
+static int counters_open(ThreadCounters *c)
+{
+    pthread_once(&key_once, key_create);
+
+    int open = atomic_load_explicit(&groups_open, memory_order_relaxed);
+    do
+    {
+        if (open >= PERF_MAX_GROUPS)
+        {
+            atomic_fetch_add_explicit(&no_group, 1, memory_order_relaxed);
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&groups_open, &open, open + 1, memory_order_relaxed,
+                                                    memory_order_relaxed));
+
+    int user_only = atomic_load_explicit(&kernel_counted, memory_order_relaxed) == 0;
+    int leader = open_counter(PERF_COUNT_HW_CPU_CYCLES, user_only, -1);
+    if (leader < 0 && !user_only && (errno == EACCES || errno == EPERM))
+    {
+        user_only = 1;
+        leader = open_counter(PERF_COUNT_HW_CPU_CYCLES, user_only, -1);
+    }
+    if (leader < 0)
+    {
+        atomic_store_explicit(&open_error, errno, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&groups_open, 1, memory_order_relaxed);
+        c->state = -1;
+        return -1;
+    }
+    atomic_store_explicit(&kernel_counted, !user_only, memory_order_relaxed);
+
+    c->fds[c->counters++] = leader;
+    static const uint64_t members[] = {PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_CPU_CYCLES};
+    int wanted = user_only ? CTR_COUNT - 1 : CTR_COUNT;
+    for (int i = 1; i < wanted; i++)
+    {
+        int fd = open_counter(members[i - 1], i == CTR_USER_CYCLES || user_only, leader);
+        if (fd < 0)
+        {
+            atomic_store_explicit(&open_error, errno, memory_order_relaxed);
+            counters_close(c);
+            c->state = -1;
+            return -1;
+        }
+        c->fds[c->counters++] = fd;
+    }
+    pthread_setspecific(counters_key, c);
+    return 0;
+}
+
+/**
+ * Ends one sample's use of the group, closing it after the last
+ *
+ * @param c Thread counters
+ */
+static void counters_release(ThreadCounters *c)
+{
+    if (--c->users == 0)
+        counters_close(c);
+}
+
+/**
+ * Reads the whole group in one syscall
+ *
+ * @param c Thread counters
+ * @param values Output, CTR_COUNT entries; missing members read as 0
+ * @param running Output for the time the group was on the PMU
+ * @return 0 on success, -1 on failure
+ */
+static int counters_read(ThreadCounters *c, uint64_t *values, uint64_t *running)
+{
+    uint64_t buf[2 + CTR_COUNT] = {0};
+    ssize_t n = read(c->fds[0], buf, sizeof(buf));
+    if (n < (ssize_t)(2 * sizeof(uint64_t)) || buf[0] != (uint64_t)c->counters)
+        return -1;
+    *running = buf[1];
+    for (int i = 0; i < CTR_COUNT; i++)
+        values[i] = i < c->counters ? buf[2 + i] : 0;
+    return 0;
+}
+
+/**
+ * Starts measuring one execution of a stage if it is sampled
+ *
+ * One stage execution in perf_sample is measured per thread; with
+ * perf_sample = 0 this is a counter check and a config load. The two
+ * group reads of a sample are syscalls and are themselves partly
+ * counted, which inflates kernel cycles of very short stages.
+ *
+ * @param sample Filled with the starting counts
+ */
+void perf_begin(PerfSample *sample)
+{
+    sample->active = 0;
+    if (mine.countdown)
+    {
+        mine.countdown--;
+        return;
+    }
+    int rate = config_get()->perf_sample;
+    if (rate == 0)
+        return;
+    mine.countdown = rate - 1;
+
+    if (mine.state < 0 || (mine.users == 0 && counters_open(&mine) < 0))
+        return;
+    mine.users++;
+    sample->switches = switches;
+    sample->active = counters_read(&mine, sample->start, &sample->running) == 0;
+    if (!sample->active)
+        counters_release(&mine);
+}
+
+/**
+ * Adds the counts since perf_begin() to a stage's totals
+ *
+ * @param sample Sample started by perf_begin()
+ * @param stage Stage that was measured
+ */
+void perf_end(PerfSample *sample, PerfStage stage)
+{
+    if (!sample->active)
+        return;
+
+    uint64_t now[CTR_COUNT];
+    uint64_t running;
+    if (sample->switches == switches && counters_read(&mine, now, &running) == 0)
+    {
+        if (running == sample->running)
+        {
+            // Too many groups for the PMU; this one was not counting
+            atomic_fetch_add_explicit(&unscheduled, 1, memory_order_relaxed);
+        }
+        else
+        {
+            StageTotals *t = &totals[stage];
+            atomic_fetch_add_explicit(&t->samples, 1, memory_order_relaxed);
+            for (int i = 0; i < CTR_COUNT; i++)
+                atomic_fetch_add_explicit(&t->values[i], now[i] - sample->start[i], memory_order_relaxed);
+        }
+    }
+    counters_release(&mine);
+}
+
+/**
+ * Notes that the thread is switching to another coroutine
+ *
+ * Counters are per thread, so a sample spanning the switch would include
+ * other sessions' work; perf_end() drops it.
+ */
+void perf_switch(void)
+{
+    switches++;
+}
+
+/**
+ * Writes per-stage counter averages
+ *
+ * @param fd Admin connection to write to
+ */
+void perf_report(int fd)
+{
+    int rate = config_get()->perf_sample;
+    int kernel = atomic_load_explicit(&kernel_counted, memory_order_relaxed);
+    int error = atomic_load_explicit(&open_error, memory_order_relaxed);
+
+    if (rate == 0)
+        dprintf(fd, "sampling off (set perf_sample)\n");
+    else
+        dprintf(fd, "sampling 1 in %d stage executions per thread, %s\n", rate,
+                kernel == 1 ? "kernel cycles counted" : kernel == 0 ? "user space only" : "no samples yet");
+    if (error)
+        dprintf(fd, "counters unavailable on some threads: %s\n", strerror(error));
+    dprintf(fd, "unscheduled samples %lu, skipped with %d groups open %lu\n",
+            atomic_load_explicit(&unscheduled, memory_order_relaxed), PERF_MAX_GROUPS,
+            atomic_load_explicit(&no_group, memory_order_relaxed));
+
+    dprintf(fd, "%-8s %10s %10s %10s %6s %10s %10s %8s\n",
+            "stage", "samples", "cycles", "instr", "IPC", "LLC miss", "miss/kins", "kernel%");
+    for (int s = 0; s < STAGE_COUNT; s++)
+    {
+        StageTotals *t = &totals[s];
+        unsigned long n = atomic_load_explicit(&t->samples, memory_order_relaxed);
+        double cycles = atomic_load_explicit(&t->values[CTR_CYCLES], memory_order_relaxed);
+        double instr = atomic_load_explicit(&t->values[CTR_INSTRUCTIONS], memory_order_relaxed);
+        double misses = atomic_load_explicit(&t->values[CTR_LLC_MISSES], memory_order_relaxed);
+        double user = atomic_load_explicit(&t->values[CTR_USER_CYCLES], memory_order_relaxed);
+        if (user > cycles)
+            user = cycles; // The two cycle counters are read a few instructions apart
+        if (n == 0)
+        {
+            dprintf(fd, "%-8s %10lu\n", stage_names[s], n);
+            continue;
+        }
+        dprintf(fd, "%-8s %10lu %10.0f %10.0f %6.2f %10.1f %10.2f", stage_names[s], n,
+                cycles / n, instr / n, cycles ? instr / cycles : 0.0, misses / n, instr ? misses * 1000 / instr : 0.0);
+        if (kernel == 1 && cycles)
+            dprintf(fd, " %7.1f%%\n", (cycles - user) * 100 / cycles);
+        else
+            dprintf(fd, " %8s\n", "-");
+    }
+}
@@ -0,0 +1,99 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * USDT probes - Static tracepoints for bpftrace, perf and SystemTap
+ *
+ * Each probe site is a single nop plus an ELF note (.note.stapsdt)
+ * recording its address, provider "chat", name, semaphore and argument
+ * locations, in the layout of <sys/sdt.h>. Tracers patch the nop into a
+ * breakpoint when attached and increment the probe's semaphore, so
+ * arguments that cost something to compute (latencies) are only computed
+ * while PROBE_ENABLED(name) is true. All arguments are passed as signed
+ * 64-bit values; pointers can be read with str() in bpftrace.
+ *
+ * Each probe needs PROBE_SEMAPHORE(name) once at file scope in the
+ * translation unit that fires it. On other architectures or compilers
+ * probes compile to nothing.
+ *
+ * List them with: bpftrace -l 'usdt:./server:chat:*'
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__)) && !defined(NO_PROBES)
+
+#define PROBE_SEMAPHORE(name) \
+    __attribute__((used, section(".probes"))) static volatile unsigned short chat_##name##_semaphore
+
+#define PROBE_ENABLED(name) __builtin_expect(chat_##name##_semaphore != 0, 0)
+
+// Note layout shared by every probe; args is the argument location string
+#define PROBE_ASM(name, args)                                                          \
+    "990: nop\n"                                                                       \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                                      \
+    ".balign 4\n"                                                                      \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                                 \
+    "991: .asciz \"stapsdt\"\n"                                                        \
+    "992: .balign 4\n"                                                                 \
+    "993: .8byte 990b\n"                                                               \
+    ".8byte _.stapsdt.base\n"                                                          \
+    ".8byte chat_" #name "_semaphore\n"                                                \
+    ".asciz \"chat\"\n"                                                                \
+    ".asciz \"" #name "\"\n"                                                           \
+    ".asciz \"" args "\"\n"                                                            \
+    "994: .balign 4\n"                                                                 \
+    ".popsection\n"                                                                    \
+    ".ifndef _.stapsdt.base\n"                                                         \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"            \
+    ".weak _.stapsdt.base\n"                                                           \
+    ".hidden _.stapsdt.base\n"                                                         \
+    "_.stapsdt.base: .space 1\n"                                                       \
+    ".size _.stapsdt.base, 1\n"                                                        \
+    ".popsection\n"                                                                    \
+    ".endif\n"
+
+#define PROBE_ARG(n) "-8@%[a" #n "]"
+#define PROBE_IN(n, v) [a##n] "nor"((int64_t)(v))
+
+#define PROBE0(name) __asm__ __volatile__(PROBE_ASM(name, ""))
+#define PROBE1(name, v1) __asm__ __volatile__(PROBE_ASM(name, PROBE_ARG(1)) ::PROBE_IN(1, v1))
+#define PROBE2(name, v1, v2) \
+    __asm__ __volatile__(PROBE_ASM(name, PROBE_ARG(1) " " PROBE_ARG(2)) ::PROBE_IN(1, v1), PROBE_IN(2, v2))
+#define PROBE3(name, v1, v2, v3)                                                        \
+    __asm__ __volatile__(PROBE_ASM(name, PROBE_ARG(1) " " PROBE_ARG(2) " " PROBE_ARG(3)) \
+                         ::PROBE_IN(1, v1), PROBE_IN(2, v2), PROBE_IN(3, v3))
+#define PROBE4(name, v1, v2, v3, v4)                                                                       \
+    __asm__ __volatile__(PROBE_ASM(name, PROBE_ARG(1) " " PROBE_ARG(2) " " PROBE_ARG(3) " " PROBE_ARG(4)) \
+                         ::PROBE_IN(1, v1), PROBE_IN(2, v2), PROBE_IN(3, v3), PROBE_IN(4, v4))
+
+#else
+
+#define PROBE_SEMAPHORE(name) __attribute__((unused)) static const unsigned short chat_##name##_semaphore = 0
+#define PROBE_ENABLED(name) 0
+#define PROBE0(name) ((void)0)
+#define PROBE1(name, v1) ((void)0)
+#define PROBE2(name, v1, v2) ((void)0)
+#define PROBE3(name, v1, v2, v3) ((void)0)
+#define PROBE4(name, v1, v2, v3, v4) ((void)0)
+
+#endif
+
+/**
+ * Reads a monotonic timestamp for a latency argument, or returns 0 when
+ * the probe it is for is not being traced
+ *
+ * @param enabled PROBE_ENABLED() of the probe
+ * @return Nanoseconds, or 0
+ */
+static inline uint64_t probe_clock(int enabled)
+{
+    if (!enabled)
+        return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+#endif // PROBES_H
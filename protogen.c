@@ -0,0 +1,612 @@
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * protogen - Generates the wire codec from protocol.schema
+ *
+ * Usage: ./protogen protocol.schema > protocol.h
+ *
+ * The output is a self-contained header of static inline functions, so
+ * both server and client include it without extra link steps.
+ */
+
+#define MAX_MESSAGES 64 // Message definitions per schema
+#define MAX_FIELDS 32   // Fields per message
+#define MAX_TOKEN 64    // Longest identifier or limit expression
+
+/**
+ * Field kind enumeration - Wire representations supported by the schema
+ */
+typedef enum
+{
+    FIELD_U8,
+    FIELD_U16,
+    FIELD_U32,
+    FIELD_U64,
+    FIELD_STR,
+    FIELD_BYTES
+} FieldKind;
+
+/**
+ * Field structure - One field of a message definition
+ */
+typedef struct
+{
+    FieldKind kind;
+    char name[MAX_TOKEN];
+    char max[MAX_TOKEN]; // Length limit expression for str/bytes
+    int tag;             // Tag of an optional field, 0 if required
+} Field;
+
+/**
+ * Message definition structure - One message block of the schema
+ */
+typedef struct
+{
+    char name[MAX_TOKEN];
+    int id;
+    Field fields[MAX_FIELDS];
+    int field_count;
+} MessageDef;
+
+static MessageDef messages[MAX_MESSAGES];
+static int message_count = 0;
+static int schema_version = 1;
+static const char *schema_path;
+static int lineno = 0;
+
+/**
+ * Reports a schema error with its location and exits
+ *
+ * @param format Printf-style format string
+ * @param ... Variable arguments for formatting
+ */
+static void fail(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%s:%d: ", schema_path, lineno);
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(1);
+}
+
+/**
+ * Returns the C type used for an integer field
+ */
+static const char *int_ctype(FieldKind kind)
+{
+    switch (kind)
+    {
+    case FIELD_U8:
+        return "uint8_t";
+    case FIELD_U16:
+        return "uint16_t";
+    case FIELD_U32:
+        return "uint32_t";
+    default:
+        return "uint64_t";
+    }
+}
+
+/**
+ * Returns the encoded width of an integer field, or the length prefix
+ * width of a str/bytes field
+ */
+static int wire_width(FieldKind kind)
+{
+    switch (kind)
+    {
+    case FIELD_U8:
+        return 1;
+    case FIELD_U16:
+    case FIELD_STR:
+        return 2;
+    case FIELD_U32:
+    case FIELD_BYTES:
+        return 4;
+    default:
+        return 8;
+    }
+}
+
+/**
+ * Returns the integer accessor suffix for a field width
+ */
+static const char *width_suffix(int width)
+{
+    return width == 1 ? "u8" : width == 2 ? "u16" : width == 4 ? "u32" : "u64";
+}
+
+/**
+ * Writes a message name in CamelCase (e.g. mention_notice -> MentionNotice)
+ */
+static void print_camel(const char *name)
+{
+    int upper = 1;
+    for (const char *p = name; *p; p++)
+    {
+        if (*p == '_')
+        {
+            upper = 1;
+            continue;
+        }
+        putchar(upper ? toupper((unsigned char)*p) : *p);
+        upper = 0;
+    }
+}
+
+/**
+ * Writes a message name in UPPER_CASE
+ */
+static void print_upper(const char *name)
+{
+    for (const char *p = name; *p; p++)
+        putchar(toupper((unsigned char)*p));
+}
+
+/**
+ * Parses a field type keyword
+ *
+ * @param word Type keyword from the schema
+ * @return The field kind; exits on unknown types
+ */
+static FieldKind parse_kind(const char *word)
+{
+    static const char *names[] = {"u8", "u16", "u32", "u64", "str", "bytes"};
+    for (int i = 0; i < 6; i++)
+    {
+        if (strcmp(word, names[i]) == 0)
+            return (FieldKind)i;
+    }
+    fail("unknown field type '%s'", word);
+    return FIELD_U8;
+}
+
+/**
+ * Reads the schema file into the message table
+ *
+ * @param file Open schema file
+ */
+static void parse_schema(FILE *file)
+{
+    char line[256];
+    MessageDef *current = NULL;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        lineno++;
+        line[strcspn(line, "#\n")] = '\0';
+
+        char words[5][MAX_TOKEN];
+        int count = sscanf(line, "%63s %63s %63s %63s %63s",
+                           words[0], words[1], words[2], words[3], words[4]);
+        if (count <= 0)
+            continue;
+
+        if (strcmp(words[0], "version") == 0 && count == 2 && !current)
+        {
+            schema_version = atoi(words[1]);
+        }
+        else if (strcmp(words[0], "message") == 0 && count == 3 && !current)
+        {
+            if (message_count == MAX_MESSAGES)
+                fail("too many messages");
+            current = &messages[message_count++];
+            strcpy(current->name, words[1]);
+            current->id = atoi(words[2]);
+            if (current->id <= 0 || current->id > 65535)
+                fail("message id must be between 1 and 65535");
+            for (int i = 0; i < message_count - 1; i++)
+            {
+                if (messages[i].id == current->id || strcmp(messages[i].name, current->name) == 0)
+                    fail("duplicate message '%s' or id %d", current->name, current->id);
+            }
+        }
+        else if (strcmp(words[0], "end") == 0 && current)
+        {
+            current = NULL;
+        }
+        else if (current)
+        {
+            if (current->field_count == MAX_FIELDS)
+                fail("too many fields in '%s'", current->name);
+            Field *f = &current->fields[current->field_count++];
+            int w = 0;
+
+            if (strcmp(words[0], "optional") == 0)
+            {
+                if (count < 4)
+                    fail("expected: optional <tag> <type> <name> [max]");
+                f->tag = atoi(words[1]);
+                if (f->tag <= 0 || f->tag > 255)
+                    fail("optional tag must be between 1 and 255");
+                for (int i = 0; i < current->field_count - 1; i++)
+                {
+                    if (current->fields[i].tag == f->tag)
+                        fail("duplicate tag %d", f->tag);
+                }
+                w = 2;
+            }
+            else if (current->field_count > 1 && current->fields[current->field_count - 2].tag)
+            {
+                fail("required fields must precede optional fields");
+            }
+
+            if (count < w + 2)
+                fail("expected: <type> <name> [max]");
+            f->kind = parse_kind(words[w]);
+            strcpy(f->name, words[w + 1]);
+            if (f->kind == FIELD_STR || f->kind == FIELD_BYTES)
+            {
+                if (count < w + 3)
+                    fail("field '%s' needs a length limit", f->name);
+                strcpy(f->max, words[w + 2]);
+            }
+        }
+        else
+        {
+            fail("unexpected '%s'", words[0]);
+        }
+    }
+
+    if (current)
+        fail("message '%s' is missing 'end'", current->name);
+}
+
+/**
+ * Writes the fixed runtime shared by all generated codecs
+ */
+static void emit_prelude(void)
+{
+    printf("/* Generated by protogen from %s - do not edit */\n", schema_path);
+    printf("#ifndef PROTOCOL_H\n#define PROTOCOL_H\n\n");
+    printf("#include \"common.h\"\n#include <stdint.h>\n#include <stddef.h>\n\n");
+    printf("#define PROTO_VERSION %d\n", schema_version);
+    printf("#define PROTO_HEADER_SIZE 12 // u32 length, u16 type, u8 version, u8 flags, u32 request id\n\n");
+    printf("#define PROTO_MAX(a, b) ((a) > (b) ? (a) : (b))\n\n");
+
+    printf("/**\n * String view - Points into a frame buffer, not NUL-terminated\n */\n");
+    printf("typedef struct\n{\n    const char *ptr;\n    uint16_t len;\n} ProtoStr;\n\n");
+    printf("/**\n * Byte view - Points into a frame buffer\n */\n");
+    printf("typedef struct\n{\n    const uint8_t *ptr;\n    uint32_t len;\n} ProtoBytes;\n\n");
+    printf("/**\n * Frame header - Decoded fixed part of every frame\n */\n");
+    printf("typedef struct\n{\n    uint32_t length; // Body length, excluding the header\n"
+           "    uint16_t type;\n    uint8_t version;\n    uint8_t flags;\n"
+           "    uint32_t request_id; // Echoed in responses, 0 for unsolicited frames\n} ProtoHeader;\n\n");
+
+    // Big-endian integer accessors
+    for (int w = 1; w <= 8; w *= 2)
+    {
+        const char *s = width_suffix(w);
+        printf("static inline void proto_put_%s(uint8_t *p, uint%d_t v)\n{\n", s, w * 8);
+        for (int i = 0; i < w; i++)
+            printf("    p[%d] = (uint8_t)(v >> %d);\n", i, (w - 1 - i) * 8);
+        printf("}\n\n");
+        printf("static inline uint%d_t proto_get_%s(const uint8_t *p)\n{\n    return ", w * 8, s);
+        for (int i = 0; i < w; i++)
+            printf("%s(uint%d_t)p[%d] << %d", i ? " | " : "", w * 8, i, (w - 1 - i) * 8);
+        printf(";\n}\n\n");
+    }
+
+    printf("/**\n * Builds a view of a C string, clamped to the u16 length range\n */\n");
+    printf("static inline ProtoStr proto_str(const char *s)\n{\n"
+           "    size_t len = s ? strlen(s) : 0;\n"
+           "    ProtoStr v = {s, (uint16_t)(len > 65535 ? 65535 : len)};\n"
+           "    return v;\n}\n\n");
+    printf("/**\n * Compares a view with a C string\n */\n");
+    printf("static inline int proto_str_eq(ProtoStr v, const char *s)\n{\n"
+           "    return strlen(s) == v.len && memcmp(v.ptr, s, v.len) == 0;\n}\n\n");
+    printf("/**\n * Copies a view into a NUL-terminated buffer, truncating if needed\n */\n");
+    printf("static inline size_t proto_str_copy(char *dst, size_t cap, ProtoStr v)\n{\n"
+           "    size_t n = v.len < cap - 1 ? v.len : cap - 1;\n"
+           "    memcpy(dst, v.ptr, n);\n    dst[n] = '\\0';\n    return n;\n}\n\n");
+
+    printf("static inline void proto_encode_header(uint8_t *out, uint16_t type, uint32_t length)\n{\n"
+           "    proto_put_u32(out, length);\n    proto_put_u16(out + 4, type);\n"
+           "    out[6] = PROTO_VERSION;\n    out[7] = 0;\n    proto_put_u32(out + 8, 0);\n}\n\n");
+    printf("/**\n * Stamps a request id into an encoded frame\n */\n");
+    printf("static inline void proto_set_request_id(uint8_t *frame, uint32_t request_id)\n{\n"
+           "    proto_put_u32(frame + 8, request_id);\n}\n\n");
+    printf("/**\n * Decodes a frame header\n *\n * @return 0 on success, -1 for an unsupported version\n */\n");
+    printf("static inline int proto_decode_header(const uint8_t *in, ProtoHeader *h)\n{\n"
+           "    h->length = proto_get_u32(in);\n    h->type = proto_get_u16(in + 4);\n"
+           "    h->version = in[6];\n    h->flags = in[7];\n    h->request_id = proto_get_u32(in + 8);\n"
+           "    return h->version >= 1 ? 0 : -1;\n}\n\n");
+}
+
+/**
+ * Writes the size expression of a field's encoded form
+ *
+ * @param f Field
+ * @param worst 1 to use the length limit, 0 to use the value in 'm'
+ */
+static void emit_field_size(const Field *f, int worst)
+{
+    int w = wire_width(f->kind);
+    if (f->kind == FIELD_STR || f->kind == FIELD_BYTES)
+    {
+        if (worst)
+            printf("%d + (%s)", w, f->max);
+        else
+            printf("%d + m->%s.len", w, f->name);
+    }
+    else
+    {
+        printf("%d", w);
+    }
+}
+
+/**
+ * Writes the statements encoding one field value at 'p'
+ */
+static void emit_put_value(const Field *f, const char *indent)
+{
+    int w = wire_width(f->kind);
+    if (f->kind == FIELD_STR || f->kind == FIELD_BYTES)
+    {
+        printf("%sproto_put_%s(p, m->%s.len);\n", indent, width_suffix(w), f->name);
+        printf("%sif (m->%s.len)\n%s    memcpy(p + %d, m->%s.ptr, m->%s.len);\n",
+               indent, f->name, indent, w, f->name, f->name);
+        printf("%sp += %d + m->%s.len;\n", indent, w, f->name);
+    }
+    else
+    {
+        printf("%sproto_put_%s(p, m->%s);\n%sp += %d;\n", indent, width_suffix(w), f->name, indent, w);
+    }
+}
+
+/**
+ * Writes the statements decoding one field value from 'p' bounded by 'end'
+ */
+static void emit_get_value(const Field *f, const char *indent)
+{
+    int w = wire_width(f->kind);
+    printf("%sif (end - p < %d)\n%s    return -1;\n", indent, w, indent);
+    if (f->kind == FIELD_STR || f->kind == FIELD_BYTES)
+    {
+        const char *cast = f->kind == FIELD_STR ? "(const char *)" : "";
+        printf("%sm->%s.len = proto_get_%s(p);\n", indent, f->name, width_suffix(w));
+        printf("%sif ((size_t)(end - p - %d) < m->%s.len || m->%s.len > (%s))\n%s    return -1;\n",
+               indent, w, f->name, f->name, f->max, indent);
+        printf("%sm->%s.ptr = %sp + %d;\n", indent, f->name, cast, w);
+        printf("%sp += %d + m->%s.len;\n", indent, w, f->name);
+    }
+    else
+    {
+        printf("%sm->%s = proto_get_%s(p);\n%sp += %d;\n", indent, f->name, width_suffix(w), indent, w);
+    }
+}
+
+/**
+ * Writes the view struct, size limit, encoder and decoder of a message
+ */
+static void emit_message(const MessageDef *msg)
+{
+    // Upper bound of the encoded body
+    printf("#define ");
+    print_upper(msg->name);
+    printf("_MAX_BODY (0");
+    for (int i = 0; i < msg->field_count; i++)
+    {
+        printf(" + ");
+        if (msg->fields[i].tag)
+            printf("3 + ");
+        emit_field_size(&msg->fields[i], 1);
+    }
+    printf(")\n\n");
+
+    // View struct
+    printf("/**\n * %s message (type %d) - Fields view into a frame buffer\n */\n", msg->name, msg->id);
+    printf("typedef struct\n{\n");
+    for (int i = 0; i < msg->field_count; i++)
+    {
+        const Field *f = &msg->fields[i];
+        if (f->kind == FIELD_STR)
+            printf("    ProtoStr %s;\n", f->name);
+        else if (f->kind == FIELD_BYTES)
+            printf("    ProtoBytes %s;\n", f->name);
+        else
+            printf("    %s %s;\n", int_ctype(f->kind), f->name);
+        if (f->tag)
+            printf("    uint8_t has_%s; // Optional field, tag %d\n", f->name, f->tag);
+    }
+    if (msg->field_count == 0)
+        printf("    uint8_t unused;\n");
+    printf("} ");
+    print_camel(msg->name);
+    printf("Msg;\n\n");
+
+    // Encoder
+    printf("/**\n * Encodes a %s frame (header and body)\n *\n"
+           " * @return Frame length, or 0 if a field exceeds its limit or cap is too small\n */\n",
+           msg->name);
+    printf("static inline size_t encode_%s(uint8_t *out, size_t cap, const ", msg->name);
+    print_camel(msg->name);
+    printf("Msg *m)\n{\n    size_t body = 0");
+    for (int i = 0; i < msg->field_count; i++)
+    {
+        const Field *f = &msg->fields[i];
+        if (f->tag)
+        {
+            printf(" + (m->has_%s ? 3 + ", f->name);
+            emit_field_size(f, 0);
+            printf(" : 0)");
+        }
+        else
+        {
+            printf(" + ");
+            emit_field_size(f, 0);
+        }
+    }
+    printf(";\n");
+    for (int i = 0; i < msg->field_count; i++)
+    {
+        const Field *f = &msg->fields[i];
+        if (f->kind == FIELD_STR || f->kind == FIELD_BYTES)
+            printf("    if (m->%s.len > (%s))\n        return 0;\n", f->name, f->max);
+    }
+    printf("    if (cap < PROTO_HEADER_SIZE + body)\n        return 0;\n\n");
+    if (msg->field_count)
+        printf("    uint8_t *p = out + PROTO_HEADER_SIZE;\n");
+    printf("    proto_encode_header(out, %d, (uint32_t)body);\n", msg->id);
+    for (int i = 0; i < msg->field_count; i++)
+    {
+        const Field *f = &msg->fields[i];
+        if (f->tag)
+        {
+            printf("    if (m->has_%s)\n    {\n", f->name);
+            printf("        *p++ = %d;\n        proto_put_u16(p, (uint16_t)(", f->tag);
+            emit_field_size(f, 0);
+            printf("));\n        p += 2;\n");
+            emit_put_value(f, "        ");
+            printf("    }\n");
+        }
+        else
+        {
+            emit_put_value(f, "    ");
+        }
+    }
+    printf("    return PROTO_HEADER_SIZE + body;\n}\n\n");
+
+    // Decoder
+    printf("/**\n * Decodes a %s body into views pointing into 'body'\n *\n"
+           " * Unknown optional tags are skipped without being parsed.\n *\n"
+           " * @return 0 on success, -1 if the body is malformed\n */\n",
+           msg->name);
+    printf("static inline int decode_%s(const uint8_t *body, size_t len, ", msg->name);
+    print_camel(msg->name);
+    printf("Msg *m)\n{\n    const uint8_t *p = body;\n    const uint8_t *end = body + len;\n");
+    printf("    memset(m, 0, sizeof(*m));\n");
+    int has_optional = 0;
+    for (int i = 0; i < msg->field_count; i++)
+    {
+        if (msg->fields[i].tag)
+            has_optional = 1;
+        else
+            emit_get_value(&msg->fields[i], "    ");
+    }
+    printf("\n    // Optional fields: u8 tag, u16 length, value\n");
+    printf("    while (end - p >= 3)\n    {\n");
+    printf("        uint8_t tag = p[0];\n        uint16_t flen = proto_get_u16(p + 1);\n");
+    printf("        p += 3;\n        if (end - p < flen)\n            return -1;\n");
+    if (has_optional)
+    {
+        printf("        const uint8_t *next = p + flen;\n");
+        printf("        const uint8_t *outer_end = end;\n        end = next;\n");
+        printf("        switch (tag)\n        {\n");
+        for (int i = 0; i < msg->field_count; i++)
+        {
+            const Field *f = &msg->fields[i];
+            if (!f->tag)
+                continue;
+            printf("        case %d:\n", f->tag);
+            emit_get_value(f, "            ");
+            printf("            m->has_%s = 1;\n            break;\n", f->name);
+        }
+        printf("        default:\n            break;\n        }\n");
+        printf("        end = outer_end;\n        p = next;\n");
+    }
+    else
+    {
+        printf("        (void)tag;\n        p += flen;\n");
+    }
+    printf("    }\n    return p == end ? 0 : -1;\n}\n\n");
+}
+
+/**
+ * Writes the message type enum and helpers
+ */
+static void emit_types(void)
+{
+    printf("/**\n * Message types: one per schema message, values are the wire ids\n */\n");
+    printf("typedef enum\n{\n");
+    for (int i = 0; i < message_count; i++)
+    {
+        printf("    MSG_");
+        print_upper(messages[i].name);
+        printf(" = %d,\n", messages[i].id);
+    }
+    printf("} MessageType;\n\n");
+
+    printf("/**\n * Returns the schema name of a message type\n */\n");
+    printf("static inline const char *proto_type_name(int type)\n{\n    switch (type)\n    {\n");
+    for (int i = 0; i < message_count; i++)
+    {
+        printf("    case MSG_");
+        print_upper(messages[i].name);
+        printf(":\n        return \"%s\";\n", messages[i].name);
+    }
+    printf("    }\n    return \"unknown\";\n}\n\n");
+}
+
+/**
+ * Writes the largest body any message can have
+ *
+ * The maximum is built up one message at a time in an enum. Nesting
+ * PROTO_MAX() calls in a single macro would instead double the expansion
+ * with every message added to the schema.
+ */
+static void emit_max_body(void)
+{
+    printf("enum\n{\n");
+    for (int i = 0; i < message_count; i++)
+    {
+        printf("    PROTO_MAX_BODY_");
+        print_upper(messages[i].name);
+        printf(" = ");
+        if (i > 0)
+        {
+            printf("PROTO_MAX(PROTO_MAX_BODY_");
+            print_upper(messages[i - 1].name);
+            printf(", ");
+        }
+        print_upper(messages[i].name);
+        printf("_MAX_BODY%s,\n", i > 0 ? ")" : "");
+    }
+    printf("};\n\n#define PROTO_MAX_BODY PROTO_MAX_BODY_");
+    print_upper(messages[message_count - 1].name);
+    printf("\n#define PROTO_MAX_FRAME (PROTO_HEADER_SIZE + PROTO_MAX_BODY)\n\n");
+}
+
+/**
+ * Entry point of the generator
+ *
+ * @param argc Argument count
+ * @param argv Arguments: schema path
+ * @return 0 on success, 1 on schema errors
+ */
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <schema>\n", argv[0]);
+        return 1;
+    }
+
+    schema_path = argv[1];
+    FILE *file = fopen(schema_path, "r");
+    if (!file)
+    {
+        perror(schema_path);
+        return 1;
+    }
+    parse_schema(file);
+    fclose(file);
+
+    if (message_count == 0)
+        fail("no messages defined");
+
+    emit_prelude();
+    emit_types();
+    for (int i = 0; i < message_count; i++)
+        emit_message(&messages[i]);
+    emit_max_body();
+    printf("#endif // PROTOCOL_H\n");
+
+    return 0;
+}
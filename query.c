@@ -0,0 +1,249 @@
+#include "server.h"
+#include "wire.h"
+
+/**
+ * Query job structure - A request waiting for a pool thread
+ *
+ * The body is copied out of the connection's receive buffer so the
+ * connection thread can keep reading chat frames immediately.
+ */
+typedef struct QueryJob
+{
+    struct QueryJob *next;
+    Client requester;                // Session the response goes to
+    uint32_t request_id;             // Id echoed in the response
+    uint16_t type;                   // Request message type
+    uint32_t length;                 // Body length
+    uint8_t body[MAX_INBOUND_BODY];  // Copy of the request body
+} QueryJob;
+
+static QueryJob *queue_head = NULL;
+static QueryJob *queue_tail = NULL;
+static int queue_length = 0;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Sends an encoded response stamped with the job's request id
+ *
+ * @param job The job being answered
+ * @param frame Encoded frame
+ * @param len Frame length, 0 if encoding failed
+ */
+static void reply(const QueryJob *job, uint8_t *frame, size_t len)
+{
+    if (len == 0)
+    {
+        send_error(&job->requester, job->request_id, "Response too large");
+        return;
+    }
+    proto_set_request_id(frame, job->request_id);
+    send_to_client(&job->requester, frame, len);
+}
+
+/**
+ * Answers a roster request with the names of all online users
+ *
+ * Reads session slots through their seqlock, so it never blocks
+ * registration or routing.
+ *
+ * @param job The roster request
+ */
+static void run_roster(const QueryJob *job)
+{
+    uint8_t *frame = malloc(PROTO_HEADER_SIZE + ROSTER_RESPONSE_MAX_BODY);
+    uint8_t *names = malloc(MAX_QUERY_BYTES);
+    if (!frame || !names)
+    {
+        free(frame);
+        free(names);
+        send_error(&job->requester, job->request_id, "Out of memory");
+        return;
+    }
+
+    RosterResponseMsg response = {0};
+    for (int i = 0; i < client_capacity; i++)
+    {
+        SessionSnapshot snap;
+        if (!session_snapshot(&sessions[i], &snap))
+            continue;
+
+        response.count++;
+        size_t len = strlen(snap.username) + 1;
+        if (response.names.len + len <= MAX_QUERY_BYTES)
+        {
+            memcpy(names + response.names.len, snap.username, len);
+            response.names.len += len;
+        }
+    }
+    response.names.ptr = names;
+
+    reply(job, frame, encode_roster_response(frame, PROTO_HEADER_SIZE + ROSTER_RESPONSE_MAX_BODY, &response));
+    free(names);
+    free(frame);
+}
+
+/**
+ * Answers a history request with the recent messages of a conversation
+ *
+ * @param job The history request
+ */
+static void run_history(const QueryJob *job)
+{
+    HistoryRequestMsg request;
+    char peer[MAX_USERNAME];
+
+    if (decode_history_request(job->body, job->length, &request) < 0)
+    {
+        send_error(&job->requester, job->request_id, "Malformed history request");
+        return;
+    }
+    proto_str_copy(peer, sizeof(peer), request.peer);
+
+    size_t len;
+    uint8_t *frame = history_encode(job->requester.username, peer[0] ? peer : NULL, &len);
+    if (!frame)
+    {
+        send_error(&job->requester, job->request_id, "Out of memory");
+        return;
+    }
+    reply(job, frame, len);
+    free(frame);
+}
+
+/**
+ * Answers a mentions request with the room messages that named the user
+ *
+ * @param job The mentions request
+ */
+static void run_mentions(const QueryJob *job)
+{
+    size_t len;
+    uint8_t *frame = mention_encode(job->requester.username, &len);
+    if (!frame)
+    {
+        send_error(&job->requester, job->request_id, "Out of memory");
+        return;
+    }
+    reply(job, frame, len);
+    free(frame);
+}
+
+/**
+ * Runs one job on the calling pool thread
+ *
+ * @param job Job to execute
+ */
+static void run_job(const QueryJob *job)
+{
+    switch (job->type)
+    {
+    case MSG_ROSTER_REQUEST:
+        run_roster(job);
+        break;
+    case MSG_HISTORY_REQUEST:
+        run_history(job);
+        break;
+    case MSG_MENTIONS_REQUEST:
+        run_mentions(job);
+        break;
+    default:
+        send_error(&job->requester, job->request_id, "Unsupported request");
+        break;
+    }
+}
+
+/**
+ * Pool thread - Executes queued queries until the process exits
+ *
+ * @param arg Unused
+ * @return Never returns
+ */
+static void *query_thread(void *arg)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&queue_mutex);
+        while (!queue_head)
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+
+        QueryJob *job = queue_head;
+        queue_head = job->next;
+        if (!queue_head)
+            queue_tail = NULL;
+        queue_length--;
+        pthread_mutex_unlock(&queue_mutex);
+
+        run_job(job);
+        free(job);
+    }
+
+    return NULL;
+}
+
+/**
+ * Queues a request for a pool thread
+ *
+ * Called from the connection thread, which returns to reading frames
+ * right away; the response is sent later and may overtake or trail any
+ * other traffic on the connection.
+ *
+ * @param requester Client that sent the request
+ * @param hdr Header of the request frame
+ * @param body Request body
+ * @return 0 if queued, -1 if the queue is full or the body is too large
+ */
+int query_submit(const Client *requester, const ProtoHeader *hdr, const uint8_t *body)
+{
+    if (hdr->length > MAX_INBOUND_BODY)
+        return -1;
+
+    QueryJob *job = malloc(sizeof(QueryJob));
+    if (!job)
+        return -1;
+    job->next = NULL;
+    job->requester = *requester;
+    job->request_id = hdr->request_id;
+    job->type = hdr->type;
+    job->length = hdr->length;
+    memcpy(job->body, body, hdr->length);
+
+    pthread_mutex_lock(&queue_mutex);
+    if (queue_length >= config_get()->query_queue_max)
+    {
+        pthread_mutex_unlock(&queue_mutex);
+        free(job);
+        return -1;
+    }
+    if (queue_tail)
+        queue_tail->next = job;
+    else
+        queue_head = job;
+    queue_tail = job;
+    queue_length++;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+
+    return 0;
+}
+
+/**
+ * Starts the query pool
+ *
+ * @param threads Number of pool threads
+ * @return 0 on success, -1 if no thread could be created
+ */
+int query_start(int threads)
+{
+    int started = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_t thread_id;
+        if (pthread_create(&thread_id, NULL, query_thread, NULL) == 0)
+        {
+            pthread_detach(thread_id);
+            started++;
+        }
+    }
+    return started > 0 ? 0 : -1;
+}
@@ -0,0 +1,582 @@
+#include "server.h"
+#include "wire.h"
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define REPLICA_HEARTBEAT_MS 100 // Idle interval between heartbeats
+#define REPLICA_RETRY_MS 50      // Delay between standby connection attempts
+#define REPLICA_SEND_TIMEOUT_MS 1000
+
+/**
+ * Shadow session structure - A session of the primary as seen by the standby
+ */
+typedef struct
+{
+    uint64_t id;
+    time_t connected_at;
+    char username[MAX_USERNAME];
+} ShadowSession;
+
+/**
+ * Snapshot buffer structure - Growable buffer of encoded replication frames
+ */
+typedef struct
+{
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+    uint64_t frames;
+    int failed;
+} ReplBuffer;
+
+// Primary side: publishers hold the lock shared, attaching a standby holds
+// it exclusively so its snapshot and the change stream neither overlap nor
+// leave a gap
+static pthread_rwlock_t publish_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static uint8_t *queue;      // Byte ring of frames waiting for the standby
+static size_t queue_cap;
+static size_t queue_head;
+static size_t queue_used;
+static atomic_int attached = 0; // A standby is receiving the change stream
+static int overflowed = 0;  // The standby fell a whole queue behind
+static uint64_t events_queued = 0;
+static int replica_listener = -1;
+static atomic_ulong standby_attaches;
+static atomic_ulong standby_overflows;
+
+// Standby side, written by the follower thread only
+static ShadowSession *shadow = NULL;
+static int shadow_count = 0;
+static int shadow_capacity = 0;
+static pthread_mutex_t shadow_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int following = 0;
+static atomic_ulong events_applied;
+static atomic_ulong primary_events;
+static atomic_long primary_delay_ms;
+
+/**
+ * Returns the wall-clock time in milliseconds
+ */
+static uint64_t now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Appends an encoded frame to the standby queue
+ *
+ * Never blocks: if the standby is a whole queue behind it is marked as
+ * overflowed and detached, and resynchronizes from a fresh snapshot.
+ *
+ * @param frame Encoded frame
+ * @param len Frame length, 0 if encoding failed
+ */
+static void enqueue(const uint8_t *frame, size_t len)
+{
+    if (len == 0)
+        return;
+
+    pthread_mutex_lock(&queue_mutex);
+    if (attached && !overflowed)
+    {
+        if (queue_cap - queue_used < len)
+        {
+            overflowed = 1;
+        }
+        else
+        {
+            size_t tail = (queue_head + queue_used) % queue_cap;
+            size_t first = len < queue_cap - tail ? len : queue_cap - tail;
+            memcpy(queue + tail, frame, first);
+            memcpy(queue, frame + first, len - first);
+            queue_used += len;
+            events_queued++;
+        }
+        pthread_cond_signal(&queue_cond);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+/**
+ * Encodes a history change
+ *
+ * @return Frame length, or 0 on failure
+ */
+static size_t encode_history_change(uint8_t *out, size_t cap, const char *a, const char *b,
+                                    const uint8_t *frame, size_t len)
+{
+    ReplHistoryMsg msg = {
+        .first = proto_str(a ? a : ""),
+        .second = proto_str(b ? b : ""),
+        .frame = {frame, len}};
+    return encode_repl_history(out, cap, &msg);
+}
+
+/**
+ * Records a routed frame in history and ships it to the standby
+ *
+ * @param a Sender username, or NULL for the global room
+ * @param b Recipient username, or NULL for the global room
+ * @param frame Encoded frame as delivered to recipients
+ * @param len Frame length
+ */
+void replica_record(const char *a, const char *b, const uint8_t *frame, size_t len)
+{
+    uint8_t out[PROTO_HEADER_SIZE + REPL_HISTORY_MAX_BODY];
+
+    pthread_rwlock_rdlock(&publish_lock);
+    history_record(a, b, frame, len);
+    if (attached)
+        enqueue(out, encode_history_change(out, sizeof(out), a, b, frame, len));
+    pthread_rwlock_unlock(&publish_lock);
+}
+
+/**
+ * Ships a login or logout to the standby
+ *
+ * Session events are idempotent on the standby, keyed by session id, so
+ * they need not be ordered against the attach snapshot.
+ *
+ * @param online 1 for a login, 0 for a logout
+ * @param id Session id
+ * @param username Username of the session
+ * @param connected_at Login time
+ */
+void replica_session(int online, uint64_t id, const char *username, time_t connected_at)
+{
+    if (!attached)
+        return;
+
+    uint8_t out[PROTO_HEADER_SIZE + REPL_SESSION_MAX_BODY];
+    ReplSessionMsg msg = {
+        .online = online,
+        .session_id = id,
+        .connected_at = connected_at,
+        .username = proto_str(username)};
+    enqueue(out, encode_repl_session(out, sizeof(out), &msg));
+}
+
+/**
+ * Appends a frame to a snapshot buffer, growing it as needed
+ */
+static void buffer_append(ReplBuffer *buf, const uint8_t *frame, size_t len)
+{
+    if (len == 0 || buf->failed)
+        return;
+    if (buf->cap - buf->len < len)
+    {
+        size_t cap = buf->cap ? buf->cap * 2 : 65536;
+        while (cap - buf->len < len)
+            cap *= 2;
+        uint8_t *grown = realloc(buf->data, cap);
+        if (!grown)
+        {
+            buf->failed = 1;
+            return;
+        }
+        buf->data = grown;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, frame, len);
+    buf->len += len;
+    buf->frames++;
+}
+
+/**
+ * History visitor adding one stored frame to a snapshot
+ */
+static void snapshot_history(const char *a, const char *b, const uint8_t *frame, size_t len, void *arg)
+{
+    uint8_t out[PROTO_HEADER_SIZE + REPL_HISTORY_MAX_BODY];
+    buffer_append(arg, out, encode_history_change(out, sizeof(out), a, b, frame, len));
+}
+
+/**
+ * Captures the current state and starts queueing changes for a standby
+ *
+ * Holds publish_lock exclusively only while copying memory, so routing
+ * pauses for the copy but never for the standby's socket.
+ *
+ * @param snapshot Output buffer of encoded frames to send first
+ */
+static void attach_standby(ReplBuffer *snapshot)
+{
+    pthread_rwlock_wrlock(&publish_lock);
+
+    for (int i = 0; i < client_capacity; i++)
+    {
+        SessionSnapshot snap;
+        if (!session_snapshot(&sessions[i], &snap))
+            continue;
+        uint8_t out[PROTO_HEADER_SIZE + REPL_SESSION_MAX_BODY];
+        ReplSessionMsg msg = {
+            .online = 1,
+            .session_id = snap.id,
+            .connected_at = snap.connected_at,
+            .username = proto_str(snap.username)};
+        buffer_append(snapshot, out, encode_repl_session(out, sizeof(out), &msg));
+    }
+    history_foreach(snapshot_history, snapshot);
+
+    pthread_mutex_lock(&queue_mutex);
+    queue_head = queue_used = 0;
+    overflowed = 0;
+    events_queued = snapshot->frames;
+    attached = 1;
+    pthread_mutex_unlock(&queue_mutex);
+
+    pthread_rwlock_unlock(&publish_lock);
+}
+
+/**
+ * Stops queueing changes for the standby
+ */
+static void detach_standby(void)
+{
+    pthread_mutex_lock(&queue_mutex);
+    attached = 0;
+    queue_head = queue_used = 0;
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+/**
+ * Streams queued changes to an attached standby until it goes away
+ *
+ * @param fd Standby connection
+ */
+static void ship_changes(int fd)
+{
+    uint8_t *chunk = malloc(queue_cap);
+    if (!chunk)
+        return;
+
+    while (1)
+    {
+        pthread_mutex_lock(&queue_mutex);
+        if (queue_used == 0 && !overflowed)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += REPLICA_HEARTBEAT_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&queue_cond, &queue_mutex, &deadline);
+        }
+        if (overflowed)
+        {
+            pthread_mutex_unlock(&queue_mutex);
+            atomic_fetch_add(&standby_overflows, 1);
+            format_whiteboard_msg(MSG_TYPE_ERROR, "Standby fell behind, dropping it for a resync");
+            break;
+        }
+
+        // Take everything queued, in at most two pieces of the ring
+        size_t len = queue_used;
+        size_t first = len < queue_cap - queue_head ? len : queue_cap - queue_head;
+        memcpy(chunk, queue + queue_head, first);
+        memcpy(chunk + first, queue, len - first);
+        queue_head = (queue_head + len) % queue_cap;
+        queue_used = 0;
+        uint64_t events = events_queued;
+        pthread_mutex_unlock(&queue_mutex);
+
+        if (len == 0)
+        {
+            uint8_t beat[PROTO_HEADER_SIZE + REPL_HEARTBEAT_MAX_BODY];
+            ReplHeartbeatMsg msg = {.sent_ms = now_ms(), .events = events};
+            len = encode_repl_heartbeat(beat, sizeof(beat), &msg);
+            memcpy(chunk, beat, len);
+        }
+        size_t sent = send_all(fd, chunk, len);
+        if (sent < len)
+            break;
+    }
+    free(chunk);
+}
+
+/**
+ * Replication thread - Serves one standby at a time
+ *
+ * @param arg Unused
+ * @return Never returns
+ */
+static void *replica_thread(void *arg)
+{
+    while (1)
+    {
+        int fd = accept(replica_listener, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        struct timeval tv = {REPLICA_SEND_TIMEOUT_MS / 1000, (REPLICA_SEND_TIMEOUT_MS % 1000) * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        ReplBuffer snapshot = {0};
+        attach_standby(&snapshot);
+        atomic_fetch_add(&standby_attaches, 1);
+        format_whiteboard_msg(MSG_TYPE_ADMIN, "Standby attached, sending %llu snapshot frames",
+                              (unsigned long long)snapshot.frames);
+
+        // send_all() returns a short count when the standby fails or stalls
+        if (!snapshot.failed)
+        {
+            size_t sent = send_all(fd, snapshot.data, snapshot.len);
+            if (sent == snapshot.len)
+                ship_changes(fd);
+        }
+        free(snapshot.data);
+
+        detach_standby();
+        close(fd);
+        format_whiteboard_msg(MSG_TYPE_ADMIN, "Standby detached");
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts serving the change stream on a local socket
+ *
+ * @param path Replication socket path
+ * @param queue_kb Size of the standby queue in KiB
+ * @return 0 on success, -1 on failure
+ */
+int replica_start(const char *path, int queue_kb)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    queue_cap = (size_t)queue_kb * 1024;
+    queue = malloc(queue_cap);
+    if (!queue)
+        return -1;
+
+    replica_listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (replica_listener < 0)
+        return -1;
+    // Restrict the socket before listen() so no other user can attach as a
+    // standby; connect() is refused until then. The umask is left alone
+    unlink(path);
+    if (bind(replica_listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(path, 0600) < 0 || listen(replica_listener, 1) < 0)
+    {
+        close(replica_listener);
+        replica_listener = -1;
+        return -1;
+    }
+
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, replica_thread, NULL) != 0)
+        return -1;
+    pthread_detach(thread_id);
+    return 0;
+}
+
+/**
+ * Applies a session change to the shadow registry
+ */
+static void apply_session(const ReplSessionMsg *msg)
+{
+    pthread_mutex_lock(&shadow_mutex);
+    int found = -1;
+    for (int i = 0; i < shadow_count && found < 0; i++)
+    {
+        if (shadow[i].id == msg->session_id)
+            found = i;
+    }
+
+    if (!msg->online)
+    {
+        if (found >= 0)
+            shadow[found] = shadow[--shadow_count];
+    }
+    else if (found < 0)
+    {
+        if (shadow_count == shadow_capacity)
+        {
+            int capacity = shadow_capacity ? shadow_capacity * 2 : 64;
+            ShadowSession *grown = realloc(shadow, capacity * sizeof(ShadowSession));
+            if (grown)
+            {
+                shadow = grown;
+                shadow_capacity = capacity;
+            }
+        }
+        if (shadow_count < shadow_capacity)
+        {
+            ShadowSession *s = &shadow[shadow_count++];
+            s->id = msg->session_id;
+            s->connected_at = msg->connected_at;
+            proto_str_copy(s->username, sizeof(s->username), msg->username);
+        }
+    }
+    pthread_mutex_unlock(&shadow_mutex);
+}
+
+/**
+ * Applies one replication frame to the local state
+ *
+ * @return 0 on success, -1 if the frame is malformed
+ */
+static int apply_change(const ProtoHeader *hdr, const uint8_t *body)
+{
+    switch (hdr->type)
+    {
+    case MSG_REPL_SESSION:
+    {
+        ReplSessionMsg msg;
+        if (decode_repl_session(body, hdr->length, &msg) < 0)
+            return -1;
+        apply_session(&msg);
+        break;
+    }
+    case MSG_REPL_HISTORY:
+    {
+        ReplHistoryMsg msg;
+        char first[MAX_USERNAME], second[MAX_USERNAME];
+        if (decode_repl_history(body, hdr->length, &msg) < 0)
+            return -1;
+        proto_str_copy(first, sizeof(first), msg.first);
+        proto_str_copy(second, sizeof(second), msg.second);
+        history_record(first[0] ? first : NULL, second[0] ? second : NULL, msg.frame.ptr, msg.frame.len);
+        break;
+    }
+    case MSG_REPL_HEARTBEAT:
+    {
+        ReplHeartbeatMsg msg;
+        if (decode_repl_heartbeat(body, hdr->length, &msg) < 0)
+            return -1;
+        atomic_store(&primary_events, msg.events);
+        atomic_store(&primary_delay_ms, (long)(now_ms() - msg.sent_ms));
+        return 0; // Heartbeats are not counted as events
+    }
+    default:
+        return -1;
+    }
+
+    atomic_fetch_add(&events_applied, 1);
+    return 0;
+}
+
+/**
+ * Follows a primary's change stream until the primary is lost
+ *
+ * Reconnects while the primary is restarting and returns once no
+ * primary has been reachable for takeover_ms, or an attached stream
+ * stayed silent that long. The caller then tries to take over the port.
+ *
+ * @param path Replication socket of the primary
+ * @param takeover_ms Time without a primary before taking over
+ */
+void replica_follow(const char *path, int takeover_ms)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    // Sized for the largest change a primary sends, a history record
+    uint8_t frame[PROTO_HEADER_SIZE + PROTO_MAX(REPL_HISTORY_MAX_BODY, REPL_SESSION_MAX_BODY)];
+    ProtoHeader hdr;
+    uint64_t lost_at = now_ms();
+
+    atomic_store(&following, 1);
+    while (now_ms() - lost_at < (uint64_t)takeover_ms)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            if (fd >= 0)
+                close(fd);
+            usleep(REPLICA_RETRY_MS * 1000);
+            continue;
+        }
+
+        // A silent primary is as good as a dead one
+        struct timeval tv = {takeover_ms / 1000, (takeover_ms % 1000) * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        int fresh = 1;
+        while (recv_frame(fd, frame, sizeof(frame), &hdr) >= 0)
+        {
+            // A new snapshot replaces what was applied before, but only once
+            // the primary proves alive: a dying one may still accept
+            if (fresh)
+            {
+                pthread_mutex_lock(&shadow_mutex);
+                shadow_count = 0;
+                pthread_mutex_unlock(&shadow_mutex);
+                history_clear();
+                atomic_store(&events_applied, 0);
+                format_whiteboard_msg(MSG_TYPE_ADMIN, "Following primary at %s", path);
+                fresh = 0;
+            }
+            if (apply_change(&hdr, frame + PROTO_HEADER_SIZE) < 0)
+            {
+                format_whiteboard_msg(MSG_TYPE_ERROR, "Malformed replication frame type %u", hdr.type);
+                break;
+            }
+        }
+        close(fd);
+        if (!fresh)
+        {
+            lost_at = now_ms();
+            format_whiteboard_msg(MSG_TYPE_ERROR, "Lost primary after %lu events",
+                                  atomic_load(&events_applied));
+        }
+    }
+    atomic_store(&following, 0);
+}
+
+/**
+ * Drops the shadow registry once this process serves clients itself
+ *
+ * Sessions of the old primary died with it; their users reconnect here.
+ */
+void replica_promote(void)
+{
+    pthread_mutex_lock(&shadow_mutex);
+    shadow_count = 0;
+    pthread_mutex_unlock(&shadow_mutex);
+}
+
+/**
+ * Writes the replication state to an admin connection
+ *
+ * @param fd Connection to write to
+ */
+void replica_report(int fd)
+{
+    if (atomic_load(&following))
+    {
+        dprintf(fd, "role standby\n");
+        dprintf(fd, "events_applied %lu primary_events %lu delay_ms %ld\n",
+                atomic_load(&events_applied), atomic_load(&primary_events), atomic_load(&primary_delay_ms));
+        pthread_mutex_lock(&shadow_mutex);
+        dprintf(fd, "primary sessions %d\n", shadow_count);
+        for (int i = 0; i < shadow_count; i++)
+            dprintf(fd, "  %-6llu %s\n", (unsigned long long)shadow[i].id, shadow[i].username);
+        pthread_mutex_unlock(&shadow_mutex);
+        return;
+    }
+
+    pthread_mutex_lock(&queue_mutex);
+    int is_attached = attached;
+    size_t used = queue_used;
+    uint64_t events = events_queued;
+    pthread_mutex_unlock(&queue_mutex);
+
+    dprintf(fd, "role primary\n");
+    dprintf(fd, "standby %s attaches %lu overflows %lu\n", is_attached ? "attached" : "none",
+            atomic_load(&standby_attaches), atomic_load(&standby_overflows));
+    if (is_attached)
+        dprintf(fd, "events %llu queued_bytes %zu of %zu\n", (unsigned long long)events, used, queue_cap);
+}
@@ -0,0 +1,489 @@
+#include "common.h"
+#include "wire.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define BENCH_ROUNDS 5            // Broadcasts timed at each step
+#define BENCH_LOGIN_TIMEOUT_MS 10000
+#define BENCH_ROUND_TIMEOUT_MS 5000
+#define BENCH_SETTLE_MS 500       // Quiet time before memory is read
+#define BENCH_CONFIG "/tmp/scalebench.conf"
+
+/**
+ * Connection structure - One simulated idle user
+ *
+ * Incoming data is parsed only far enough to find frame boundaries and
+ * types, so a connection costs a few dozen bytes here however much the
+ * server sends it.
+ */
+typedef struct
+{
+    int fd;
+    uint8_t header[PROTO_HEADER_SIZE]; // Header of the frame being read
+    int header_len;                    // Header bytes received so far
+    uint32_t skip;                     // Body bytes of the current frame still to discard
+    uint64_t started_ns;               // When the connection was opened
+    uint64_t login_ns;                 // When the first frame arrived, 0 before
+    int round;                         // Last broadcast round received
+} Conn;
+
+static Conn *conns;
+static int conn_count = 0;
+static int epoll_fd = -1;
+static int server_port = 9777;
+static int reactor_threads = 0;        // Passed to the server, 0 = thread per connection
+static int connect_port = 0;           // Users connect here instead, e.g. through faultproxy; 0 = server_port
+static int broadcast_round = 0;        // Round currently being timed
+static uint64_t broadcast_sent_ns;
+static uint64_t *samples;              // Latencies collected in the current phase
+static int sample_count = 0;
+static int sample_cap = 0;
+
+/**
+ * Returns a monotonic timestamp in nanoseconds
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Adds a latency sample to the current phase
+ */
+static void add_sample(uint64_t ns)
+{
+    if (sample_count == sample_cap)
+    {
+        sample_cap = sample_cap ? sample_cap * 2 : 1024;
+        samples = realloc(samples, sample_cap * sizeof(uint64_t));
+        if (!samples)
+        {
+            fprintf(stderr, "scalebench: out of memory\n");
+            exit(1);
+        }
+    }
+    samples[sample_count++] = ns;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Returns a percentile of the current samples in microseconds
+ *
+ * Sorts the samples; call after the phase is complete.
+ */
+static double percentile_us(double p)
+{
+    if (sample_count == 0)
+        return 0;
+    qsort(samples, sample_count, sizeof(uint64_t), compare_u64);
+    int index = (int)(p / 100 * (sample_count - 1) + 0.5);
+    return samples[index] / 1000.0;
+}
+
+/**
+ * Consumes a frame header, recording logins and broadcast arrivals
+ */
+static void on_frame(Conn *c, uint64_t now)
+{
+    ProtoHeader hdr;
+    proto_decode_header(c->header, &hdr);
+    c->skip = hdr.length;
+
+    if (!c->login_ns)
+    {
+        c->login_ns = now;
+        add_sample(now - c->started_ns);
+    }
+    else if (hdr.type == MSG_BROADCAST && broadcast_round && c->round != broadcast_round)
+    {
+        c->round = broadcast_round;
+        add_sample(now - broadcast_sent_ns);
+    }
+}
+
+/**
+ * Reads and discards everything pending on a connection
+ *
+ * @return 0 while the connection is open, -1 once the server closed it
+ */
+static int drain(Conn *c)
+{
+    uint8_t buf[65536];
+    while (1)
+    {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+            return -1;
+        if (n < 0)
+            return 0;
+
+        uint64_t now = now_ns();
+        for (ssize_t pos = 0; pos < n;)
+        {
+            if (c->skip)
+            {
+                size_t take = (size_t)(n - pos) < c->skip ? (size_t)(n - pos) : c->skip;
+                c->skip -= take;
+                pos += take;
+                continue;
+            }
+            size_t take = PROTO_HEADER_SIZE - c->header_len;
+            if ((size_t)(n - pos) < take)
+                take = n - pos;
+            memcpy(c->header + c->header_len, buf + pos, take);
+            c->header_len += take;
+            pos += take;
+            if (c->header_len == PROTO_HEADER_SIZE)
+            {
+                c->header_len = 0;
+                on_frame(c, now);
+            }
+        }
+    }
+}
+
+/**
+ * Services readable connections for up to timeout_ms
+ *
+ * @return Number of connections the server closed
+ */
+static int pump(int timeout_ms)
+{
+    struct epoll_event events[256];
+    int closed = 0;
+    int n = epoll_wait(epoll_fd, events, 256, timeout_ms);
+    for (int i = 0; i < n; i++)
+    {
+        Conn *c = &conns[events[i].data.u32];
+        if (drain(c) < 0)
+        {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+            close(c->fd);
+            c->fd = -1;
+            closed++;
+        }
+    }
+    return closed;
+}
+
+/**
+ * Opens one connection and sends its login
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int open_conn(void)
+{
+    Conn *c = &conns[conn_count];
+    memset(c, 0, sizeof(*c));
+    c->started_ns = now_ns();
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0)
+        return -1;
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(connect_port ? connect_port : server_port)};
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(c->fd);
+        return -1;
+    }
+
+    char name[MAX_USERNAME];
+    snprintf(name, sizeof(name), "bench%d", conn_count);
+    uint8_t frame[PROTO_HEADER_SIZE + LOGIN_MAX_BODY];
+    LoginMsg login = {.username = proto_str(name)};
+    size_t len = encode_login(frame, sizeof(frame), &login);
+    if (send_all(c->fd, frame, len) != len)
+    {
+        close(c->fd);
+        return -1;
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = conn_count};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+    conn_count++;
+    return 0;
+}
+
+/**
+ * Reads resident memory and thread count of a process
+ */
+static void read_status(pid_t pid, long *rss_kb, int *threads)
+{
+    char path[64];
+    char line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    *rss_kb = 0;
+    *threads = 0;
+
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return;
+    while (fgets(line, sizeof(line), f))
+    {
+        sscanf(line, "VmRSS: %ld", rss_kb);
+        sscanf(line, "Threads: %d", threads);
+    }
+    fclose(f);
+}
+
+/**
+ * Starts the server under test with a config sized for the run
+ *
+ * Load shedding and flood limits are off so every step measures the same
+ * work.
+ *
+ * @param binary Server executable
+ * @param max Largest number of connections the run will open
+ * @return Server pid, or -1 on failure
+ */
+static pid_t start_server(const char *binary, int max)
+{
+    FILE *f = fopen(BENCH_CONFIG, "w");
+    if (!f)
+        return -1;
+    fprintf(f, "port = %d\nmax_clients = %d\nlisten_backlog = 1024\n", server_port, max + 1);
+    fprintf(f, "admin_socket = /tmp/scalebench-%d.sock\n", server_port);
+    fprintf(f, "overload_lag_ms = 0\noverload_queue_kb = 0\nlog_level = error\n");
+    fprintf(f, "reactor_threads = %d\n", reactor_threads);
+    fclose(f);
+
+    char port[16];
+    snprintf(port, sizeof(port), "%d", server_port);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execl(binary, binary, port, "-c", BENCH_CONFIG, (char *)NULL);
+        _exit(127);
+    }
+    if (pid < 0)
+        return -1;
+
+    // Wait for the listener
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(server_port)};
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    for (int i = 0; i < 100; i++)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int ok = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        close(fd);
+        if (ok)
+            return pid;
+        usleep(50000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+/**
+ * Opens connections until count are open and waits for their logins
+ *
+ * @return 0 on success, -1 if a connection failed or logins timed out
+ */
+static int ramp_to(int count)
+{
+    sample_count = 0;
+    int first = conn_count;
+    while (conn_count < count)
+    {
+        if (open_conn() < 0)
+        {
+            fprintf(stderr, "scalebench: connection %d failed: %s\n", conn_count, strerror(errno));
+            return -1;
+        }
+        // Keep up with join notices so no socket backs up
+        if (conn_count % 32 == 0)
+            pump(0);
+    }
+
+    uint64_t deadline = now_ns() + BENCH_LOGIN_TIMEOUT_MS * 1000000ULL;
+    while (sample_count < conn_count - first && now_ns() < deadline)
+    {
+        if (pump(100) > 0)
+        {
+            fprintf(stderr, "scalebench: server closed connections during login\n");
+            return -1;
+        }
+    }
+    if (sample_count < conn_count - first)
+    {
+        fprintf(stderr, "scalebench: only %d of %d logins completed\n", sample_count, conn_count - first);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Sends room messages from the first connection and times their arrival
+ * at every other connection
+ */
+static void time_broadcasts(void)
+{
+    sample_count = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+    {
+        int expected = sample_count + conn_count - 1;
+        broadcast_round++;
+
+        uint8_t frame[PROTO_HEADER_SIZE + BROADCAST_MAX_BODY];
+        BroadcastMsg msg = {.content = proto_str("scalebench")};
+        size_t len = encode_broadcast(frame, sizeof(frame), &msg);
+        broadcast_sent_ns = now_ns();
+        send_all(conns[0].fd, frame, len);
+
+        uint64_t deadline = broadcast_sent_ns + BENCH_ROUND_TIMEOUT_MS * 1000000ULL;
+        while (sample_count < expected && now_ns() < deadline)
+            pump(100);
+    }
+    broadcast_round = 0;
+}
+
+/**
+ * Entry point of the connection-scaling benchmark
+ *
+ * Starts ./server, then ramps idle connections in steps. After each step
+ * it records server memory and threads, login latency of the step's new
+ * connections and room message latency to every connection, as one CSV
+ * row.
+ *
+ * @param argc Argument count
+ * @param argv [-m max] [-s step] [-p port] [-o file.csv] [-S server] [-r reactors]
+ *             [-P connect_port]
+ * @return 0 on success, 1 on failure
+ */
+int main(int argc, char *argv[])
+{
+    int max = 1000;
+    int step = 100;
+    const char *out_path = "bench.csv";
+    const char *binary = "./server";
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+            max = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            step = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            server_port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            out_path = argv[++i];
+        else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+            binary = argv[++i];
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            reactor_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc)
+            connect_port = atoi(argv[++i]);
+        else
+        {
+            printf("Usage: %s [-m max] [-s step] [-p port] [-o file.csv] [-S server] [-r reactors] [-P connect_port]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (max < 1 || max > 65535 || step < 1 || server_port <= 0 || server_port > 65535 || reactor_threads < 0 ||
+        connect_port < 0 || connect_port > 65535)
+    {
+        fprintf(stderr, "scalebench: invalid max, step, port or reactor count\n");
+        return 1;
+    }
+
+    // Both processes need a descriptor per connection
+    struct rlimit files;
+    getrlimit(RLIMIT_NOFILE, &files);
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+    if (files.rlim_cur < (rlim_t)max + 64)
+    {
+        fprintf(stderr, "scalebench: open file limit %lu is too low for %d connections\n",
+                (unsigned long)files.rlim_cur, max);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    conns = calloc(max + 1, sizeof(Conn));
+    epoll_fd = epoll_create1(0);
+    FILE *out = fopen(out_path, "w");
+    if (!conns || epoll_fd < 0 || !out)
+    {
+        fprintf(stderr, "scalebench: setup failed: %s\n", strerror(errno));
+        return 1;
+    }
+
+    pid_t pid = start_server(binary, max);
+    if (pid < 0)
+    {
+        fprintf(stderr, "scalebench: could not start %s on port %d\n", binary, server_port);
+        return 1;
+    }
+
+    // The sender of the timed room messages is not counted as idle
+    long base_rss;
+    int base_threads;
+    int status = 0;
+    if (ramp_to(1) < 0)
+        status = 1;
+    usleep(BENCH_SETTLE_MS * 1000);
+    read_status(pid, &base_rss, &base_threads);
+
+    fprintf(out, "connections,rss_kb,kb_per_connection,threads,login_p50_us,login_p99_us,"
+                 "broadcast_p50_us,broadcast_p99_us,broadcast_max_us\n");
+    printf("%11s %10s %8s %8s %10s %10s %10s %10s\n", "connections", "rss_kb", "kb/conn", "threads",
+           "login_p50", "login_p99", "bcast_p50", "bcast_max");
+
+    int target = 0;
+    while (status == 0 && target < max)
+    {
+        target = target + step < max ? target + step : max;
+        if (ramp_to(target + 1) < 0)
+        {
+            status = 1;
+            break;
+        }
+        double login_p50 = percentile_us(50);
+        double login_p99 = percentile_us(99);
+
+        uint64_t settle = now_ns() + BENCH_SETTLE_MS * 1000000ULL;
+        while (now_ns() < settle)
+            pump(50);
+        long rss;
+        int threads;
+        read_status(pid, &rss, &threads);
+
+        time_broadcasts();
+        double bcast_p50 = percentile_us(50);
+        double bcast_p99 = percentile_us(99);
+        double bcast_max = percentile_us(100);
+
+        double per_conn = (double)(rss - base_rss) / target;
+        fprintf(out, "%d,%ld,%.2f,%d,%.1f,%.1f,%.1f,%.1f,%.1f\n", target, rss, per_conn, threads,
+                login_p50, login_p99, bcast_p50, bcast_p99, bcast_max);
+        fflush(out);
+        printf("%11d %10ld %8.2f %8d %10.1f %10.1f %10.1f %10.1f\n", target, rss, per_conn, threads,
+               login_p50, login_p99, bcast_p50, bcast_max);
+    }
+
+    fclose(out);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(BENCH_CONFIG);
+    if (status == 0)
+        printf("Results written to %s\n", out_path);
+    return status;
+}
@@ -1,48 +1,37 @@
-#include "common.h"
-#include <time.h>
+#include "server.h"
+#include "probes.h"
+#include "wire.h"
+#include <errno.h>
 #include <stdarg.h>
-
-void update_whiteboard(const char *message);
-
-/**
- * Client structure - Represents a connected client
- * Contains socket descriptor and username
- */
-typedef struct
-{
-    int socket;                  // Socket file descriptor for client connection
-    char username[MAX_USERNAME]; // Client's username
-} Client;
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 
 // Client list with mutex protection
-Client clients[MAX_CLIENTS];
+Client *clients;
 pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
 int client_count = 0;
 
-/**
- * Whiteboard structure - Implements a circular buffer for storing messages
- * to display in the server console
- */
-typedef struct
-{
-    char messages[WHITEBOARD_SIZE][MAX_USERNAME + MAX_MESSAGE + 50]; // Array of messages
-    int current_index;                                               // Current position in the circular buffer
-} Whiteboard;
+// Stable session slots, readable without clients_mutex
+Session *sessions;
+int client_capacity = 0;
+atomic_ulong next_session_id = 1;
 
-Whiteboard whiteboard = {{0}, 0};
+Whiteboard whiteboard = {NULL, 0, 0};
 pthread_mutex_t whiteboard_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-/**
- * Message type enumeration - Defines types of server messages
- */
-typedef enum
-{
-    MSG_TYPE_BROADCAST,
-    MSG_TYPE_PRIVATE,
-    MSG_TYPE_LOGIN,
-    MSG_TYPE_LOGOUT,
-    MSG_TYPE_ERROR
-} ServerMsgType;
+// Minimum level of whiteboard entries, adjustable through the admin socket
+atomic_int log_level = LOG_INFO;
+
+// USDT probe semaphores, raised by tracers attached to the probe
+PROBE_SEMAPHORE(accept);
+PROBE_SEMAPHORE(login);
+PROBE_SEMAPHORE(frame_receive);
+PROBE_SEMAPHORE(find_client);
+PROBE_SEMAPHORE(private_route);
+PROBE_SEMAPHORE(broadcast_fanout);
+PROBE_SEMAPHORE(send_done);
+PROBE_SEMAPHORE(disconnect);
 
 /**
  * Returns the appropriate ANSI color and type string for a message type
@@ -70,12 +59,56 @@ const char *get_msg_properties(ServerMsgType type, const char **type_str)
     case MSG_TYPE_ERROR:
         *type_str = "ERROR";
         return ANSI_RED;
+    case MSG_TYPE_ADMIN:
+        *type_str = "ADMIN";
+        return ANSI_CYAN;
+    case MSG_TYPE_DEBUG:
+        *type_str = "DEBUG";
+        return ANSI_WHITE;
     default:
         *type_str = "INFO";
         return ANSI_WHITE;
     }
 }
 
+/**
+ * Returns the printable name of a log level
+ *
+ * @param level The log level
+ * @return Lowercase level name
+ */
+const char *log_level_name(LogLevel level)
+{
+    switch (level)
+    {
+    case LOG_DEBUG:
+        return "debug";
+    case LOG_INFO:
+        return "info";
+    case LOG_WARN:
+        return "warn";
+    case LOG_ERROR:
+        return "error";
+    }
+    return "unknown";
+}
+
+/**
+ * Parses a log level name
+ *
+ * @param name Level name (debug, info, warn or error)
+ * @return The LogLevel value, or -1 if the name is not recognized
+ */
+int parse_log_level(const char *name)
+{
+    for (int level = LOG_DEBUG; level <= LOG_ERROR; level++)
+    {
+        if (strcmp(name, log_level_name(level)) == 0)
+            return level;
+    }
+    return -1;
+}
+
 /**
  * Formats a message and adds it to the whiteboard
  *
@@ -85,6 +118,12 @@ const char *get_msg_properties(ServerMsgType type, const char **type_str)
  */
 void format_whiteboard_msg(ServerMsgType type, const char *format, ...)
 {
+    // Drop entries below the current log level before formatting
+    LogLevel level = type == MSG_TYPE_ERROR ? LOG_ERROR : type == MSG_TYPE_DEBUG ? LOG_DEBUG
+                                                                                 : LOG_INFO;
+    if (level < atomic_load_explicit(&log_level, memory_order_relaxed))
+        return;
+
     char message[MAX_USERNAME + MAX_MESSAGE + 50];
     va_list args;
     va_start(args, format);
@@ -118,7 +157,7 @@ void update_whiteboard(const char *message)
     // Add message to circular buffer
     strncpy(whiteboard.messages[whiteboard.current_index], message,
             sizeof(whiteboard.messages[0]) - 1);
-    whiteboard.current_index = (whiteboard.current_index + 1) % WHITEBOARD_SIZE;
+    whiteboard.current_index = (whiteboard.current_index + 1) % whiteboard.capacity;
 
     // Clear screen and show header
     printf("\033[2J\033[H");
@@ -128,12 +167,14 @@ void update_whiteboard(const char *message)
     pthread_mutex_lock(&clients_mutex);
     int active = client_count;
     pthread_mutex_unlock(&clients_mutex);
-    printf("Active clients: %s%d/%d%s\n\n", ANSI_GREEN, active, MAX_CLIENTS, ANSI_RESET);
+    const Config *cfg = config_get();
+    printf("Active clients: %s%d/%d%s\n\n", ANSI_GREEN, active, cfg->max_clients, ANSI_RESET);
 
-    // Display messages
-    for (int i = 0; i < WHITEBOARD_SIZE; i++)
+    // Display the most recent messages, up to the configured view size
+    int shown = cfg->whiteboard_size < whiteboard.capacity ? cfg->whiteboard_size : whiteboard.capacity;
+    for (int i = whiteboard.capacity - shown; i < whiteboard.capacity; i++)
     {
-        int idx = (whiteboard.current_index + i) % WHITEBOARD_SIZE;
+        int idx = (whiteboard.current_index + i) % whiteboard.capacity;
         if (whiteboard.messages[idx][0])
             printf("%s\n", whiteboard.messages[idx]);
     }
@@ -142,16 +183,249 @@ void update_whiteboard(const char *message)
     pthread_mutex_unlock(&whiteboard_mutex);
 }
 
+/**
+ * Claims a free session slot and publishes its identity
+ *
+ * Must be called with clients_mutex held, which serializes writers;
+ * readers use the seqlock in session_snapshot() instead.
+ *
+ * @param client The new client; its socket, stream and username are copied
+ * @return Pointer to the claimed slot, or NULL if all slots are taken
+ */
+Session *session_acquire(const Client *client)
+{
+    for (int i = 0; i < client_capacity; i++)
+    {
+        Session *s = &sessions[i];
+        if (s->in_use)
+            continue;
+
+        atomic_fetch_add_explicit(&s->seq, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        s->in_use = 1;
+        s->socket = client->socket;
+        s->stream = client->stream;
+        s->link = client->link;
+        s->id = atomic_fetch_add(&next_session_id, 1);
+        strncpy(s->username, client->username, MAX_USERNAME - 1);
+        s->username[MAX_USERNAME - 1] = '\0';
+        s->connected_at = time(NULL);
+        atomic_store_explicit(&s->frames_in, 0, memory_order_relaxed);
+        atomic_store_explicit(&s->frames_out, 0, memory_order_relaxed);
+        atomic_store_explicit(&s->bytes_in, 0, memory_order_relaxed);
+        atomic_store_explicit(&s->bytes_out, 0, memory_order_relaxed);
+        atomic_store_explicit(&s->cpu_ns, 0, memory_order_relaxed);
+        atomic_store_explicit(&s->drops, 0, memory_order_relaxed);
+        atomic_store_explicit(&s->outq_peak, 0, memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->seq, 1, memory_order_release);
+        return s;
+    }
+    return NULL;
+}
+
+/**
+ * Returns a session slot to the free pool
+ *
+ * Must be called with clients_mutex held.
+ *
+ * @param s The slot to release
+ */
+void session_release(Session *s)
+{
+    atomic_fetch_add_explicit(&s->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    s->in_use = 0;
+    s->socket = -1;
+    s->stream = 0;
+    s->link = NULL;
+    atomic_fetch_add_explicit(&s->seq, 1, memory_order_release);
+}
+
+/**
+ * Copies a session's identity fields without taking clients_mutex
+ *
+ * Retries while a writer is updating the slot so the copy is consistent.
+ *
+ * @param session The slot to read
+ * @param out Destination for the snapshot
+ * @return 1 if the slot holds a live session, 0 otherwise
+ */
+int session_snapshot(Session *session, SessionSnapshot *out)
+{
+    unsigned start;
+    do
+    {
+        start = atomic_load_explicit(&session->seq, memory_order_acquire);
+        if (start & 1)
+            continue;
+        out->in_use = session->in_use;
+        out->socket = session->socket;
+        out->link = session->link;
+        out->id = session->id;
+        memcpy(out->username, session->username, MAX_USERNAME);
+        out->connected_at = session->connected_at;
+        atomic_thread_fence(memory_order_acquire);
+    } while ((start & 1) || atomic_load_explicit(&session->seq, memory_order_relaxed) != start);
+
+    out->username[MAX_USERNAME - 1] = '\0';
+    return out->in_use;
+}
+
+/**
+ * Reads the bytes waiting in a direct session's kernel send buffer
+ *
+ * Takes no lock, so callers that must not block can use it. A slot's
+ * socket is only closed after the slot is released, so the session id is
+ * checked again after the ioctl: if it still matches, the descriptor was
+ * not yet reused by another connection. The session's high-water mark is
+ * raised on the way.
+ *
+ * @param session The slot the snapshot was taken from
+ * @param snap Live snapshot of the slot
+ * @return Bytes queued, or -1 for a gateway session or one that went away
+ */
+int session_outq(Session *session, const SessionSnapshot *snap)
+{
+    int outq;
+    SessionSnapshot check;
+    if (snap->link || ioctl(snap->socket, SIOCOUTQ, &outq) < 0)
+        return -1;
+    if (!session_snapshot(session, &check) || check.id != snap->id)
+        return -1;
+    counter_max(&session->outq_peak, outq);
+    return outq;
+}
+
+/**
+ * Sends an encoded frame to a session
+ *
+ * The session's send lock keeps frames from different threads from
+ * interleaving, and the id check stops a frame from reaching a newer
+ * session that reused the slot. If the send timeout expires part-way
+ * through a frame the stream can no longer be parsed, so the session
+ * is shut down; a frame that could not be started is simply dropped.
+ * Sessions behind a gateway are written through their link instead.
+ *
+ * @param session Destination slot
+ * @param session_id Id the caller expects the slot to hold
+ * @param frame Encoded frame
+ * @param len Frame length
+ * @return 0 if the whole frame was sent, -1 otherwise
+ */
+int session_send(Session *session, uint64_t session_id, const uint8_t *frame, size_t len)
+{
+    int result = -1;
+
+    pthread_mutex_lock(&session->send_lock);
+    if (session->in_use && session->id == session_id && session->link)
+    {
+        if (mux_send(session->link, session->stream, frame, len) == 0)
+        {
+            atomic_fetch_add_explicit(&session->frames_out, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&session->bytes_out, len, memory_order_relaxed);
+            result = 0;
+        }
+    }
+    else if (session->in_use && session->id == session_id)
+    {
+        size_t sent = send_all(session->socket, frame, len);
+        if (sent == len)
+        {
+            atomic_fetch_add_explicit(&session->frames_out, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&session->bytes_out, sent, memory_order_relaxed);
+            result = 0;
+        }
+        else if (sent > 0)
+        {
+            shutdown(session->socket, SHUT_RDWR);
+        }
+    }
+    if (result < 0 && session->id == session_id)
+    {
+        // A full send buffer is the likely cause; record how full it got
+        int outq;
+        atomic_fetch_add_explicit(&session->drops, 1, memory_order_relaxed);
+        if (!session->link && ioctl(session->socket, SIOCOUTQ, &outq) == 0)
+            counter_max(&session->outq_peak, outq);
+    }
+    pthread_mutex_unlock(&session->send_lock);
+
+    return result;
+}
+
+/**
+ * Sends an encoded frame to a client
+ *
+ * Clients without a session (not yet registered) are written directly,
+ * or through their gateway link.
+ *
+ * @param client Recipient client
+ * @param frame Encoded frame
+ * @param len Frame length
+ */
+void send_to_client(const Client *client, const uint8_t *frame, size_t len)
+{
+    PerfSample perf;
+    perf_begin(&perf);
+    uint64_t started = probe_clock(PROBE_ENABLED(send_done));
+    if (client->session)
+        session_send(client->session, client->session_id, frame, len);
+    else if (client->link)
+        mux_send(client->link, client->stream, frame, len);
+    else
+        send_all(client->socket, frame, len);
+    perf_end(&perf, STAGE_SEND);
+    PROBE3(send_done, client->session_id, len, started ? probe_clock(1) - started : 0);
+}
+
+/**
+ * Sends an error message to a client
+ *
+ * @param client Recipient client
+ * @param request_id Id of the failed request, 0 if not caused by one
+ * @param text Error text
+ */
+void send_error(const Client *client, uint32_t request_id, const char *text)
+{
+    uint8_t frame[PROTO_HEADER_SIZE + ERROR_MAX_BODY];
+    ErrorMsg error_msg = {.sender = proto_str("Server"), .content = proto_str(text)};
+    size_t len = encode_error(frame, sizeof(frame), &error_msg);
+    if (len)
+    {
+        proto_set_request_id(frame, request_id);
+        send_to_client(client, frame, len);
+    }
+    eventlog_emit(LOG_WARN, EV_ERROR_SENT, client->session_id, request_id, 0, text);
+}
+
+/**
+ * Sends an error telling a client to try again later
+ *
+ * @param client Recipient client
+ * @param text Error text
+ * @param retry_after_ms Suggested delay before retrying
+ */
+void send_retry_error(const Client *client, const char *text, uint32_t retry_after_ms)
+{
+    uint8_t frame[PROTO_HEADER_SIZE + ERROR_MAX_BODY];
+    ErrorMsg error_msg = {.sender = proto_str("Server"), .content = proto_str(text),
+                          .retry_after_ms = retry_after_ms, .has_retry_after_ms = 1};
+    size_t len = encode_error(frame, sizeof(frame), &error_msg);
+    if (len)
+        send_to_client(client, frame, len);
+}
+
 /**
  * Searches for a client by username
  *
  * @param username Username to search for
- * @param socket_out Optional pointer to store socket descriptor
+ * @param client_out Optional pointer to store a copy of the client entry
  * @return 1 if client found, 0 otherwise
  */
-int find_client(const char *username, int *socket_out)
+int find_client(const char *username, Client *client_out)
 {
     int found = 0;
+    uint64_t started = probe_clock(PROBE_ENABLED(find_client));
 
     pthread_mutex_lock(&clients_mutex);
     for (int i = 0; i < client_count; i++)
@@ -159,38 +433,124 @@ int find_client(const char *username, int *socket_out)
         if (strcmp(clients[i].username, username) == 0)
         {
             found = 1;
-            if (socket_out)
-                *socket_out = clients[i].socket;
+            if (client_out)
+                *client_out = clients[i];
             break;
         }
     }
     pthread_mutex_unlock(&clients_mutex);
 
+    PROBE3(find_client, username, found, started ? probe_clock(1) - started : 0);
     return found;
 }
 
 /**
- * Sends a message to all active clients except the sender
+ * Sends an encoded frame to all active clients except the sender
+ *
+ * The frame is encoded once by the caller and the same bytes are
+ * written to every recipient. Users behind a gateway only have their
+ * counters updated here; each link gets the frame once as a fanout.
  *
- * @param msg Pointer to the Message structure
- * @param sender_socket Socket of sender to exclude
+ * @param frame Encoded frame
+ * @param len Frame length
+ * @param except Sender to exclude, or NULL
+ * @return Number of recipients
  */
-void broadcast_message(Message *msg, int sender_socket)
+int broadcast_frame(const uint8_t *frame, size_t len, const Client *except)
 {
+    int recipients = 0;
+    PerfSample perf;
+    perf_begin(&perf);
+    uint64_t started = probe_clock(PROBE_ENABLED(broadcast_fanout));
     pthread_mutex_lock(&clients_mutex);
 
     for (int i = 0; i < client_count; i++)
     {
-        if (clients[i].socket != sender_socket)
+        if (except && clients[i].session_id == except->session_id)
+            continue;
+
+        recipients++;
+        if (clients[i].link)
         {
-            send(clients[i].socket, msg, sizeof(Message), 0);
+            Session *session = clients[i].session;
+            atomic_fetch_add_explicit(&session->frames_out, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&session->bytes_out, len, memory_order_relaxed);
+        }
+        else
+        {
+            send_to_client(&clients[i], frame, len);
         }
     }
 
     pthread_mutex_unlock(&clients_mutex);
 
+    mux_fanout(frame, len, except);
+    perf_end(&perf, STAGE_FANOUT);
+    PROBE4(broadcast_fanout, except ? except->session_id : 0, recipients, len,
+           started ? probe_clock(1) - started : 0);
+    return recipients;
+}
+
+/**
+ * Keeps a routed chat message in history, the journal and the standby
+ *
+ * @param a Sender username, or NULL for the global room
+ * @param b Recipient username, or NULL for the global room
+ * @param frame Encoded frame as delivered to recipients
+ * @param len Frame length
+ */
+static void record_message(const char *a, const char *b, const uint8_t *frame, size_t len)
+{
+    replica_record(a, b, frame, len);
+    journal_append(frame, len);
+}
+
+/**
+ * Sends a message to all active clients except the sender
+ *
+ * @param type MSG_BROADCAST, MSG_JOIN or MSG_LOGOUT
+ * @param sender Username of the sender
+ * @param content Message content
+ * @param except Sender to exclude, or NULL
+ */
+void broadcast_message(MessageType type, const char *sender, ProtoStr content, const Client *except)
+{
+    const size_t cap = PROTO_HEADER_SIZE + PROTO_MAX(BROADCAST_MAX_BODY, PROTO_MAX(JOIN_MAX_BODY, LOGOUT_MAX_BODY));
+    uint8_t *frame = buffer_get(cap);
+    size_t len = 0;
+
+    if (frame && type == MSG_JOIN)
+    {
+        JoinMsg msg = {.sender = proto_str(sender), .content = content};
+        len = encode_join(frame, cap, &msg);
+    }
+    else if (frame && type == MSG_LOGOUT)
+    {
+        LogoutMsg msg = {.sender = proto_str(sender), .content = content};
+        len = encode_logout(frame, cap, &msg);
+    }
+    else if (frame)
+    {
+        BroadcastMsg msg = {.sender = proto_str(sender), .content = content};
+        len = encode_broadcast(frame, cap, &msg);
+    }
+
+    if (len)
+    {
+        // Chat messages (not join/leave notices) are kept for late joiners
+        if (type == MSG_BROADCAST)
+            record_message(NULL, NULL, frame, len);
+        int recipients = broadcast_frame(frame, len, except);
+        if (type == MSG_BROADCAST)
+        {
+            mention_scan(sender, content, frame, len);
+            eventlog_emit(LOG_INFO, EV_BROADCAST, except ? except->session_id : 0, recipients, len, NULL);
+        }
+    }
+    buffer_put(frame);
+
     // Log the broadcast message
-    format_whiteboard_msg(MSG_TYPE_BROADCAST, "%s: %s", msg->sender, msg->content);
+    format_whiteboard_msg(MSG_TYPE_BROADCAST, "%s: %.*s", sender, (int)content.len, content.ptr);
 }
 
 /**
@@ -199,43 +559,601 @@ void broadcast_message(Message *msg, int sender_socket)
  * Checks if recipient exists and sends message or error response.
  * Logs the action to the server whiteboard.
  *
- * @param msg Message containing sender, recipient, and content
+ * @param sender Client that sent the message
+ * @param msg Decoded message; its sender field is ignored
  */
-void send_private_message(Message *msg)
+void send_private_message(const Client *sender, const PrivateMsg *msg)
 {
-    int recipient_socket = -1;
+    char recipient_name[MAX_USERNAME];
+    Client recipient;
+
+    proto_str_copy(recipient_name, sizeof(recipient_name), msg->recipient);
 
     // Check if recipient exists
-    if (!find_client(msg->recipient, &recipient_socket))
+    PerfSample perf;
+    perf_begin(&perf);
+    int found = find_client(recipient_name, &recipient);
+    perf_end(&perf, STAGE_LOOKUP);
+    if (!found)
     {
         // Send error back to sender
-        Message error_msg;
-        error_msg.type = MSG_ERROR;
-        sprintf(error_msg.content, "User '%s' does not exist or is offline", msg->recipient);
-        strcpy(error_msg.sender, "Server");
+        char text[MAX_MESSAGE];
+        snprintf(text, sizeof(text), "User '%s' does not exist or is offline", recipient_name);
+        send_error(sender, 0, text);
+
+        format_whiteboard_msg(MSG_TYPE_ERROR, "%s tried to message non-existent user %s",
+                              sender->username, recipient_name);
+        return;
+    }
+
+    // Stamp the authenticated sender and forward the message
+    uint8_t *frame = buffer_get(PROTO_HEADER_SIZE + PRIVATE_MAX_BODY);
+    PrivateMsg out = *msg;
+    out.sender = proto_str(sender->username);
+    size_t len = frame ? encode_private(frame, PROTO_HEADER_SIZE + PRIVATE_MAX_BODY, &out) : 0;
+    if (len)
+    {
+        record_message(sender->username, recipient_name, frame, len);
+        send_to_client(&recipient, frame, len);
+        PROBE3(private_route, sender->session_id, recipient.session_id, len);
+        eventlog_emit(LOG_INFO, EV_PRIVATE, sender->session_id, recipient.session_id, len, NULL);
+    }
+    buffer_put(frame);
+
+    format_whiteboard_msg(MSG_TYPE_PRIVATE, "%s to %s: %.*s",
+                          sender->username, recipient_name, (int)msg->content.len, msg->content.ptr);
+}
+
+/**
+ * Fills a new session's bucket to the configured burst
+ *
+ * @param bucket Bucket to initialize
+ */
+void rate_limit_init(RateBucket *bucket)
+{
+    bucket->tokens = config_get()->rate_limit_burst;
+    clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+    bucket->spam_epoch = 0;
+    bucket->spam_sent = 0;
+}
+
+/**
+ * Takes one token from a session's bucket, refilling it first
+ *
+ * Limits come from the current config snapshot, so reloads apply to
+ * live sessions on their next message.
+ *
+ * @param bucket The session's token bucket
+ * @param cfg Current configuration snapshot
+ * @return 1 if the message may be processed, 0 if it exceeds the limit
+ */
+int rate_limit_allow(RateBucket *bucket, const Config *cfg)
+{
+    if (cfg->rate_limit_msgs == 0)
+        return 1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - bucket->last.tv_sec) + (now.tv_nsec - bucket->last.tv_nsec) / 1e9;
+    bucket->last = now;
 
-        int sender_socket;
-        if (find_client(msg->sender, &sender_socket))
+    bucket->tokens += elapsed * cfg->rate_limit_msgs;
+    if (bucket->tokens > cfg->rate_limit_burst)
+        bucket->tokens = cfg->rate_limit_burst;
+
+    if (bucket->tokens < 1)
+        return 0;
+    bucket->tokens -= 1;
+    return 1;
+}
+
+/**
+ * Sets a socket timeout in milliseconds
+ *
+ * @param socket Socket descriptor
+ * @param option SO_RCVTIMEO or SO_SNDTIMEO
+ * @param timeout_ms Timeout, 0 to block indefinitely
+ */
+void set_socket_timeout(int socket, int option, int timeout_ms)
+{
+    struct timeval tv = {.tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000};
+    setsockopt(socket, SOL_SOCKET, option, &tv, sizeof(tv));
+}
+
+/**
+ * Checks a gateway's secret against gateway_secret
+ *
+ * Compares every byte whatever the input, so timing does not reveal how
+ * much of a guess was right. Without a configured secret no gateway is
+ * accepted.
+ *
+ * @param secret Secret from the hello
+ * @return Non-zero if the gateway may link
+ */
+static int gateway_secret_ok(ProtoStr secret)
+{
+    const char *expected = config_get()->gateway_secret;
+    size_t len = strlen(expected);
+    if (len == 0 || secret.len != len)
+        return 0;
+    unsigned char diff = 0;
+    for (size_t i = 0; i < len; i++)
+        diff |= (unsigned char)secret.ptr[i] ^ (unsigned char)expected[i];
+    return diff == 0;
+}
+
+/**
+ * Receives and validates the first frame of a new connection
+ *
+ * Users send a login; gateways send a hello naming themselves and
+ * carrying the shared gateway_secret.
+ *
+ * @param client_socket Socket of the new connection
+ * @param username Output buffer of MAX_USERNAME bytes for the user or
+ *                 gateway name
+ * @return MSG_LOGIN or MSG_GATEWAY_HELLO if a valid name was received,
+ *         0 otherwise
+ */
+int receive_login(int client_socket, char *username)
+{
+    uint8_t frame[PROTO_HEADER_SIZE + PROTO_MAX(LOGIN_MAX_BODY, GATEWAY_HELLO_MAX_BODY)];
+    ProtoHeader hdr;
+    ProtoStr name;
+
+    // Threads time out through the socket, coroutines through their reactor
+    int timeout_ms = config_get()->login_timeout_ms;
+    if (!coro_running())
+        set_socket_timeout(client_socket, SO_RCVTIMEO, timeout_ms);
+    int received = coro_read(client_socket, frame, PROTO_HEADER_SIZE, timeout_ms) &&
+                   proto_decode_header(frame, &hdr) == 0 && hdr.length <= sizeof(frame) - PROTO_HEADER_SIZE &&
+                   coro_read(client_socket, frame + PROTO_HEADER_SIZE, hdr.length, timeout_ms);
+    if (!coro_running())
+        set_socket_timeout(client_socket, SO_RCVTIMEO, 0);
+    if (!received)
+        return 0;
+
+    if (hdr.type == MSG_LOGIN)
+    {
+        LoginMsg login;
+        if (decode_login(frame + PROTO_HEADER_SIZE, hdr.length, &login) < 0)
+            return 0;
+        name = login.username;
+    }
+    else if (hdr.type == MSG_GATEWAY_HELLO)
+    {
+        GatewayHelloMsg hello;
+        if (decode_gateway_hello(frame + PROTO_HEADER_SIZE, hdr.length, &hello) < 0)
+            return 0;
+        if (!hello.has_secret || !gateway_secret_ok(hello.secret))
+        {
+            eventlog_emit(LOG_WARN, EV_LOGIN_REJECTED, 0, client_socket, 0, "gateway with a wrong secret");
+            format_whiteboard_msg(MSG_TYPE_ERROR, "Rejected a gateway link: wrong or missing secret");
+            return 0;
+        }
+        name = hello.name;
+    }
+    else
+    {
+        return 0;
+    }
+
+    if (name.len == 0 || memchr(name.ptr, '\0', name.len))
+        return 0;
+
+    proto_str_copy(username, MAX_USERNAME, name);
+    return hdr.type;
+}
+
+/**
+ * Removes a client from the client list and frees its session slot
+ *
+ * Waits for in-flight sends to the session before releasing it, so the
+ * socket can be closed safely afterwards.
+ *
+ * @param session_id Session of the departing client
+ */
+void unregister_client(uint64_t session_id)
+{
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < client_count; i++)
+    {
+        if (clients[i].session_id == session_id)
         {
-            send(sender_socket, &error_msg, sizeof(Message), 0);
+            Session *session = clients[i].session;
+            pthread_mutex_lock(&session->send_lock);
+            session_release(session);
+            pthread_mutex_unlock(&session->send_lock);
+
+            // Remove client by shifting all subsequent clients
+            for (int j = i; j < client_count - 1; j++)
+            {
+                clients[j] = clients[j + 1];
+            }
+            client_count--;
+            break;
         }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
 
-        format_whiteboard_msg(MSG_TYPE_ERROR, "%s tried to message non-existent user %s",
-                              msg->sender, msg->recipient);
+/**
+ * Logs a refused login with its reason and the username
+ */
+static void log_rejected(const Client *self, const char *reason)
+{
+    char text[MAX_USERNAME + 16];
+    snprintf(text, sizeof(text), "%s %s", reason, self->username);
+    eventlog_emit(LOG_WARN, EV_LOGIN_REJECTED, 0, self->socket, 0, text);
+}
+
+/**
+ * Admits a logged-in user: rejects duplicates, catches the user up on
+ * the global room, claims a session slot and announces the join
+ *
+ * The name check, the history snapshot and the registration happen in
+ * one clients_mutex section. A broadcast is recorded before it takes that
+ * lock to fan out, so one routed meanwhile is either in the snapshot or
+ * sent live after registration, never lost (at worst it arrives twice).
+ * The history is written before the lock is released, so it reaches the
+ * user ahead of any live message.
+ *
+ * Errors are sent to the user; closing the connection is left to the
+ * caller.
+ *
+ * @param self The new client; its session fields are filled in
+ * @return The claimed session, or NULL if the user was rejected
+ */
+Session *client_join(Client *self)
+{
+    // Existing users come first when the server is overloaded
+    if (overload_shed(SHED_LOGINS))
+    {
+        send_retry_error(self, "Server overloaded, try again later", config_get()->overload_retry_ms);
+        format_whiteboard_msg(MSG_TYPE_ERROR, "Rejected %s: server overloaded", self->username);
+        log_rejected(self, "overloaded");
+        return NULL;
+    }
+
+    // Under load the newcomer can still ask with a history request
+    int send_history = !overload_shed(SHED_EPHEMERAL);
+
+    pthread_mutex_lock(&clients_mutex);
+    int duplicate = 0;
+    for (int i = 0; i < client_count && !duplicate; i++)
+        duplicate = strcmp(clients[i].username, self->username) == 0;
+    Session *session = NULL;
+    if (!duplicate && client_count < config_get()->max_clients)
+        session = session_acquire(self);
+    if (session)
+    {
+        self->session = session;
+        self->session_id = session->id;
+        clients[client_count++] = *self;
+
+        // Catch the newcomer up on the global room in one batched frame
+        size_t history_len;
+        uint8_t *history = send_history ? history_encode(NULL, NULL, &history_len) : NULL;
+        if (history)
+        {
+            send_to_client(self, history, history_len);
+            free(history);
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+
+    if (duplicate)
+    {
+        char text[MAX_MESSAGE];
+        snprintf(text, sizeof(text), "Username '%s' is already in use", self->username);
+        send_error(self, 0, text);
+        log_rejected(self, "duplicate");
+        return NULL;
+    }
+    if (!session)
+    {
+        send_error(self, 0, "Server is full");
+        format_whiteboard_msg(MSG_TYPE_ERROR, "Rejected %s: server is full", self->username);
+        log_rejected(self, "full");
+        return NULL;
+    }
+
+    format_whiteboard_msg(MSG_TYPE_LOGIN, "%s has joined the chat", self->username);
+    eventlog_emit(LOG_INFO, EV_LOGIN, self->session_id, self->socket, self->stream, self->username);
+    PROBE3(login, self->session_id, self->username, self->stream);
+    replica_session(1, self->session_id, self->username, session->connected_at);
+
+    // Notify others of new user
+    if (!overload_defer_presence(self, 1))
+        broadcast_message(MSG_JOIN, self->username, proto_str("has joined the chat"), self);
+    return session;
+}
+
+/**
+ * Removes a departed user and announces the logout
+ *
+ * @param self The client that left
+ */
+void client_leave(const Client *self)
+{
+    unregister_client(self->session_id);
+    topic_forget(self->session_id);
+    replica_session(0, self->session_id, self->username, 0);
+
+    format_whiteboard_msg(MSG_TYPE_LOGOUT, "%s has left the chat", self->username);
+    PROBE4(disconnect, self->session_id,
+           atomic_load_explicit(&self->session->frames_in, memory_order_relaxed),
+           atomic_load_explicit(&self->session->frames_out, memory_order_relaxed),
+           time(NULL) - self->session->connected_at);
+    eventlog_emit(LOG_INFO, EV_LOGOUT, self->session_id,
+                  atomic_load_explicit(&self->session->frames_in, memory_order_relaxed),
+                  atomic_load_explicit(&self->session->frames_out, memory_order_relaxed), self->username);
+
+    if (!overload_defer_presence(self, 0))
+        broadcast_message(MSG_LOGOUT, self->username, proto_str("has left the chat"), self);
+}
+
+/**
+ * Checks the content of a chat message before it is routed
+ *
+ * Replies with an error when the message is too long or is dropped by
+ * flood detection.
+ *
+ * @param self The sending client
+ * @param bucket The sender's rate bucket, also holding its flood count
+ * @param request_id Request id echoed in errors
+ * @param cfg Current configuration snapshot
+ * @param content Message content
+ * @return 1 if the message may be routed, 0 otherwise
+ */
+static int accept_content(const Client *self, RateBucket *bucket, uint32_t request_id, const Config *cfg,
+                          ProtoStr content)
+{
+    if (content.len >= (size_t)cfg->max_message)
+    {
+        char text[MAX_MESSAGE];
+        snprintf(text, sizeof(text), "Message exceeds %d characters", cfg->max_message - 1);
+        send_error(self, request_id, text);
+        return 0;
+    }
+
+    const char *reason = spam_observe(self->username, bucket, content);
+    if (reason)
+    {
+        send_error(self, request_id, reason);
+        format_whiteboard_msg(MSG_TYPE_ERROR, "Dropped message from %s: %s", self->username, reason);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Handles one frame received from a logged-in user
+ *
+ * @param self The sending client
+ * @param bucket The client's rate limit bucket
+ * @param hdr Decoded header of the frame
+ * @param frame The frame, header included
+ * @param len Frame length
+ */
+static void dispatch_frame(Client *self, RateBucket *bucket, const ProtoHeader *hdr, const uint8_t *frame, size_t len)
+{
+    Session *session = self->session;
+    owned_add(&session->frames_in, 1);
+    owned_add(&session->bytes_in, len);
+    eventlog_emit(LOG_DEBUG, EV_FRAME, self->session_id, hdr->type, len, NULL);
+    PROBE3(frame_receive, self->session_id, hdr->type, len);
+
+    const Config *cfg = config_get();
+    PerfSample perf;
+    if (!rate_limit_allow(bucket, cfg))
+    {
+        send_error(self, hdr->request_id, "Rate limit exceeded, message dropped");
+        return;
+    }
+
+    switch (hdr->type)
+    {
+    case MSG_PRIVATE:
+    {
+        PrivateMsg msg;
+        perf_begin(&perf);
+        int decoded = decode_private(frame + PROTO_HEADER_SIZE, hdr->length, &msg);
+        perf_end(&perf, STAGE_DECODE);
+        if (decoded < 0)
+        {
+            send_error(self, hdr->request_id, "Malformed private message");
+            break;
+        }
+        if (!accept_content(self, bucket, hdr->request_id, cfg, msg.content))
+            break;
+        send_private_message(self, &msg);
+        break;
+    }
+    case MSG_BROADCAST:
+    {
+        BroadcastMsg msg;
+        perf_begin(&perf);
+        int decoded = decode_broadcast(frame + PROTO_HEADER_SIZE, hdr->length, &msg);
+        perf_end(&perf, STAGE_DECODE);
+        if (decoded < 0)
+        {
+            send_error(self, hdr->request_id, "Malformed broadcast message");
+            break;
+        }
+        if (!accept_content(self, bucket, hdr->request_id, cfg, msg.content))
+            break;
+        broadcast_message(MSG_BROADCAST, self->username, msg.content, self);
+        break;
+    }
+    case MSG_SUBSCRIBE:
+    {
+        SubscribeMsg msg;
+        if (decode_subscribe(frame + PROTO_HEADER_SIZE, hdr->length, &msg) < 0)
+        {
+            send_error(self, hdr->request_id, "Malformed subscribe message");
+            break;
+        }
+        topic_subscribe(self, hdr->request_id, msg.pattern);
+        break;
+    }
+    case MSG_UNSUBSCRIBE:
+    {
+        UnsubscribeMsg msg;
+        if (decode_unsubscribe(frame + PROTO_HEADER_SIZE, hdr->length, &msg) < 0)
+        {
+            send_error(self, hdr->request_id, "Malformed unsubscribe message");
+            break;
+        }
+        topic_unsubscribe(self, hdr->request_id, msg.pattern);
+        break;
+    }
+    case MSG_PUBLISH:
+    {
+        PublishMsg msg;
+        perf_begin(&perf);
+        int decoded = decode_publish(frame + PROTO_HEADER_SIZE, hdr->length, &msg);
+        perf_end(&perf, STAGE_DECODE);
+        if (decoded < 0)
+        {
+            send_error(self, hdr->request_id, "Malformed publish message");
+            break;
+        }
+        if (!accept_content(self, bucket, hdr->request_id, cfg, msg.content))
+            break;
+        topic_publish(self, hdr->request_id, &msg);
+        break;
+    }
+    case MSG_ROSTER_REQUEST:
+    case MSG_HISTORY_REQUEST:
+    case MSG_MENTIONS_REQUEST:
+        // Answered by the query pool so chat frames keep flowing
+        if (query_submit(self, hdr, frame + PROTO_HEADER_SIZE) < 0)
+            send_error(self, hdr->request_id, "Server busy, retry later");
+        break;
+    default:
+        send_error(self, hdr->request_id, "Unsupported message type");
+        break;
+    }
+}
+
+/**
+ * Handles one frame received from a logged-in user, charging the CPU
+ * time it takes to the user's session
+ *
+ * @param self The sending client
+ * @param bucket The client's rate limit bucket
+ * @param hdr Decoded header of the frame
+ * @param frame The frame, header included
+ * @param len Frame length
+ */
+void client_dispatch(Client *self, RateBucket *bucket, const ProtoHeader *hdr, const uint8_t *frame, size_t len)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    dispatch_frame(self, bucket, hdr, frame, len);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    owned_add(&self->session->cpu_ns,
+              (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec));
+}
+
+/**
+ * Receives one frame from a logged-in user into a pooled buffer
+ *
+ * The session waits for the header on its stack and borrows a buffer
+ * only once a frame is arriving, so an idle session holds none. In a
+ * coroutine the waits park the session instead of its thread.
+ *
+ * @param socket Socket of the user
+ * @param hdr Output for the decoded header
+ * @param len Output for the frame length, header included
+ * @return Frame to give back with buffer_put(), or NULL on close, error,
+ *         bad version or an oversized body
+ */
+static uint8_t *recv_client_frame(int socket, ProtoHeader *hdr, size_t *len)
+{
+    uint8_t header[PROTO_HEADER_SIZE];
+    if (!coro_read(socket, header, sizeof(header), 0) || proto_decode_header(header, hdr) < 0 ||
+        hdr->length > MAX_INBOUND_BODY)
+        return NULL;
+
+    uint8_t *frame = buffer_get(PROTO_HEADER_SIZE + hdr->length);
+    if (!frame)
+        return NULL;
+    memcpy(frame, header, sizeof(header));
+    if (!coro_read(socket, frame + PROTO_HEADER_SIZE, hdr->length, 0))
+    {
+        buffer_put(frame);
+        return NULL;
+    }
+    *len = PROTO_HEADER_SIZE + hdr->length;
+    return frame;
+}
+
+/**
+ * Gateway start structure - A gateway link leaving its coroutine
+ */
+typedef struct
+{
+    int socket;
+    char name[MAX_USERNAME];
+} GatewayStart;
+
+/**
+ * Thread function serving one gateway link
+ *
+ * @param arg GatewayStart, freed here
+ * @return Always NULL
+ */
+static void *gateway_thread(void *arg)
+{
+    GatewayStart *start = arg;
+    mux_serve(start->socket, start->name);
+    free(start);
+    return NULL;
+}
+
+/**
+ * Serves a gateway link after its hello
+ *
+ * A link carries many users and mux_serve() reads it with blocking
+ * calls, so in a coroutine the link moves to a thread of its own.
+ * mux_serve() closes the socket once nothing uses the link any more.
+ *
+ * @param socket Link socket
+ * @param name Gateway name from the hello
+ */
+static void serve_gateway(int socket, const char *name)
+{
+    if (!coro_running())
+    {
+        mux_serve(socket, name);
         return;
     }
 
-    // Send the private message
-    send(recipient_socket, msg, sizeof(Message), 0);
-    format_whiteboard_msg(MSG_TYPE_PRIVATE, "%s to %s: %s",
-                          msg->sender, msg->recipient, msg->content);
+    GatewayStart *start = malloc(sizeof(GatewayStart));
+    pthread_t thread_id;
+    if (start)
+    {
+        start->socket = socket;
+        snprintf(start->name, sizeof(start->name), "%s", name);
+        coro_release(socket);
+        if (pthread_create(&thread_id, NULL, gateway_thread, start) == 0)
+        {
+            pthread_detach(thread_id);
+            return;
+        }
+    }
+    free(start);
+    close(socket);
 }
 
 /**
  * Thread function to manage a client connection
  *
  * Handles login verification, client registration, and message
- * processing until client disconnects or logs out.
+ * processing until client disconnects or logs out. A gateway's
+ * connection is handed to mux_serve() instead. With reactor_threads
+ * set this runs as a coroutine, started by coro_spawn().
  *
  * @param arg Pointer to client socket descriptor
  * @return Always NULL
@@ -244,86 +1162,131 @@ void *handle_client(void *arg)
 {
     int client_socket = *((int *)arg);
     free(arg);
-    Message msg;
+    ProtoHeader hdr;
     char username[MAX_USERNAME] = {0};
+    Client self = {.socket = client_socket};
+    RateBucket bucket;
 
-    // Receive username directly instead of waiting for a login message
-    if (recv(client_socket, username, MAX_USERNAME, 0) <= 0)
+    // The first frame must be a login carrying the username
+    int kind = receive_login(client_socket, username);
+    if (!kind)
     {
         close(client_socket);
         return NULL;
     }
 
-    // Check for duplicate username
-    if (find_client(username, NULL))
+    // Slow readers get dropped messages instead of stalling senders
+    set_socket_timeout(client_socket, SO_SNDTIMEO, config_get()->send_timeout_ms);
+
+    if (kind == MSG_GATEWAY_HELLO)
     {
-        Message error_msg = {.type = MSG_ERROR};
-        sprintf(error_msg.content, "Username '%s' is already in use", username);
-        strcpy(error_msg.sender, "Server");
-        send(client_socket, &error_msg, sizeof(Message), 0);
-        close(client_socket);
+        serve_gateway(client_socket, username);
         return NULL;
     }
 
-    // Register the new client
-    pthread_mutex_lock(&clients_mutex);
-    clients[client_count].socket = client_socket;
-    strncpy(clients[client_count].username, username, MAX_USERNAME);
-    client_count++;
-    pthread_mutex_unlock(&clients_mutex);
-
-    format_whiteboard_msg(MSG_TYPE_LOGIN, "%s has joined the chat", username);
+    strcpy(self.username, username);
+    if (!client_join(&self))
+    {
+        close(client_socket);
+        return NULL;
+    }
 
-    // Notify others of new user
-    Message login_msg = {.type = MSG_LOGIN};
-    strcpy(login_msg.sender, username);
-    strcpy(login_msg.content, "has joined the chat");
-    broadcast_message(&login_msg, client_socket);
+    rate_limit_init(&bucket);
 
     // Message processing loop
     while (1)
     {
-        int bytes = recv(client_socket, &msg, sizeof(Message), 0);
+        PerfSample perf;
+        perf_begin(&perf);
+        size_t len;
+        uint8_t *frame = recv_client_frame(client_socket, &hdr, &len);
+        perf_end(&perf, STAGE_RECEIVE);
 
-        if (bytes <= 0)
+        if (!frame)
         {
             // Handle disconnect
-            pthread_mutex_lock(&clients_mutex);
-            for (int i = 0; i < client_count; i++)
-            {
-                if (clients[i].socket == client_socket)
-                {
-                    strcpy(username, clients[i].username);
-
-                    // Remove client by shifting all subsequent clients
-                    for (int j = i; j < client_count - 1; j++)
-                    {
-                        clients[j] = clients[j + 1];
-                    }
-                    client_count--;
-                    break;
-                }
-            }
-            pthread_mutex_unlock(&clients_mutex);
-
-            format_whiteboard_msg(MSG_TYPE_LOGOUT, "%s has left the chat", username);
-
-            Message logout_msg = {.type = MSG_LOGOUT};
-            strcpy(logout_msg.sender, username);
-            strcpy(logout_msg.content, "has left the chat");
-            broadcast_message(&logout_msg, client_socket);
+            client_leave(&self);
             close(client_socket);
             break;
         }
-        else if (msg.type == MSG_PRIVATE)
-        {
-            send_private_message(&msg);
-        }
+
+        client_dispatch(&self, &bucket, &hdr, frame, len);
+        buffer_put(frame);
     }
 
     return NULL;
 }
 
+/**
+ * Applies a reloaded configuration to the running server
+ *
+ * Hot settings are read from the snapshot on every use; this only
+ * updates derived state and reports settings that need a restart.
+ *
+ * @param old_cfg Snapshot that was replaced
+ * @param new_cfg New snapshot, or NULL if the file failed to parse
+ */
+void apply_config(const Config *old_cfg, const Config *new_cfg)
+{
+    if (!new_cfg)
+    {
+        format_whiteboard_msg(MSG_TYPE_ERROR, "Config reload failed, keeping previous settings");
+        eventlog_emit(LOG_ERROR, EV_RELOAD, 0, 0, 0, NULL);
+        return;
+    }
+
+    atomic_store(&log_level, parse_log_level(new_cfg->log_level));
+
+    if (new_cfg->port != old_cfg->port || new_cfg->listen_backlog != old_cfg->listen_backlog ||
+        strcmp(new_cfg->admin_socket, old_cfg->admin_socket) != 0 ||
+        strcmp(new_cfg->store_dir, old_cfg->store_dir) != 0 ||
+        strcmp(new_cfg->replication_socket, old_cfg->replication_socket) != 0 ||
+        new_cfg->journal_buffer_kb != old_cfg->journal_buffer_kb ||
+        strcmp(new_cfg->event_log, old_cfg->event_log) != 0 ||
+        new_cfg->log_ring_records != old_cfg->log_ring_records ||
+        strcmp(new_cfg->flight_file, old_cfg->flight_file) != 0 ||
+        new_cfg->flight_records != old_cfg->flight_records || new_cfg->reactor_threads != old_cfg->reactor_threads ||
+        new_cfg->coroutine_stack_kb != old_cfg->coroutine_stack_kb)
+        format_whiteboard_msg(MSG_TYPE_ADMIN, "Port, backlog, socket, store, log file and reactor changes apply after restart");
+    if (new_cfg->max_clients > client_capacity)
+        format_whiteboard_msg(MSG_TYPE_ADMIN, "max_clients above startup capacity %d applies after restart",
+                              client_capacity);
+    if (new_cfg->whiteboard_size > whiteboard.capacity)
+        format_whiteboard_msg(MSG_TYPE_ADMIN, "whiteboard_size above startup capacity %d applies after restart",
+                              whiteboard.capacity);
+
+    format_whiteboard_msg(MSG_TYPE_ADMIN, "Configuration reloaded");
+    eventlog_emit(LOG_INFO, EV_RELOAD, 0, 1, 0, NULL);
+}
+
+/**
+ * Sizes client, session and whiteboard storage from the startup
+ * configuration
+ *
+ * @param cfg Startup configuration snapshot
+ * @return 0 on success, -1 if memory ran out
+ */
+int server_init(const Config *cfg)
+{
+    client_capacity = cfg->max_clients;
+    clients = calloc(client_capacity, sizeof(Client));
+    sessions = aligned_alloc(_Alignof(Session), client_capacity * sizeof(Session));
+    if (sessions)
+        memset(sessions, 0, client_capacity * sizeof(Session));
+    whiteboard.capacity = cfg->whiteboard_size;
+    whiteboard.messages = calloc(whiteboard.capacity, WHITEBOARD_LINE);
+    if (!clients || !sessions || !whiteboard.messages)
+        return -1;
+    for (int i = 0; i < client_capacity; i++)
+        pthread_mutex_init(&sessions[i].send_lock, NULL);
+    atomic_store(&log_level, parse_log_level(cfg->log_level));
+    return 0;
+}
+
+// The simulator (sim.c) links this file and drives the server functions
+// from its own main
+#ifndef SIMULATOR
+
 /**
  * Entry point for the chat server
  *
@@ -331,13 +1294,70 @@ void *handle_client(void *arg)
  * accept loop to handle new client connections.
  *
  * @param argc Command line argument count
- * @param argv Command line arguments (optional port)
+ * @param argv Command line arguments (optional port, optional -c config file)
  * @return Exit status (0 for success, 1 for errors)
  */
 int main(int argc, char *argv[])
 {
-    // Setup port number
-    int port = argc > 1 ? atoi(argv[1]) : 8888;
+    const char *config_path = NULL;
+    int port = 0;
+    int standby = 0;
+
+    // Parse arguments: [port] [-c config] [--standby]
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            config_path = argv[++i];
+        else if (strcmp(argv[i], "--standby") == 0)
+            standby = 1;
+        else
+            port = atoi(argv[i]);
+    }
+
+    if (config_load(config_path) < 0)
+    {
+        fprintf(stderr, "Usage: %s [port] [-c config] [--standby]\n", argv[0]);
+        return 1;
+    }
+
+    // Setup port number; the command line overrides the config file.
+    // Startup works from its own copy, since opening the store may outlast
+    // the snapshot once a reload replaces it
+    Config startup = *config_get();
+    const Config *cfg = &startup;
+    if (port <= 0)
+        port = cfg->port;
+
+    if (server_init(cfg) < 0)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    // A client vanishing mid-send must not terminate the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Record recent events from the start; dumped if the server crashes
+    char flight_path[CONFIG_PATH_MAX];
+    if (cfg->flight_file[0])
+        snprintf(flight_path, sizeof(flight_path), "%s%s", cfg->flight_file, standby ? ".standby" : "");
+    else
+        snprintf(flight_path, sizeof(flight_path), "/tmp/chat-server-%d%s.flight", port, standby ? "-standby" : "");
+    if (flight_start(flight_path, cfg->flight_records) < 0)
+        fprintf(stderr, "Flight recorder unavailable\n");
+
+    // Route SIGHUP to the config reloader only; threads inherit this mask
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+    config_start_reloader(config_path, apply_config);
+
+    if (query_start(cfg->query_threads) < 0)
+    {
+        fprintf(stderr, "Failed to start query threads\n");
+        return 1;
+    }
 
     // Initialize server
     printf("\n%s╔══════════════════════════════════════╗%s\n", ANSI_BOLD, ANSI_RESET);
@@ -359,11 +1379,82 @@ int main(int argc, char *argv[])
         .sin_addr.s_addr = INADDR_ANY,
         .sin_port = htons(port)};
 
-    bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr));
-    listen(server_socket, 5);
+    // Start the local admin control socket; a standby gets its own
+    char admin_path[CONFIG_PATH_MAX];
+    if (cfg->admin_socket[0])
+        snprintf(admin_path, sizeof(admin_path), "%s%s", cfg->admin_socket, standby ? ".standby" : "");
+    else
+        snprintf(admin_path, sizeof(admin_path), "/tmp/chat-server-%d%s.sock", port, standby ? "-standby" : "");
+    if (admin_start(admin_path) == 0)
+        format_whiteboard_msg(MSG_TYPE_ADMIN, "Admin socket listening on %s", admin_path);
+    else
+        format_whiteboard_msg(MSG_TYPE_ERROR, "Admin socket unavailable at %s", admin_path);
+
+    char repl_path[CONFIG_PATH_MAX];
+    if (cfg->replication_socket[0])
+        snprintf(repl_path, sizeof(repl_path), "%s", cfg->replication_socket);
+    else
+        snprintf(repl_path, sizeof(repl_path), "/tmp/chat-server-%d.repl", port);
+
+    if (standby)
+    {
+        // Mirror the primary until it is gone and its port can be bound;
+        // a port still in use means the primary is alive, so keep following
+        format_whiteboard_msg(MSG_TYPE_ADMIN, "Standing by for the primary on port %d", port);
+        while (1)
+        {
+            replica_follow(repl_path, config_get()->takeover_ms);
+            if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0)
+                break;
+            if (errno != EADDRINUSE)
+            {
+                fprintf(stderr, "Cannot bind port %d: %s\n", port, strerror(errno));
+                return 1;
+            }
+        }
+        replica_promote();
+        format_whiteboard_msg(MSG_TYPE_ADMIN, "Primary lost, taking over port %d", port);
+    }
+    else if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        fprintf(stderr, "Cannot bind port %d: %s\n", port, strerror(errno));
+        return 1;
+    }
+    startup = *config_get(); // Pick up reloads made while standing by
+
+    // The store belongs to whichever process holds the port
+    if (cfg->store_dir[0] &&
+        (store_start(cfg->store_dir) < 0 || journal_start(cfg->store_dir, cfg->journal_buffer_kb) < 0))
+    {
+        fprintf(stderr, "Failed to open message store in %s: %s\n", cfg->store_dir, strerror(errno));
+        return 1;
+    }
 
+    listen(server_socket, cfg->listen_backlog);
     printf("Server started on port %d\n", port);
 
+    if (cfg->event_log[0] && eventlog_start(cfg->event_log, cfg->log_ring_records) < 0)
+        format_whiteboard_msg(MSG_TYPE_ERROR, "Event log unavailable at %s", cfg->event_log);
+
+    if (overload_start(server_socket) < 0)
+        format_whiteboard_msg(MSG_TYPE_ERROR, "Overload monitor unavailable");
+
+    int reactors = 0;
+    if (cfg->reactor_threads)
+    {
+        reactors = coro_start(cfg->reactor_threads, cfg->coroutine_stack_kb) == 0;
+        if (reactors)
+            format_whiteboard_msg(MSG_TYPE_ADMIN, "Sessions run as coroutines on %d reactor threads",
+                                  cfg->reactor_threads);
+        else
+            format_whiteboard_msg(MSG_TYPE_ERROR, "Reactors unavailable, using a thread per connection");
+    }
+
+    if (replica_start(repl_path, cfg->replication_queue_kb) == 0)
+        format_whiteboard_msg(MSG_TYPE_ADMIN, "Replication socket listening on %s", repl_path);
+    else
+        format_whiteboard_msg(MSG_TYPE_ERROR, "Replication socket unavailable at %s", repl_path);
+
     // Main accept loop
     while (1)
     {
@@ -372,14 +1463,30 @@ int main(int argc, char *argv[])
         int *client_socket = malloc(sizeof(int));
 
         *client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &addr_size);
+        if (*client_socket >= 0)
+        {
+            PROBE1(accept, *client_socket);
+            eventlog_emit(LOG_INFO, EV_ACCEPT, 0, *client_socket, 0, NULL);
+        }
 
-        // Create and detach client thread
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, handle_client, client_socket) == 0)
+        // Run the session as a coroutine, or on a detached thread; frames
+        // live in pooled buffers, so the thread needs only a small stack
+        int created;
+        if (reactors)
         {
-            pthread_detach(thread_id);
+            created = coro_spawn(handle_client, client_socket);
         }
         else
+        {
+            pthread_t thread_id;
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            pthread_attr_setstacksize(&attr, (size_t)config_get()->thread_stack_kb * 1024);
+            created = pthread_create(&thread_id, &attr, handle_client, client_socket);
+            pthread_attr_destroy(&attr);
+        }
+        if (created != 0)
         {
             close(*client_socket);
             free(client_socket);
@@ -388,3 +1495,5 @@ int main(int argc, char *argv[])
 
     return 0;
 }
+
+#endif // SIMULATOR
@@ -0,0 +1,444 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "common.h"
+#include "config.h"
+#include "protocol.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef struct MuxLink MuxLink; // Gateway connection carrying user streams (mux.c)
+
+/**
+ * Session structure - Stable per-connection slot
+ *
+ * Slots never move while a client is connected, so other threads can read
+ * them without holding clients_mutex. Identity fields are published under a
+ * seqlock; counters are relaxed atomics updated on the routing path.
+ * Inbound counters have a single writer and outbound counters many, so
+ * each group gets its own cache line and senders never invalidate the
+ * line the session's own thread is updating.
+ */
+typedef struct
+{
+    atomic_uint seq;             // Seqlock sequence, odd while identity fields are rewritten
+    int in_use;                  // Non-zero while a client occupies the slot
+    int socket;                  // Socket file descriptor of the session
+    uint32_t stream;             // Gateway stream id, 0 for a direct connection
+    MuxLink *link;               // Gateway link carrying the stream, NULL if direct
+    uint64_t id;                 // Unique, never reused session id
+    char username[MAX_USERNAME]; // Username bound to the session
+    time_t connected_at;         // Wall-clock time of login
+    pthread_mutex_t send_lock;   // Serializes frames written to the socket
+
+    // Written only by the thread reading the session's frames
+    _Alignas(64) atomic_ulong frames_in; // Messages received from the client
+    atomic_ulong bytes_in;       // Bytes received from the client
+    atomic_ulong cpu_ns;         // Thread CPU time spent handling its messages
+
+    // Written by every thread sending to the session
+    _Alignas(64) atomic_ulong frames_out; // Messages sent to the client
+    atomic_ulong bytes_out;      // Bytes sent to the client
+    atomic_ulong drops;          // Messages that could not be sent
+    atomic_ulong outq_peak;      // Most bytes seen waiting in its kernel send buffer
+} Session;
+
+/**
+ * Adds to a counter that only the calling thread writes
+ *
+ * A relaxed load and store instead of a locked read-modify-write; other
+ * threads may still read the counter at any time.
+ *
+ * @param counter Counter to update
+ * @param n Amount to add
+ */
+static inline void owned_add(atomic_ulong *counter, unsigned long n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ * Raises a counter to at least a value
+ *
+ * @param counter Counter to update
+ * @param value Newly observed value
+ */
+static inline void counter_max(atomic_ulong *counter, unsigned long value)
+{
+    unsigned long seen = atomic_load_explicit(counter, memory_order_relaxed);
+    while (value > seen && !atomic_compare_exchange_weak_explicit(counter, &seen, value, memory_order_relaxed,
+                                                                  memory_order_relaxed))
+        ;
+}
+
+/**
+ * LRU link structure - Intrusive node of a least-recently-used list
+ *
+ * Embedded in a table entry and guarded by the table's own lock. The
+ * most recently used entry is at the head, the eviction victim at the tail.
+ */
+typedef struct LruLink
+{
+    struct LruLink *prev; // Towards the head, more recently used
+    struct LruLink *next; // Towards the tail, less recently used
+} LruLink;
+
+/**
+ * LRU list structure - Head and tail of a least-recently-used list
+ */
+typedef struct
+{
+    LruLink *head;
+    LruLink *tail;
+} LruList;
+
+// Entry embedding an LruLink as the named member
+#define LRU_ENTRY(link, type, member) ((type *)((char *)(link) - offsetof(type, member)))
+
+/**
+ * Unlinks an entry from an LRU list
+ *
+ * @param list List holding the entry
+ * @param link Entry's node
+ */
+static inline void lru_remove(LruList *list, LruLink *link)
+{
+    if (link->prev)
+        link->prev->next = link->next;
+    else
+        list->head = link->next;
+    if (link->next)
+        link->next->prev = link->prev;
+    else
+        list->tail = link->prev;
+    link->prev = link->next = NULL;
+}
+
+/**
+ * Inserts an entry at the head of an LRU list
+ *
+ * @param list List to insert into
+ * @param link Unlinked node of the entry
+ */
+static inline void lru_push(LruList *list, LruLink *link)
+{
+    link->prev = NULL;
+    link->next = list->head;
+    if (list->head)
+        list->head->prev = link;
+    else
+        list->tail = link;
+    list->head = link;
+}
+
+/**
+ * Marks an entry as the most recently used
+ *
+ * @param list List holding the entry
+ * @param link Entry's node
+ */
+static inline void lru_touch(LruList *list, LruLink *link)
+{
+    if (list->head == link)
+        return;
+    lru_remove(list, link);
+    lru_push(list, link);
+}
+
+/**
+ * Session snapshot - Consistent copy of a session's identity fields
+ */
+typedef struct
+{
+    int in_use;
+    int socket;
+    MuxLink *link;
+    uint64_t id;
+    char username[MAX_USERNAME];
+    time_t connected_at;
+} SessionSnapshot;
+
+/**
+ * Client structure - Represents a connected client
+ * Contains socket descriptor, username and its session slot. Users behind
+ * a gateway share the link's socket and are told apart by stream id.
+ */
+typedef struct
+{
+    int socket;                  // Socket file descriptor for client connection
+    uint32_t stream;             // Gateway stream id, 0 for a direct connection
+    MuxLink *link;               // Gateway link carrying the stream, NULL if direct
+    char username[MAX_USERNAME]; // Client's username
+    Session *session;            // Stable slot holding stats for this client
+    uint64_t session_id;         // Id of the session when the entry was created
+} Client;
+
+/**
+ * Rate bucket structure - Token bucket limiting one session's message rate
+ */
+typedef struct
+{
+    double tokens;                 // Messages that may currently be sent
+    struct timespec last;          // Time of the last refill
+    unsigned long long spam_epoch; // Flood detection window spam_sent belongs to
+    uint32_t spam_sent;            // Chat messages sent in that window
+} RateBucket;
+
+#define WHITEBOARD_LINE (MAX_USERNAME + MAX_MESSAGE + 50) // Size of one whiteboard entry
+
+/**
+ * Whiteboard structure - Implements a circular buffer for storing messages
+ * to display in the server console
+ */
+typedef struct
+{
+    char (*messages)[WHITEBOARD_LINE]; // Array of messages, sized at startup
+    int capacity;                      // Number of entries in the array
+    int current_index;                 // Current position in the circular buffer
+} Whiteboard;
+
+/**
+ * Log level enumeration - Minimum severity shown on the whiteboard
+ */
+typedef enum
+{
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR
+} LogLevel;
+
+/**
+ * Shed level enumeration - Load shedding steps, each including the ones
+ * before it
+ */
+typedef enum
+{
+    SHED_NONE,
+    SHED_EPHEMERAL, // Skip notifications and replays users can ask for again
+    SHED_PRESENCE,  // Hold join/leave notices until load drops
+    SHED_LOGINS     // Turn new logins away with a retry hint
+} ShedLevel;
+
+/**
+ * Event type enumeration - Records written to the structured event log
+ */
+typedef enum
+{
+    EV_ACCEPT,          // Connection accepted; a = socket
+    EV_LOGIN,           // Session started; a = socket, b = gateway stream
+    EV_LOGIN_REJECTED,  // Login refused; a = socket, text = reason and username
+    EV_LOGOUT,          // Session ended; a = frames in, b = frames out
+    EV_FRAME,           // Frame received; a = message type, b = length
+    EV_PRIVATE,         // Private message routed; a = recipient session, b = length
+    EV_BROADCAST,       // Room message routed; a = recipients, b = length
+    EV_ERROR_SENT,      // Error returned to a client; a = request id
+    EV_OVERLOAD,        // Shedding level changed; a = old level, b = new level
+    EV_RELOAD,          // Configuration reloaded; a = 1 on success
+    EV_COUNT            // Number of event types
+} EventType;
+
+#define EVENT_TEXT 24 // Bytes of text carried by an event record
+
+/**
+ * Event record structure - One binary event, a cache line in size
+ *
+ * Formatting is left to whoever reads the record, so recording an event
+ * costs a clock read and a 64-byte copy.
+ */
+typedef struct
+{
+    uint64_t ns;            // CLOCK_REALTIME timestamp
+    uint64_t session;       // Session id, 0 if none
+    uint64_t a;             // Event-specific values, see event_formats
+    uint64_t b;
+    uint32_t thread;        // Kernel thread id of the thread that recorded it
+    uint16_t event;         // EventType
+    uint8_t level;          // LogLevel
+    uint8_t text_len;
+    char text[EVENT_TEXT];  // Username or short reason, not NUL-terminated
+} EventRecord;
+
+/**
+ * Event format structure - How one event type is printed
+ */
+typedef struct
+{
+    const char *name;
+    const char *a;    // Label of the a value, NULL if unused
+    const char *b;    // Label of the b value, NULL if unused
+    const char *text; // Label of the text, NULL if unused
+} EventFormat;
+
+/**
+ * Pipeline stage enumeration - Parts of message handling measured with
+ * hardware counters
+ */
+typedef enum
+{
+    STAGE_RECEIVE, // Reading a frame from a client socket
+    STAGE_DECODE,  // Decoding a chat message body
+    STAGE_LOOKUP,  // Finding the recipient of a private message
+    STAGE_FANOUT,  // Delivering a room frame to every session, sends included
+    STAGE_SEND,    // Writing one frame to one client
+    STAGE_COUNT
+} PerfStage;
+
+/**
+ * Perf sample structure - Counter values at the start of a measured stage
+ */
+typedef struct
+{
+    uint64_t start[4];
+    uint64_t running;  // Time the counter group had been on the PMU
+    unsigned switches; // Coroutine switches of the thread when sampling began
+    int active;        // 0 if this execution is not sampled
+} PerfSample;
+
+/**
+ * Message type enumeration - Defines types of server messages
+ */
+typedef enum
+{
+    MSG_TYPE_BROADCAST,
+    MSG_TYPE_PRIVATE,
+    MSG_TYPE_LOGIN,
+    MSG_TYPE_LOGOUT,
+    MSG_TYPE_ERROR,
+    MSG_TYPE_ADMIN,
+    MSG_TYPE_DEBUG
+} ServerMsgType;
+
+// Shared server state (defined in server.c)
+extern Client *clients;
+extern pthread_mutex_t clients_mutex;
+extern int client_count;
+extern Session *sessions;
+extern int client_capacity;
+extern Whiteboard whiteboard;
+extern pthread_mutex_t whiteboard_mutex;
+extern atomic_int log_level;
+
+void format_whiteboard_msg(ServerMsgType type, const char *format, ...);
+void update_whiteboard(const char *message);
+int find_client(const char *username, Client *client_out);
+void send_to_client(const Client *client, const uint8_t *frame, size_t len);
+void send_error(const Client *client, uint32_t request_id, const char *text);
+void send_retry_error(const Client *client, const char *text, uint32_t retry_after_ms);
+void broadcast_message(MessageType type, const char *sender, ProtoStr content, const Client *except);
+int session_snapshot(Session *session, SessionSnapshot *out);
+int session_outq(Session *session, const SessionSnapshot *snap);
+int session_send(Session *session, uint64_t session_id, const uint8_t *frame, size_t len);
+int server_init(const Config *cfg);
+Session *client_join(Client *self);
+void client_leave(const Client *self);
+void client_dispatch(Client *self, RateBucket *bucket, const ProtoHeader *hdr, const uint8_t *frame, size_t len);
+void rate_limit_init(RateBucket *bucket);
+const char *log_level_name(LogLevel level);
+int parse_log_level(const char *name);
+
+// Gateway links (mux.c)
+void mux_serve(int socket, const char *name);
+int mux_send(MuxLink *link, uint32_t stream, const uint8_t *frame, size_t len);
+void mux_fanout(const uint8_t *frame, size_t len, const Client *except);
+void mux_close(MuxLink *link, uint32_t stream);
+void mux_hold(MuxLink *link);
+void mux_put(MuxLink *link);
+void mux_report(int fd);
+long mux_queued(void);
+
+// Topic publish/subscribe (topic.c)
+void topic_subscribe(const Client *client, uint32_t request_id, ProtoStr pattern);
+void topic_unsubscribe(const Client *client, uint32_t request_id, ProtoStr pattern);
+void topic_publish(const Client *sender, uint32_t request_id, const PublishMsg *msg);
+void topic_forget(uint64_t session_id);
+void topic_report(int fd);
+
+// @username mentions in room messages (mention.c)
+void mention_scan(const char *sender, ProtoStr content, const uint8_t *frame, size_t len);
+uint8_t *mention_encode(const char *username, size_t *len);
+void mention_report(int fd);
+
+// Flood detection with streaming sketches (spam.c)
+const char *spam_observe(const char *sender, RateBucket *bucket, ProtoStr content);
+void spam_report(int fd);
+
+// Overload detection and load shedding (overload.c)
+int overload_start(int socket);
+int overload_level(void);
+int overload_shed(ShedLevel at);
+int overload_defer_presence(const Client *client, int online);
+void overload_report(int fd);
+
+// Structured event log with per-thread rings (eventlog.c)
+int eventlog_start(const char *path, int ring_records);
+void eventlog_emit(LogLevel level, EventType event, uint64_t session, uint64_t a, uint64_t b, const char *text);
+void eventlog_report(int fd);
+extern const EventFormat event_formats[];
+
+// Always-on per-thread flight recorder (flight.c)
+int flight_start(const char *path, int records);
+void flight_attach(void);
+void flight_record(const EventRecord *record);
+int flight_dump(const char *path);
+void flight_report(int fd);
+
+// Hardware performance counters per pipeline stage (perfctr.c)
+void perf_begin(PerfSample *sample);
+void perf_end(PerfSample *sample, PerfStage stage);
+void perf_switch(void);
+void perf_report(int fd);
+
+// Frame buffers borrowed only while a frame is in flight (bufpool.c)
+uint8_t *buffer_get(size_t size);
+void buffer_put(uint8_t *data);
+void buffer_report(int fd);
+
+// Coroutine sessions on reactor threads (coro.c)
+int coro_start(int threads, int stack_kb);
+int coro_spawn(void *(*entry)(void *), void *arg);
+int coro_read(int fd, void *buf, size_t len, int timeout_ms);
+int coro_running(void);
+void coro_release(int fd);
+void coro_report(int fd);
+
+// Admin control socket (admin.c)
+int admin_start(const char *path);
+
+// Recent-history rings (history.c)
+void history_record(const char *a, const char *b, const uint8_t *frame, size_t len);
+size_t history_collect(const char *a, const char *b, uint8_t *out, size_t cap, uint32_t *count);
+uint8_t *history_encode(const char *requester, const char *peer, size_t *len);
+typedef void (*HistoryVisitor)(const char *a, const char *b, const uint8_t *frame, size_t len, void *arg);
+void history_foreach(HistoryVisitor visit, void *arg);
+void history_clear(void);
+
+// Warm standby replication (replica.c)
+int replica_start(const char *path, int queue_kb);
+void replica_record(const char *a, const char *b, const uint8_t *frame, size_t len);
+void replica_session(int online, uint64_t id, const char *username, time_t connected_at);
+void replica_follow(const char *path, int takeover_ms);
+void replica_promote(void);
+void replica_report(int fd);
+
+// Persistent message log (journal.c); records are a u32 frame length,
+// a u64 timestamp in ms and the frame
+#define JOURNAL_RECORD_HEADER 12
+int journal_start(const char *dir, int buffer_kb);
+void journal_append(const uint8_t *frame, size_t len);
+size_t journal_record_size(const uint8_t *p, size_t avail);
+void journal_report(int fd);
+
+// Compressed history segments (store.c)
+int store_start(const char *dir);
+int store_seal(const char *journal_path);
+int store_read(uint32_t segment, uint32_t index, uint8_t *frame, size_t cap, uint64_t *timestamp);
+void store_report(int fd);
+
+// Background query pool (query.c)
+int query_start(int threads);
+int query_submit(const Client *requester, const ProtoHeader *hdr, const uint8_t *body);
+
+#endif // SERVER_H
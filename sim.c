@@ -0,0 +1,782 @@
+#include "server.h"
+#include "wire.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <linux/sockios.h>
+
+#define SIM_FD_BASE 1000000          // Simulated sockets are numbered from here
+#define SIM_EPOCH 1700000000ULL      // Wall-clock seconds at virtual time 0
+#define SIM_CONFIG "/tmp/chat-sim-%d.conf"
+
+/**
+ * Scenario structure - Workload and network of one simulated run
+ */
+typedef struct
+{
+    const char *name;
+    int users;              // Users that connect
+    int duration_ms;        // Virtual time simulated
+    int login_window_ms;    // Users connect at uniformly random times in this window
+    int message_ms;         // Mean interval between a user's messages, 0 = silent
+    int private_percent;    // Messages sent privately to a random user instead of the room
+    int slow_percent;       // Users that read at slow_bps
+    int slow_bps;           // Read rate of slow users, bytes per second
+    int latency_min_us;     // One-way link latency, drawn per user
+    int latency_max_us;
+    int sndbuf_kb;          // Kernel send buffer of each connection
+    int leave_at_ms;        // Time of the mass disconnect, -1 for none
+    int leave_percent;      // Users that disconnect then
+} Scenario;
+
+static const Scenario presets[] = {
+    {.name = "slow", .users = 50, .duration_ms = 10000, .login_window_ms = 100, .message_ms = 500,
+     .private_percent = 20, .slow_percent = 10, .slow_bps = 2000, .latency_min_us = 100,
+     .latency_max_us = 2000, .sndbuf_kb = 64, .leave_at_ms = -1},
+    {.name = "storm", .users = 500, .duration_ms = 3000, .login_window_ms = 200, .message_ms = 1000,
+     .private_percent = 20, .latency_min_us = 100, .latency_max_us = 5000, .sndbuf_kb = 64, .leave_at_ms = -1},
+    {.name = "disconnect", .users = 300, .duration_ms = 5000, .login_window_ms = 500, .message_ms = 1000,
+     .private_percent = 20, .latency_min_us = 100, .latency_max_us = 5000, .sndbuf_kb = 64,
+     .leave_at_ms = 2000, .leave_percent = 50},
+};
+
+/**
+ * Simulated connection structure - A user and its socket
+ */
+typedef struct
+{
+    Client client;         // Identity given to the server
+    RateBucket bucket;     // Rate limit state, as handle_client() keeps it
+    int online;            // Joined and not yet left
+    int closed;            // The server shut the socket down
+    uint64_t read_bps;     // Rate the user reads, bytes per second; 0 = unlimited
+    uint64_t latency_ns;   // One-way link latency
+    uint64_t queued;       // Bytes in the send buffer at drained_at
+    uint64_t drained_at;   // Virtual time queued was last brought up to date
+    uint64_t latency_sum;  // Delivery latency summed over frames received
+    uint64_t received;     // Frames received whole
+} SimConn;
+
+typedef enum
+{
+    SIM_ARRIVE,   // The login reaches the server
+    SIM_MESSAGE,  // A chat message reaches the server
+    SIM_LEAVE     // The server notices the user is gone
+} SimEventType;
+
+/**
+ * Simulated event structure - Something the server reacts to
+ *
+ * Events are ordered by time, then by a random key drawn from the run's
+ * seed, so simultaneous events run in a seeded but repeatable order.
+ */
+typedef struct
+{
+    uint64_t at;      // Virtual time the server sees the event
+    uint64_t order;   // Tie-break among events at the same time
+    uint64_t origin;  // When the user acted; deliveries it causes are timed from here
+    int type;
+    int conn;
+} SimEvent;
+
+/**
+ * Run result structure - Measurements of one seeded run
+ */
+typedef struct
+{
+    uint64_t seed;
+    uint64_t events;      // Events handled
+    uint64_t frames;      // Frames written whole to a socket
+    uint64_t drops;       // Sends that timed out on a full buffer
+    uint64_t forced;      // Sessions shut down after a partial frame
+    uint64_t queue_peak;  // Largest send buffer backlog, bytes
+    uint64_t stall_ns;    // Virtual time the server spent blocked in send()
+    uint64_t p50_ns;      // Delivery latency percentiles over all frames
+    uint64_t p99_ns;
+    uint64_t max_ns;
+    double fairness;      // Jain's index of the users' mean delivery latency
+} SimResult;
+
+// State of the run in progress; each run has a process of its own
+static const Scenario *scenario;
+static SimConn *conns;
+static SimEvent *heap;
+static int heap_count;
+static int heap_cap;
+static uint64_t now;            // Virtual time in nanoseconds
+static uint64_t origin;         // Origin of the event being handled
+static uint64_t rng_state;
+static int simulating;          // Time and sockets are virtual
+static uint64_t *samples;
+static size_t sample_count;
+static size_t sample_cap;
+static SimResult result;
+
+ssize_t __real_send(int fd, const void *buf, size_t len, int flags);
+int __real_shutdown(int fd, int how);
+int __real_ioctl(int fd, unsigned long request, ...);
+int __real_clock_gettime(clockid_t clock, struct timespec *ts);
+time_t __real_time(time_t *out);
+
+/**
+ * Returns the next number of the run's generator (splitmix64)
+ */
+static uint64_t rng_next(void)
+{
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Returns a uniformly distributed number in [lo, hi]
+ */
+static uint64_t rng_range(uint64_t lo, uint64_t hi)
+{
+    return hi <= lo ? lo : lo + rng_next() % (hi - lo + 1);
+}
+
+static void oom(void)
+{
+    fprintf(stderr, "sim: out of memory\n");
+    _exit(1);
+}
+
+static int event_before(const SimEvent *a, const SimEvent *b)
+{
+    return a->at != b->at ? a->at < b->at : a->order < b->order;
+}
+
+/**
+ * Schedules an event
+ */
+static void event_push(uint64_t at, int type, int conn, uint64_t event_origin)
+{
+    if (heap_count == heap_cap)
+    {
+        heap_cap = heap_cap ? heap_cap * 2 : 1024;
+        heap = realloc(heap, heap_cap * sizeof(SimEvent));
+        if (!heap)
+            oom();
+    }
+    SimEvent ev = {.at = at, .order = rng_next(), .origin = event_origin, .type = type, .conn = conn};
+    int i = heap_count++;
+    while (i > 0 && event_before(&ev, &heap[(i - 1) / 2]))
+    {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = ev;
+}
+
+/**
+ * Removes the earliest event
+ */
+static SimEvent event_pop(void)
+{
+    SimEvent top = heap[0];
+    SimEvent last = heap[--heap_count];
+    int i = 0;
+    while (1)
+    {
+        int child = 2 * i + 1;
+        if (child >= heap_count)
+            break;
+        if (child + 1 < heap_count && event_before(&heap[child + 1], &heap[child]))
+            child++;
+        if (!event_before(&heap[child], &last))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (heap_count)
+        heap[i] = last;
+    return top;
+}
+
+static void add_sample(uint64_t ns)
+{
+    if (sample_count == sample_cap)
+    {
+        sample_cap = sample_cap ? sample_cap * 2 : 4096;
+        samples = realloc(samples, sample_cap * sizeof(uint64_t));
+        if (!samples)
+            oom();
+    }
+    samples[sample_count++] = ns;
+}
+
+/**
+ * Maps a socket number to its simulated connection
+ *
+ * @return The connection, or NULL for a real descriptor
+ */
+static SimConn *sim_conn(int fd)
+{
+    if (!simulating || fd < SIM_FD_BASE || fd >= SIM_FD_BASE + scenario->users)
+        return NULL;
+    return &conns[fd - SIM_FD_BASE];
+}
+
+/**
+ * Removes what the user has read since the buffer was last updated
+ */
+static void drain(SimConn *c)
+{
+    if (!c->read_bps)
+    {
+        c->queued = 0;
+        c->drained_at = now;
+        return;
+    }
+    uint64_t gone = (now - c->drained_at) * c->read_bps / 1000000000ULL;
+    if (gone >= c->queued)
+    {
+        c->queued = 0;
+        c->drained_at = now;
+        return;
+    }
+    c->queued -= gone;
+    c->drained_at += gone * 1000000000ULL / c->read_bps;
+}
+
+/**
+ * Simulated send() - Queues bytes on a connection's send buffer
+ *
+ * A full buffer blocks the caller as SO_SNDTIMEO does: virtual time
+ * advances until the user has read enough, or by send_timeout_ms, after
+ * which whatever fits is taken. The whole server waits meanwhile, as it
+ * does when a broadcast holds clients_mutex. A frame is delivered when
+ * the user has read everything queued before it, plus the link latency.
+ */
+ssize_t __wrap_send(int fd, const void *buf, size_t len, int flags)
+{
+    SimConn *c = sim_conn(fd);
+    if (!c)
+        return __real_send(fd, buf, len, flags);
+    if (c->closed)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    uint64_t cap = (uint64_t)scenario->sndbuf_kb * 1024;
+    uint64_t timeout = (uint64_t)config_get()->send_timeout_ms * 1000000;
+    size_t taken = 0;
+    while (1)
+    {
+        drain(c);
+        size_t chunk = cap - c->queued < len - taken ? cap - c->queued : len - taken;
+        c->queued += chunk;
+        taken += chunk;
+        if (taken == len)
+            break;
+
+        // Full: the sender sleeps until the buffer is a third empty
+        uint64_t wait = ((c->queued - cap * 2 / 3) * 1000000000ULL + c->read_bps - 1) / c->read_bps;
+        if (timeout && wait >= timeout)
+        {
+            now += timeout;
+            result.stall_ns += timeout;
+            break;
+        }
+        now += wait;
+        result.stall_ns += wait;
+        if (timeout)
+            timeout -= wait;
+    }
+    if (c->queued > result.queue_peak)
+        result.queue_peak = c->queued;
+    if (taken == 0)
+    {
+        result.drops++;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (taken == len)
+    {
+        uint64_t read_ns = c->read_bps ? c->queued * 1000000000ULL / c->read_bps : 0;
+        uint64_t latency = now + read_ns + c->latency_ns - origin;
+        add_sample(latency);
+        c->latency_sum += latency;
+        c->received++;
+        result.frames++;
+    }
+    return taken;
+}
+
+/**
+ * Simulated shutdown() - The user's session ends as soon as the server
+ * gets to it, like a reader thread seeing the socket close
+ */
+int __wrap_shutdown(int fd, int how)
+{
+    SimConn *c = sim_conn(fd);
+    if (!c)
+        return __real_shutdown(fd, how);
+    if (!c->closed)
+    {
+        c->closed = 1;
+        result.forced++;
+        event_push(now, SIM_LEAVE, c - conns, now);
+    }
+    return 0;
+}
+
+/**
+ * Simulated ioctl() - Answers SIOCOUTQ from the simulated send buffer
+ */
+int __wrap_ioctl(int fd, unsigned long request, ...)
+{
+    va_list args;
+    va_start(args, request);
+    void *arg = va_arg(args, void *);
+    va_end(args);
+
+    SimConn *c = sim_conn(fd);
+    if (!c)
+        return __real_ioctl(fd, request, arg);
+    if (request != SIOCOUTQ)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    drain(c);
+    *(int *)arg = (int)c->queued;
+    return 0;
+}
+
+/**
+ * Simulated clock_gettime() - Every clock reads virtual time while a run
+ * is in progress, CPU time clocks included
+ */
+int __wrap_clock_gettime(clockid_t clock, struct timespec *ts)
+{
+    if (!simulating)
+        return __real_clock_gettime(clock, ts);
+    uint64_t t = now + (clock == CLOCK_REALTIME ? SIM_EPOCH * 1000000000ULL : 0);
+    ts->tv_sec = t / 1000000000ULL;
+    ts->tv_nsec = t % 1000000000ULL;
+    return 0;
+}
+
+time_t __wrap_time(time_t *out)
+{
+    if (!simulating)
+        return __real_time(out);
+    time_t t = SIM_EPOCH + now / 1000000000ULL;
+    if (out)
+        *out = t;
+    return t;
+}
+
+/**
+ * Schedules a user's next message after the mean interval, jittered by
+ * up to half of it either way
+ */
+static void schedule_message(int i)
+{
+    uint64_t mean = (uint64_t)scenario->message_ms * 1000000;
+    uint64_t sent = now + rng_range(mean / 2, mean + mean / 2);
+    event_push(sent + conns[i].latency_ns, SIM_MESSAGE, i, sent);
+}
+
+/**
+ * Hands a user's chat message to the server as its reader would
+ */
+static void deliver_message(int i)
+{
+    SimConn *c = &conns[i];
+    char text[MAX_MESSAGE];
+    int max_len = config_get()->max_message - 1;
+    int len = (int)rng_range(8, max_len < 120 ? max_len : 120);
+    memset(text, 'a' + i % 26, len);
+
+    uint8_t frame[PROTO_HEADER_SIZE + PROTO_MAX(BROADCAST_MAX_BODY, PRIVATE_MAX_BODY)];
+    size_t frame_len;
+    ProtoStr content = {.ptr = text, .len = len};
+    if ((int)rng_range(1, 100) <= scenario->private_percent)
+    {
+        PrivateMsg msg = {.recipient = proto_str(conns[rng_range(0, scenario->users - 1)].client.username),
+                          .content = content};
+        frame_len = encode_private(frame, sizeof(frame), &msg);
+    }
+    else
+    {
+        BroadcastMsg msg = {.content = content};
+        frame_len = encode_broadcast(frame, sizeof(frame), &msg);
+    }
+
+    ProtoHeader hdr;
+    if (frame_len && proto_decode_header(frame, &hdr) == 0)
+        client_dispatch(&c->client, &c->bucket, &hdr, frame, frame_len);
+}
+
+/**
+ * Reacts to one event with the server functions handle_client() calls
+ */
+static void handle_event(const SimEvent *ev)
+{
+    SimConn *c = &conns[ev->conn];
+    origin = ev->origin;
+    switch (ev->type)
+    {
+    case SIM_ARRIVE:
+        rate_limit_init(&c->bucket);
+        c->online = client_join(&c->client) != NULL;
+        if (c->online && scenario->message_ms)
+            schedule_message(ev->conn);
+        break;
+    case SIM_MESSAGE:
+        if (!c->online || c->closed)
+            break;
+        deliver_message(ev->conn);
+        schedule_message(ev->conn);
+        break;
+    case SIM_LEAVE:
+        if (!c->online)
+            break;
+        c->online = 0;
+        client_leave(&c->client);
+        break;
+    }
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Runs one seeded scenario to its end and fills in result
+ *
+ * Called in a child process, so the server state starts fresh.
+ */
+static void sim_run(const Scenario *sc, uint64_t seed)
+{
+    scenario = sc;
+    rng_state = seed;
+    result.seed = seed;
+    simulating = 1;
+
+    conns = calloc(sc->users, sizeof(SimConn));
+    if (!conns)
+        oom();
+    for (int i = 0; i < sc->users; i++)
+    {
+        SimConn *c = &conns[i];
+        c->client.socket = SIM_FD_BASE + i;
+        snprintf(c->client.username, sizeof(c->client.username), "user%d", i);
+        c->latency_ns = rng_range(sc->latency_min_us, sc->latency_max_us) * 1000;
+        if ((int)rng_range(1, 100) <= sc->slow_percent)
+            c->read_bps = sc->slow_bps;
+
+        uint64_t connect = rng_range(0, (uint64_t)sc->login_window_ms * 1000000);
+        event_push(connect + c->latency_ns, SIM_ARRIVE, i, connect);
+        if (sc->leave_at_ms >= 0 && (int)rng_range(1, 100) <= sc->leave_percent)
+        {
+            uint64_t leave = (uint64_t)sc->leave_at_ms * 1000000;
+            event_push(leave + c->latency_ns, SIM_LEAVE, i, leave);
+        }
+    }
+
+    uint64_t end = (uint64_t)sc->duration_ms * 1000000;
+    while (heap_count && heap[0].at <= end)
+    {
+        SimEvent ev = event_pop();
+        if (ev.at > now)
+            now = ev.at;
+        handle_event(&ev);
+        result.events++;
+    }
+
+    if (sample_count)
+    {
+        qsort(samples, sample_count, sizeof(uint64_t), compare_u64);
+        result.p50_ns = samples[(sample_count - 1) / 2];
+        result.p99_ns = samples[(sample_count - 1) * 99 / 100];
+        result.max_ns = samples[sample_count - 1];
+    }
+
+    double sum = 0, squares = 0;
+    int n = 0;
+    for (int i = 0; i < sc->users; i++)
+    {
+        if (!conns[i].received)
+            continue;
+        double mean = (double)conns[i].latency_sum / conns[i].received;
+        sum += mean;
+        squares += mean * mean;
+        n++;
+    }
+    result.fairness = squares > 0 ? sum * sum / (n * squares) : 1.0;
+}
+
+/**
+ * Prints the spread of one measurement over all runs
+ *
+ * @param label Row label
+ * @param results All runs
+ * @param runs Number of runs
+ * @param field Offset of a uint64_t field in SimResult
+ * @param scale Divisor for display
+ */
+static void print_row(const char *label, const SimResult *results, int runs, size_t field, double scale)
+{
+    double sum = 0, low = 0, high = 0;
+    uint64_t worst_seed = 0;
+    for (int r = 0; r < runs; r++)
+    {
+        double v = *(const uint64_t *)((const char *)&results[r] + field) / scale;
+        sum += v;
+        if (r == 0 || v < low)
+            low = v;
+        if (r == 0 || v > high)
+        {
+            high = v;
+            worst_seed = results[r].seed;
+        }
+    }
+    printf("%-18s %12.2f %12.2f %12.2f %12llu\n", label, sum / runs, low, high, (unsigned long long)worst_seed);
+}
+
+/**
+ * Writes a config for the simulated server: the user's file if given,
+ * then the capacity the scenario needs
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int write_config(const char *path, const char *user_path, int users)
+{
+    FILE *out = fopen(path, "w");
+    if (!out)
+        return -1;
+    if (user_path)
+    {
+        FILE *in = fopen(user_path, "r");
+        if (!in)
+        {
+            fclose(out);
+            return -1;
+        }
+        char line[512];
+        while (fgets(line, sizeof(line), in))
+            fputs(line, out);
+        fclose(in);
+        fputc('\n', out);
+    }
+    fprintf(out, "max_clients = %d\nlog_level = error\n", users);
+    fclose(out);
+    return 0;
+}
+
+/**
+ * Entry point for the simulator
+ *
+ * Runs a scenario once per seed, each in a child process, several at a
+ * time. Results depend only on the scenario, the seed and the server
+ * config, so a bad seed can be replayed with -s seed -R 1.
+ *
+ * @param argc Argument count
+ * @param argv scenario [-s seed] [-R runs] [-j jobs] [-n users]
+ *             [-d duration_ms] [-m message_ms] [-S slow_percent]
+ *             [-c server.conf] [-o runs.csv]
+ * @return 0 on success, 1 on failure
+ */
+int main(int argc, char *argv[])
+{
+    Scenario sc;
+    uint64_t seed = 1;
+    int runs = 100;
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *config_path = NULL;
+    const char *csv_path = NULL;
+
+    int found = 0;
+    for (size_t i = 0; argc > 1 && i < sizeof(presets) / sizeof(presets[0]); i++)
+    {
+        if (strcmp(argv[1], presets[i].name) == 0)
+        {
+            sc = presets[i];
+            found = 1;
+        }
+    }
+    for (int i = 2; found && i < argc; i++)
+    {
+        const char *opt = argv[i];
+        if (i + 1 >= argc || opt[0] != '-' || strlen(opt) != 2)
+        {
+            found = 0;
+            break;
+        }
+        const char *value = argv[++i];
+        switch (opt[1])
+        {
+        case 's':
+            seed = strtoull(value, NULL, 10);
+            break;
+        case 'R':
+            runs = atoi(value);
+            break;
+        case 'j':
+            jobs = atoi(value);
+            break;
+        case 'n':
+            sc.users = atoi(value);
+            break;
+        case 'd':
+            sc.duration_ms = atoi(value);
+            break;
+        case 'm':
+            sc.message_ms = atoi(value);
+            break;
+        case 'S':
+            sc.slow_percent = atoi(value);
+            break;
+        case 'c':
+            config_path = value;
+            break;
+        case 'o':
+            csv_path = value;
+            break;
+        default:
+            found = 0;
+        }
+    }
+    if (!found || runs < 1 || jobs < 1 || sc.users < 1 || sc.duration_ms < 1 || sc.message_ms < 0)
+    {
+        fprintf(stderr, "Usage: %s slow|storm|disconnect [-s seed] [-R runs] [-j jobs] [-n users] "
+                        "[-d duration_ms] [-m message_ms] [-S slow_percent] [-c server.conf] [-o runs.csv]\n",
+                argv[0]);
+        return 1;
+    }
+
+    char generated[64];
+    snprintf(generated, sizeof(generated), SIM_CONFIG, (int)getpid());
+    int loaded = write_config(generated, config_path, sc.users) == 0 && config_load(generated) == 0;
+    unlink(generated);
+    if (!loaded || server_init(config_get()) < 0)
+    {
+        fprintf(stderr, "sim: cannot load server config%s%s\n", config_path ? " " : "", config_path ? config_path : "");
+        return 1;
+    }
+
+    SimResult *results = calloc(runs, sizeof(SimResult));
+    pid_t *pids = calloc(runs, sizeof(pid_t));
+    int *pipes = calloc(runs, sizeof(int));
+    if (!results || !pids || !pipes)
+        oom();
+
+    struct timespec started, finished;
+    __real_clock_gettime(CLOCK_MONOTONIC, &started);
+    fflush(stdout);
+
+    int next = 0, running = 0, failed = 0;
+    while (next < runs || running)
+    {
+        if (next < runs && running < jobs)
+        {
+            int fds[2];
+            if (pipe(fds) < 0)
+            {
+                perror("sim: pipe");
+                return 1;
+            }
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                // The whiteboard redraws on stdout; keep it out of the report
+                close(fds[0]);
+                if (!freopen("/dev/null", "w", stdout))
+                    _exit(1);
+                atomic_store(&log_level, LOG_ERROR);
+                sim_run(&sc, seed + next);
+                _exit(write(fds[1], &result, sizeof(result)) == sizeof(result) ? 0 : 1);
+            }
+            close(fds[1]);
+            if (pid < 0)
+            {
+                perror("sim: fork");
+                return 1;
+            }
+            pids[next] = pid;
+            pipes[next] = fds[0];
+            next++;
+            running++;
+            continue;
+        }
+
+        int status;
+        pid_t pid = wait(&status);
+        for (int r = 0; r < next; r++)
+        {
+            if (pids[r] != pid)
+                continue;
+            if (read(pipes[r], &results[r], sizeof(SimResult)) != sizeof(SimResult) || !WIFEXITED(status) ||
+                WEXITSTATUS(status) != 0)
+            {
+                fprintf(stderr, "sim: run with seed %llu failed\n", (unsigned long long)(seed + r));
+                results[r].seed = seed + r;
+                failed++;
+            }
+            close(pipes[r]);
+            pids[r] = 0;
+            running--;
+        }
+    }
+    __real_clock_gettime(CLOCK_MONOTONIC, &finished);
+    double wall = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+
+    printf("%s: %d users, %d ms, message every %d ms, %d%% slow readers; seeds %llu-%llu in %.2f s\n", sc.name,
+           sc.users, sc.duration_ms, sc.message_ms, sc.slow_percent, (unsigned long long)seed,
+           (unsigned long long)(seed + runs - 1), wall);
+    printf("%-18s %12s %12s %12s %12s\n", "", "mean", "min", "max", "seed of max");
+    print_row("events", results, runs, offsetof(SimResult, events), 1);
+    print_row("frames", results, runs, offsetof(SimResult, frames), 1);
+    print_row("drops", results, runs, offsetof(SimResult, drops), 1);
+    print_row("forced closes", results, runs, offsetof(SimResult, forced), 1);
+    print_row("queue peak KB", results, runs, offsetof(SimResult, queue_peak), 1024);
+    print_row("send stall ms", results, runs, offsetof(SimResult, stall_ns), 1e6);
+    print_row("latency p50 ms", results, runs, offsetof(SimResult, p50_ns), 1e6);
+    print_row("latency p99 ms", results, runs, offsetof(SimResult, p99_ns), 1e6);
+    print_row("latency max ms", results, runs, offsetof(SimResult, max_ns), 1e6);
+    double fairness = 1;
+    uint64_t fairness_seed = seed;
+    for (int r = 0; r < runs; r++)
+    {
+        if (results[r].fairness < fairness)
+        {
+            fairness = results[r].fairness;
+            fairness_seed = results[r].seed;
+        }
+    }
+    printf("%-18s %12.3f (seed %llu)\n", "worst fairness", fairness, (unsigned long long)fairness_seed);
+
+    if (csv_path)
+    {
+        FILE *csv = fopen(csv_path, "w");
+        if (!csv)
+        {
+            perror("sim: csv");
+            return 1;
+        }
+        fprintf(csv, "seed,events,frames,drops,forced_closes,queue_peak_bytes,stall_ms,"
+                     "latency_p50_ms,latency_p99_ms,latency_max_ms,fairness\n");
+        for (int r = 0; r < runs; r++)
+        {
+            const SimResult *res = &results[r];
+            fprintf(csv, "%llu,%llu,%llu,%llu,%llu,%llu,%.3f,%.3f,%.3f,%.3f,%.4f\n", (unsigned long long)res->seed,
+                    (unsigned long long)res->events, (unsigned long long)res->frames,
+                    (unsigned long long)res->drops, (unsigned long long)res->forced,
+                    (unsigned long long)res->queue_peak, res->stall_ns / 1e6, res->p50_ns / 1e6,
+                    res->p99_ns / 1e6, res->max_ns / 1e6, res->fairness);
+        }
+        fclose(csv);
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,293 @@
+#include "server.h"
+
+#define SKETCH_DEPTH 4      // Independent rows; the estimate is the row minimum
+#define SKETCH_WIDTH 4096   // Counters per row, a power of two
+#define TOP_K 16            // Heavy hitters tracked per kind
+#define TOP_LABEL 40        // Bytes of a username or message kept for display
+
+/**
+ * Count-min sketch structure - Approximate per-key counts in fixed memory
+ *
+ * Estimates never undercount; they overcount by at most about
+ * total / SKETCH_WIDTH with high probability. Rows are updated with
+ * relaxed atomics so receive threads never lock.
+ */
+typedef struct
+{
+    atomic_uint rows[SKETCH_DEPTH][SKETCH_WIDTH];
+} Sketch;
+
+/**
+ * Heavy hitter structure - One monitored key of a space-saving summary
+ */
+typedef struct
+{
+    uint64_t key;           // Key hash, 0 for an empty slot
+    uint32_t count;         // Counted occurrences, an upper bound
+    uint32_t error;         // Possible overcount inherited from the evicted key
+    char label[TOP_LABEL];  // Username or start of the message
+} HeavyHitter;
+
+/**
+ * Space-saving summary structure - The TOP_K most frequent keys
+ *
+ * An unmonitored key replaces the entry with the lowest count and
+ * inherits that count as its error. Only occurrences whose sketch
+ * estimate is above the lowest count are fed in, so ordinary messages
+ * never take the lock; the key of such an occurrence could not displace
+ * anything anyway. count - error stays a lower bound of the true count.
+ */
+typedef struct
+{
+    HeavyHitter items[TOP_K];
+    atomic_uint floor;      // Lowest count in items, 0 while a slot is free
+    pthread_mutex_t lock;
+} TopK;
+
+/**
+ * Stream structure - Sketch and summary of one kind of key
+ */
+typedef struct
+{
+    const char *name;
+    Sketch sketch;
+    TopK top;
+} Stream;
+
+static Stream senders = {.name = "senders", .top.lock = PTHREAD_MUTEX_INITIALIZER};
+static Stream contents = {.name = "contents", .top.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static atomic_ullong window_epoch; // Current window number, 0 before the first message
+static atomic_ulong observed;
+static atomic_ulong dropped_senders;
+static atomic_ulong dropped_contents;
+
+/**
+ * Hashes a byte string (64-bit FNV-1a with a final mix)
+ */
+static uint64_t hash_bytes(const void *data, size_t len, uint64_t seed)
+{
+    const uint8_t *p = data;
+    uint64_t h = 14695981039346656037ULL ^ seed;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+/**
+ * Adds one occurrence of a key and returns its estimated count
+ *
+ * Row positions come from two halves of the key hash (double hashing).
+ */
+static uint32_t sketch_add(Sketch *sketch, uint64_t key)
+{
+    uint32_t h1 = (uint32_t)key;
+    uint32_t h2 = (uint32_t)(key >> 32) | 1;
+    uint32_t estimate = UINT32_MAX;
+    for (int row = 0; row < SKETCH_DEPTH; row++)
+    {
+        uint32_t col = (h1 + row * h2) & (SKETCH_WIDTH - 1);
+        uint32_t count = atomic_fetch_add_explicit(&sketch->rows[row][col], 1, memory_order_relaxed) + 1;
+        if (count < estimate)
+            estimate = count;
+    }
+    return estimate;
+}
+
+/**
+ * Counts a key in a space-saving summary
+ *
+ * @return The key's guaranteed count, count - error
+ */
+static uint32_t top_add(TopK *top, uint64_t key, const char *label, size_t label_len)
+{
+    pthread_mutex_lock(&top->lock);
+    HeavyHitter *item = NULL;
+    HeavyHitter *min = &top->items[0];
+    for (int i = 0; i < TOP_K && !item; i++)
+    {
+        if (top->items[i].key == key)
+            item = &top->items[i];
+        else if (top->items[i].count < min->count)
+            min = &top->items[i];
+    }
+
+    if (item)
+    {
+        item->count++;
+    }
+    else
+    {
+        item = min;
+        item->error = item->count;
+        item->count++;
+        item->key = key;
+        if (label_len >= TOP_LABEL)
+            label_len = TOP_LABEL - 1;
+        for (size_t i = 0; i < label_len; i++)
+            item->label[i] = (uint8_t)label[i] < 0x20 ? '?' : label[i];
+        item->label[label_len] = '\0';
+    }
+
+    uint32_t floor = UINT32_MAX;
+    for (int i = 0; i < TOP_K; i++)
+    {
+        uint32_t count = top->items[i].key ? top->items[i].count : 0;
+        if (count < floor)
+            floor = count;
+    }
+    atomic_store_explicit(&top->floor, floor, memory_order_relaxed);
+
+    uint32_t guaranteed = item->count - item->error;
+    pthread_mutex_unlock(&top->lock);
+    return guaranteed;
+}
+
+/**
+ * Clears a stream for a new window
+ *
+ * Increments racing with the reset may be lost or kept, which only
+ * shifts a few counts between adjacent windows.
+ */
+static void stream_reset(Stream *stream)
+{
+    for (int row = 0; row < SKETCH_DEPTH; row++)
+        for (int col = 0; col < SKETCH_WIDTH; col++)
+            atomic_store_explicit(&stream->sketch.rows[row][col], 0, memory_order_relaxed);
+
+    pthread_mutex_lock(&stream->top.lock);
+    memset(stream->top.items, 0, sizeof(stream->top.items));
+    atomic_store_explicit(&stream->top.floor, 0, memory_order_relaxed);
+    pthread_mutex_unlock(&stream->top.lock);
+}
+
+/**
+ * Starts a new window if the current one has ended
+ *
+ * The thread that advances the epoch clears both streams.
+ *
+ * @return Number of the current window
+ */
+static unsigned long long roll_window(const Config *cfg)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long long epoch = ((unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000) / cfg->spam_window_ms + 1;
+
+    unsigned long long seen = atomic_load_explicit(&window_epoch, memory_order_relaxed);
+    if (seen != epoch && atomic_compare_exchange_strong(&window_epoch, &seen, epoch))
+    {
+        stream_reset(&senders);
+        stream_reset(&contents);
+    }
+    return epoch;
+}
+
+/**
+ * Counts a chat message by sender and by content
+ *
+ * Called on the receive path before routing. The sketches cover every
+ * session, so a flood spread over reconnects or over several bots is
+ * still seen. Sketch estimates only overcount, so they decide when a
+ * message is safely under a limit; dropping needs an exact count. A
+ * sender is limited on its own session's count, kept in its rate
+ * bucket, and repeats on the space-saving summary's guaranteed count.
+ *
+ * @param sender Username of the sending session
+ * @param bucket Sending session's rate bucket
+ * @param content Message content
+ * @return NULL to route the message, or the reason it must be dropped
+ */
+const char *spam_observe(const char *sender, RateBucket *bucket, ProtoStr content)
+{
+    const Config *cfg = config_get();
+    unsigned long long epoch = roll_window(cfg);
+    atomic_fetch_add_explicit(&observed, 1, memory_order_relaxed);
+
+    if (bucket->spam_epoch != epoch)
+    {
+        bucket->spam_epoch = epoch;
+        bucket->spam_sent = 0;
+    }
+    bucket->spam_sent++;
+
+    size_t sender_len = strlen(sender);
+    uint64_t sender_key = hash_bytes(sender, sender_len, 0);
+    uint64_t content_key = hash_bytes(content.ptr, content.len, 1);
+
+    uint32_t sent = sketch_add(&senders.sketch, sender_key);
+    uint32_t repeats = sketch_add(&contents.sketch, content_key);
+    if (sent > atomic_load_explicit(&senders.top.floor, memory_order_relaxed))
+        top_add(&senders.top, sender_key, sender, sender_len);
+
+    uint32_t content_max = cfg->spam_content_max;
+    uint32_t guaranteed = 0;
+    if (repeats > atomic_load_explicit(&contents.top.floor, memory_order_relaxed) ||
+        (content_max && repeats > content_max))
+        guaranteed = top_add(&contents.top, content_key, content.ptr, content.len);
+
+    if (cfg->spam_sender_max && bucket->spam_sent > (uint32_t)cfg->spam_sender_max)
+    {
+        atomic_fetch_add_explicit(&dropped_senders, 1, memory_order_relaxed);
+        return "Too many messages, slow down";
+    }
+    if (content_max && guaranteed > content_max)
+    {
+        atomic_fetch_add_explicit(&dropped_contents, 1, memory_order_relaxed);
+        return "Message repeated too often, dropped";
+    }
+    return NULL;
+}
+
+/**
+ * Orders heavy hitters by descending count
+ */
+static int compare_count(const void *a, const void *b)
+{
+    uint32_t x = ((const HeavyHitter *)a)->count;
+    uint32_t y = ((const HeavyHitter *)b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/**
+ * Writes the heavy hitters of one stream
+ *
+ * @param fd Admin connection to write to
+ * @param stream Stream to report
+ * @param limit Configured per-window limit, 0 if none
+ */
+static void report_stream(int fd, Stream *stream, int limit)
+{
+    HeavyHitter items[TOP_K];
+    pthread_mutex_lock(&stream->top.lock);
+    memcpy(items, stream->top.items, sizeof(items));
+    pthread_mutex_unlock(&stream->top.lock);
+    qsort(items, TOP_K, sizeof(HeavyHitter), compare_count);
+
+    dprintf(fd, "top %s (limit %d):\n", stream->name, limit);
+    for (int i = 0; i < TOP_K && items[i].key; i++)
+    {
+        dprintf(fd, "  %8u (+/-%u) %s%s\n", items[i].count, items[i].error, items[i].label,
+                limit && items[i].count - items[i].error > (uint32_t)limit ? "  [flagged]" : "");
+    }
+}
+
+/**
+ * Writes flood detection counters and the current heavy hitters
+ *
+ * @param fd Admin connection to write to
+ */
+void spam_report(int fd)
+{
+    const Config *cfg = config_get();
+    int window_ms = cfg->spam_window_ms, sender_max = cfg->spam_sender_max, content_max = cfg->spam_content_max;
+    dprintf(fd, "window %d ms, messages %lu, dropped by sender %lu, dropped as repeats %lu\n",
+            window_ms, atomic_load_explicit(&observed, memory_order_relaxed),
+            atomic_load_explicit(&dropped_senders, memory_order_relaxed),
+            atomic_load_explicit(&dropped_contents, memory_order_relaxed));
+    report_stream(fd, &senders, sender_max);
+    report_stream(fd, &contents, content_max);
+}
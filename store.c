@@ -0,0 +1,1234 @@
+#include "server.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define STORE_MAGIC "CHATSEG1"
+#define STORE_HEADER_SIZE 32    // magic, dict id, block count, record count, reserved, index offset
+#define STORE_INDEX_ENTRY 40    // offset, stored, raw, first record, records, first/last timestamp
+#define STORE_BLOCK_BYTES 8192  // Uncompressed records per block, the unit of a point read
+#define STORE_DICT_BYTES 16384  // Dictionary size; deflate can reference at most 32 KiB
+#define STORE_DICT_SEGMENT 64   // Dictionary training picks samples of this size
+#define STORE_DICT_K 8          // Length of the substrings counted during training
+#define STORE_DICT_HASH_BITS 20 // Counter table size for training
+#define STORE_DICT_CACHE 4      // Dictionaries kept loaded for reads
+#define STORE_RETENTION_INTERVAL 10  // Seconds between retention passes
+#define STORE_COMPACT_MIN_EXPIRED 25 // Percent of a segment that must be expired before it is rewritten
+
+/**
+ * Segment info structure - Summary of one immutable segment file
+ */
+typedef struct
+{
+    uint32_t seq;        // Segment number, also in the file name
+    uint32_t dict_id;    // Dictionary the blocks were compressed with, 0 = none
+    uint32_t blocks;     // Number of independently compressed blocks
+    uint32_t records;    // Number of records
+    uint64_t raw_bytes;  // Uncompressed record bytes
+    uint64_t file_bytes; // Size on disk
+    uint64_t first_ts;   // Timestamp of the first record in ms
+    uint64_t last_ts;    // Timestamp of the last record in ms
+} SegmentInfo;
+
+/**
+ * Dictionary structure - Preset deflate dictionary trained on recent traffic
+ */
+typedef struct
+{
+    uint32_t id; // Sequence of the segment it was trained on, 0 = unused entry
+    size_t len;
+    uint8_t data[STORE_DICT_BYTES];
+} StoreDict;
+
+static char store_dir[CONFIG_PATH_MAX];
+static int store_enabled = 0;
+static uint32_t next_seq = 1;
+static uint32_t *pending = NULL; // Sealed journals waiting for compression
+static int pending_count = 0;
+static int pending_capacity = 0;
+static SegmentInfo *segments = NULL; // Sorted by seq
+static int segment_count = 0;
+static int segment_capacity = 0;
+static int segments_since_training = 0;
+static StoreDict current_dict; // Dictionary used for new segments
+static StoreDict dict_cache[STORE_DICT_CACHE];
+static int dict_cache_next = 0;
+static pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t store_cond = PTHREAD_COND_INITIALIZER;
+
+// Retention state, owned by the retention thread; counters are read by the admin socket
+static double io_tokens;             // Compaction bytes that may be transferred right now
+static struct timespec io_refilled;  // Last refill of io_tokens
+static atomic_ulong segments_deleted;
+static atomic_ulong segments_compacted;
+static atomic_ulong bytes_reclaimed;
+static atomic_ulong throttled_ms;
+
+/**
+ * Formats the path of a store file
+ *
+ * @param out Destination buffer
+ * @param cap Size of out
+ * @param kind File kind: "journal", "segment" or "dict"
+ * @param seq Sequence number
+ */
+static void store_path(char *out, size_t cap, const char *kind, uint32_t seq)
+{
+    const char *ext = strcmp(kind, "journal") == 0 ? "log" : strcmp(kind, "segment") == 0 ? "seg" : "bin";
+    snprintf(out, cap, "%s/%s-%08u.%s", store_dir, kind, seq, ext);
+}
+
+/**
+ * Makes renames and unlinks in the store directory durable
+ */
+static void sync_dir(void)
+{
+    int fd = open(store_dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/**
+ * Reads a whole file into memory
+ *
+ * @param path File path
+ * @param size Output for the file size
+ * @return Malloc'd contents the caller must free, or NULL on failure
+ */
+static uint8_t *read_file(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    uint8_t *data = NULL;
+    if (fstat(fd, &st) == 0)
+        data = malloc(st.st_size ? st.st_size : 1);
+    if (data && pread(fd, data, st.st_size, 0) != st.st_size)
+    {
+        free(data);
+        data = NULL;
+    }
+    close(fd);
+    *size = data ? (size_t)st.st_size : 0;
+    return data;
+}
+
+/**
+ * Writes a whole buffer at an offset
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int pwrite_all(int fd, const void *data, size_t len, off_t offset)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = pwrite(fd, (const uint8_t *)data + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/**
+ * Hashes the STORE_DICT_K bytes at p into the training counter table
+ */
+static uint32_t kmer_hash(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return (uint32_t)((v * 0x9E3779B97F4A7C15ull) >> (64 - STORE_DICT_HASH_BITS));
+}
+
+/**
+ * Trains a deflate dictionary on a sample of records
+ *
+ * A simplified COVER selection: every STORE_DICT_K-byte substring of the
+ * sample is counted, the sample is split into one epoch per dictionary
+ * slot, and each epoch contributes its STORE_DICT_SEGMENT-byte window
+ * whose substrings are most frequent overall. Counts of chosen substrings
+ * are cleared so later picks add new content. Windows are laid out with
+ * the best last, since deflate encodes nearer matches more cheaply.
+ *
+ * @param sample Journal records back to back
+ * @param len Sample length
+ * @param dict Dictionary to fill
+ */
+static void train_dict(const uint8_t *sample, size_t len, StoreDict *dict)
+{
+    dict->len = 0;
+    if (len <= STORE_DICT_BYTES)
+    {
+        memcpy(dict->data, sample, len);
+        dict->len = len;
+        return;
+    }
+
+    uint16_t *counts = calloc((size_t)1 << STORE_DICT_HASH_BITS, sizeof(uint16_t));
+    if (!counts)
+        return;
+    for (size_t i = 0; i + STORE_DICT_K <= len; i++)
+    {
+        uint32_t h = kmer_hash(sample + i);
+        if (counts[h] < UINT16_MAX)
+            counts[h]++;
+    }
+
+    int slots = STORE_DICT_BYTES / STORE_DICT_SEGMENT;
+    size_t epoch = len / slots;
+    size_t *picks = malloc(slots * sizeof(size_t));
+    uint64_t *scores = malloc(slots * sizeof(uint64_t));
+    int picked = 0;
+    if (!picks || !scores || epoch < STORE_DICT_SEGMENT)
+        slots = 0;
+
+    for (int e = 0; e < slots; e++)
+    {
+        // Slide a window over the epoch keeping the sum of its substring counts
+        size_t start = e * epoch;
+        size_t kmers = STORE_DICT_SEGMENT - STORE_DICT_K + 1;
+        uint64_t sum = 0;
+        for (size_t i = 0; i < kmers; i++)
+            sum += counts[kmer_hash(sample + start + i)];
+
+        uint64_t best = sum;
+        size_t best_at = start;
+        for (size_t at = start + 1; at + STORE_DICT_SEGMENT <= start + epoch; at++)
+        {
+            sum -= counts[kmer_hash(sample + at - 1)];
+            sum += counts[kmer_hash(sample + at + kmers - 1)];
+            if (sum > best)
+            {
+                best = sum;
+                best_at = at;
+            }
+        }
+        if (best == 0)
+            continue;
+
+        for (size_t i = 0; i < kmers; i++)
+            counts[kmer_hash(sample + best_at + i)] = 0;
+
+        // Insertion sort by ascending score
+        int pos = picked++;
+        while (pos > 0 && scores[pos - 1] > best)
+        {
+            scores[pos] = scores[pos - 1];
+            picks[pos] = picks[pos - 1];
+            pos--;
+        }
+        scores[pos] = best;
+        picks[pos] = best_at;
+    }
+
+    for (int i = 0; i < picked; i++)
+    {
+        memcpy(dict->data + dict->len, sample + picks[i], STORE_DICT_SEGMENT);
+        dict->len += STORE_DICT_SEGMENT;
+    }
+    free(scores);
+    free(picks);
+    free(counts);
+}
+
+/**
+ * Loads a dictionary for reading, from the cache or its file
+ *
+ * Must be called with store_mutex held.
+ *
+ * @param id Dictionary id
+ * @return The dictionary, or NULL if it cannot be read
+ */
+static const StoreDict *load_dict(uint32_t id)
+{
+    if (current_dict.id == id)
+        return &current_dict;
+    for (int i = 0; i < STORE_DICT_CACHE; i++)
+    {
+        if (dict_cache[i].id == id)
+            return &dict_cache[i];
+    }
+
+    char path[CONFIG_PATH_MAX + 32];
+    store_path(path, sizeof(path), "dict", id);
+    size_t size;
+    uint8_t *data = read_file(path, &size);
+    if (!data || size > STORE_DICT_BYTES)
+    {
+        free(data);
+        return NULL;
+    }
+
+    StoreDict *dict = &dict_cache[dict_cache_next];
+    dict_cache_next = (dict_cache_next + 1) % STORE_DICT_CACHE;
+    dict->id = id;
+    dict->len = size;
+    memcpy(dict->data, data, size);
+    free(data);
+    return dict;
+}
+
+/**
+ * Saves a freshly trained dictionary and makes it current
+ *
+ * @param dict Trained dictionary with its id set
+ * @return 0 on success, -1 on failure
+ */
+static int save_dict(const StoreDict *dict)
+{
+    char path[CONFIG_PATH_MAX + 32], tmp[CONFIG_PATH_MAX + 40];
+    store_path(path, sizeof(path), "dict", dict->id);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return -1;
+    int rc = pwrite_all(fd, dict->data, dict->len, 0) == 0 && fsync(fd) == 0 ? 0 : -1;
+    close(fd);
+    if (rc == 0)
+        rc = rename(tmp, path);
+    else
+        unlink(tmp);
+    if (rc == 0)
+    {
+        pthread_mutex_lock(&store_mutex);
+        current_dict = *dict;
+        pthread_mutex_unlock(&store_mutex);
+    }
+    return rc;
+}
+
+/**
+ * Inserts or replaces a segment summary, keeping the list sorted
+ *
+ * Must be called with store_mutex held.
+ */
+static void add_segment(const SegmentInfo *info)
+{
+    if (segment_count == segment_capacity)
+    {
+        int capacity = segment_capacity ? segment_capacity * 2 : 16;
+        SegmentInfo *grown = realloc(segments, capacity * sizeof(SegmentInfo));
+        if (!grown)
+            return;
+        segments = grown;
+        segment_capacity = capacity;
+    }
+
+    int pos = segment_count;
+    while (pos > 0 && segments[pos - 1].seq > info->seq)
+        pos--;
+    memmove(&segments[pos + 1], &segments[pos], (segment_count - pos) * sizeof(SegmentInfo));
+    segments[pos] = *info;
+    segment_count++;
+}
+
+/**
+ * Compresses one block of records with the preset dictionary
+ *
+ * @param stream Deflate stream, reset before use
+ * @param dict Dictionary, or NULL
+ * @param raw Records to compress
+ * @param raw_len Length of raw
+ * @param out Destination buffer of at least deflateBound() bytes
+ * @param out_cap Size of out
+ * @return Compressed length, or 0 on failure
+ */
+static size_t compress_block(z_stream *stream, const StoreDict *dict, const uint8_t *raw, size_t raw_len,
+                             uint8_t *out, size_t out_cap)
+{
+    if (deflateReset(stream) != Z_OK)
+        return 0;
+    if (dict && dict->len && deflateSetDictionary(stream, dict->data, dict->len) != Z_OK)
+        return 0;
+
+    stream->next_in = (Bytef *)raw;
+    stream->avail_in = raw_len;
+    stream->next_out = out;
+    stream->avail_out = out_cap;
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END)
+        return 0;
+    return out_cap - stream->avail_out;
+}
+
+/**
+ * Decompresses one block
+ *
+ * @param dict_id Dictionary the block was compressed with, 0 = none
+ * @param stored Compressed block
+ * @param stored_len Length of stored
+ * @param raw Destination for the records
+ * @param raw_len Exact uncompressed length from the index
+ * @return 0 on success, -1 if the block or its dictionary is unreadable
+ */
+static int inflate_block(uint32_t dict_id, const uint8_t *stored, size_t stored_len, uint8_t *raw, size_t raw_len)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, -15) != Z_OK)
+        return -1;
+
+    int ok = 1;
+    if (dict_id)
+    {
+        pthread_mutex_lock(&store_mutex);
+        const StoreDict *dict = load_dict(dict_id);
+        ok = dict && inflateSetDictionary(&stream, dict->data, dict->len) == Z_OK;
+        pthread_mutex_unlock(&store_mutex);
+    }
+    stream.next_in = (Bytef *)stored;
+    stream.avail_in = stored_len;
+    stream.next_out = raw;
+    stream.avail_out = raw_len;
+    ok = ok && inflate(&stream, Z_FINISH) == Z_STREAM_END && stream.avail_out == 0;
+    inflateEnd(&stream);
+    return ok ? 0 : -1;
+}
+
+/**
+ * Converts a sealed journal into an immutable compressed segment
+ *
+ * Records are grouped into blocks of up to STORE_BLOCK_BYTES that are
+ * compressed independently, so reading one record inflates one block.
+ * An index of block offsets and record ranges follows the blocks. The
+ * segment is written under a temporary name and renamed when complete,
+ * then the journal is removed.
+ *
+ * @param seq Sequence number of the sealed journal
+ * @return 0 on success, -1 on failure
+ */
+static int build_segment(uint32_t seq)
+{
+    char journal[CONFIG_PATH_MAX + 32], path[CONFIG_PATH_MAX + 32], tmp[CONFIG_PATH_MAX + 40];
+    store_path(journal, sizeof(journal), "journal", seq);
+    store_path(path, sizeof(path), "segment", seq);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    size_t size;
+    uint8_t *data = read_file(journal, &size);
+    if (!data)
+        return -1;
+
+    // Retrain on this journal when the dictionary is missing or stale
+    const Config *cfg = config_get();
+    StoreDict *trained = NULL;
+    if (current_dict.id == 0 || ++segments_since_training >= cfg->dict_retrain_segments)
+    {
+        trained = malloc(sizeof(StoreDict));
+        if (trained)
+        {
+            train_dict(data, size, trained);
+            trained->id = seq;
+            if (trained->len == 0 || save_dict(trained) < 0)
+            {
+                free(trained);
+                trained = NULL;
+            }
+            else
+            {
+                segments_since_training = 0;
+            }
+        }
+    }
+    StoreDict dict = current_dict;
+    free(trained);
+
+    size_t index_cap = size / STORE_BLOCK_BYTES + 2;
+    uint8_t *index = malloc(index_cap * STORE_INDEX_ENTRY);
+    size_t out_cap = compressBound(STORE_BLOCK_BYTES + JOURNAL_RECORD_HEADER + PROTO_MAX_FRAME);
+    uint8_t *out = malloc(out_cap);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    int ok = index && out && fd >= 0 &&
+             deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY) == Z_OK;
+
+    SegmentInfo info = {.seq = seq, .dict_id = dict.id};
+    uint64_t offset = STORE_HEADER_SIZE;
+    size_t pos = 0;
+    while (ok && pos < size)
+    {
+        // Gather whole records up to the block size
+        size_t start = pos;
+        uint32_t block_records = 0;
+        uint64_t first_ts = 0, last_ts = 0;
+        size_t rec;
+        while (pos < size && (rec = journal_record_size(data + pos, size - pos)) > 0 &&
+               (block_records == 0 || pos + rec - start <= STORE_BLOCK_BYTES))
+        {
+            last_ts = proto_get_u64(data + pos + 4);
+            if (block_records++ == 0)
+                first_ts = last_ts;
+            pos += rec;
+        }
+        if (block_records == 0)
+            break; // Zero padding or a torn tail ends the journal
+
+        size_t stored = compress_block(&stream, &dict, data + start, pos - start, out, out_cap);
+        if (stored == 0 || pwrite_all(fd, out, stored, offset) < 0)
+        {
+            ok = 0;
+            break;
+        }
+
+        uint8_t *entry = index + info.blocks * STORE_INDEX_ENTRY;
+        proto_put_u64(entry, offset);
+        proto_put_u32(entry + 8, stored);
+        proto_put_u32(entry + 12, pos - start);
+        proto_put_u32(entry + 16, info.records);
+        proto_put_u32(entry + 20, block_records);
+        proto_put_u64(entry + 24, first_ts);
+        proto_put_u64(entry + 32, last_ts);
+
+        if (info.records == 0)
+            info.first_ts = first_ts;
+        info.last_ts = last_ts;
+        info.records += block_records;
+        info.raw_bytes += pos - start;
+        info.blocks++;
+        offset += stored;
+    }
+    if (stream.state)
+        deflateEnd(&stream);
+
+    uint8_t header[STORE_HEADER_SIZE] = STORE_MAGIC;
+    proto_put_u32(header + 8, info.dict_id);
+    proto_put_u32(header + 12, info.blocks);
+    proto_put_u32(header + 16, info.records);
+    proto_put_u64(header + 24, offset);
+    ok = ok && pwrite_all(fd, index, info.blocks * STORE_INDEX_ENTRY, offset) == 0 &&
+         pwrite_all(fd, header, sizeof(header), 0) == 0 && fsync(fd) == 0;
+    info.file_bytes = offset + info.blocks * STORE_INDEX_ENTRY;
+
+    if (fd >= 0)
+        close(fd);
+    free(out);
+    free(index);
+    free(data);
+
+    if (ok && info.records == 0)
+    {
+        // Nothing but padding, e.g. sealed right after a restart
+        unlink(tmp);
+        unlink(journal);
+        return 0;
+    }
+    if (!ok || rename(tmp, path) < 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    unlink(journal);
+    sync_dir();
+
+    pthread_mutex_lock(&store_mutex);
+    add_segment(&info);
+    pthread_mutex_unlock(&store_mutex);
+    return 0;
+}
+
+/**
+ * Reads the summary of an existing segment from its header and index
+ *
+ * @param seq Segment number
+ * @param info Output summary
+ * @return 0 on success, -1 if the file is missing or malformed
+ */
+static int load_segment_info(uint32_t seq, SegmentInfo *info)
+{
+    char path[CONFIG_PATH_MAX + 32];
+    store_path(path, sizeof(path), "segment", seq);
+    size_t size;
+    uint8_t *data = read_file(path, &size);
+    if (!data)
+        return -1;
+
+    int rc = -1;
+    if (size >= STORE_HEADER_SIZE && memcmp(data, STORE_MAGIC, 8) == 0)
+    {
+        memset(info, 0, sizeof(*info));
+        info->seq = seq;
+        info->dict_id = proto_get_u32(data + 8);
+        info->blocks = proto_get_u32(data + 12);
+        info->records = proto_get_u32(data + 16);
+        info->file_bytes = size;
+        uint64_t index = proto_get_u64(data + 24);
+        if (index <= size && (size - index) / STORE_INDEX_ENTRY >= info->blocks)
+        {
+            for (uint32_t b = 0; b < info->blocks; b++)
+            {
+                const uint8_t *entry = data + index + b * STORE_INDEX_ENTRY;
+                info->raw_bytes += proto_get_u32(entry + 12);
+                if (b == 0)
+                    info->first_ts = proto_get_u64(entry + 24);
+                info->last_ts = proto_get_u64(entry + 32);
+            }
+            rc = 0;
+        }
+    }
+    free(data);
+    return rc;
+}
+
+/**
+ * Store thread - Compresses sealed journals into segments
+ *
+ * @param arg Unused
+ * @return Never returns
+ */
+static void *store_thread(void *arg)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&store_mutex);
+        while (pending_count == 0)
+            pthread_cond_wait(&store_cond, &store_mutex);
+        uint32_t seq = pending[0];
+        pthread_mutex_unlock(&store_mutex);
+
+        if (build_segment(seq) < 0)
+            format_whiteboard_msg(MSG_TYPE_ERROR, "Failed to build history segment %u", seq);
+
+        // A failed journal is left on disk and retried on the next start
+        pthread_mutex_lock(&store_mutex);
+        memmove(&pending[0], &pending[1], (pending_count - 1) * sizeof(uint32_t));
+        pending_count--;
+        pthread_mutex_unlock(&store_mutex);
+    }
+
+    return NULL;
+}
+
+/**
+ * Queues a sealed journal for compression
+ *
+ * Must be called with store_mutex held.
+ */
+static int queue_pending(uint32_t seq)
+{
+    if (pending_count == pending_capacity)
+    {
+        int capacity = pending_capacity ? pending_capacity * 2 : 8;
+        uint32_t *grown = realloc(pending, capacity * sizeof(uint32_t));
+        if (!grown)
+            return -1;
+        pending = grown;
+        pending_capacity = capacity;
+    }
+    pending[pending_count++] = seq;
+    pthread_cond_signal(&store_cond);
+    return 0;
+}
+
+/**
+ * Charges compaction I/O against the compaction_kbps budget
+ *
+ * Refills a token bucket holding at most one second of budget and sleeps
+ * off any debt, so compaction stays below the configured bandwidth no
+ * matter how much expired data has piled up.
+ *
+ * @param bytes Bytes about to be read or written
+ */
+static void io_throttle(size_t bytes)
+{
+    double rate = config_get()->compaction_kbps * 1024.0;
+    if (rate <= 0)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (io_refilled.tv_sec == 0)
+        io_tokens = rate;
+    else
+        io_tokens += ((now.tv_sec - io_refilled.tv_sec) + (now.tv_nsec - io_refilled.tv_nsec) / 1e9) * rate;
+    io_refilled = now;
+    if (io_tokens > rate)
+        io_tokens = rate;
+
+    io_tokens -= bytes;
+    if (io_tokens < 0)
+    {
+        double wait = -io_tokens / rate;
+        struct timespec ts = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+        nanosleep(&ts, NULL);
+        atomic_fetch_add(&throttled_ms, (unsigned long)(wait * 1000));
+    }
+}
+
+/**
+ * Drops a segment summary from the list
+ *
+ * Must be called with store_mutex held.
+ */
+static void remove_segment(uint32_t seq)
+{
+    for (int i = 0; i < segment_count; i++)
+    {
+        if (segments[i].seq == seq)
+        {
+            memmove(&segments[i], &segments[i + 1], (segment_count - i - 1) * sizeof(SegmentInfo));
+            segment_count--;
+            return;
+        }
+    }
+}
+
+/**
+ * Deletes a whole segment
+ *
+ * @param info Segment to delete
+ */
+static void delete_segment(const SegmentInfo *info)
+{
+    char path[CONFIG_PATH_MAX + 32];
+    store_path(path, sizeof(path), "segment", info->seq);
+    if (unlink(path) < 0 && errno != ENOENT)
+        return;
+
+    pthread_mutex_lock(&store_mutex);
+    remove_segment(info->seq);
+    pthread_mutex_unlock(&store_mutex);
+    atomic_fetch_add(&segments_deleted, 1);
+    atomic_fetch_add(&bytes_reclaimed, info->file_bytes);
+}
+
+/**
+ * Rewrites a segment without its records older than a cutoff
+ *
+ * Blocks that expired entirely are skipped and blocks that are entirely
+ * live are copied without recompression; only the block straddling the
+ * cutoff is inflated, filtered and deflated again. Surviving records are
+ * renumbered from 0. All reads and writes are charged to the I/O budget.
+ *
+ * @param info Segment to compact
+ * @param cutoff Oldest timestamp to keep, in ms
+ * @return 0 on success, -1 on failure (the segment is left unchanged)
+ */
+static int compact_segment(const SegmentInfo *info, uint64_t cutoff)
+{
+    char path[CONFIG_PATH_MAX + 32], tmp[CONFIG_PATH_MAX + 40];
+    store_path(path, sizeof(path), "segment", info->seq);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    int in = open(path, O_RDONLY);
+    if (in < 0)
+        return -1;
+
+    size_t index_len = (size_t)info->blocks * STORE_INDEX_ENTRY;
+    size_t raw_cap = STORE_BLOCK_BYTES + JOURNAL_RECORD_HEADER + PROTO_MAX_FRAME;
+    size_t stored_cap = compressBound(raw_cap);
+    uint8_t header[STORE_HEADER_SIZE];
+    uint8_t *index = malloc(index_len);
+    uint8_t *out_index = malloc(index_len);
+    uint8_t *stored = malloc(stored_cap);
+    uint8_t *raw = malloc(raw_cap);
+    StoreDict *dict = malloc(sizeof(StoreDict));
+    int out = -1;
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    io_throttle(sizeof(header) + index_len);
+    int ok = index && out_index && stored && raw && dict &&
+             pread(in, header, sizeof(header), 0) == sizeof(header) && memcmp(header, STORE_MAGIC, 8) == 0 &&
+             proto_get_u32(header + 12) == info->blocks &&
+             pread(in, index, index_len, proto_get_u64(header + 24)) == (ssize_t)index_len;
+
+    // The straddling block is recompressed with the segment's own dictionary
+    if (ok)
+    {
+        dict->id = info->dict_id;
+        dict->len = 0;
+        if (info->dict_id)
+        {
+            pthread_mutex_lock(&store_mutex);
+            const StoreDict *loaded = load_dict(info->dict_id);
+            if (loaded)
+                *dict = *loaded;
+            else
+                ok = 0;
+            pthread_mutex_unlock(&store_mutex);
+        }
+    }
+    ok = ok && (out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) >= 0 &&
+         deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY) == Z_OK;
+
+    SegmentInfo result = {.seq = info->seq, .dict_id = info->dict_id};
+    uint64_t offset = STORE_HEADER_SIZE;
+    for (uint32_t b = 0; ok && b < info->blocks; b++)
+    {
+        const uint8_t *entry = index + b * STORE_INDEX_ENTRY;
+        uint32_t stored_len = proto_get_u32(entry + 8);
+        uint32_t raw_len = proto_get_u32(entry + 12);
+        uint32_t records = proto_get_u32(entry + 20);
+        uint64_t first_ts = proto_get_u64(entry + 24);
+        uint64_t last_ts = proto_get_u64(entry + 32);
+        if (last_ts < cutoff)
+            continue;
+        if (stored_len > stored_cap || raw_len > raw_cap)
+        {
+            ok = 0;
+            break;
+        }
+
+        io_throttle(stored_len);
+        if (pread(in, stored, stored_len, proto_get_u64(entry)) != (ssize_t)stored_len)
+        {
+            ok = 0;
+            break;
+        }
+
+        if (first_ts < cutoff)
+        {
+            // Keep only the live records of the straddling block
+            if (inflate_block(info->dict_id, stored, stored_len, raw, raw_len) < 0)
+            {
+                ok = 0;
+                break;
+            }
+            size_t kept = 0, pos = 0, rec;
+            records = 0;
+            while ((rec = journal_record_size(raw + pos, raw_len - pos)) > 0)
+            {
+                uint64_t ts = proto_get_u64(raw + pos + 4);
+                if (ts >= cutoff)
+                {
+                    if (records++ == 0)
+                        first_ts = ts;
+                    memmove(raw + kept, raw + pos, rec);
+                    kept += rec;
+                }
+                pos += rec;
+            }
+            raw_len = kept;
+            stored_len = compress_block(&stream, dict, raw, raw_len, stored, stored_cap);
+            if (stored_len == 0)
+            {
+                ok = 0;
+                break;
+            }
+        }
+
+        io_throttle(stored_len);
+        if (pwrite_all(out, stored, stored_len, offset) < 0)
+        {
+            ok = 0;
+            break;
+        }
+
+        uint8_t *out_entry = out_index + result.blocks * STORE_INDEX_ENTRY;
+        proto_put_u64(out_entry, offset);
+        proto_put_u32(out_entry + 8, stored_len);
+        proto_put_u32(out_entry + 12, raw_len);
+        proto_put_u32(out_entry + 16, result.records);
+        proto_put_u32(out_entry + 20, records);
+        proto_put_u64(out_entry + 24, first_ts);
+        proto_put_u64(out_entry + 32, last_ts);
+
+        if (result.blocks++ == 0)
+            result.first_ts = first_ts;
+        result.last_ts = last_ts;
+        result.records += records;
+        result.raw_bytes += raw_len;
+        offset += stored_len;
+    }
+    if (stream.state)
+        deflateEnd(&stream);
+
+    uint8_t out_header[STORE_HEADER_SIZE] = STORE_MAGIC;
+    proto_put_u32(out_header + 8, result.dict_id);
+    proto_put_u32(out_header + 12, result.blocks);
+    proto_put_u32(out_header + 16, result.records);
+    proto_put_u64(out_header + 24, offset);
+    result.file_bytes = offset + (uint64_t)result.blocks * STORE_INDEX_ENTRY;
+    if (ok)
+        io_throttle(sizeof(out_header) + result.blocks * STORE_INDEX_ENTRY);
+    ok = ok && pwrite_all(out, out_index, result.blocks * STORE_INDEX_ENTRY, offset) == 0 &&
+         pwrite_all(out, out_header, sizeof(out_header), 0) == 0 && fsync(out) == 0;
+
+    if (out >= 0)
+        close(out);
+    close(in);
+    free(dict);
+    free(raw);
+    free(stored);
+    free(out_index);
+    free(index);
+
+    if (!ok || rename(tmp, path) < 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    sync_dir();
+
+    pthread_mutex_lock(&store_mutex);
+    remove_segment(info->seq);
+    add_segment(&result);
+    pthread_mutex_unlock(&store_mutex);
+    atomic_fetch_add(&segments_compacted, 1);
+    atomic_fetch_add(&bytes_reclaimed, info->file_bytes - result.file_bytes);
+    return 0;
+}
+
+/**
+ * Deletes dictionaries that no segment uses any more
+ */
+static void remove_unused_dicts(void)
+{
+    DIR *d = opendir(store_dir);
+    if (!d)
+        return;
+
+    struct dirent *entry;
+    pthread_mutex_lock(&store_mutex);
+    while ((entry = readdir(d)))
+    {
+        unsigned id;
+        char ext[8];
+        if (sscanf(entry->d_name, "dict-%u.%3s", &id, ext) != 2 || strcmp(ext, "bin") != 0 ||
+            id == current_dict.id)
+            continue;
+
+        int used = 0;
+        for (int i = 0; i < segment_count && !used; i++)
+            used = segments[i].dict_id == id;
+        if (used)
+            continue;
+
+        char path[CONFIG_PATH_MAX + 32];
+        store_path(path, sizeof(path), "dict", id);
+        unlink(path);
+        for (int i = 0; i < STORE_DICT_CACHE; i++)
+        {
+            if (dict_cache[i].id == id)
+                dict_cache[i].id = 0;
+        }
+    }
+    pthread_mutex_unlock(&store_mutex);
+    closedir(d);
+}
+
+/**
+ * Applies the retention policy once
+ *
+ * Segments are visited oldest first. A segment is deleted when all of it
+ * is older than retention_hours or the store is above retention_mb; a
+ * segment that is partly expired is compacted once at least
+ * STORE_COMPACT_MIN_EXPIRED percent of its time span has expired, so
+ * each segment is rewritten a bounded number of times.
+ */
+static void retention_pass(void)
+{
+    const Config *cfg = config_get();
+    uint64_t max_age = (uint64_t)cfg->retention_hours * 3600000;
+    uint64_t max_bytes = (uint64_t)cfg->retention_mb * 1024 * 1024;
+    if (!max_age && !max_bytes)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t now_ms = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    uint64_t cutoff = max_age && now_ms > max_age ? now_ms - max_age : 0;
+
+    // Work on a copy so the list lock is not held during file I/O
+    pthread_mutex_lock(&store_mutex);
+    int count = segment_count;
+    SegmentInfo *list = malloc((count ? count : 1) * sizeof(SegmentInfo));
+    if (list)
+        memcpy(list, segments, count * sizeof(SegmentInfo));
+    pthread_mutex_unlock(&store_mutex);
+    if (!list)
+        return;
+
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++)
+        total += list[i].file_bytes;
+
+    for (int i = 0; i < count; i++)
+    {
+        const SegmentInfo *s = &list[i];
+        if ((cutoff && s->last_ts < cutoff) || (max_bytes && total > max_bytes))
+        {
+            delete_segment(s);
+            total -= s->file_bytes;
+            continue;
+        }
+
+        uint64_t span = s->last_ts - s->first_ts;
+        if (cutoff && s->first_ts < cutoff && span &&
+            (cutoff - s->first_ts) * 100 / span >= STORE_COMPACT_MIN_EXPIRED)
+        {
+            if (compact_segment(s, cutoff) < 0)
+                format_whiteboard_msg(MSG_TYPE_ERROR, "Failed to compact history segment %u", s->seq);
+        }
+    }
+    free(list);
+
+    remove_unused_dicts();
+}
+
+/**
+ * Retention thread - Runs a retention pass every STORE_RETENTION_INTERVAL
+ *
+ * @param arg Unused
+ * @return Never returns
+ */
+static void *retention_thread(void *arg)
+{
+    while (1)
+    {
+        sleep(STORE_RETENTION_INTERVAL);
+        retention_pass();
+    }
+
+    return NULL;
+}
+
+/**
+ * Seals the active journal file so it is compressed into a segment
+ *
+ * Called by the journal writer once the file reached segment_kb and its
+ * last batch is synced. The file is renamed to the next sequence number;
+ * the caller then starts a new journal file.
+ *
+ * @param journal_path Path of the active journal file
+ * @return 0 on success, -1 on failure
+ */
+int store_seal(const char *journal_path)
+{
+    char sealed[CONFIG_PATH_MAX + 32];
+
+    pthread_mutex_lock(&store_mutex);
+    uint32_t seq = next_seq++;
+    store_path(sealed, sizeof(sealed), "journal", seq);
+    int rc = rename(journal_path, sealed);
+    if (rc == 0)
+    {
+        sync_dir();
+        queue_pending(seq);
+    }
+    pthread_mutex_unlock(&store_mutex);
+    return rc;
+}
+
+/**
+ * Reads one record from a segment
+ *
+ * Binary-searches the block index for the record, then reads and inflates
+ * that single block.
+ *
+ * @param segment Segment number
+ * @param index Record number within the segment
+ * @param frame Destination for the frame
+ * @param cap Size of frame
+ * @param timestamp Output for the record timestamp in ms, may be NULL
+ * @return Frame length, or -1 if the record does not exist or is unreadable
+ */
+int store_read(uint32_t segment, uint32_t index, uint8_t *frame, size_t cap, uint64_t *timestamp)
+{
+    char path[CONFIG_PATH_MAX + 32];
+    store_path(path, sizeof(path), "segment", segment);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    int result = -1;
+    uint8_t header[STORE_HEADER_SIZE];
+    uint8_t *stored = NULL, *raw = NULL;
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, STORE_MAGIC, 8) != 0)
+        goto done;
+
+    uint32_t dict_id = proto_get_u32(header + 8);
+    uint32_t blocks = proto_get_u32(header + 12);
+    uint64_t index_offset = proto_get_u64(header + 24);
+
+    // Find the last block whose first record is at or before index
+    uint8_t entry[STORE_INDEX_ENTRY];
+    uint32_t lo = 0, hi = blocks;
+    while (hi - lo > 1)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (pread(fd, entry, sizeof(entry), index_offset + (uint64_t)mid * STORE_INDEX_ENTRY) != sizeof(entry))
+            goto done;
+        if (proto_get_u32(entry + 16) <= index)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (blocks == 0 || pread(fd, entry, sizeof(entry), index_offset + (uint64_t)lo * STORE_INDEX_ENTRY) != sizeof(entry))
+        goto done;
+
+    uint64_t offset = proto_get_u64(entry);
+    uint32_t stored_len = proto_get_u32(entry + 8);
+    uint32_t raw_len = proto_get_u32(entry + 12);
+    uint32_t first = proto_get_u32(entry + 16);
+    if (index - first >= proto_get_u32(entry + 20) || raw_len > STORE_BLOCK_BYTES + JOURNAL_RECORD_HEADER + PROTO_MAX_FRAME)
+        goto done;
+
+    stored = malloc(stored_len);
+    raw = malloc(raw_len);
+    if (!stored || !raw || pread(fd, stored, stored_len, offset) != (ssize_t)stored_len)
+        goto done;
+
+    if (inflate_block(dict_id, stored, stored_len, raw, raw_len) < 0)
+        goto done;
+
+    // Walk to the record within the block
+    size_t pos = 0;
+    for (uint32_t i = first;; i++)
+    {
+        size_t rec = journal_record_size(raw + pos, raw_len - pos);
+        if (rec == 0)
+            break;
+        if (i == index)
+        {
+            size_t len = rec - JOURNAL_RECORD_HEADER;
+            if (len <= cap)
+            {
+                memcpy(frame, raw + pos + JOURNAL_RECORD_HEADER, len);
+                if (timestamp)
+                    *timestamp = proto_get_u64(raw + pos + 4);
+                result = (int)len;
+            }
+            break;
+        }
+        pos += rec;
+    }
+
+done:
+    free(raw);
+    free(stored);
+    close(fd);
+    return result;
+}
+
+/**
+ * Opens the segment store and starts its compression thread
+ *
+ * Loads the summaries of existing segments, removes files left over by an
+ * interrupted build, and queues journals sealed before a restart.
+ *
+ * @param dir Store directory, created if missing
+ * @return 0 on success, -1 on failure
+ */
+int store_start(const char *dir)
+{
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        return -1;
+    snprintf(store_dir, sizeof(store_dir), "%s", dir);
+
+    DIR *d = opendir(dir);
+    if (!d)
+        return -1;
+
+    uint32_t newest_dict = 0;
+    struct dirent *entry;
+    pthread_mutex_lock(&store_mutex);
+    while ((entry = readdir(d)))
+    {
+        unsigned seq;
+        char ext[8];
+        char path[CONFIG_PATH_MAX + 300];
+        if (strstr(entry->d_name, ".tmp"))
+        {
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            unlink(path);
+            continue;
+        }
+        if (sscanf(entry->d_name, "segment-%u.%3s", &seq, ext) == 2 && strcmp(ext, "seg") == 0)
+        {
+            SegmentInfo info;
+            if (load_segment_info(seq, &info) == 0)
+                add_segment(&info);
+        }
+        else if (sscanf(entry->d_name, "journal-%u.%3s", &seq, ext) == 2 && strcmp(ext, "log") == 0)
+        {
+            queue_pending(seq);
+        }
+        else if (sscanf(entry->d_name, "dict-%u.%3s", &seq, ext) == 2 && strcmp(ext, "bin") == 0)
+        {
+            if (seq > newest_dict)
+                newest_dict = seq;
+        }
+        else
+        {
+            continue;
+        }
+        if (seq >= next_seq)
+            next_seq = seq + 1;
+    }
+    closedir(d);
+
+    // Sealed journals are compressed oldest first
+    for (int i = 1; i < pending_count; i++)
+    {
+        for (int j = i; j > 0 && pending[j - 1] > pending[j]; j--)
+        {
+            uint32_t t = pending[j];
+            pending[j] = pending[j - 1];
+            pending[j - 1] = t;
+        }
+    }
+
+    if (newest_dict)
+    {
+        const StoreDict *dict = load_dict(newest_dict);
+        if (dict)
+            current_dict = *dict;
+    }
+    pthread_mutex_unlock(&store_mutex);
+
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, store_thread, NULL) != 0)
+        return -1;
+    pthread_detach(thread_id);
+    if (pthread_create(&thread_id, NULL, retention_thread, NULL) != 0)
+        return -1;
+    pthread_detach(thread_id);
+    store_enabled = 1;
+    return 0;
+}
+
+/**
+ * Writes the segment list and compression totals to an admin connection
+ *
+ * @param fd Connection to write to
+ */
+void store_report(int fd)
+{
+    if (!store_enabled)
+    {
+        dprintf(fd, "store disabled (set store_dir to enable)\n");
+        return;
+    }
+
+    pthread_mutex_lock(&store_mutex);
+    uint64_t raw_total = 0, file_total = 0, records_total = 0;
+    dprintf(fd, "%-10s %8s %6s %10s %10s %6s %6s\n", "SEGMENT", "RECORDS", "BLOCKS", "RAW", "STORED", "RATIO", "DICT");
+    for (int i = 0; i < segment_count; i++)
+    {
+        const SegmentInfo *s = &segments[i];
+        dprintf(fd, "%-10u %8u %6u %10lu %10lu %6.2f %6u\n", s->seq, s->records, s->blocks,
+                (unsigned long)s->raw_bytes, (unsigned long)s->file_bytes,
+                s->file_bytes ? (double)s->raw_bytes / s->file_bytes : 0.0, s->dict_id);
+        raw_total += s->raw_bytes;
+        file_total += s->file_bytes;
+        records_total += s->records;
+    }
+    dprintf(fd, "segments %d records %lu raw %lu stored %lu ratio %.2f pending %d dict %u (%zu bytes)\n",
+            segment_count, (unsigned long)records_total, (unsigned long)raw_total, (unsigned long)file_total,
+            file_total ? (double)raw_total / file_total : 0.0, pending_count, current_dict.id, current_dict.len);
+    pthread_mutex_unlock(&store_mutex);
+    dprintf(fd, "retention deleted %lu compacted %lu reclaimed %lu throttled %lums\n",
+            atomic_load(&segments_deleted), atomic_load(&segments_compacted),
+            atomic_load(&bytes_reclaimed), atomic_load(&throttled_ms));
+}
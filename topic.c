@@ -0,0 +1,588 @@
+#include "server.h"
+
+#define TOPIC_MAX_SEGMENTS 16   // Deepest topic or pattern accepted
+#define TOPIC_BUCKETS_MIN 256   // Initial size of the child table
+#define TOPIC_SESSION_BUCKETS 1024
+
+/**
+ * Topic node structure - One segment of the subscription trie
+ *
+ * Named children are found through a single table keyed by parent and
+ * segment, so a lookup costs the same however many siblings a node has.
+ * The '*' and '#' children are held directly. Nodes exist only while a
+ * subscription ends at them or below them.
+ */
+typedef struct TopicNode
+{
+    struct TopicNode *next;   // Next node in the same child table bucket
+    struct TopicNode *parent; // NULL for the root
+    struct TopicNode *star;   // Child matching any one segment
+    struct TopicNode *hash;   // Child matching any remaining segments
+    int children;             // Children of every kind
+    Client *subs;             // Sessions subscribed to the pattern ending here
+    int sub_count;
+    int sub_cap;
+    size_t segment_len;
+    char segment[];           // Segment name, not NUL-terminated
+} TopicNode;
+
+/**
+ * Topic session structure - The subscriptions of one session, so they can
+ * be dropped when it leaves
+ */
+typedef struct TopicSession
+{
+    struct TopicSession *next; // Next session in the same bucket
+    uint64_t session_id;
+    TopicNode **nodes;         // Node each subscription ends at
+    int count;
+    int cap;
+} TopicSession;
+
+// Publishers hold the lock shared; subscription changes hold it exclusively
+static pthread_rwlock_t topic_lock = PTHREAD_RWLOCK_INITIALIZER;
+static TopicNode *root;
+static TopicNode **buckets;
+static size_t bucket_count;
+static size_t node_count;
+static size_t subscription_count;
+static TopicSession *topic_sessions[TOPIC_SESSION_BUCKETS];
+
+static atomic_ulong publishes;
+static atomic_ulong deliveries;
+
+/**
+ * Splits a topic or pattern into segments
+ *
+ * @param text Topic or pattern
+ * @param parts Output views, TOPIC_MAX_SEGMENTS entries
+ * @param wildcards Non-zero if '*' and '#' segments are allowed
+ * @return Number of segments, or -1 if the text is malformed
+ */
+static int split_topic(ProtoStr text, ProtoStr *parts, int wildcards)
+{
+    int count = 0;
+    size_t start = 0;
+
+    if (text.len == 0 || memchr(text.ptr, '\0', text.len))
+        return -1;
+
+    for (size_t i = 0; i <= text.len; i++)
+    {
+        if (i < text.len && text.ptr[i] != '.')
+            continue;
+        if (i == start || count == TOPIC_MAX_SEGMENTS)
+            return -1;
+
+        ProtoStr seg = {.ptr = text.ptr + start, .len = i - start};
+        int star = seg.len == 1 && seg.ptr[0] == '*';
+        int hash = seg.len == 1 && seg.ptr[0] == '#';
+        if ((star || hash) && !wildcards)
+            return -1;
+        if (!star && !hash && (memchr(seg.ptr, '*', seg.len) || memchr(seg.ptr, '#', seg.len)))
+            return -1;
+        if (hash && i != text.len)
+            return -1; // '#' only as the last segment
+
+        parts[count++] = seg;
+        start = i + 1;
+    }
+    return count;
+}
+
+/**
+ * Returns the child table bucket of a named child
+ *
+ * @param parent Parent node
+ * @param seg Segment name
+ * @return Pointer to the head of the bucket's chain
+ */
+static TopicNode **child_bucket(const TopicNode *parent, ProtoStr seg)
+{
+    uint64_t h = 1469598103934665603ULL ^ (uintptr_t)parent;
+    for (size_t i = 0; i < seg.len; i++)
+        h = (h ^ (uint8_t)seg.ptr[i]) * 1099511628211ULL;
+    return &buckets[h & (bucket_count - 1)];
+}
+
+/**
+ * Finds a named child
+ *
+ * @param parent Parent node
+ * @param seg Segment name
+ * @return The child, or NULL if there is none
+ */
+static TopicNode *child_find(const TopicNode *parent, ProtoStr seg)
+{
+    for (TopicNode *n = *child_bucket(parent, seg); n; n = n->next)
+        if (n->parent == parent && n->segment_len == seg.len && memcmp(n->segment, seg.ptr, seg.len) == 0)
+            return n;
+    return NULL;
+}
+
+/**
+ * Doubles the child table once it holds as many nodes as buckets
+ */
+static void grow_buckets(void)
+{
+    size_t old_count = bucket_count;
+    TopicNode **old = buckets;
+    TopicNode **grown = calloc(old_count * 2, sizeof(TopicNode *));
+    if (!grown)
+        return;
+
+    buckets = grown;
+    bucket_count = old_count * 2;
+    for (size_t i = 0; i < old_count; i++)
+    {
+        while (old[i])
+        {
+            TopicNode *n = old[i];
+            old[i] = n->next;
+            TopicNode **b = child_bucket(n->parent, (ProtoStr){.ptr = n->segment, .len = n->segment_len});
+            n->next = *b;
+            *b = n;
+        }
+    }
+    free(old);
+}
+
+/**
+ * Returns the child for a segment, creating it if needed
+ *
+ * Must be called with topic_lock held exclusively.
+ *
+ * @param parent Parent node
+ * @param seg Segment name, '*' or '#'
+ * @return The child, or NULL if out of memory
+ */
+static TopicNode *child_get(TopicNode *parent, ProtoStr seg)
+{
+    int star = seg.len == 1 && seg.ptr[0] == '*';
+    int hash = seg.len == 1 && seg.ptr[0] == '#';
+
+    TopicNode *n = star ? parent->star : hash ? parent->hash : child_find(parent, seg);
+    if (n)
+        return n;
+
+    n = calloc(1, sizeof(TopicNode) + seg.len);
+    if (!n)
+        return NULL;
+    n->parent = parent;
+    n->segment_len = seg.len;
+    memcpy(n->segment, seg.ptr, seg.len);
+    parent->children++;
+    node_count++;
+
+    if (star)
+        parent->star = n;
+    else if (hash)
+        parent->hash = n;
+    else
+    {
+        if (node_count > bucket_count)
+            grow_buckets();
+        TopicNode **b = child_bucket(parent, seg);
+        n->next = *b;
+        *b = n;
+    }
+    return n;
+}
+
+/**
+ * Frees nodes that no longer lead to any subscription, from a node up
+ * towards the root
+ *
+ * Must be called with topic_lock held exclusively.
+ *
+ * @param n Node that just lost a subscription
+ */
+static void prune(TopicNode *n)
+{
+    while (n != root && n->sub_count == 0 && n->children == 0)
+    {
+        TopicNode *parent = n->parent;
+        if (parent->star == n)
+            parent->star = NULL;
+        else if (parent->hash == n)
+            parent->hash = NULL;
+        else
+        {
+            TopicNode **p = child_bucket(parent, (ProtoStr){.ptr = n->segment, .len = n->segment_len});
+            while (*p != n)
+                p = &(*p)->next;
+            *p = n->next;
+        }
+        parent->children--;
+        node_count--;
+        free(n->subs);
+        free(n);
+        n = parent;
+    }
+}
+
+/**
+ * Walks the trie along a pattern
+ *
+ * Must be called with topic_lock held exclusively.
+ *
+ * @param parts Pattern segments
+ * @param count Number of segments
+ * @param create Non-zero to create missing nodes
+ * @return The node the pattern ends at, or NULL
+ */
+static TopicNode *pattern_node(const ProtoStr *parts, int count, int create)
+{
+    if (!root)
+    {
+        if (!create)
+            return NULL;
+        root = calloc(1, sizeof(TopicNode));
+        buckets = calloc(TOPIC_BUCKETS_MIN, sizeof(TopicNode *));
+        if (!root || !buckets)
+        {
+            free(root);
+            free(buckets);
+            root = NULL;
+            buckets = NULL;
+            return NULL;
+        }
+        bucket_count = TOPIC_BUCKETS_MIN;
+    }
+
+    TopicNode *n = root;
+    for (int i = 0; n && i < count; i++)
+    {
+        if (create)
+            n = child_get(n, parts[i]);
+        else if (parts[i].len == 1 && parts[i].ptr[0] == '*')
+            n = n->star;
+        else if (parts[i].len == 1 && parts[i].ptr[0] == '#')
+            n = n->hash;
+        else
+            n = child_find(n, parts[i]);
+    }
+    return n;
+}
+
+/**
+ * Finds the subscription record of a session
+ *
+ * @param session_id Session to look up
+ * @param create Non-zero to create a record if there is none
+ * @return The record, or NULL
+ */
+static TopicSession *session_get(uint64_t session_id, int create)
+{
+    TopicSession **b = &topic_sessions[session_id % TOPIC_SESSION_BUCKETS];
+    for (TopicSession *s = *b; s; s = s->next)
+        if (s->session_id == session_id)
+            return s;
+    if (!create)
+        return NULL;
+
+    TopicSession *s = calloc(1, sizeof(TopicSession));
+    if (!s)
+        return NULL;
+    s->session_id = session_id;
+    s->next = *b;
+    *b = s;
+    return s;
+}
+
+/**
+ * Removes a session from a node's subscriber list
+ *
+ * @param n Node
+ * @param session_id Session to remove
+ * @return 1 if the session was subscribed there, 0 otherwise
+ */
+static int node_remove(TopicNode *n, uint64_t session_id)
+{
+    for (int i = 0; i < n->sub_count; i++)
+    {
+        if (n->subs[i].session_id == session_id)
+        {
+            n->subs[i] = n->subs[--n->sub_count];
+            subscription_count--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Subscribes a session to a pattern
+ *
+ * @param client Subscribing client
+ * @param request_id Request id echoed in errors
+ * @param pattern Subscription pattern
+ */
+void topic_subscribe(const Client *client, uint32_t request_id, ProtoStr pattern)
+{
+    ProtoStr parts[TOPIC_MAX_SEGMENTS];
+    int count = split_topic(pattern, parts, 1);
+    if (count < 0)
+    {
+        send_error(client, request_id, "Invalid topic pattern");
+        return;
+    }
+
+    const char *error = NULL;
+    int limit = config_get()->max_subscriptions;
+
+    pthread_rwlock_wrlock(&topic_lock);
+    TopicSession *s = session_get(client->session_id, 1);
+    TopicNode *n = s && s->count < limit ? pattern_node(parts, count, 1) : NULL;
+    if (!s || s->count >= limit)
+        error = s ? "Subscription limit reached" : "Out of memory";
+    else if (!n)
+        error = "Out of memory";
+    else
+    {
+        for (int i = 0; i < n->sub_count && !error; i++)
+            if (n->subs[i].session_id == client->session_id)
+                error = "Already subscribed";
+
+        if (!error && (s->count == s->cap || n->sub_count == n->sub_cap))
+        {
+            int cap = s->cap ? s->cap * 2 : 4;
+            TopicNode **nodes = s->count == s->cap ? realloc(s->nodes, cap * sizeof(TopicNode *)) : s->nodes;
+            if (nodes && s->count == s->cap)
+            {
+                s->nodes = nodes;
+                s->cap = cap;
+            }
+            cap = n->sub_cap ? n->sub_cap * 2 : 4;
+            Client *subs = n->sub_count == n->sub_cap ? realloc(n->subs, cap * sizeof(Client)) : n->subs;
+            if (subs && n->sub_count == n->sub_cap)
+            {
+                n->subs = subs;
+                n->sub_cap = cap;
+            }
+            if (!nodes || !subs)
+                error = "Out of memory";
+        }
+
+        if (!error)
+        {
+            n->subs[n->sub_count++] = *client;
+            s->nodes[s->count++] = n;
+            subscription_count++;
+        }
+        else
+        {
+            prune(n);
+        }
+    }
+    pthread_rwlock_unlock(&topic_lock);
+
+    if (error)
+        send_error(client, request_id, error);
+}
+
+/**
+ * Drops one subscription of a session
+ *
+ * @param client Unsubscribing client
+ * @param request_id Request id echoed in errors
+ * @param pattern Pattern given when subscribing
+ */
+void topic_unsubscribe(const Client *client, uint32_t request_id, ProtoStr pattern)
+{
+    ProtoStr parts[TOPIC_MAX_SEGMENTS];
+    int count = split_topic(pattern, parts, 1);
+    int removed = 0;
+
+    pthread_rwlock_wrlock(&topic_lock);
+    TopicNode *n = count < 0 ? NULL : pattern_node(parts, count, 0);
+    TopicSession *s = session_get(client->session_id, 0);
+    if (n && s && node_remove(n, client->session_id))
+    {
+        for (int i = 0; i < s->count; i++)
+        {
+            if (s->nodes[i] == n)
+            {
+                s->nodes[i] = s->nodes[--s->count];
+                break;
+            }
+        }
+        prune(n);
+        removed = 1;
+    }
+    pthread_rwlock_unlock(&topic_lock);
+
+    if (!removed)
+        send_error(client, request_id, "Not subscribed to that pattern");
+}
+
+/**
+ * Drops every subscription of a session that ended
+ *
+ * @param session_id The departed session
+ */
+void topic_forget(uint64_t session_id)
+{
+    pthread_rwlock_wrlock(&topic_lock);
+    TopicSession **p = &topic_sessions[session_id % TOPIC_SESSION_BUCKETS];
+    while (*p && (*p)->session_id != session_id)
+        p = &(*p)->next;
+
+    TopicSession *s = *p;
+    if (s)
+    {
+        *p = s->next;
+        // A node still holding this session's subscription is never
+        // pruned, so the remaining entries stay valid
+        for (int i = 0; i < s->count; i++)
+        {
+            node_remove(s->nodes[i], session_id);
+            prune(s->nodes[i]);
+        }
+        free(s->nodes);
+        free(s);
+    }
+    pthread_rwlock_unlock(&topic_lock);
+}
+
+/**
+ * Match list structure - Growable list of subscribers a publish reaches
+ */
+typedef struct
+{
+    Client *items;
+    size_t count;
+    size_t cap;
+} MatchList;
+
+/**
+ * Appends a node's subscribers to the match list
+ *
+ * @param list Match list
+ * @param n Matching node
+ */
+static void collect(MatchList *list, const TopicNode *n)
+{
+    if (list->count + n->sub_count > list->cap)
+    {
+        size_t cap = list->cap ? list->cap : 16;
+        while (cap < list->count + n->sub_count)
+            cap *= 2;
+        Client *grown = realloc(list->items, cap * sizeof(Client));
+        if (!grown)
+            return;
+        list->items = grown;
+        list->cap = cap;
+    }
+    memcpy(list->items + list->count, n->subs, n->sub_count * sizeof(Client));
+    list->count += n->sub_count;
+}
+
+/**
+ * Collects the subscribers of every pattern matching a topic
+ *
+ * Only branches that can still match are visited: the named child for
+ * the next segment, '*', and '#', so the work is bounded by the matching
+ * patterns rather than by the size of the trie.
+ *
+ * @param list Match list
+ * @param n Current node
+ * @param parts Topic segments
+ * @param count Number of segments
+ * @param depth Segments already consumed
+ */
+static void match(MatchList *list, const TopicNode *n, const ProtoStr *parts, int count, int depth)
+{
+    if (n->hash)
+        collect(list, n->hash);
+    if (depth == count)
+    {
+        collect(list, n);
+        return;
+    }
+
+    TopicNode *child = child_find(n, parts[depth]);
+    if (child)
+        match(list, child, parts, count, depth + 1);
+    if (n->star)
+        match(list, n->star, parts, count, depth + 1);
+}
+
+/**
+ * Orders clients by session id so duplicates become neighbours
+ */
+static int compare_session(const void *a, const void *b)
+{
+    uint64_t x = ((const Client *)a)->session_id;
+    uint64_t y = ((const Client *)b)->session_id;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Publishes a message on a topic
+ *
+ * Subscribers are collected under the shared lock and sent to after it
+ * is released. A session with several matching patterns gets the message
+ * once.
+ *
+ * @param sender Publishing client
+ * @param request_id Request id echoed in errors
+ * @param msg Decoded message; its sender field is ignored
+ */
+void topic_publish(const Client *sender, uint32_t request_id, const PublishMsg *msg)
+{
+    ProtoStr parts[TOPIC_MAX_SEGMENTS];
+    int count = split_topic(msg->topic, parts, 0);
+    if (count < 0)
+    {
+        send_error(sender, request_id, "Invalid topic");
+        return;
+    }
+
+    uint8_t frame[PROTO_HEADER_SIZE + PUBLISH_MAX_BODY];
+    PublishMsg out = *msg;
+    out.sender = proto_str(sender->username);
+    size_t len = encode_publish(frame, sizeof(frame), &out);
+    if (!len)
+        return;
+
+    MatchList list = {0};
+    pthread_rwlock_rdlock(&topic_lock);
+    if (root)
+        match(&list, root, parts, count, 0);
+    pthread_rwlock_unlock(&topic_lock);
+
+    qsort(list.items, list.count, sizeof(Client), compare_session);
+    size_t sent = 0;
+    for (size_t i = 0; i < list.count; i++)
+    {
+        if (i > 0 && list.items[i].session_id == list.items[i - 1].session_id)
+            continue;
+        send_to_client(&list.items[i], frame, len);
+        sent++;
+    }
+    free(list.items);
+
+    atomic_fetch_add_explicit(&publishes, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&deliveries, sent, memory_order_relaxed);
+    format_whiteboard_msg(MSG_TYPE_DEBUG, "%s published on %.*s to %zu subscriber(s)",
+                          sender->username, (int)msg->topic.len, msg->topic.ptr, sent);
+}
+
+/**
+ * Writes topic routing statistics to an admin connection
+ *
+ * @param fd Admin connection to write to
+ */
+void topic_report(int fd)
+{
+    pthread_rwlock_rdlock(&topic_lock);
+    size_t nodes = node_count;
+    size_t subscriptions = subscription_count;
+    pthread_rwlock_unlock(&topic_lock);
+
+    dprintf(fd, "subscriptions %zu\n", subscriptions);
+    dprintf(fd, "trie nodes %zu\n", nodes);
+    dprintf(fd, "publishes %lu\n", atomic_load_explicit(&publishes, memory_order_relaxed));
+    dprintf(fd, "deliveries %lu\n", atomic_load_explicit(&deliveries, memory_order_relaxed));
+}
@@ -0,0 +1,526 @@
+#define _GNU_SOURCE // strcasestr
+#include "websocket.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_MIN_WINDOW_BITS 9  // Smallest window zlib can use for raw deflate
+#define WS_MAX_WINDOW_BITS 15
+
+/**
+ * Unmasking vector - 32 bytes XORed at a time; the compiler maps it to
+ * whatever SIMD registers the target has (two SSE2 or one AVX2 on x86,
+ * NEON on ARM)
+ */
+typedef uint8_t WsVector __attribute__((vector_size(32)));
+
+// Compression state shared by every connection. Both directions run
+// without context takeover, so each message starts from a reset stream
+// and a broadcast compresses to the same bytes for every recipient with
+// the same window. One deflater per window size a client may ask for.
+// Not thread-safe; the gateway uses it from its single loop.
+static z_stream deflaters[WS_MAX_WINDOW_BITS + 1];
+static z_stream inflater;
+static unsigned deflaters_ready; // Bit n set once deflaters[n] is initialized
+static int inflater_ready;
+
+/**
+ * Rotates a 32-bit word left
+ */
+static uint32_t rol32(uint32_t v, int n)
+{
+    return (v << n) | (v >> (32 - n));
+}
+
+/**
+ * Computes the SHA-1 digest of a short message
+ *
+ * Only used for the handshake's accept key, so it favours size over speed.
+ *
+ * @param data Message
+ * @param len Message length
+ * @param digest Output, 20 bytes
+ */
+static void sha1(const uint8_t *data, size_t len, uint8_t digest[20])
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    uint64_t bits = (uint64_t)len * 8;
+    size_t total = (len + 9 + 63) / 64 * 64;
+
+    for (size_t block = 0; block < total; block += 64)
+    {
+        uint8_t chunk[64];
+        for (size_t i = 0; i < 64; i++)
+        {
+            size_t pos = block + i;
+            if (pos < len)
+                chunk[i] = data[pos];
+            else if (pos == len)
+                chunk[i] = 0x80;
+            else if (pos >= total - 8)
+                chunk[i] = (uint8_t)(bits >> (8 * (total - 1 - pos)));
+            else
+                chunk[i] = 0;
+        }
+
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)chunk[4 * i] << 24 | (uint32_t)chunk[4 * i + 1] << 16 |
+                   (uint32_t)chunk[4 * i + 2] << 8 | chunk[4 * i + 3];
+        for (int i = 16; i < 80; i++)
+            w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++)
+        {
+            uint32_t f, k;
+            if (i < 20)
+                f = (b & c) | (~b & d), k = 0x5A827999;
+            else if (i < 40)
+                f = b ^ c ^ d, k = 0x6ED9EBA1;
+            else if (i < 60)
+                f = (b & c) | (b & d) | (c & d), k = 0x8F1BBCDC;
+            else
+                f = b ^ c ^ d, k = 0xCA62C1D6;
+            uint32_t t = rol32(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rol32(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    for (int i = 0; i < 5; i++)
+        for (int j = 0; j < 4; j++)
+            digest[4 * i + j] = (uint8_t)(h[i] >> (24 - 8 * j));
+}
+
+/**
+ * Encodes bytes as base64
+ *
+ * @param in Input bytes
+ * @param len Input length
+ * @param out Output, at least 4 * ((len + 2) / 3) + 1 bytes
+ */
+static void base64(const uint8_t *in, size_t len, char *out)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t o = 0;
+    for (size_t i = 0; i < len; i += 3)
+    {
+        uint32_t v = (uint32_t)in[i] << 16;
+        if (i + 1 < len)
+            v |= (uint32_t)in[i + 1] << 8;
+        if (i + 2 < len)
+            v |= in[i + 2];
+        out[o++] = alphabet[(v >> 18) & 63];
+        out[o++] = alphabet[(v >> 12) & 63];
+        out[o++] = i + 1 < len ? alphabet[(v >> 6) & 63] : '=';
+        out[o++] = i + 2 < len ? alphabet[v & 63] : '=';
+    }
+    out[o] = '\0';
+}
+
+/**
+ * Strips leading and trailing spaces and tabs in place
+ */
+static char *trim(char *text)
+{
+    while (*text == ' ' || *text == '\t')
+        text++;
+    size_t len = strlen(text);
+    while (len > 0 && (text[len - 1] == ' ' || text[len - 1] == '\t'))
+        text[--len] = '\0';
+    return text;
+}
+
+/**
+ * Parses a window bits parameter value, possibly quoted
+ *
+ * @return 8 to 15, or 0 if the value is missing or out of range
+ */
+static int window_bits(char *value)
+{
+    if (!value)
+        return 0;
+    size_t len = strlen(value);
+    if (len >= 2 && value[0] == '"' && value[len - 1] == '"')
+    {
+        value[len - 1] = '\0';
+        value++;
+    }
+    if (value[0] < '1' || value[0] > '9' || (value[1] && (value[1] < '0' || value[1] > '9' || value[2])))
+        return 0;
+    int bits = atoi(value);
+    return bits >= 8 && bits <= WS_MAX_WINDOW_BITS ? bits : 0;
+}
+
+/**
+ * Checks the parameters of one permessage-deflate offer (RFC 7692)
+ *
+ * Both directions always run without context takeover, and client
+ * messages are inflated with the largest window, so only a limit on
+ * the server's window changes what is sent. An offer with an unknown,
+ * repeated or invalid parameter, or a window zlib cannot use, is declined.
+ *
+ * @param params Parameters after the extension name, ';'-separated
+ * @param server_bits Set to the window the server must keep within
+ * @param limited Set to 1 if server_max_window_bits was given and must be echoed
+ * @return 1 if the offer can be accepted, 0 otherwise
+ */
+static int deflate_offer(char *params, int *server_bits, int *limited)
+{
+    static const char *names[] = {"server_no_context_takeover", "client_no_context_takeover",
+                                  "server_max_window_bits", "client_max_window_bits"};
+    int seen[4] = {0};
+    *server_bits = WS_MAX_WINDOW_BITS;
+    *limited = 0;
+
+    char *save;
+    for (char *param = strtok_r(params, ";", &save); param; param = strtok_r(NULL, ";", &save))
+    {
+        char *value = strchr(param, '=');
+        if (value)
+            *value++ = '\0';
+        param = trim(param);
+        if (value)
+            value = trim(value);
+
+        int which = 0;
+        while (which < 4 && strcasecmp(param, names[which]) != 0)
+            which++;
+        if (which == 4 || seen[which]++)
+            return 0;
+
+        if (which < 2 && value)
+            return 0;
+        if (which == 2)
+        {
+            *server_bits = window_bits(value);
+            *limited = 1;
+            if (*server_bits < WS_MIN_WINDOW_BITS)
+                return 0;
+        }
+        if (which == 3 && value && !window_bits(value))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Picks the first acceptable permessage-deflate offer of a header value
+ *
+ * @param value Sec-WebSocket-Extensions value, modified in place
+ * @param server_bits Set to the server's window if an offer is accepted
+ * @param limited Set as by deflate_offer()
+ * @return 1 if an offer was accepted, 0 otherwise
+ */
+static int deflate_negotiate(char *value, int *server_bits, int *limited)
+{
+    char *save;
+    for (char *offer = strtok_r(value, ",", &save); offer; offer = strtok_r(NULL, ",", &save))
+    {
+        char *params = strchr(offer, ';');
+        if (params)
+            *params++ = '\0';
+        if (strcasecmp(trim(offer), "permessage-deflate") == 0 && deflate_offer(params ? params : "", server_bits, limited))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Validates an HTTP upgrade request and builds the 101 response
+ *
+ * The first permessage-deflate offer whose parameters can be honored is
+ * accepted, always without context takeover in either direction, so no
+ * per-connection zlib state is kept. A requested server_max_window_bits
+ * is echoed and becomes the window the connection is compressed with.
+ *
+ * @param request Request bytes up to and including the blank line
+ * @param len Request length
+ * @param response Output for the response
+ * @param cap Size of response, at least WS_MAX_RESPONSE
+ * @param deflate Set to the window bits to compress with if
+ *                permessage-deflate was negotiated, 0 otherwise
+ * @return Response length, or -1 if the request is not a valid upgrade
+ */
+int ws_handshake(const char *request, size_t len, char *response, size_t cap, int *deflate)
+{
+    char text[WS_MAX_REQUEST + 1];
+    char key[64] = {0};
+    int upgrade = 0, connection = 0, version = 0;
+    int server_bits = 0, limited = 0;
+
+    *deflate = 0;
+    if (len > WS_MAX_REQUEST || strncmp(request, "GET ", 4) != 0)
+        return -1;
+    memcpy(text, request, len);
+    text[len] = '\0';
+
+    char *save;
+    char *line = strtok_r(text, "\r\n", &save);
+    if (!line || !strstr(line, " HTTP/1.1"))
+        return -1;
+
+    while ((line = strtok_r(NULL, "\r\n", &save)))
+    {
+        char *colon = strchr(line, ':');
+        if (!colon)
+            continue;
+        *colon = '\0';
+        char *value = colon + 1;
+        while (*value == ' ' || *value == '\t')
+            value++;
+
+        if (strcasecmp(line, "Upgrade") == 0)
+            upgrade = strcasecmp(value, "websocket") == 0;
+        else if (strcasecmp(line, "Connection") == 0)
+            connection = strcasestr(value, "upgrade") != NULL;
+        else if (strcasecmp(line, "Sec-WebSocket-Version") == 0)
+            version = strcmp(value, "13") == 0;
+        else if (strcasecmp(line, "Sec-WebSocket-Key") == 0 && strlen(value) < sizeof(key))
+            strcpy(key, value);
+        else if (strcasecmp(line, "Sec-WebSocket-Extensions") == 0 && !*deflate &&
+                 deflate_negotiate(value, &server_bits, &limited))
+            *deflate = server_bits;
+    }
+
+    if (!upgrade || !connection || !version || !key[0] || cap < WS_MAX_RESPONSE)
+        return -1;
+
+    char input[sizeof(key) + sizeof(WS_GUID)];
+    uint8_t digest[20];
+    char accept[32];
+    char extension[160] = "";
+    if (*deflate)
+    {
+        char window[32] = "";
+        if (limited)
+            snprintf(window, sizeof(window), "; server_max_window_bits=%d", server_bits);
+        snprintf(extension, sizeof(extension),
+                 "Sec-WebSocket-Extensions: permessage-deflate; "
+                 "server_no_context_takeover; client_no_context_takeover%s\r\n",
+                 window);
+    }
+    snprintf(input, sizeof(input), "%s%s", key, WS_GUID);
+    sha1((const uint8_t *)input, strlen(input), digest);
+    base64(digest, sizeof(digest), accept);
+
+    return snprintf(response, cap,
+                    "HTTP/1.1 101 Switching Protocols\r\n"
+                    "Upgrade: websocket\r\n"
+                    "Connection: Upgrade\r\n"
+                    "Sec-WebSocket-Accept: %s\r\n"
+                    "%s"
+                    "\r\n",
+                    accept, extension);
+}
+
+/**
+ * Decodes a frame header
+ *
+ * @param p Received bytes
+ * @param avail Number of bytes available
+ * @param frame Output for the decoded header
+ * @return 1 if a header was decoded, 0 if more bytes are needed, -1 if
+ *         the header is invalid
+ */
+int ws_parse_header(const uint8_t *p, size_t avail, WsFrame *frame)
+{
+    if (avail < 2)
+        return 0;
+
+    frame->fin = p[0] >> 7;
+    frame->rsv1 = (p[0] >> 6) & 1;
+    frame->opcode = p[0] & 0x0F;
+    frame->masked = p[1] >> 7;
+    if (p[0] & 0x30)
+        return -1;
+
+    size_t pos = 2;
+    uint64_t length = p[1] & 0x7F;
+    if (length == 126)
+    {
+        if (avail < 4)
+            return 0;
+        length = (uint64_t)p[2] << 8 | p[3];
+        pos = 4;
+    }
+    else if (length == 127)
+    {
+        if (avail < 10)
+            return 0;
+        length = 0;
+        for (int i = 0; i < 8; i++)
+            length = length << 8 | p[2 + i];
+        pos = 10;
+    }
+
+    // Control frames are short and never fragmented
+    if ((frame->opcode & 0x08) && (length > 125 || !frame->fin))
+        return -1;
+
+    if (frame->masked)
+    {
+        if (avail < pos + 4)
+            return 0;
+        memcpy(frame->mask, p + pos, 4);
+        pos += 4;
+    }
+
+    frame->length = length;
+    frame->header_len = pos;
+    return 1;
+}
+
+/**
+ * Writes an unmasked server frame header
+ *
+ * @param out Output, at least WS_MAX_HEADER bytes
+ * @param opcode WS_OP_*
+ * @param rsv1 Non-zero if the payload is compressed
+ * @param len Payload length
+ * @return Header length
+ */
+size_t ws_encode_header(uint8_t *out, int opcode, int rsv1, size_t len)
+{
+    out[0] = 0x80 | (rsv1 ? 0x40 : 0) | opcode;
+    if (len < 126)
+    {
+        out[1] = len;
+        return 2;
+    }
+    if (len <= 0xFFFF)
+    {
+        out[1] = 126;
+        out[2] = len >> 8;
+        out[3] = len;
+        return 4;
+    }
+    out[1] = 127;
+    for (int i = 0; i < 8; i++)
+        out[2 + i] = (uint8_t)((uint64_t)len >> (56 - 8 * i));
+    return 10;
+}
+
+/**
+ * Removes the client's mask from a payload in place
+ *
+ * XORs a vector of the repeated key over the payload, then finishes the
+ * tail a byte at a time. Vectors are whole multiples of the 4-byte key,
+ * so the tail continues at the right key offset.
+ *
+ * @param p Payload
+ * @param len Payload length
+ * @param mask Masking key
+ */
+void ws_unmask(uint8_t *p, size_t len, const uint8_t mask[4])
+{
+    size_t i = 0;
+
+    if (len >= sizeof(WsVector))
+    {
+        WsVector key;
+        for (size_t j = 0; j < sizeof(WsVector); j++)
+            key[j] = mask[j & 3];
+
+        for (; i + sizeof(WsVector) <= len; i += sizeof(WsVector))
+        {
+            WsVector v;
+            memcpy(&v, p + i, sizeof(v));
+            v ^= key;
+            memcpy(p + i, &v, sizeof(v));
+        }
+    }
+
+    for (; i < len; i++)
+        p[i] ^= mask[i & 3];
+}
+
+/**
+ * Compresses a message payload for permessage-deflate
+ *
+ * Output made with a window can be inflated with any window at least as
+ * large.
+ *
+ * @param in Payload
+ * @param len Payload length
+ * @param out Output buffer
+ * @param cap Size of out
+ * @param bits Window bits negotiated by ws_handshake()
+ * @return Compressed length without the trailing empty block, or 0 if
+ *         the output did not fit or compression failed
+ */
+size_t ws_deflate(const uint8_t *in, size_t len, uint8_t *out, size_t cap, int bits)
+{
+    if (bits < WS_MIN_WINDOW_BITS || bits > WS_MAX_WINDOW_BITS)
+        return 0;
+    z_stream *deflater = &deflaters[bits];
+    if (!(deflaters_ready & 1u << bits))
+    {
+        if (deflateInit2(deflater, Z_BEST_SPEED, Z_DEFLATED, -bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return 0;
+        deflaters_ready |= 1u << bits;
+    }
+    deflateReset(deflater);
+
+    deflater->next_in = (Bytef *)in;
+    deflater->avail_in = len;
+    deflater->next_out = out;
+    deflater->avail_out = cap;
+    if (deflate(deflater, Z_SYNC_FLUSH) != Z_OK || deflater->avail_in || deflater->avail_out == 0)
+        return 0;
+
+    // RFC 7692 drops the 00 00 FF FF that ends a sync flush
+    size_t n = cap - deflater->avail_out;
+    return n >= 4 ? n - 4 : 0;
+}
+
+/**
+ * Decompresses a permessage-deflate payload
+ *
+ * @param in Compressed payload
+ * @param len Compressed length
+ * @param out Output buffer
+ * @param cap Size of out; larger messages are rejected
+ * @return Decompressed length, or -1 if the data is invalid or too large
+ */
+ssize_t ws_inflate(const uint8_t *in, size_t len, uint8_t *out, size_t cap)
+{
+    static const uint8_t tail[4] = {0x00, 0x00, 0xFF, 0xFF};
+
+    if (!inflater_ready)
+    {
+        if (inflateInit2(&inflater, -15) != Z_OK)
+            return -1;
+        inflater_ready = 1;
+    }
+    inflateReset(&inflater);
+
+    inflater.next_out = out;
+    inflater.avail_out = cap;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        inflater.next_in = (Bytef *)(pass ? tail : in);
+        inflater.avail_in = pass ? sizeof(tail) : len;
+        int rc = inflate(&inflater, Z_SYNC_FLUSH);
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+            return -1;
+        // A full buffer may have cut the message short
+        if (inflater.avail_in || inflater.avail_out == 0)
+            return -1;
+        if (rc == Z_STREAM_END)
+            break;
+    }
+    return cap - inflater.avail_out;
+}
@@ -0,0 +1,46 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define WS_MAX_HEADER 14     // 2 bytes, 8-byte extended length, 4-byte mask
+#define WS_MAX_REQUEST 4096  // Largest upgrade request accepted
+#define WS_MAX_RESPONSE 320  // Room needed for the upgrade response
+
+/**
+ * WebSocket opcodes (RFC 6455 section 5.2)
+ */
+enum
+{
+    WS_OP_CONTINUATION = 0x0,
+    WS_OP_TEXT = 0x1,
+    WS_OP_BINARY = 0x2,
+    WS_OP_CLOSE = 0x8,
+    WS_OP_PING = 0x9,
+    WS_OP_PONG = 0xA
+};
+
+/**
+ * WebSocket frame header - Decoded fields of one frame
+ */
+typedef struct
+{
+    int fin;            // Last frame of the message
+    int rsv1;           // Payload is compressed (permessage-deflate)
+    int opcode;         // WS_OP_*
+    int masked;         // Payload is masked; required from clients
+    uint8_t mask[4];    // Masking key
+    uint64_t length;    // Payload length
+    size_t header_len;  // Bytes taken by the header
+} WsFrame;
+
+int ws_handshake(const char *request, size_t len, char *response, size_t cap, int *deflate);
+int ws_parse_header(const uint8_t *p, size_t avail, WsFrame *frame);
+size_t ws_encode_header(uint8_t *out, int opcode, int rsv1, size_t len);
+void ws_unmask(uint8_t *p, size_t len, const uint8_t mask[4]);
+size_t ws_deflate(const uint8_t *in, size_t len, uint8_t *out, size_t cap, int bits);
+ssize_t ws_inflate(const uint8_t *in, size_t len, uint8_t *out, size_t cap);
+
+#endif // WEBSOCKET_H
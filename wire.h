@@ -0,0 +1,76 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include "common.h"
+#include "protocol.h"
+#include <errno.h>
+
+/**
+ * Sends a whole buffer, retrying after partial writes
+ *
+ * @param fd Socket descriptor
+ * @param buf Data to send
+ * @param len Number of bytes to send
+ * @return Number of bytes sent; less than len if the socket failed or
+ *         its send timeout expired
+ */
+static inline size_t send_all(int fd, const void *buf, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = send(fd, (const char *)buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    return sent;
+}
+
+/**
+ * Receives exactly len bytes
+ *
+ * @param fd Socket descriptor
+ * @param buf Destination buffer
+ * @param len Number of bytes to read
+ * @return 1 on success, 0 on orderly close or error
+ */
+static inline int recv_all(int fd, void *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        ssize_t n = recv(fd, (char *)buf + got, len - got, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        got += n;
+    }
+    return 1;
+}
+
+/**
+ * Receives one frame into buf (header followed by body)
+ *
+ * @param fd Socket descriptor
+ * @param buf Destination buffer, at least PROTO_HEADER_SIZE bytes
+ * @param cap Size of buf
+ * @param hdr Output for the decoded header
+ * @return Total frame length, or -1 on close, error, bad version or a
+ *         body that does not fit in buf
+ */
+static inline ssize_t recv_frame(int fd, uint8_t *buf, size_t cap, ProtoHeader *hdr)
+{
+    if (!recv_all(fd, buf, PROTO_HEADER_SIZE) || proto_decode_header(buf, hdr) < 0)
+        return -1;
+    if (hdr->length > cap - PROTO_HEADER_SIZE)
+        return -1;
+    if (hdr->length && !recv_all(fd, buf + PROTO_HEADER_SIZE, hdr->length))
+        return -1;
+    return PROTO_HEADER_SIZE + hdr->length;
+}
+
+#endif // WIRE_H